@@ -0,0 +1,377 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../lib/filesystem.h"
+#include "../lib/operations.h"
+
+/*
+ * make bench: times every operation of operations.h, and fs_load, fs_load_mmap
+ * and fs_dump, on images of every size in SIZES filled to every level in FILLS.
+ * Prints one JSON object; for each operation and image the count, mean and
+ * percentiles of the latency in nanoseconds, and MB/s where an operation moves
+ * file data. Save it per commit and compare the files.
+ *
+ * Usage: bench [-q] [-o <file>], see make bench
+ *  -q  a tenth of the repetitions, for a quick look
+ *  -o  write the JSON to file instead of stdout
+ */
+
+#define IMAGE "./build/bench.fs"
+#define EXT_FILE "./build/bench.ext"
+
+static const uint32_t SIZES[] = { 4096, 16384, 65536 }; //inodes and blocks of the image
+static const int FILLS[] = { 0, 50, 90 }; //percent of the blocks in use before timing
+
+#define FILL_FILE (8 * BLOCK_SIZE) //size of the files filling the image
+#define FILL_DIR 256 //files per fill directory
+#define DEPTH_MAX 16 //deepest path looked up
+#define READ_FILE (16 * BLOCK_SIZE)
+#define READV_LEN (4 * BLOCK_SIZE)
+#define IMPORT_FILE (256 * BLOCK_SIZE)
+#define TREE_FILES 16 //files of the tree fs_cp copies
+#define TREE_FILE (4 * BLOCK_SIZE)
+#define COMPRESS_FILE (64 * BLOCK_SIZE)
+#define LIST_FILES 100
+
+// latencies of one operation
+struct samples{
+	uint64_t* ns;
+	int count;
+	int cap;
+	uint64_t bytes; //file data moved by all of them
+};
+
+struct bench{
+	FILE* out;
+	int reps; //repetitions of a cheap operation, fewer for costly ones
+	int first; //no result printed yet
+	uint32_t size;
+	int fill;
+	char* text; //filler content, a NUL terminated string as fs_writef takes it
+};
+
+static uint64_t now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void sample_add(struct samples* s, uint64_t ns){
+	if(s->count == s->cap){
+		s->cap = s->cap ? s->cap * 2 : 256;
+		s->ns = realloc(s->ns, s->cap * sizeof(uint64_t));
+		if(s->ns == NULL){
+			perror("Malloc error");
+			exit(errno);
+		}
+	}
+	s->ns[s->count++] = ns;
+}
+
+static int cmp_ns(const void* a, const void* b){
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+// nearest rank, s->ns is sorted
+static uint64_t percentile(const struct samples* s, int p){
+	int rank = (int)(((int64_t)s->count * p + 99) / 100);
+	return s->ns[rank > 0 ? rank - 1 : 0];
+}
+
+/*
+ * Print the results of op on the current image and clear s for the next one
+ */
+static void report(struct bench* b, const char* op, struct samples* s){
+	if(s->count == 0) return;
+	qsort(s->ns, s->count, sizeof(uint64_t), cmp_ns);
+	uint64_t total = 0;
+	for (int i = 0; i < s->count; i++) total += s->ns[i];
+	fprintf(b->out, "%s\n    {\"op\": \"%s\", \"size\": %u, \"fill\": %d, \"count\": %d, \"mean_ns\": %llu, "
+		"\"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu",
+		b->first ? "" : ",", op, b->size, b->fill, s->count, (unsigned long long)(total / s->count),
+		(unsigned long long)percentile(s, 50), (unsigned long long)percentile(s, 90),
+		(unsigned long long)percentile(s, 99), (unsigned long long)s->ns[s->count - 1]);
+	if(s->bytes) fprintf(b->out, ", \"mb_per_s\": %.1f", (double)s->bytes / 1e6 / ((double)total / 1e9));
+	fprintf(b->out, "}");
+	b->first = 0;
+	s->count = 0;
+	s->bytes = 0;
+}
+
+static void check(int ok, const char* what){
+	if(ok) return;
+	fprintf(stderr, "bench: %s failed\n", what);
+	exit(1);
+}
+
+// times one call of expr into samples s
+#define TIME(s, expr) do{ \
+		uint64_t _start = now_ns(); \
+		expr; \
+		sample_add(&(s), now_ns() - _start); \
+	}while(0)
+
+/*
+ * Append len bytes of filler to path, in pieces fs_writef can take as a string
+ */
+static void fill_file(struct bench* b, file_system* fs, char* path, int len){
+	check(fs_mkfile(fs, path) == 0, "mkfile");
+	while(len > 0){
+		int piece = MIN(len, FILL_FILE);
+		char saved = b->text[piece];
+		b->text[piece] = '\0';
+		check(fs_writef(fs, path, b->text) == piece, "writef");
+		b->text[piece] = saved;
+		len -= piece;
+	}
+}
+
+/*
+ * Fill the image with FILL_FILE sized files until fill percent of its blocks are used
+ */
+static void fill(struct bench* b, file_system* fs){
+	uint32_t blocks = b->size;
+	uint32_t target = (uint64_t)blocks * b->fill / 100;
+	char path[64];
+	check(fs_mkdir(fs, "/fill") == 0, "mkdir");
+	for (int i = 0; blocks - block_count_free(fs) < target; i++) {
+		if(i % FILL_DIR == 0){
+			snprintf(path, sizeof(path), "/fill/%d", i / FILL_DIR);
+			check(fs_mkdir(fs, path) == 0, "mkdir");
+		}
+		snprintf(path, sizeof(path), "/fill/%d/%d", i / FILL_DIR, i % FILL_DIR);
+		fill_file(b, fs, path, FILL_FILE);
+	}
+}
+
+static void bench_names(struct bench* b, file_system* fs){
+	struct samples mkdir = {0}, mkfile = {0}, list = {0}, rm = {0};
+	char path[64];
+	int count = b->reps;
+	check(fs_mkdir(fs, "/names") == 0, "mkdir");
+	for (int i = 0; i < count; i++) {
+		snprintf(path, sizeof(path), "/names/d%d", i);
+		TIME(mkdir, check(fs_mkdir(fs, path) == 0, "mkdir"));
+		snprintf(path, sizeof(path), "/names/f%d", i);
+		TIME(mkfile, check(fs_mkfile(fs, path) == 0, "mkfile"));
+	}
+	check(fs_mkdir(fs, "/list") == 0, "mkdir");
+	for (int i = 0; i < LIST_FILES; i++) {
+		snprintf(path, sizeof(path), "/list/file_%d", i);
+		check(fs_mkfile(fs, path) == 0, "mkfile");
+	}
+	for (int i = 0; i < count; i++) {
+		char* listing;
+		TIME(list, listing = fs_list(fs, "/list"));
+		check(listing != NULL, "list");
+		free(listing);
+	}
+	for (int i = 0; i < count; i++) {
+		snprintf(path, sizeof(path), "/names/f%d", i);
+		TIME(rm, check(fs_rm(fs, path) == 0, "rm"));
+		snprintf(path, sizeof(path), "/names/d%d", i);
+		check(fs_rm(fs, path) == 0, "rm");
+	}
+	check(fs_rm(fs, "/names") == 0 && fs_rm(fs, "/list") == 0, "rm");
+	report(b, "mkdir", &mkdir);
+	report(b, "mkfile", &mkfile);
+	report(b, "list", &list);
+	report(b, "rm", &rm);
+	free(mkdir.ns);
+	free(mkfile.ns);
+	free(list.ns);
+	free(rm.ns);
+}
+
+/*
+ * Path lookup by depth, timed as fs_readf of an empty file at the end of the path
+ */
+static void bench_lookup(struct bench* b, file_system* fs){
+	struct samples s = {0};
+	char path[DEPTH_MAX * 4 + 16] = "";
+	char file[sizeof(path) + 4];
+	char op[32];
+	for (int depth = 1; depth <= DEPTH_MAX; depth++) {
+		size_t len = strlen(path);
+		snprintf(path + len, sizeof(path) - len, "/d%d", depth);
+		check(fs_mkdir(fs, path) == 0, "mkdir");
+		snprintf(file, sizeof(file), "%s/f", path);
+		check(fs_mkfile(fs, file) == 0, "mkfile");
+		if(depth != 1 && depth != 4 && depth != DEPTH_MAX) continue;
+		for (int i = 0; i < b->reps; i++) {
+			int size;
+			uint8_t* content;
+			TIME(s, content = fs_readf(fs, file, &size));
+			free(content);
+		}
+		snprintf(op, sizeof(op), "lookup_depth_%d", depth);
+		report(b, op, &s);
+	}
+	check(fs_rm(fs, "/d1") == 0, "rm");
+	free(s.ns);
+}
+
+static void bench_data(struct bench* b, file_system* fs){
+	struct samples writef = {0}, readf = {0}, readv = {0};
+	int reps = b->reps;
+	check(fs_mkfile(fs, "/append") == 0, "mkfile");
+	char saved = b->text[64];
+	b->text[64] = '\0';
+	for (int i = 0; i < reps; i++) {
+		TIME(writef, check(fs_writef(fs, "/append", b->text) == 64, "writef"));
+		writef.bytes += 64;
+	}
+	b->text[64] = saved;
+	check(fs_rm(fs, "/append") == 0, "rm");
+
+	fill_file(b, fs, "/read", READ_FILE);
+	for (int i = 0; i < reps; i++) {
+		int size;
+		uint8_t* content;
+		TIME(readf, content = fs_readf(fs, "/read", &size));
+		check(content != NULL && size == READ_FILE, "readf");
+		free(content);
+		readf.bytes += READ_FILE;
+	}
+	struct iovec iov[READV_LEN / BLOCK_SIZE + 1];
+	for (int i = 0; i < reps; i++) {
+		uint64_t offset = (uint64_t)(i * 7919) % (READ_FILE - READV_LEN);
+		int n;
+		TIME(readv, n = fs_readv(fs, "/read", offset, READV_LEN, iov, READV_LEN / BLOCK_SIZE + 1));
+		check(n > 0, "readv");
+		readv.bytes += READV_LEN;
+	}
+	check(fs_rm(fs, "/read") == 0, "rm");
+	report(b, "writef", &writef);
+	report(b, "readf", &readf);
+	report(b, "readv", &readv);
+	free(writef.ns);
+	free(readf.ns);
+	free(readv.ns);
+}
+
+static void bench_transfer(struct bench* b, file_system* fs){
+	struct samples import = {0}, export = {0}, compress = {0}, cp = {0};
+	int reps = MAX(b->reps / 20, 3);
+	FILE* ext = fopen(EXT_FILE, "w");
+	check(ext != NULL && fwrite(b->text, 1, IMPORT_FILE, ext) == IMPORT_FILE && fclose(ext) == 0, "writing " EXT_FILE);
+	for (int i = 0; i < reps; i++) {
+		TIME(import, check(fs_import(fs, "/imported", EXT_FILE) == 0, "import"));
+		import.bytes += IMPORT_FILE;
+		TIME(export, check(fs_export(fs, "/imported", EXT_FILE) == 0, "export"));
+		export.bytes += IMPORT_FILE;
+		check(fs_rm(fs, "/imported") == 0, "rm");
+	}
+	unlink(EXT_FILE);
+
+	fill_file(b, fs, "/compressed", COMPRESS_FILE);
+	for (int i = 0; i < reps; i++) {
+		TIME(compress, check(fs_compress(fs, "/compressed", (i & 1) == 0) == 0, "compress"));
+		compress.bytes += COMPRESS_FILE;
+	}
+	check(fs_rm(fs, "/compressed") == 0, "rm");
+
+	char path[64];
+	check(fs_mkdir(fs, "/tree") == 0, "mkdir");
+	for (int i = 0; i < TREE_FILES; i++) {
+		snprintf(path, sizeof(path), "/tree/f%d", i);
+		fill_file(b, fs, path, TREE_FILE);
+	}
+	for (int i = 0; i < reps; i++) {
+		// no bytes: the copies share the blocks of the tree, fs_cp moves no file data
+		TIME(cp, check(fs_cp(fs, "/tree", "/tree_copy") == 0, "cp"));
+		check(fs_rm(fs, "/tree_copy") == 0, "rm");
+	}
+	check(fs_rm(fs, "/tree") == 0, "rm");
+	report(b, "import", &import);
+	report(b, "export", &export);
+	report(b, "compress", &compress);
+	report(b, "cp_tree", &cp);
+	free(import.ns);
+	free(export.ns);
+	free(compress.ns);
+	free(cp.ns);
+}
+
+/*
+ * fs_dump, fs_load and fs_load_mmap of the whole image, fs is cleaned up.
+ * The first dump writes everything, later ones only what a small append changed
+ */
+static void bench_image(struct bench* b, file_system* fs){
+	struct samples dump_full = {0}, dump = {0}, load = {0}, load_mmap = {0};
+	int reps = MAX(b->reps / 100, 3);
+	TIME(dump_full, check(fs_dump(fs, IMAGE) == 0, "dump"));
+	check(fs_mkfile(fs, "/log") == 0, "mkfile");
+	for (int i = 0; i < reps; i++) {
+		check(fs_writef(fs, "/log", "entry\n") > 0, "writef");
+		TIME(dump, check(fs_dump(fs, IMAGE) == 0, "dump"));
+	}
+	cleanup(fs);
+	for (int i = 0; i < reps; i++) {
+		file_system* loaded;
+		TIME(load, loaded = fs_load(IMAGE));
+		check(loaded != NULL, "load");
+		cleanup(loaded);
+		TIME(load_mmap, loaded = fs_load_mmap(IMAGE));
+		check(loaded != NULL, "load_mmap");
+		cleanup(loaded);
+	}
+	unlink(IMAGE);
+	report(b, "dump_full", &dump_full);
+	report(b, "dump_changed", &dump);
+	report(b, "load", &load);
+	report(b, "load_mmap", &load_mmap);
+	free(dump_full.ns);
+	free(dump.ns);
+	free(load.ns);
+	free(load_mmap.ns);
+}
+
+int main(int argc, char* argv[]){
+	struct bench b = { stdout, 1000, 1, 0, 0, NULL };
+	for (int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "-q") == 0){
+			b.reps = 100;
+		}
+		else if(strcmp(argv[i], "-o") == 0 && i + 1 < argc){
+			b.out = fopen(argv[++i], "w");
+			check(b.out != NULL, "opening the output");
+		}
+		else{
+			fprintf(stderr, "Usage: %s [-q] [-o <file>]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	// printable filler, the image holds it as text
+	b.text = malloc(IMPORT_FILE + 1);
+	check(b.text != NULL, "malloc");
+	for (int i = 0; i < IMPORT_FILE; i++) b.text[i] = 'a' + (i * 31 + i / 97) % 26;
+	b.text[IMPORT_FILE] = '\0';
+
+	fprintf(b.out, "{\"block_size\": %d, \"reps\": %d, \"results\": [", BLOCK_SIZE, b.reps);
+	for (size_t s = 0; s < sizeof(SIZES) / sizeof(SIZES[0]); s++) {
+		for (size_t f = 0; f < sizeof(FILLS) / sizeof(FILLS[0]); f++) {
+			b.size = SIZES[s];
+			b.fill = FILLS[f];
+			file_system* fs = fs_create(IMAGE, b.size);
+			check(fs != NULL, "create");
+			fill(&b, fs);
+			bench_names(&b, fs);
+			bench_lookup(&b, fs);
+			bench_data(&b, fs);
+			bench_transfer(&b, fs);
+			bench_image(&b, fs);
+			fflush(b.out);
+		}
+	}
+	fprintf(b.out, "\n]}\n");
+	if(b.out != stdout) fclose(b.out);
+	free(b.text);
+	return 0;
+}
@@ -0,0 +1,59 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * Packed bitmaps stored as arrays of 64-bit words. Bit i lives in word i/64.
+ */
+
+#define BITMAP_WORDS(n) (((size_t)(n) + 63) / 64)
+
+static inline uint64_t* bitmap_alloc(size_t n){
+	return calloc(BITMAP_WORDS(n) ? BITMAP_WORDS(n) : 1, sizeof(uint64_t));
+}
+
+static inline void bitmap_set(uint64_t* map, size_t i){
+	map[i / 64] |= (uint64_t)1 << (i % 64);
+}
+
+static inline void bitmap_clear(uint64_t* map, size_t i){
+	map[i / 64] &= ~((uint64_t)1 << (i % 64));
+}
+
+static inline int bitmap_test(const uint64_t* map, size_t i){
+	return (map[i / 64] >> (i % 64)) & 1;
+}
+
+/*
+ * Returns the index of the first set bit at or after start, or n if there is none
+ */
+static inline size_t bitmap_next_set(const uint64_t* map, size_t n, size_t start){
+	if(start >= n) return n;
+	size_t w = start / 64;
+	uint64_t word = map[w] & (~(uint64_t)0 << (start % 64));
+	while(word == 0){
+		if(++w >= BITMAP_WORDS(n)) return n;
+		word = map[w];
+	}
+	size_t i = w * 64 + __builtin_ctzll(word);
+	return i < n ? i : n;
+}
+
+/*
+ * Returns the index of the first clear bit at or after start, or n if there is none
+ */
+static inline size_t bitmap_next_clear(const uint64_t* map, size_t n, size_t start){
+	if(start >= n) return n;
+	size_t w = start / 64;
+	uint64_t word = ~map[w] & (~(uint64_t)0 << (start % 64));
+	while(word == 0){
+		if(++w >= BITMAP_WORDS(n)) return n;
+		word = ~map[w];
+	}
+	size_t i = w * 64 + __builtin_ctzll(word);
+	return i < n ? i : n;
+}
+
+#endif //BITMAP_H
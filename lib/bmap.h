@@ -0,0 +1,58 @@
+#ifndef BMAP_H
+#define BMAP_H
+
+#include "../lib/filesystem.h"
+
+/*
+ * Block map of a regular file.
+ * Data block i of a file is direct_blocks[i] for the first
+ * DIRECT_BLOCKS_COUNT blocks. The following blocks are reached through
+ * indirect_blocks: level 0 is a single indirect block holding BMAP_SLOTS
+ * block numbers, level 1 a double and level 2 a triple indirect block.
+ * Every data block of a file but the last is full, so byte offset o lies in
+ * block o / BLOCK_SIZE, which is found in at most INDIRECT_LEVELS steps.
+ */
+
+#define BMAP_SLOTS (BLOCK_SIZE / sizeof(int32_t))
+#define BMAP_MAX_BLOCKS (DIRECT_BLOCKS_COUNT + BMAP_SLOTS + BMAP_SLOTS * BMAP_SLOTS \
+                         + (uint64_t)BMAP_SLOTS * BMAP_SLOTS * BMAP_SLOTS)
+
+/*
+	* number of data block i of file inode_id
+	* @return the block number or -1 if block i is not mapped
+*/
+int bmap_get(file_system* fs, int inode_id, uint64_t i);
+
+/*
+	* map data block i of file inode_id to block_id, allocating indirect blocks as needed
+	* @return 0 on success, -1 if i is too large or no block for an indirect block is left
+*/
+int bmap_set(file_system* fs, int inode_id, uint64_t i, int block_id);
+
+/*
+	* make data block i of file inode_id private to it before it is changed:
+	* a block shared with other files is replaced by a copy
+	* @return the number of the private block, -1 if block i is not mapped or no block is left for the copy
+*/
+int bmap_unshare(file_system* fs, int inode_id, uint64_t i);
+
+/*
+	* Iterate over the mapped data blocks of file inode_id in file order.
+	* *i starts at 0. Returns the next mapped block at or after *i and sets *i
+	* past it, or -1 at the end. Unmapped ranges are skipped a whole indirect block at a time.
+*/
+int bmap_next(file_system* fs, int inode_id, uint64_t* i);
+
+/*
+	* drop data block i and all following data blocks of file inode_id,
+	* together with the indirect blocks that only mapped them.
+	* Shared blocks are freed with their last reference, see block_free.
+*/
+void bmap_truncate(file_system* fs, int inode_id, uint64_t i);
+
+/*
+	* number of indirect blocks needed to map the data blocks [0, count) of a file
+*/
+uint64_t bmap_meta_blocks(uint64_t count);
+
+#endif //BMAP_H
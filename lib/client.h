@@ -0,0 +1,88 @@
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../lib/protocol.h"
+
+/*
+ * Client of ha2 --serve, see protocol.h. The client_* calls mirror the fs_*
+ * calls of operations.h and return what they return, or -1 if the server
+ * can't be reached. To pipeline, client_send any number of requests and then
+ * client_recv their replies, which come back in the order they were sent.
+ * The client_* calls drop the replies of pipelined requests not yet received.
+ * Replies that arrive while requests are still being sent are kept until they
+ * are received, so the server never waits for a client that waits for it.
+ * A connection is used by one thread at a time.
+ */
+
+typedef struct _fs_client{
+	int fd;
+	uint32_t next_tag;
+	uint8_t* out; //requests not yet sent
+	size_t out_len;
+	size_t out_cap;
+	uint8_t* in; //replies received, from in_off on not yet handed out
+	size_t in_len;
+	size_t in_off;
+	size_t in_cap;
+	uint8_t* reply; //the reply handed out last
+	size_t reply_cap;
+} fs_client;
+
+typedef struct _client_reply{
+	uint32_t tag;
+	int32_t status;
+	uint8_t* data; //valid until the next client_recv
+	uint32_t length;
+} client_reply;
+
+/*
+	* Connect to the server listening on socket_path
+	* @return the connection, NULL if it can't be made
+*/
+fs_client* client_connect(const char* socket_path);
+
+/*
+	* Close the connection, requests not yet sent are dropped
+*/
+void client_close(fs_client* c);
+
+/*
+	* Queue a request, path and arg may be NULL where op does not take them.
+	* offset and length are only sent for PROTO_READV.
+	* @return the tag its reply will carry
+*/
+uint32_t client_send(fs_client* c, uint8_t op, uint8_t flag, const char* path, const char* arg, uint64_t offset, uint64_t length);
+
+/*
+	* Send the queued requests
+	* @return 0 on success, -1 if the connection broke
+*/
+int client_flush(fs_client* c);
+
+/*
+	* Wait for the next reply, queued requests are sent first
+	* @return 0 on success, -1 if the connection broke
+*/
+int client_recv(fs_client* c, client_reply* reply);
+
+int client_mkdir(fs_client* c, const char* path);
+int client_mkfile(fs_client* c, const char* path);
+int client_cp(fs_client* c, const char* from, const char* to);
+// the listing is malloc'd, NULL if the path is not found
+char* client_list(fs_client* c, const char* path);
+int client_writef(fs_client* c, const char* path, const char* text);
+// the content is malloc'd, NULL if the file is empty or not found
+uint8_t* client_readf(fs_client* c, const char* path, int* file_size);
+// reads into dst, in requests of at most PROTO_MAX_READV bytes, returns the number of bytes read
+int64_t client_readv(fs_client* c, const char* path, uint64_t offset, size_t length, uint8_t* dst);
+int client_rm(fs_client* c, const char* path);
+int client_import(fs_client* c, const char* int_path, const char* ext_path);
+int client_export(fs_client* c, const char* int_path, const char* ext_path);
+int client_compress(fs_client* c, const char* path, int on);
+int client_dump(fs_client* c);
+int client_shutdown(fs_client* c);
+
+#endif //CLIENT_H
@@ -0,0 +1,40 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include "../lib/filesystem.h"
+
+/*
+ * Directory entry cache. Maps (parent inode, name) to the child inode number,
+ * or to -1 for names known not to exist in that directory.
+ * The table is direct mapped: a new entry replaces whatever hashed to the same slot.
+ * Lookups take no lock, they copy a slot and check its sequence number did not
+ * change meanwhile. Writers lock slots in groups.
+ * Callers hold the lock of the directory or read it without locks, see lock.h
+ */
+
+/*
+	* Look up name in directory parent.
+	* @return 1 on a hit with the child (or -1 for a negative entry) stored in *child, 0 on a miss
+*/
+int dcache_lookup(file_system* fs, int parent, const char* name, int* child);
+
+/*
+	* Remember that name in directory parent resolves to child (-1: does not exist).
+	* Skipped while another thread writes a slot of the same group.
+	* A reader without locks only inserts children it found, a negative entry
+	* could be stale by the time it is stored.
+*/
+void dcache_insert(file_system* fs, int parent, const char* name, int child);
+
+/*
+	* Forget what is cached for name in directory parent.
+	* Must be called whenever an entry is added to or removed from a directory.
+*/
+void dcache_invalidate(file_system* fs, int parent, const char* name);
+
+/*
+	* Frees the cache, it is rebuilt on the next lookup. No other thread may use it meanwhile
+*/
+void dcache_destroy(file_system* fs);
+
+#endif //DCACHE_H
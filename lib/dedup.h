@@ -0,0 +1,46 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include "../lib/filesystem.h"
+
+/*
+ * Block deduplication. In dedup mode every full data block written to a file
+ * is fingerprinted, and if an identical block is already stored the file
+ * shares that one instead (see block_share).
+ * The fingerprint index maps the hash of a block's content to its number.
+ * It is direct mapped like the dcache, so a colliding fingerprint replaces
+ * the old one and only costs a missed match. Hits are compared byte by byte.
+ * The index lives in memory only; the shared blocks themselves survive a dump.
+ */
+
+/*
+	* turn dedup mode on or off. Turning it on indexes the full data blocks
+	* already stored, so later writes can share them.
+	* Holds the filesystem lock exclusive, see lock.h
+	* @return 0 on success, -1 if there is no memory for the index
+*/
+int dedup_enable(file_system* fs, int on);
+
+/*
+	* Offer the freshly written full data block block_id, which no other file maps.
+	* @return the number of an identical stored block, with a reference added for
+	* the caller, or block_id itself after adding it to the index
+*/
+int dedup_block(file_system* fs, int block_id);
+
+/*
+	* drop block_id from the index, it is being freed
+*/
+void dedup_forget(file_system* fs, int block_id);
+
+/*
+	* number of full blocks offered and how many of them were shared instead of stored
+*/
+void dedup_stats(file_system* fs, uint64_t* checked, uint64_t* shared);
+
+/*
+	* Frees the index and leaves dedup mode
+*/
+void dedup_destroy(file_system* fs);
+
+#endif //DEDUP_H
@@ -0,0 +1,81 @@
+#ifndef DIR_H
+#define DIR_H
+
+#include "../lib/filesystem.h"
+
+/*
+ * Directory entries.
+ * The first DIRECT_BLOCKS_COUNT children of a directory live in its
+ * direct_blocks. Further children go into a hashed index (extendible hashing)
+ * rooted at dir_index:
+ *  - the root block holds the global depth and the numbers of up to
+ *    DIR_ROOT_LEAVES leaf blocks,
+ *  - the leaf blocks together form the table of 2^depth bucket numbers,
+ *    indexed by the low depth bits of the name hash,
+ *  - a bucket block holds up to DIR_BUCKET_ENTRIES (hash, inode) pairs and
+ *    its local depth. A full bucket is split, doubling the table if needed.
+ * Lookup, insert and delete touch one bucket.
+ */
+
+#define DIR_LEAF_SLOTS (BLOCK_SIZE / sizeof(int32_t))
+#define DIR_ROOT_LEAVES ((BLOCK_SIZE - 2 * sizeof(uint32_t)) / sizeof(int32_t))
+#define DIR_BUCKET_ENTRIES ((BLOCK_SIZE - 2 * sizeof(uint32_t)) / (2 * sizeof(uint32_t)))
+#define DIR_MAX_DEPTH 15 // 2^15 bucket numbers fit into DIR_ROOT_LEAVES leaves
+
+typedef struct _dir_root{
+	uint32_t depth; //global depth, the table has 2^depth entries
+	uint32_t count; //number of entries in the hashed part
+	int32_t leaves[DIR_ROOT_LEAVES]; //leaf blocks of the bucket table, -1 if unused
+} dir_root;
+
+typedef struct _dir_bucket{
+	uint32_t depth; //local depth, all entries agree in the low depth bits of their hash
+	uint32_t count;
+	struct{
+		uint32_t hash;
+		int32_t inode;
+	} entries[DIR_BUCKET_ENTRIES];
+} dir_bucket;
+
+/*
+	* hash of an entry name
+*/
+uint32_t dir_hash(const char* name);
+
+/*
+	* find the child called name in directory dir_id
+	* @return its inode number or -1 if there is none
+*/
+int dir_find(file_system* fs, int dir_id, const char* name);
+
+/*
+	* add inode child_id (its name must be set) to directory dir_id
+	* @return 0 on success, -1 if no block for the index is left
+*/
+int dir_add(file_system* fs, int dir_id, int child_id);
+
+/*
+	* remove inode child_id (its name must still be set) from directory dir_id
+	* @return 0 on success, -1 if it is not an entry of dir_id
+*/
+int dir_remove(file_system* fs, int dir_id, int child_id);
+
+/*
+	* Iterate over the children of directory dir_id.
+	* *cursor starts at 0. Returns the next child and advances *cursor, or -1 at the end.
+	* Children are visited in storage order: the direct_blocks first, then the hashed index.
+*/
+int dir_next(file_system* fs, int dir_id, uint64_t* cursor);
+
+/*
+	* number of children of directory dir_id
+*/
+uint32_t dir_count(file_system* fs, int dir_id);
+
+/*
+	* collect the children of directory dir_id sorted by inode-index
+	* @return their number and a malloc'd array in *children, or -2 if there is no memory
+*/
+int dir_children(file_system* fs, int dir_id, int** children);
+
+#endif //DIR_H
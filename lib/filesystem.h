@@ -9,6 +9,12 @@
 #define BLOCK_SIZE 1024
 #define NAME_MAX_LENGTH 32
 #define DIRECT_BLOCKS_COUNT 12
+#define INDIRECT_LEVELS 3 //single, double and triple indirect blocks
+
+#define FS_MAGIC 0x32414853 //"SHA2"
+#define FS_VERSION 4
+
+#define INODE_COMPRESSED 0x1 //the data blocks hold compressed frames, see zfile.h
 
 enum node_type{
 	reg_file=1,
@@ -24,35 +30,92 @@ typedef struct _data_block{
 /*
  * The direct_blocks can either point to other inode, in case this inode is a directory
  * or to data_blocks, in case this is a regular file
+ * A directory with more children than direct_blocks keeps the rest in a hashed
+ * index stored in data blocks, see dir.h
+ * A regular file with more data blocks than direct_blocks maps the rest
+ * through its indirect_blocks, see bmap.h
+ * A regular file with INODE_COMPRESSED in its flags stores its content compressed, see zfile.h
  */
 typedef struct _inode {
 	enum node_type n_type;
-	uint16_t size;
+	uint64_t size;
 	char name[NAME_MAX_LENGTH];
 	int direct_blocks[DIRECT_BLOCKS_COUNT]; //Block numbers. -1 if there is no block
+	int indirect_blocks[INDIRECT_LEVELS]; //Block numbers of the indirect blocks. -1 if there is no block
 	int parent; //inode number of parent
+	int dir_index; //root block of the hashed directory index. -1 if there is none
+	uint32_t flags; //INODE_COMPRESSED
 } inode;
 
+/*
+ * Images written before the format was versioned start with num_blocks and
+ * free_blocks only. They and images of an older version are converted when
+ * they are loaded.
+ */
 typedef struct _superblock{
 	uint32_t num_blocks;
 	uint32_t free_blocks;
+	uint32_t magic; //FS_MAGIC
+	uint32_t version; //FS_VERSION
 } superblock;
 
+struct dcache;
+struct dedup;
+struct zfile;
+struct journal;
+struct snapshots;
+struct fs_locks;
+
 typedef struct _fs{
 	superblock* s_block;
 	uint8_t * free_list; //free == 1
 	inode * inodes;	
 	data_block* data_blocks;
 	int root_node; //inode-number of root node
+	void* map_base; //start of the mmap'ed image, NULL if the arrays above are malloc'ed
+	size_t map_len; //length of the mapping in bytes
+	int image_fd; //descriptor of the image this fs was loaded from or last dumped to, -1 if none
+	uint64_t* dirty_inodes; //bitmap of inodes changed since the last dump
+	uint64_t* dirty_blocks; //bitmap of data blocks changed since the last dump
+	uint32_t dirty_free_lo; //free list entries [dirty_free_lo, dirty_free_hi) changed since the last dump
+	uint32_t dirty_free_hi;
+	uint64_t* free_map; //packed in-memory copy of free_list, a set bit means free and no reader sees it
+	uint32_t free_hint; //no block below this index is free
+	uint64_t* inode_map; //free inodes, a set bit means n_type == free_block and no reader sees it
+	uint64_t* inode_summary; //bit w is set if word w of inode_map has a free inode
+	uint32_t inode_hint; //no word of inode_summary below this index has a set bit
+	uint32_t free_inodes; //number of set bits in inode_map
+	uint32_t* block_refs; //references to each data block beyond the first, see block_share
+	struct dcache* dcache; //directory entry cache, see dcache.h
+	struct dedup* dedup; //fingerprint index of full data blocks, NULL unless dedup mode is on, see dedup.h
+	struct zfile* zfile; //cursors into compressed files, one per thread, see zfile.h
+	struct journal* journal; //write-ahead journal, NULL unless it is open, see journal.h
+	struct snapshots* snapshots; //NULL unless there are snapshots, see snapshot.h
+	int read_only; //a mounted snapshot, operations that change it fail
+	struct fs_locks* locks; //for using fs from several threads, see lock.h
 }file_system ;
 
 /**
 	* Allocates memory for a filesystem and loads an existing filesystem from a .fs-file.
+	* Transactions committed to the journal of the image are replayed into it first.
+	* Its snapshots are read as well, see snapshot.h.
 	* @param const char* path to the fs-file
 	* @return pointer to a fs-struct 
 **/
 file_system* fs_load(const char* fs_file_path);
 
+/**
+	* Maps an existing .fs-file into memory instead of copying it.
+	* s_block, free_list, inodes and data_blocks point straight into the
+	* mapping, so loading does not depend on the image size and fs_dump to the
+	* same file only has to msync the dirty pages.
+	* Falls back to fs_load for images in an older format, which have to be converted,
+	* and for images with snapshots, see snapshot.h.
+	* @param const char* path to the fs-file
+	* @return pointer to a fs-struct
+**/
+file_system* fs_load_mmap(const char* fs_file_path);
+
 
 /**
 	* creates a new file system file
@@ -65,12 +128,38 @@ file_system* fs_create(const char* fs_file_path, uint32_t size);
 
 /*
  * dumps the filesystem to harddrive
+ * If file_path is the image the filesystem was loaded from (or last dumped to),
+ * only the superblock and the regions marked dirty since then are written in place.
+ * Otherwise the whole image is written.
+ * With a journal open, a dump to its image also empties the journal, see journal.h.
+ * The snapshots of fs are written next to the image, see snapshot.h.
  * @param file_system* fs the filesystem to dump
  * @param const char* file_path where to put the file on the harddrive
  * @return 0 on success, -1 else
  */
 int fs_dump(file_system* fs, const char* file_path);
 
+/*
+	* Record that an inode, a data block or a free list entry is about to change,
+	* so the next fs_dump writes it. Call them before the change, the newest
+	* snapshot saves the old content then, see snapshot.h
+*/
+void fs_mark_inode_dirty(file_system* fs, int inode_id);
+void fs_mark_block_dirty(file_system* fs, int block_id);
+void fs_mark_free_dirty(file_system* fs, int block_id);
+
+
+/*
+	* An in-memory copy of fs that belongs to no image, fs_dump writes it as a whole.
+	* Free it with cleanup.
+*/
+file_system* fs_clone(file_system* fs);
+
+/*
+	* The free list and the inodes of fs were replaced as a whole,
+	* drop what was built from them. It is built again on first use.
+*/
+void fs_drop_caches(file_system* fs);
 
 /*
 	* Initialize an empty inode
@@ -81,6 +170,87 @@ void inode_init(inode* i);
 */
 int find_free_inode(file_system* fs);
 
+/*
+	* Inode allocator. Free inodes are kept in a two-level bitmap that is built
+	* from the inode table on first use, so the lowest free inode is found
+	* without scanning the table.
+*/
+
+/*
+	* take the lowest free inode and return its number or -1 if there is no free inode.
+	* The caller initializes the inode and sets its n_type.
+*/
+int inode_alloc(file_system* fs);
+/*
+	* take up to count of the lowest free inodes in ascending order, the numbers
+	* inode_alloc would return one after the other, and store them in inodes
+	* @return number of taken inodes, less than count if there are not enough
+*/
+int inode_alloc_n(file_system* fs, int count, int* inodes);
+/*
+	* initialize an inode as free and return it to the allocator,
+	* which hands it out again once the readers without locks have left
+*/
+void inode_free(file_system* fs, int inode_id);
+/*
+	* number of free inodes
+*/
+uint32_t inode_count_free(file_system* fs);
+
+/*
+	* The allocators and the marks above may be called from several threads,
+	* they take the allocator lock, see lock.h
+*/
+
+/*
+	* Block allocator. free_list stays the persistent byte map, the allocator
+	* scans the packed free_map 64 blocks at a time starting at free_hint.
+	* free_map is built from free_list on first use.
+	* free_list must only be changed through these functions.
+*/
+
+/*
+	* allocate the lowest free data block and return its number or -1 if there is no free block
+*/
+int block_alloc(file_system* fs);
+/*
+	* allocate up to count free data blocks in ascending order and store their numbers in blocks
+	* @return number of allocated blocks, less than count if the filesystem runs full
+*/
+int block_alloc_n(file_system* fs, int count, int* blocks);
+/*
+	* allocate up to count data blocks for a file, preferring consecutive block numbers:
+	* first the free blocks starting at goal (the block after the caller's last one, -1 if none),
+	* then the lowest run of free blocks long enough for the rest,
+	* and only if there is none the lowest free blocks like block_alloc_n
+	* @return number of allocated blocks, less than count if the filesystem runs full
+*/
+int block_alloc_run(file_system* fs, int count, int goal, int* blocks);
+/*
+	* drop a reference to a data block. The block returns to the free list
+	* when this was its last reference, and is allocated again once the readers
+	* without locks have left.
+*/
+void block_free(file_system* fs, int block_id);
+/*
+	* Data blocks of files can be shared, fs_cp shares them instead of copying.
+	* block_refs is built from the block maps of all files on first use,
+	* so shared blocks survive a dump and load without being stored.
+*/
+
+/*
+	* add a reference to a data block
+*/
+void block_share(file_system* fs, int block_id);
+/*
+	* 1 if a data block has more than one reference, 0 else
+*/
+int block_is_shared(file_system* fs, int block_id);
+/*
+	* number of free data blocks
+*/
+uint32_t block_count_free(file_system* fs);
+
 /*
 	* frees up memory
 */
@@ -0,0 +1,75 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "../lib/filesystem.h"
+
+/*
+ * Write-ahead journal next to the image, in <image>.journal.
+ * While it is open, the inodes, data blocks and free list entries an operation
+ * marks dirty are also marked for the journal. At the end of every group-th
+ * operation everything marked is appended to the journal as one transaction
+ * (a header, the changed records in runs, and a trailer with a checksum) and
+ * made durable with a single fdatasync, so many operations share one commit.
+ * Records hold whole inodes and blocks, replaying a transaction twice does no harm.
+ * fs_load replays the committed transactions into the image. A dump to the
+ * image, and a journal grown past a quarter of the image, checkpoint: the image
+ * is written and synced, then the journal is emptied.
+ * An image mapped with fs_load_mmap can't be journaled: the shared mapping
+ * carries every change to the image before it is committed.
+ */
+
+/*
+	* Start journaling fs, whose image is image_path. The image is dumped first,
+	* it is what the journal applies to.
+	* @param group operations per commit, 1 makes every operation durable when it returns
+	* @return 0 on success, -1 if the image or the journal can't be written or the image is mapped
+*/
+int journal_open(file_system* fs, const char* image_path, int group);
+
+/*
+	* Record that an inode, a data block or a free list entry changed, see fs_mark_inode_dirty
+*/
+void journal_mark_inode(file_system* fs, int inode_id);
+void journal_mark_block(file_system* fs, int block_id);
+void journal_mark_free(file_system* fs, int block_id);
+
+/*
+	* End of an operation that may have changed fs, commits every group-th call.
+	* Called with the filesystem lock held exclusive, see lock.h
+*/
+void journal_op_end(file_system* fs);
+
+/*
+	* Append everything marked since the last commit as one transaction and sync it.
+	* No operation is halfway through then, it holds the filesystem lock exclusive.
+	* @return 0 on success (or if there is no journal), -1 else
+*/
+int journal_commit(file_system* fs);
+
+/*
+	* The image was just written from fs: sync it and empty the journal
+	* @return 0 on success, -1 else
+*/
+int journal_reset(file_system* fs);
+
+/*
+	* Apply the committed transactions in the journal of image_path to fs, which
+	* was just loaded from it, then write them to the image and empty the journal.
+	* A transaction cut short by a crash and anything after it is dropped.
+	* @return the number of transactions replayed, -1 if they could not be written to the image
+*/
+int journal_replay(file_system* fs, const char* image_path);
+
+/*
+	* Checkpoint, stop journaling and remove the journal
+	* @return 0 on success, -1 if the checkpoint failed
+*/
+int journal_close(file_system* fs);
+
+/*
+	* Commit what is pending and free the journal, the journal file is kept
+	* for fs_load to replay
+*/
+void journal_destroy(file_system* fs);
+
+#endif //JOURNAL_H
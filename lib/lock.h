@@ -0,0 +1,132 @@
+#ifndef LOCK_H
+#define LOCK_H
+
+#include "../lib/filesystem.h"
+
+/*
+ * Locks for using one filesystem from several threads, from the outside in:
+ *  - the filesystem lock. Every operation holds it shared. fs_dump, journal
+ *    commits, snapshots, switching dedup mode and removing or copying a whole
+ *    directory tree hold it exclusive, which leaves them alone with the filesystem.
+ *    Directories are only removed under it, so they stay put under a shared one.
+ *  - inode locks, one reader/writer lock per file or directory. Path lookup holds
+ *    the directory it searches shared, one at a time and no other inode lock.
+ *    An operation on several inodes takes their locks together with
+ *    inode_locks_acquire, which goes in ascending order.
+ *    Inodes share INODE_LOCK_STRIPES locks, inode i uses lock i % INODE_LOCK_STRIPES.
+ *  - the allocator lock, for the free list, the inode allocator, block reference
+ *    counts, dirty marks and what hangs off them (journal, snapshots, dedup index)
+ *    and for building the caches. It is recursive, the allocator calls the marks.
+ *  - the locks of the dcache slots, which are taken last.
+ * A thread that holds the filesystem lock exclusive skips the inode locks
+ * and may take the filesystem lock again.
+ *
+ * Path lookup, fs_list and fs_readf read without taking any of these. Every
+ * lock that is held exclusive has a sequence number which is odd meanwhile,
+ * a reader checks the numbers of what it read did not change and else reads
+ * again, after a few tries it takes the locks. Inodes and blocks that are freed
+ * go back to the allocators only once the readers that might still see them
+ * have left (epoch based reclamation), so whatever a reader follows stays
+ * a part of the filesystem while it reads.
+ */
+
+#define INODE_LOCK_STRIPES 1024
+#define INODE_LOCKS_MAX 4 //inodes one operation locks together
+
+/*
+	* Create and free the locks of fs, fs_load, fs_create and cleanup do this
+*/
+void fs_locks_init(file_system* fs);
+void fs_locks_destroy(file_system* fs);
+
+/*
+	* Take the filesystem lock shared or exclusive, and release either
+*/
+void fs_lock_shared(file_system* fs);
+void fs_lock_exclusive(file_system* fs);
+void fs_unlock(file_system* fs);
+/*
+	* 1 if the calling thread holds the filesystem lock exclusive, 0 else
+*/
+int fs_lock_owned(file_system* fs);
+
+/*
+	* Lock a single inode shared, for path lookup
+*/
+void inode_lock_shared(file_system* fs, int inode_id);
+void inode_unlock_shared(file_system* fs, int inode_id);
+
+/*
+	* A set of inode locks taken together
+*/
+typedef struct _inode_locks{
+	int count;
+	int skipped; //the filesystem lock was held exclusive, nothing was taken
+	uint32_t stripes[INODE_LOCKS_MAX]; //ascending once acquired
+	uint8_t exclusive[INODE_LOCKS_MAX];
+} inode_locks;
+
+/*
+	* Empty the set
+*/
+void inode_locks_init(inode_locks* set);
+/*
+	* Add inode_id to the set, an inode added twice is locked exclusive if either asked for it
+*/
+void inode_locks_add(inode_locks* set, int inode_id, int exclusive);
+/*
+	* Take the locks of the set in ascending order, and release them
+*/
+void inode_locks_acquire(file_system* fs, inode_locks* set);
+void inode_locks_release(file_system* fs, inode_locks* set);
+
+/*
+	* Take and release the allocator lock
+*/
+void alloc_lock(file_system* fs);
+void alloc_unlock(file_system* fs);
+
+/*
+	* A read without locks
+*/
+typedef struct _read_guard{
+	uint32_t fs_seq;
+	struct reader* reader;
+} read_guard;
+
+/*
+	* Start a read without locks, they may nest.
+	* @return 0 if another thread holds the filesystem lock exclusive, the read is
+	* pointless then. read_leave has to follow either way
+*/
+int read_enter(file_system* fs, read_guard* guard);
+/*
+	* End the read.
+	* @return 1 if no thread held the filesystem lock exclusive meanwhile
+*/
+int read_leave(file_system* fs, read_guard* guard);
+/*
+	* The sequence number of the lock of inode_id, odd while it is held exclusive
+*/
+uint32_t inode_seq(file_system* fs, int inode_id);
+/*
+	* 1 if seq is even and the lock of inode_id was not taken exclusive since it was read
+*/
+int inode_seq_check(file_system* fs, int inode_id, uint32_t seq);
+
+/*
+	* Call release(fs, id) once every read that started before has ended.
+	* Takes the allocator lock, as does release when it is called
+*/
+void epoch_defer(file_system* fs, void (*release)(file_system* fs, int id), int id);
+/*
+	* Run the deferred releases whose readers have left
+*/
+void epoch_reclaim(file_system* fs);
+/*
+	* Wait until the reads running now have ended and run all deferred releases.
+	* Must not be called with the allocator lock or inside a read
+*/
+void epoch_synchronize(file_system* fs);
+
+#endif //LOCK_H
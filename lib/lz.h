@@ -0,0 +1,30 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdint.h>
+
+/*
+ * A small LZ77 codec in the LZ4 block format: a sequence is a token byte
+ * (literal length in the high, match length - 4 in the low nibble, 15 meaning
+ * more length bytes follow), the literals, and a 16 bit little endian match
+ * offset followed by the rest of the match length. The last sequence has
+ * literals only.
+ * Compression is greedy with one hash table probe per position, decompression
+ * copies literals and matches 8 bytes at a time where there is room.
+ */
+
+#define LZ_MAX_INPUT 65535 //match offsets have 16 bit
+
+/*
+	* compress len bytes of src into dst, which holds cap bytes
+	* @return the compressed length, 0 if it does not fit into cap or len is larger than LZ_MAX_INPUT
+*/
+int lz_compress(const uint8_t* src, int len, uint8_t* dst, int cap);
+
+/*
+	* decompress len bytes of src into dst, which holds cap bytes
+	* @return the decompressed length, -1 if src is corrupt or does not fit into cap
+*/
+int lz_decompress(const uint8_t* src, int len, uint8_t* dst, int cap);
+
+#endif //LZ_H
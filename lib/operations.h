@@ -2,10 +2,19 @@
 
 #include <stdint.h>
 #include <string.h>
+#include <sys/uio.h>
 
 #include "../lib/filesystem.h"
+#include "../lib/tree.h"
+
+/*
+ * All operations may be called from several threads on the same filesystem,
+ * see lock.h for how they wait for each other. Path lookup, fs_list, the
+ * directory handles and fs_readf (of files that are not compressed) take no locks.
+ */
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 
 /**
  * Creates a new directory under the given path
@@ -58,6 +67,71 @@ int fs_mkfile(file_system *fs, char *path_and_name);
  */
 char *fs_list(file_system *fs, char *path);
 
+/**
+ * An entry of a directory as fs_readdir returns it
+ */
+typedef struct _fs_dirent{
+	int inode;
+	enum node_type type; //reg_file or directory
+	char name[NAME_MAX_LENGTH];
+} fs_dirent;
+
+/**
+ * An open directory, see fs_opendir
+ */
+typedef struct _fs_dir fs_dir;
+
+/**
+ * Opens the directory at path for reading its entries one at a time, sorted by
+ * inode-index like fs_list, without building a listing of all of them.
+ * The handle holds the inode-indices of the entries when it was opened and
+ * reads their names in small batches as it goes, each batch without locks
+ * like fs_list. Entries removed meanwhile are skipped, entries added meanwhile
+ * are not returned. A handle is used by one thread at a time.
+ *
+ * @Returns the handle, to be closed with fs_closedir, or NULL if path is not a directory
+ */
+fs_dir *fs_opendir(file_system *fs, char *path);
+
+/**
+ * The next entry of the directory
+ *
+ * @Returns the entry, valid until the next call on the handle, or NULL after the last one
+ */
+fs_dirent *fs_readdir(fs_dir *dir);
+
+/**
+ * The position of the handle, the inode-index the next entry has at least.
+ * It stays meaningful while the directory changes and in other handles of the
+ * same directory: fs_seekdir of another handle goes on after the entries read so far,
+ * which pages through a huge directory without keeping a handle open.
+ */
+uint64_t fs_telldir(fs_dir *dir);
+
+/**
+ * Go on from position cursor, a result of fs_telldir, 0 starts over
+ */
+void fs_seekdir(fs_dir *dir, uint64_t cursor);
+
+/**
+ * Frees the handle
+ */
+void fs_closedir(fs_dir *dir);
+
+/**
+ * Walks the tree at path, calling pre on each file and directory before the
+ * ones below it and post after them, see tree.h. With threads > 1 the
+ * directories are shared out to that many threads, the callbacks then run
+ * concurrently and in no fixed order. The filesystem lock is held shared
+ * meanwhile, the callbacks must not call the operations on fs.
+ *
+ * @Returns:
+ * 0 on success
+ * -1 if the path was not found
+ * the first negative result of a callback, which stops the walk
+ */
+int fs_walk(file_system *fs, char *path, walk_fn pre, walk_fn post, void *arg, int threads);
+
 /**
  * Write (append, not overwrite) @param text to a file pointed to by @param
  * filename The file must exist before it can be written to
@@ -78,6 +152,23 @@ int fs_writef(file_system *fs, char *filename, char *text);
  */
 uint8_t *fs_readf(file_system *fs, char *filename, int *file_size);
 
+/**
+ * Reads part of a file without copying it. Fills iov with pointers into the
+ * data blocks holding the bytes [offset, offset + length) of the file, one
+ * iovec per block, at most iov_count of them. They stay valid until the file
+ * is changed or the filesystem is cleaned up, so with other threads writing
+ * the file the caller has to keep them off it.
+ * A compressed file is decoded a frame at a time instead: one iovec points to
+ * the decoded rest of the frame holding offset, valid until the next call.
+ * To read a whole file, call it again with offset advanced by the iov_len of
+ * the returned iovecs until it returns 0.
+ *
+ * @Returns:
+ * number of filled iovecs, 0 at the end of the file
+ * -1 if the file does not exist or can't be decoded
+ */
+int fs_readv(file_system *fs, char *filename, uint64_t offset, size_t length, struct iovec *iov, int iov_count);
+
 /**
  * Deletes a file or a directory recursively.
  *
@@ -112,5 +203,17 @@ int fs_import(file_system *fs, char *int_path, char *ext_path);
  */
 int fs_export(file_system *fs, char *int_path, char *ext_path);
 
+/**
+ * Turns compression of a regular file on or off. The content is written again
+ * in the new form; fs_writef, fs_import, fs_readf, fs_readv and fs_export
+ * compress and decompress it transparently. Copies keep the setting.
+ *
+ * @Returns:
+ * 0 on success
+ * -1 if the file wasn't found or is a directory
+ * -2 if there is no room for the content in the new form, the file is unchanged then
+ */
+int fs_compress(file_system *fs, char *filename, int on);
+
 #define OPERATIONS_H
 #endif /* OPERATIONS_H */
@@ -0,0 +1,37 @@
+#ifndef POOL_H
+#define POOL_H
+
+/*
+ * Fork-join work on a few threads. Each thread keeps the tasks it pushed in
+ * a deque of its own and takes the newest of them first, which keeps a thread
+ * on the part of the work it started. A thread that runs out takes the oldest
+ * task of another thread, the biggest piece left there (work stealing).
+ * A task is a pointer the function knows how to run, the deques are short
+ * and locked, tasks are meant to be coarse: a directory, a run of blocks.
+ */
+
+typedef struct _pool_worker pool_worker;
+
+/*
+	* Run a task, worker is the thread running it, for pool_push
+*/
+typedef void (*pool_fn)(pool_worker* worker, void* task, void* arg);
+
+/*
+	* Run fn on task and on every task pushed meanwhile, on threads threads
+	* of which the calling thread is one. Returns once all tasks are done.
+*/
+void pool_run(int threads, pool_fn fn, void* task, void* arg);
+
+/*
+	* Add a task, from inside a running task
+*/
+void pool_push(pool_worker* worker, void* task);
+
+/*
+	* The usual number of threads: POOL_THREADS from the environment if it is set,
+	* else the number of processors online
+*/
+int pool_threads(void);
+
+#endif //POOL_H
@@ -0,0 +1,58 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+
+/*
+ * Request protocol of ha2 --serve, see server.h and client.h.
+ * Client and server share a host, numbers are in host byte order.
+ * A request is a proto_request followed by length bytes of arguments:
+ *  - PROTO_READV first has two uint64_t, the offset and the length to read
+ *  - then the path, NUL terminated
+ *  - then for PROTO_CP the destination path, for PROTO_WRITEF the text and
+ *    for PROTO_IMPORT and PROTO_EXPORT the external path, NUL terminated.
+ *    External paths are opened by the server.
+ * Every request is answered, in the order they were sent, by a proto_reply
+ * followed by length bytes: the listing for PROTO_LIST (without its NUL),
+ * the content for PROTO_READF and PROTO_READV, nothing else.
+ * status is what the fs_* function returned, 0 or -1 (not found) for PROTO_LIST
+ * and PROTO_READF, the number of bytes for PROTO_READV. A PROTO_READV returns
+ * at most PROTO_MAX_READV bytes, a longer range has to be asked for in pieces.
+ * A client may send any number of requests before it reads the replies.
+ */
+
+enum proto_op {
+	PROTO_MKDIR = 1,
+	PROTO_MKFILE,
+	PROTO_CP,
+	PROTO_LIST,
+	PROTO_WRITEF,
+	PROTO_READF,
+	PROTO_READV,
+	PROTO_RM,
+	PROTO_IMPORT,
+	PROTO_EXPORT,
+	PROTO_COMPRESS, //flag 1 turns compression on, 0 off
+	PROTO_DUMP, //dump the image the server was started with
+	PROTO_SHUTDOWN, //the server stops once the replies sent so far are written
+};
+
+#define PROTO_BAD_REQUEST -3 //status of a request the server does not understand
+#define PROTO_MAX_REQUEST (16u << 20) //longest argument part, a longer request ends the connection
+#define PROTO_MAX_READV (4u << 20) //most bytes a PROTO_READV returns, keeps its status in range and its reply small
+
+typedef struct _proto_request{
+	uint32_t length; //argument bytes following
+	uint32_t tag; //copied to the reply
+	uint8_t op; //enum proto_op
+	uint8_t flag;
+	uint16_t reserved;
+} proto_request;
+
+typedef struct _proto_reply{
+	uint32_t length; //payload bytes following
+	uint32_t tag;
+	int32_t status;
+} proto_reply;
+
+#endif //PROTOCOL_H
@@ -0,0 +1,25 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "../lib/filesystem.h"
+
+/*
+ * ha2 --serve: one resident filesystem shared by the processes that connect to
+ * a Unix domain socket, so none of them loads the image or dumps it on its own.
+ * The requests of protocol.h are read and answered by an epoll loop in the
+ * calling thread. Requests a client pipelines are run in order and their
+ * replies written back together. A client that does not read its replies
+ * is not read from either once SERVER_OUT_HIGH bytes of them are waiting.
+ */
+
+#define SERVER_OUT_HIGH (4u << 20)
+
+/*
+	* Serve fs on a socket created at socket_path (an old one is replaced) until
+	* a PROTO_SHUTDOWN request, SIGINT or SIGTERM. PROTO_DUMP dumps fs to image_path.
+	* SIGINT and SIGTERM are blocked in the calling thread meanwhile.
+	* @return 0 after a shutdown, -1 if the socket can't be set up
+*/
+int serve(file_system* fs, const char* image_path, const char* socket_path);
+
+#endif //SERVER_H
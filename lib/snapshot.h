@@ -0,0 +1,91 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "../lib/filesystem.h"
+
+/*
+ * Named snapshots of the whole filesystem, kept in <image>.snap.
+ * Taking a snapshot only records its name and the superblock, it shares every
+ * inode, data block and free list entry with the live filesystem. The first
+ * time one of them changes afterwards, its old content is saved for the newest
+ * snapshot; fs_mark_inode_dirty and friends are called before every change for
+ * this. A block that was free when the snapshot was taken is not saved, and a
+ * block in use then is saved when it is freed.
+ * A snapshot sees what it saved itself, then what the snapshots taken after it
+ * saved, then the live filesystem, so only the changes cost memory.
+ * fs_dump writes the snapshots next to the image and fs_load reads them back.
+ * Snapshots taken after the last dump are lost if the program stops without one,
+ * a journal does not record them.
+ * An image mapped with fs_load_mmap can't have snapshots: the shared mapping
+ * would change the image before the snapshot file holds what they saved. Such
+ * an image is loaded as a copy instead, and snapshots are not taken of a mapped one.
+ * Taking, listing, mounting, rolling back and deleting snapshots waits for the
+ * operations running in other threads and holds off new ones, see lock.h
+ */
+
+/*
+	* Take a snapshot of fs called name
+	* @return 0 on success, -1 if the name is empty or too long,
+	* -2 if a snapshot with that name exists, fs is read-only or mapped or there is no memory
+*/
+int snapshot_create(file_system* fs, const char* name);
+
+/*
+	* Names of the snapshots of fs, oldest first, one per line.
+	* @return a malloc'ed string, empty if there are none, NULL if there is no memory
+*/
+char* snapshot_list(file_system* fs);
+
+/*
+	* A read-only copy of fs as it was when snapshot name was taken.
+	* Operations that would change it return -2. fs_dump can write it to a new image.
+	* Free it with cleanup.
+	* @return the copy, NULL if there is no snapshot called name
+*/
+file_system* snapshot_mount(file_system* fs, const char* name);
+
+/*
+	* Return fs to the state it had when snapshot name was taken. The snapshots
+	* taken after it are deleted, snapshot name is kept.
+	* @return 0 on success, -1 if there is no snapshot called name
+*/
+int snapshot_rollback(file_system* fs, const char* name);
+
+/*
+	* Delete snapshot name, what it saved moves to the snapshot before it if that one needs it
+	* @return 0 on success, -1 if there is no snapshot called name, -2 if there is no memory
+*/
+int snapshot_delete(file_system* fs, const char* name);
+
+/*
+	* An inode, a data block or a free list entry is about to change, save it
+	* for the newest snapshot unless that was done already. Called by fs_mark_inode_dirty and friends.
+*/
+void snapshot_save_inode(file_system* fs, int inode_id);
+void snapshot_save_block(file_system* fs, int block_id);
+void snapshot_save_free(file_system* fs, int block_id);
+
+/*
+	* Write the snapshots of fs next to the image file_path, which was just written.
+	* Without snapshots an old snapshot file is removed.
+	* @return 0 on success, -1 else
+*/
+int snapshot_dump(file_system* fs, const char* file_path);
+
+/*
+	* Whether the image file_path has a snapshot file next to it
+*/
+int snapshot_exists(const char* file_path);
+
+/*
+	* Read the snapshots next to the image file_path into fs, which was just loaded from it
+	* @return the number of snapshots, -1 if the snapshot file is unreadable or belongs to another image
+*/
+int snapshot_load(file_system* fs, const char* file_path);
+
+/*
+	* Frees the snapshots, the snapshot file is kept
+*/
+void snapshot_destroy(file_system* fs);
+
+#endif //SNAPSHOT_H
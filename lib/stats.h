@@ -0,0 +1,85 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+/*
+ * Counters of the running process, over all its filesystems: for every
+ * operation of operations.h and fs_load, fs_load_mmap and fs_dump the calls,
+ * failures, file bytes moved and a histogram of the latency, and a few
+ * counters of work done inside the operations.
+ * Each thread counts into a shard of its own with plain stores, so counting
+ * costs no atomic instruction; reading sums the shards. A reset does not
+ * touch the shards, it takes the current sums as the new zero.
+ */
+
+enum stats_op {
+	STATS_MKDIR,
+	STATS_MKFILE,
+	STATS_CP,
+	STATS_LIST,
+	STATS_WRITEF,
+	STATS_READF,
+	STATS_READV,
+	STATS_RM,
+	STATS_IMPORT,
+	STATS_EXPORT,
+	STATS_COMPRESS,
+	STATS_LOAD,
+	STATS_LOAD_MMAP,
+	STATS_DUMP,
+	STATS_OPENDIR,
+	STATS_READDIR,
+	STATS_WALK,
+	STATS_OPS
+};
+
+enum stats_counter {
+	STATS_BLOCKS_SCANNED, //blocks the block allocator looked at
+	STATS_INODES_SCANNED, //inodes the inode allocator looked at
+	STATS_PATH_COMPONENTS, //path components looked up in their directory
+	STATS_COUNTERS
+};
+
+// latency bucket b counts calls that took [2^(b-1), 2^b) ns, the last one everything longer
+#define STATS_BUCKETS 40
+
+typedef struct _stats_op_totals{
+	uint64_t calls;
+	uint64_t errors;
+	uint64_t bytes; //file data read or written
+	uint64_t ns; //time spent in all calls
+	uint64_t buckets[STATS_BUCKETS];
+} stats_op_totals;
+
+typedef struct _fs_stats{
+	stats_op_totals ops[STATS_OPS];
+	uint64_t counters[STATS_COUNTERS];
+} fs_stats;
+
+/*
+	* Start timing an operation, pass the result to stats_op
+*/
+uint64_t stats_start(void);
+/*
+	* Count a call of op that began at start
+*/
+void stats_op(enum stats_op op, uint64_t start, int failed, uint64_t bytes);
+/*
+	* Add n to counter
+*/
+void stats_count(enum stats_counter counter, uint64_t n);
+
+/*
+	* The totals since the last reset
+*/
+void stats_read(fs_stats* out);
+void stats_reset(void);
+
+/*
+	* The totals as text, one line per operation that was called, or as JSON
+	* @return a malloc'd string
+*/
+char* stats_format(int json);
+
+#endif //STATS_H
@@ -0,0 +1,66 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+
+/*
+ * Begin and end events of the operations and of the steps inside them,
+ * for finding out why one call was slow. Compiled in with make TRACE=1
+ * (-D TRACE), recorded only between trace_enable(1) and trace_enable(0).
+ * Without TRACE the hooks are empty; compiled in but not enabled each hook
+ * is a load and a branch.
+ * Each thread records into a ring of its own, with the TSC as timestamp,
+ * which keeps the last TRACE_RING events of the thread.
+ * trace_export writes them in the Chrome trace format (chrome://tracing,
+ * Perfetto). Events recorded while it exports may be missing or torn, an
+ * exact trace is exported after trace_enable(0).
+ */
+
+#define TRACE_RING (1 << 15) //events kept per thread
+
+/*
+	* Start or stop recording, starting again drops what was recorded before
+	* @return 0, -1 if tracing is not compiled in
+*/
+int trace_enable(int on);
+
+/*
+	* Write the recorded events as Chrome trace JSON to path
+	* @return 0, -1 if tracing is not compiled in or path can't be written
+*/
+int trace_export(const char* path);
+
+#ifdef TRACE
+
+extern int trace_on;
+void trace_event(const char* name, char phase);
+
+static inline const char* trace_scope_begin(const char* name){
+	if(!__builtin_expect(__atomic_load_n(&trace_on, __ATOMIC_RELAXED), 0)) return NULL;
+	trace_event(name, 'B');
+	return name;
+}
+
+// ends what trace_scope_begin began, also if tracing stopped meanwhile
+static inline void trace_scope_end(const char** name){
+	if(*name != NULL) trace_event(*name, 'E');
+}
+
+// name has to stay valid until the export, a string literal.
+// token is a variable TRACE_BEGIN declares, TRACE_END ends just what it began,
+// so tracing switched on or off in between leaves no unmatched event
+#define TRACE_BEGIN(token, name) const char* token = trace_scope_begin(name)
+#define TRACE_END(token) trace_scope_end(&token)
+// begin here and end wherever the enclosing block is left
+#define TRACE_SCOPE(name) \
+	const char* _trace_scope __attribute__((cleanup(trace_scope_end), unused)) = trace_scope_begin(name)
+
+#else
+
+#define TRACE_BEGIN(token, name) do{ }while(0)
+#define TRACE_END(token) do{ }while(0)
+#define TRACE_SCOPE(name) do{ }while(0)
+
+#endif //TRACE
+
+#endif //TRACE_H
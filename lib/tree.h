@@ -0,0 +1,43 @@
+#ifndef TREE_H
+#define TREE_H
+
+#include <stddef.h>
+
+#include "../lib/filesystem.h"
+
+/*
+ * Walks over a directory tree by inode number, without resolving a path per
+ * node. pre is called on each file and directory before the ones below it,
+ * post after them, both with the inode locked shared. Serially the entries
+ * of a directory are visited sorted by inode-index, like fs_list lists them.
+ * In parallel each directory is a task of a work-stealing pool (pool.h), so
+ * the callbacks run on several threads at once and in no fixed order, only
+ * post of a directory still comes after everything below it.
+ * The caller holds the filesystem lock, which keeps directories in place;
+ * an entry removed meanwhile is passed over. The callbacks must not call
+ * the operations of operations.h on the same filesystem.
+ */
+
+#define WALK_SKIP 1 //returned by pre: don't go below this directory, post is not called for it
+
+/*
+	* Called on inode_id, depth levels below where the walk started.
+	* @return 0 to go on, WALK_SKIP from pre, or a negative number which stops the walk
+*/
+typedef int (*walk_fn)(file_system* fs, int inode_id, int depth, void* arg);
+
+/*
+	* Walk the tree below inode_id, with threads threads, 1 walks in the calling thread.
+	* pre or post may be NULL.
+	* @return 0, the first negative result of a callback, or -2 if there is no memory
+*/
+int tree_walk(file_system* fs, int inode_id, walk_fn pre, walk_fn post, void* arg, int threads);
+
+/*
+	* Write the absolute path of inode_id into path, which has length bytes.
+	* The directories above it must stay in place, as they do under the filesystem lock.
+	* @return 0, -1 if it does not fit
+*/
+int tree_path(file_system* fs, int inode_id, char* path, size_t length);
+
+#endif //TREE_H
@@ -1,9 +1,63 @@
 #ifndef UTILS_H
 #define UTILS_H
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <sys/uio.h>
 
 void printhelp();
 
+/*
+ * writev that retries until everything is written, advancing iov on short writes.
+ * Returns 0 on success, -1 else
+ */
+static inline int writev_all(int fd, struct iovec *iov, int iov_count){
+	while(iov_count > 0){
+		ssize_t written = writev(fd, iov, iov_count);
+		if(written < 0){
+			if(errno == EINTR) continue;
+			return -1;
+		}
+		while(iov_count > 0 && (size_t)written >= iov->iov_len){
+			written -= iov->iov_len;
+			iov++;
+			iov_count--;
+		}
+		if(iov_count > 0){
+			iov->iov_base = (uint8_t*)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+	return 0;
+}
+
+/*
+ * readv that retries until iov is full or the input ends, advancing iov on short reads.
+ * Returns the number of bytes read, -1 on error
+ */
+static inline ssize_t readv_all(int fd, struct iovec *iov, int iov_count){
+	ssize_t total = 0;
+	while(iov_count > 0){
+		ssize_t got = readv(fd, iov, iov_count);
+		if(got < 0){
+			if(errno == EINTR) continue;
+			return -1;
+		}
+		if(got == 0) break;
+		total += got;
+		while(iov_count > 0 && (size_t)got >= iov->iov_len){
+			got -= iov->iov_len;
+			iov++;
+			iov_count--;
+		}
+		if(iov_count > 0){
+			iov->iov_base = (uint8_t*)iov->iov_base + got;
+			iov->iov_len -= got;
+		}
+	}
+	return total;
+}
+
 #endif //UTILS_H
 
 
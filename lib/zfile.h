@@ -0,0 +1,68 @@
+#ifndef ZFILE_H
+#define ZFILE_H
+
+#include "../lib/filesystem.h"
+
+/*
+ * Compressed files. The data blocks of a file with INODE_COMPRESSED set hold a
+ * stream of frames instead of the file content, packed like the bytes of any
+ * other file, so the inode size is the length of the stream.
+ * A frame is a 4 byte header, the stored and the decoded length as 16 bit
+ * little endian numbers, followed by the stored bytes: up to ZFILE_FRAME bytes
+ * of content compressed with lz.h, or as they are if that does not make them
+ * shorter (stored length == decoded length).
+ * Every frame but the last holds ZFILE_FRAME bytes of content. Reads go through
+ * a cursor that remembers the last frame found and its decoded content, so
+ * sequential reads only walk each frame header once. Every thread has a cursor of its own.
+ */
+
+#define ZFILE_FRAME (8 * BLOCK_SIZE) //content bytes per frame
+#define ZFILE_HEADER 4
+
+/*
+	* encode len (at most ZFILE_FRAME) bytes of content into one frame.
+	* frame must hold ZFILE_HEADER + ZFILE_FRAME bytes.
+	* @return the length of the frame
+*/
+size_t zfile_encode(const uint8_t* raw, size_t len, uint8_t* frame);
+
+/*
+	* decoded length of compressed file inode_id
+	* @return 0 on success, -1 if the stream is corrupt or there is no memory for the cursor
+*/
+int zfile_size(file_system* fs, int inode_id, uint64_t* size);
+
+/*
+	* content of compressed file inode_id at offset. *data is set to the decoded
+	* bytes from offset to the end of their frame and *len to their number, 0 at the end of the file.
+	* *data stays valid until the next call from the same thread or change to a compressed file.
+	* @return 0 on success, -1 if the stream is corrupt or there is no memory for the cursor
+*/
+int zfile_read(file_system* fs, int inode_id, uint64_t offset, const uint8_t** data, size_t* len);
+
+/*
+	* decode all of compressed file inode_id, whose decoded length is size, straight into dst
+	* @return 0 on success, -1 if the stream is corrupt
+*/
+int zfile_read_all(file_system* fs, int inode_id, uint8_t* dst, uint64_t size);
+
+/*
+	* find where content appended to compressed file inode_id goes. If its last frame
+	* holds less than ZFILE_FRAME bytes, their content is decoded into raw, which holds
+	* ZFILE_FRAME bytes, and *pos is set to the start of that frame, else to the end of the stream.
+	* @return the decoded length of that frame, 0 if there is none, -1 if the stream is corrupt
+*/
+int zfile_tail(file_system* fs, int inode_id, uint64_t* pos, uint8_t* raw);
+
+/*
+	* The stream of inode_id is about to change from the frame boundary pos on.
+	* Must be called before a compressed file is truncated, appended to or removed.
+*/
+void zfile_forget(file_system* fs, int inode_id, uint64_t pos);
+
+/*
+	* Frees the cursors of all threads, none may use them meanwhile
+*/
+void zfile_destroy(file_system* fs);
+
+#endif //ZFILE_H
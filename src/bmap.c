@@ -0,0 +1,206 @@
+#include <stdint.h>
+#include <string.h>
+#include "../lib/bmap.h"
+
+// Number of data blocks mapped by the root block of each level
+static const uint64_t level_span[INDIRECT_LEVELS] = {
+	BMAP_SLOTS,
+	BMAP_SLOTS * BMAP_SLOTS,
+	(uint64_t)BMAP_SLOTS * BMAP_SLOTS * BMAP_SLOTS,
+};
+
+// First data block mapped by each level
+static const uint64_t level_base[INDIRECT_LEVELS] = {
+	DIRECT_BLOCKS_COUNT,
+	DIRECT_BLOCKS_COUNT + BMAP_SLOTS,
+	DIRECT_BLOCKS_COUNT + BMAP_SLOTS + BMAP_SLOTS * BMAP_SLOTS,
+};
+
+static int32_t* slots_of(file_system* fs, int block_id){
+	return (int32_t*)fs->data_blocks[block_id].block;
+}
+
+/*
+ * Returns the level that maps data block i (i >= DIRECT_BLOCKS_COUNT) and stores
+ * the slot to follow in each of its level + 1 indirect blocks in path.
+ * -1 if i is too large.
+ */
+static int bmap_path(uint64_t i, uint32_t path[INDIRECT_LEVELS]){
+	for (int level = 0; level < INDIRECT_LEVELS; level++) {
+		if(i - level_base[level] >= level_span[level]) continue;
+		uint64_t offset = i - level_base[level];
+		for (int d = level; d >= 0; d--) {
+			path[d] = offset % BMAP_SLOTS;
+			offset /= BMAP_SLOTS;
+		}
+		return level;
+	}
+	return -1;
+}
+
+static int indirect_create(file_system* fs){
+	int block_id = block_alloc(fs);
+	if(block_id < 0) return -1;
+	fs_mark_block_dirty(fs, block_id);
+	int32_t* slots = slots_of(fs, block_id);
+	for (size_t j = 0; j < BMAP_SLOTS; j++) {
+		slots[j] = -1;
+	}
+	fs->data_blocks[block_id].size = BLOCK_SIZE;
+	return block_id;
+}
+
+int bmap_get(file_system* fs, int inode_id, uint64_t i){
+	inode* node = &fs->inodes[inode_id];
+	if(i < DIRECT_BLOCKS_COUNT) return node->direct_blocks[i];
+
+	uint32_t path[INDIRECT_LEVELS];
+	int level = bmap_path(i, path);
+	if(level < 0) return -1;
+	int block_id = node->indirect_blocks[level];
+	for (int d = 0; d <= level && block_id != -1; d++) {
+		block_id = slots_of(fs, block_id)[path[d]];
+	}
+	return block_id;
+}
+
+int bmap_set(file_system* fs, int inode_id, uint64_t i, int block_id){
+	inode* node = &fs->inodes[inode_id];
+	if(i < DIRECT_BLOCKS_COUNT){
+		fs_mark_inode_dirty(fs, inode_id);
+		node->direct_blocks[i] = block_id;
+		return 0;
+	}
+
+	uint32_t path[INDIRECT_LEVELS];
+	int level = bmap_path(i, path);
+	if(level < 0) return -1;
+	if(node->indirect_blocks[level] == -1){
+		if(block_id == -1) return 0;
+		int root = indirect_create(fs);
+		if(root < 0) return -1;
+		fs_mark_inode_dirty(fs, inode_id);
+		node->indirect_blocks[level] = root;
+	}
+
+	int parent = node->indirect_blocks[level];
+	for (int d = 0; d < level; d++) {
+		int32_t* slot = &slots_of(fs, parent)[path[d]];
+		if(*slot == -1){
+			if(block_id == -1) return 0;
+			int child = indirect_create(fs);
+			if(child < 0) return -1;
+			fs_mark_block_dirty(fs, parent);
+			*slot = child;
+		}
+		parent = *slot;
+	}
+	fs_mark_block_dirty(fs, parent);
+	slots_of(fs, parent)[path[level]] = block_id;
+	return 0;
+}
+
+int bmap_unshare(file_system* fs, int inode_id, uint64_t i){
+	int block_id = bmap_get(fs, inode_id, i);
+	if(block_id == -1 || !block_is_shared(fs, block_id)) return block_id;
+
+	int copy = block_alloc(fs);
+	if(copy < 0) return -1;
+	fs_mark_block_dirty(fs, copy);
+	fs->data_blocks[copy].size = fs->data_blocks[block_id].size;
+	memcpy(fs->data_blocks[copy].block, fs->data_blocks[block_id].block, fs->data_blocks[block_id].size);
+
+	// the path to block i exists, so this allocates nothing and can't fail
+	bmap_set(fs, inode_id, i, copy);
+	block_free(fs, block_id);
+	return copy;
+}
+
+int bmap_next(file_system* fs, int inode_id, uint64_t* i){
+	inode* node = &fs->inodes[inode_id];
+	uint64_t next = *i;
+
+	for (; next < DIRECT_BLOCKS_COUNT; next++) {
+		if(node->direct_blocks[next] != -1){
+			*i = next + 1;
+			return node->direct_blocks[next];
+		}
+	}
+
+	uint32_t path[INDIRECT_LEVELS];
+	int level;
+	while((level = bmap_path(next, path)) >= 0){
+		int block_id = node->indirect_blocks[level];
+		uint64_t span = level_span[level];
+		for (int d = 0; d <= level && block_id != -1; d++) {
+			span /= BMAP_SLOTS;
+			block_id = slots_of(fs, block_id)[path[d]];
+		}
+		if(block_id != -1){
+			*i = next + 1;
+			return block_id;
+		}
+		// the missing block maps span data blocks, continue behind them
+		uint64_t offset = next - level_base[level];
+		next = level_base[level] + (offset / span + 1) * span;
+	}
+	*i = next;
+	return -1;
+}
+
+/*
+ * Frees the data blocks from relative index from on below the indirect block
+ * *block_id, which maps span data blocks. The indirect block itself is freed if from is 0.
+ */
+static void truncate_tree(file_system* fs, int32_t* block_id, uint64_t span, uint64_t from){
+	if(*block_id == -1) return;
+	fs_mark_block_dirty(fs, *block_id);
+	uint64_t child_span = span / BMAP_SLOTS;
+	for (uint64_t j = from / child_span; j < BMAP_SLOTS; j++) {
+		int32_t* slot = &slots_of(fs, *block_id)[j];
+		if(*slot == -1) continue;
+		if(child_span == 1){
+			block_free(fs, *slot);
+			*slot = -1;
+		}
+		else{
+			uint64_t child_from = j * child_span >= from ? 0 : from - j * child_span;
+			truncate_tree(fs, slot, child_span, child_from);
+		}
+	}
+	if(from == 0){
+		block_free(fs, *block_id);
+		*block_id = -1;
+	}
+}
+
+void bmap_truncate(file_system* fs, int inode_id, uint64_t i){
+	inode* node = &fs->inodes[inode_id];
+	fs_mark_inode_dirty(fs, inode_id);
+	for (uint64_t j = i; j < DIRECT_BLOCKS_COUNT; j++) {
+		if(node->direct_blocks[j] != -1){
+			block_free(fs, node->direct_blocks[j]);
+			node->direct_blocks[j] = -1;
+		}
+	}
+	for (int level = 0; level < INDIRECT_LEVELS; level++) {
+		if(i >= level_base[level] + level_span[level]) continue;
+		uint64_t from = i > level_base[level] ? i - level_base[level] : 0;
+		truncate_tree(fs, &node->indirect_blocks[level], level_span[level], from);
+	}
+}
+
+uint64_t bmap_meta_blocks(uint64_t count){
+	uint64_t meta = 0;
+	for (int level = 0; level < INDIRECT_LEVELS && count > level_base[level]; level++) {
+		uint64_t mapped = count - level_base[level];
+		if(mapped > level_span[level]) mapped = level_span[level];
+		// a block at depth d of the level maps level_span / BMAP_SLOTS^d data blocks
+		uint64_t span = level_span[level];
+		for (int d = 0; d <= level; d++) {
+			meta += (mapped + span - 1) / span;
+			span /= BMAP_SLOTS;
+		}
+	}
+	return meta;
+}
@@ -0,0 +1,245 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "../lib/client.h"
+
+static void* grow(void* buf, size_t* cap, size_t need){
+	if(need <= *cap) return buf;
+	size_t cap_new = *cap ? *cap : 4096;
+	while(cap_new < need) cap_new *= 2;
+	void* grown = realloc(buf, cap_new);
+	if(grown == NULL){
+		perror("Malloc error");
+		exit(errno);
+	}
+	*cap = cap_new;
+	return grown;
+}
+
+static void out_append(fs_client* c, const void* data, size_t len){
+	c->out = grow(c->out, &c->out_cap, c->out_len + len);
+	memcpy(c->out + c->out_len, data, len);
+	c->out_len += len;
+}
+
+/*
+ * Take what the server sent so far into c->in, without waiting for it.
+ * Returns -1 if the connection broke
+ */
+static int read_some(fs_client* c){
+	while(1){
+		c->in = grow(c->in, &c->in_cap, c->in_len + 4096);
+		ssize_t got = recv(c->fd, c->in + c->in_len, c->in_cap - c->in_len, 0);
+		if(got < 0 && errno == EINTR) continue;
+		if(got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+		if(got <= 0) return -1;
+		c->in_len += got;
+	}
+}
+
+/*
+ * Wait until the socket can be written, if write is set, or has something to read.
+ * What arrives meanwhile is taken into c->in. Returns -1 if the connection broke
+ */
+static int wait_socket(fs_client* c, int write){
+	struct pollfd pfd = { .fd = c->fd, .events = POLLIN | (write ? POLLOUT : 0) };
+	while(poll(&pfd, 1, -1) < 0){
+		if(errno != EINTR) return -1;
+	}
+	if(pfd.revents & (POLLIN | POLLHUP | POLLERR)) return read_some(c);
+	return 0;
+}
+
+fs_client* client_connect(const char* socket_path){
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if(strlen(socket_path) >= sizeof(addr.sun_path)) return NULL;
+	strcpy(addr.sun_path, socket_path);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0) return NULL;
+	// non-blocking, replies are taken in while requests are still being sent
+	if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || fcntl(fd, F_SETFL, O_NONBLOCK) != 0){
+		close(fd);
+		return NULL;
+	}
+	fs_client* c = calloc(1, sizeof(fs_client));
+	if(c == NULL){
+		perror("Calloc error");
+		exit(errno);
+	}
+	c->fd = fd;
+	return c;
+}
+
+void client_close(fs_client* c){
+	close(c->fd);
+	free(c->out);
+	free(c->in);
+	free(c->reply);
+	free(c);
+}
+
+uint32_t client_send(fs_client* c, uint8_t op, uint8_t flag, const char* path, const char* arg, uint64_t offset, uint64_t length){
+	proto_request req = { 0, c->next_tag++, op, flag, 0 };
+	size_t start = c->out_len;
+	out_append(c, &req, sizeof(req));
+	if(op == PROTO_READV){
+		uint64_t range[2] = { offset, length };
+		out_append(c, range, sizeof(range));
+	}
+	if(path) out_append(c, path, strlen(path) + 1);
+	if(arg) out_append(c, arg, strlen(arg) + 1);
+	req.length = c->out_len - start - sizeof(req);
+	memcpy(c->out + start, &req, sizeof(req));
+	return req.tag;
+}
+
+int client_flush(fs_client* c){
+	size_t sent = 0;
+	while(sent < c->out_len){
+		ssize_t written = send(c->fd, c->out + sent, c->out_len - sent, MSG_NOSIGNAL);
+		if(written < 0 && errno == EINTR) continue;
+		if(written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+			// the server stops reading while too many replies wait, so they are read here
+			if(wait_socket(c, 1) == 0) continue;
+		}
+		if(written < 0){
+			c->out_len = 0;
+			return -1;
+		}
+		sent += written;
+	}
+	c->out_len = 0;
+	return 0;
+}
+
+// 1 if c->in holds a whole reply
+static int reply_ready(fs_client* c){
+	return c->in_len >= sizeof(proto_reply) && c->in_len >= sizeof(proto_reply) + ((proto_reply*)c->in)->length;
+}
+
+int client_recv(fs_client* c, client_reply* reply){
+	if(c->out_len > 0 && client_flush(c) != 0) return -1;
+	// drop the reply handed out last time
+	if(c->in_off > 0){
+		memmove(c->in, c->in + c->in_off, c->in_len - c->in_off);
+		c->in_len -= c->in_off;
+		c->in_off = 0;
+	}
+
+	// a reply may come with the end of the connection, as after PROTO_SHUTDOWN
+	while(!reply_ready(c)){
+		if(wait_socket(c, 0) != 0 && !reply_ready(c)) return -1;
+	}
+	proto_reply header;
+	memcpy(&header, c->in, sizeof(header));
+	// one byte more so listings can be handed out as strings
+	c->reply = grow(c->reply, &c->reply_cap, (size_t)header.length + 1);
+	memcpy(c->reply, c->in + sizeof(header), header.length);
+	c->reply[header.length] = '\0';
+	c->in_off = sizeof(header) + header.length;
+	reply->tag = header.tag;
+	reply->status = header.status;
+	reply->data = c->reply;
+	reply->length = header.length;
+	return 0;
+}
+
+/*
+ * Send one request and wait for its reply, replies to requests pipelined
+ * before it and not yet received are dropped
+ */
+static int call(fs_client* c, uint8_t op, uint8_t flag, const char* path, const char* arg, uint64_t offset, uint64_t length, client_reply* reply){
+	uint32_t tag = client_send(c, op, flag, path, arg, offset, length);
+	do{
+		if(client_recv(c, reply) != 0) return -1;
+	}while(reply->tag != tag);
+	return 0;
+}
+
+static int call_status(fs_client* c, uint8_t op, uint8_t flag, const char* path, const char* arg){
+	client_reply reply;
+	if(call(c, op, flag, path, arg, 0, 0, &reply) != 0) return -1;
+	return reply.status;
+}
+
+int client_mkdir(fs_client* c, const char* path){
+	return call_status(c, PROTO_MKDIR, 0, path, NULL);
+}
+
+int client_mkfile(fs_client* c, const char* path){
+	return call_status(c, PROTO_MKFILE, 0, path, NULL);
+}
+
+int client_cp(fs_client* c, const char* from, const char* to){
+	return call_status(c, PROTO_CP, 0, from, to);
+}
+
+char* client_list(fs_client* c, const char* path){
+	client_reply reply;
+	if(call(c, PROTO_LIST, 0, path, NULL, 0, 0, &reply) != 0 || reply.status != 0) return NULL;
+	return strdup((char*)reply.data);
+}
+
+int client_writef(fs_client* c, const char* path, const char* text){
+	return call_status(c, PROTO_WRITEF, 0, path, text);
+}
+
+uint8_t* client_readf(fs_client* c, const char* path, int* file_size){
+	client_reply reply;
+	*file_size = 0;
+	if(call(c, PROTO_READF, 0, path, NULL, 0, 0, &reply) != 0 || reply.status != 0 || reply.length == 0) return NULL;
+	uint8_t* content = malloc(reply.length);
+	if(content == NULL){
+		perror("Malloc error");
+		exit(errno);
+	}
+	memcpy(content, reply.data, reply.length);
+	*file_size = reply.length;
+	return content;
+}
+
+int64_t client_readv(fs_client* c, const char* path, uint64_t offset, size_t length, uint8_t* dst){
+	// the server returns at most PROTO_MAX_READV bytes a request
+	size_t done = 0;
+	while(done < length){
+		size_t piece = length - done < PROTO_MAX_READV ? length - done : PROTO_MAX_READV;
+		client_reply reply;
+		if(call(c, PROTO_READV, 0, path, NULL, offset + done, piece, &reply) != 0) return -1;
+		if(reply.status < 0) return done > 0 ? (int64_t)done : reply.status;
+		memcpy(dst + done, reply.data, reply.length < piece ? reply.length : piece);
+		done += reply.status;
+		// the end of the file
+		if((size_t)reply.status < piece) break;
+	}
+	return done;
+}
+
+int client_rm(fs_client* c, const char* path){
+	return call_status(c, PROTO_RM, 0, path, NULL);
+}
+
+int client_import(fs_client* c, const char* int_path, const char* ext_path){
+	return call_status(c, PROTO_IMPORT, 0, int_path, ext_path);
+}
+
+int client_export(fs_client* c, const char* int_path, const char* ext_path){
+	return call_status(c, PROTO_EXPORT, 0, int_path, ext_path);
+}
+
+int client_compress(fs_client* c, const char* path, int on){
+	return call_status(c, PROTO_COMPRESS, on != 0, path, NULL);
+}
+
+int client_dump(fs_client* c){
+	return call_status(c, PROTO_DUMP, 0, NULL, NULL);
+}
+
+int client_shutdown(fs_client* c){
+	return call_status(c, PROTO_SHUTDOWN, 0, NULL, NULL);
+}
@@ -0,0 +1,157 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include "../lib/dcache.h"
+#include "../lib/lock.h"
+
+#define DCACHE_MIN_SLOTS 64
+#define DCACHE_MAX_SLOTS (1 << 16)
+#define DCACHE_LOCKS 64 //slot i is guarded by lock i % DCACHE_LOCKS
+
+typedef struct _dcache_entry{
+	uint32_t seq; //odd while the slot is written
+	int parent; //-1 if the slot is empty
+	int child; //-1 for a negative entry
+	uint32_t hash;
+	char name[NAME_MAX_LENGTH];
+} dcache_entry;
+
+struct dcache{
+	uint32_t mask; //number of slots - 1
+	pthread_mutex_t locks[DCACHE_LOCKS];
+	dcache_entry slots[];
+};
+
+static uint32_t dcache_hash(int parent, const char* name){
+	// FNV-1a over the parent number and the name
+	uint32_t h = 2166136261u;
+	for (int i = 0; i < 4; i++) {
+		h = (h ^ ((uint32_t)parent >> (8 * i) & 0xff)) * 16777619u;
+	}
+	for (const char* c = name; *c; c++) {
+		h = (h ^ (uint8_t)*c) * 16777619u;
+	}
+	return h;
+}
+
+static struct dcache* dcache_get(file_system* fs){
+	struct dcache* cache = __atomic_load_n(&fs->dcache, __ATOMIC_ACQUIRE);
+	if(cache != NULL) return cache;
+
+	// the first lookups of several threads race to build it
+	alloc_lock(fs);
+	cache = fs->dcache;
+	if(cache == NULL){
+		uint32_t slots = DCACHE_MIN_SLOTS;
+		while(slots < fs->s_block->num_blocks && slots < DCACHE_MAX_SLOTS){
+			slots <<= 1;
+		}
+		cache = malloc(sizeof(struct dcache) + slots * sizeof(dcache_entry));
+		if(cache != NULL){
+			cache->mask = slots - 1;
+			for (int i = 0; i < DCACHE_LOCKS; i++) {
+				pthread_mutex_init(&cache->locks[i], NULL);
+			}
+			for (uint32_t i = 0; i < slots; i++) {
+				cache->slots[i].seq = 0;
+				cache->slots[i].parent = -1;
+			}
+			__atomic_store_n(&fs->dcache, cache, __ATOMIC_RELEASE);
+		}
+	}
+	alloc_unlock(fs);
+	return cache;
+}
+
+static pthread_mutex_t* slot_lock(struct dcache* cache, uint32_t hash){
+	return &cache->locks[(hash & cache->mask) % DCACHE_LOCKS];
+}
+
+static dcache_entry* dcache_find(struct dcache* cache, int parent, const char* name, uint32_t hash){
+	dcache_entry* e = &cache->slots[hash & cache->mask];
+	if(e->parent == parent && e->hash == hash && strncmp(e->name, name, NAME_MAX_LENGTH) == 0){
+		return e;
+	}
+	return NULL;
+}
+
+// slots are written with their lock held and the sequence number odd
+static void slot_write_begin(dcache_entry* e){
+	__atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void slot_write_end(dcache_entry* e){
+	__atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+}
+
+int dcache_lookup(file_system* fs, int parent, const char* name, int* child){
+	struct dcache* cache = dcache_get(fs);
+	if(cache == NULL) return 0;
+
+	// copy the slot without its lock, a slot written meanwhile is a miss
+	uint32_t hash = dcache_hash(parent, name);
+	dcache_entry* slot = &cache->slots[hash & cache->mask];
+	uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+	if(seq & 1) return 0;
+	dcache_entry e = *slot;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if(__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) return 0;
+	if(e.parent != parent || e.hash != hash || strncmp(e.name, name, NAME_MAX_LENGTH) != 0) return 0;
+
+	// a positive entry must still describe a live child of parent, a stale one
+	// is a miss until the insert after the search replaces it
+	if(e.child >= 0){
+		if(e.child >= fs->s_block->num_blocks) return 0;
+		inode* node = &fs->inodes[e.child];
+		if(node->n_type == free_block || node->parent != parent
+		   || strncmp(node->name, name, NAME_MAX_LENGTH) != 0){
+			return 0;
+		}
+	}
+	*child = e.child;
+	return 1;
+}
+
+void dcache_insert(file_system* fs, int parent, const char* name, int child){
+	struct dcache* cache = dcache_get(fs);
+	if(cache == NULL) return;
+
+	// the cache may miss the entry, so a slot group in use is not waited for
+	uint32_t hash = dcache_hash(parent, name);
+	if(pthread_mutex_trylock(slot_lock(cache, hash)) != 0) return;
+	dcache_entry* e = &cache->slots[hash & cache->mask];
+	slot_write_begin(e);
+	e->parent = parent;
+	e->child = child;
+	e->hash = hash;
+	strncpy(e->name, name, NAME_MAX_LENGTH);
+	e->name[NAME_MAX_LENGTH - 1] = '\0';
+	slot_write_end(e);
+	pthread_mutex_unlock(slot_lock(cache, hash));
+}
+
+void dcache_invalidate(file_system* fs, int parent, const char* name){
+	struct dcache* cache = __atomic_load_n(&fs->dcache, __ATOMIC_ACQUIRE);
+	if(cache == NULL) return;
+
+	uint32_t hash = dcache_hash(parent, name);
+	pthread_mutex_lock(slot_lock(cache, hash));
+	dcache_entry* e = dcache_find(cache, parent, name, hash);
+	if(e != NULL){
+		slot_write_begin(e);
+		e->parent = -1;
+		slot_write_end(e);
+	}
+	pthread_mutex_unlock(slot_lock(cache, hash));
+}
+
+void dcache_destroy(file_system* fs){
+	struct dcache* cache = fs->dcache;
+	if(cache == NULL) return;
+	for (int i = 0; i < DCACHE_LOCKS; i++) {
+		pthread_mutex_destroy(&cache->locks[i]);
+	}
+	free(cache);
+	fs->dcache = NULL;
+}
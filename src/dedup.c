@@ -0,0 +1,141 @@
+#include <stdint.h>
+#include <string.h>
+#include "../lib/bmap.h"
+#include "../lib/dedup.h"
+#include "../lib/lock.h"
+
+#define DEDUP_MIN_SLOTS 64
+
+typedef struct _dedup_entry{
+	uint64_t hash;
+	int block; //-1 if the slot is empty
+} dedup_entry;
+
+struct dedup{
+	uint64_t checked; //full blocks offered
+	uint64_t shared; //offered blocks replaced by a stored one
+	uint32_t mask; //number of slots - 1
+	dedup_entry slots[];
+};
+
+static uint64_t block_hash(const uint8_t* data){
+	// four independent multiply-xorshift lanes over 8 byte words, then folded
+	uint64_t lanes[4] = {0x9e3779b97f4a7c15u, 0xc2b2ae3d27d4eb4fu, 0x165667b19e3779f9u, 0x27d4eb2f165667c5u};
+	for (size_t i = 0; i < BLOCK_SIZE; i += 32) {
+		for (int l = 0; l < 4; l++) {
+			uint64_t w;
+			memcpy(&w, data + i + 8 * l, sizeof(w));
+			lanes[l] = (lanes[l] ^ w) * 0xbf58476d1ce4e5b9u;
+			lanes[l] ^= lanes[l] >> 31;
+		}
+	}
+	uint64_t h = lanes[0] ^ (lanes[1] << 1 | lanes[1] >> 63) ^ (lanes[2] << 2 | lanes[2] >> 62) ^ (lanes[3] << 3 | lanes[3] >> 61);
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdu;
+	h ^= h >> 33;
+	return h;
+}
+
+static int is_full_data_block(file_system* fs, int block_id){
+	return block_id >= 0 && block_id < fs->s_block->num_blocks
+	       && !fs->free_list[block_id] && fs->data_blocks[block_id].size == BLOCK_SIZE;
+}
+
+static void index_insert(struct dedup* index, file_system* fs, int block_id){
+	uint64_t hash = block_hash(fs->data_blocks[block_id].block);
+	dedup_entry* e = &index->slots[hash & index->mask];
+	e->hash = hash;
+	e->block = block_id;
+}
+
+static int enable(file_system* fs, int on){
+	if(!on){
+		dedup_destroy(fs);
+		return 0;
+	}
+	if(fs->dedup != NULL) return 0;
+
+	uint32_t n = fs->s_block->num_blocks;
+	uint32_t slots = DEDUP_MIN_SLOTS;
+	while(slots < 2 * (uint64_t)n){
+		slots <<= 1;
+	}
+	struct dedup* index = malloc(sizeof(struct dedup) + slots * sizeof(dedup_entry));
+	if(index == NULL) return -1;
+	index->checked = 0;
+	index->shared = 0;
+	index->mask = slots - 1;
+	for (uint32_t i = 0; i < slots; i++) {
+		index->slots[i].block = -1;
+	}
+
+	for (uint32_t i = 0; i < n; i++) {
+		if(fs->inodes[i].n_type != reg_file) continue;
+		uint64_t next = 0;
+		int block_id;
+		while((block_id = bmap_next(fs, i, &next)) != -1){
+			if(is_full_data_block(fs, block_id)) index_insert(index, fs, block_id);
+		}
+	}
+	fs->dedup = index;
+	return 0;
+}
+
+int dedup_enable(file_system* fs, int on){
+	fs_lock_exclusive(fs);
+	int res = enable(fs, on);
+	fs_unlock(fs);
+	return res;
+}
+
+/*
+ * dedup_block with the allocator lock held
+ */
+static int offer(file_system* fs, struct dedup* index, int block_id){
+	if(!is_full_data_block(fs, block_id)) return block_id;
+	index->checked++;
+
+	const uint8_t* data = fs->data_blocks[block_id].block;
+	uint64_t hash = block_hash(data);
+	dedup_entry* e = &index->slots[hash & index->mask];
+	if(e->block != -1 && e->block != block_id && e->hash == hash && is_full_data_block(fs, e->block)
+	   && memcmp(fs->data_blocks[e->block].block, data, BLOCK_SIZE) == 0){
+		block_share(fs, e->block);
+		index->shared++;
+		return e->block;
+	}
+	e->hash = hash;
+	e->block = block_id;
+	return block_id;
+}
+
+int dedup_block(file_system* fs, int block_id){
+	// dedup mode only changes while no operation runs
+	if(fs->dedup == NULL) return block_id;
+	alloc_lock(fs);
+	int res = offer(fs, fs->dedup, block_id);
+	alloc_unlock(fs);
+	return res;
+}
+
+void dedup_forget(file_system* fs, int block_id){
+	struct dedup* index = fs->dedup;
+	if(index == NULL || block_id < 0 || block_id >= fs->s_block->num_blocks) return;
+
+	dedup_entry* e = &index->slots[block_hash(fs->data_blocks[block_id].block) & index->mask];
+	if(e->block == block_id){
+		e->block = -1;
+	}
+}
+
+void dedup_stats(file_system* fs, uint64_t* checked, uint64_t* shared){
+	alloc_lock(fs);
+	*checked = fs->dedup ? fs->dedup->checked : 0;
+	*shared = fs->dedup ? fs->dedup->shared : 0;
+	alloc_unlock(fs);
+}
+
+void dedup_destroy(file_system* fs){
+	free(fs->dedup);
+	fs->dedup = NULL;
+}
@@ -0,0 +1,297 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../lib/dir.h"
+
+uint32_t dir_hash(const char* name){
+	// FNV-1a, then a final mix so the low bits used by the table depend on the whole name
+	uint32_t h = 2166136261u;
+	for (const char* c = name; *c; c++) {
+		h = (h ^ (uint8_t)*c) * 16777619u;
+	}
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35u;
+	h ^= h >> 16;
+	return h;
+}
+
+static dir_root* root_of(file_system* fs, int dir_id){
+	return (dir_root*)fs->data_blocks[fs->inodes[dir_id].dir_index].block;
+}
+
+static dir_bucket* bucket_at(file_system* fs, int block_id){
+	return (dir_bucket*)fs->data_blocks[block_id].block;
+}
+
+// Entry j of the bucket table
+static int32_t* table_slot(file_system* fs, dir_root* root, uint32_t j){
+	int32_t leaf = root->leaves[j / DIR_LEAF_SLOTS];
+	return &((int32_t*)fs->data_blocks[leaf].block)[j % DIR_LEAF_SLOTS];
+}
+
+// called before an index block is written
+static void mark_index_block(file_system* fs, int block_id){
+	fs_mark_block_dirty(fs, block_id);
+	fs->data_blocks[block_id].size = BLOCK_SIZE;
+}
+
+static int index_create(file_system* fs, int dir_id){
+	int blocks[3];
+	int allocated = block_alloc_n(fs, 3, blocks);
+	if(allocated < 3){
+		for (int i = 0; i < allocated; i++) block_free(fs, blocks[i]);
+		return -1;
+	}
+	for (int i = 0; i < 3; i++) {
+		mark_index_block(fs, blocks[i]);
+	}
+
+	dir_root* root = (dir_root*)fs->data_blocks[blocks[0]].block;
+	root->depth = 0;
+	root->count = 0;
+	for (size_t i = 0; i < DIR_ROOT_LEAVES; i++) {
+		root->leaves[i] = -1;
+	}
+	root->leaves[0] = blocks[1];
+	((int32_t*)fs->data_blocks[blocks[1]].block)[0] = blocks[2];
+	dir_bucket* bucket = bucket_at(fs, blocks[2]);
+	bucket->depth = 0;
+	bucket->count = 0;
+
+	fs_mark_inode_dirty(fs, dir_id);
+	fs->inodes[dir_id].dir_index = blocks[0];
+	return 0;
+}
+
+static void index_free(file_system* fs, int dir_id){
+	int root_block = fs->inodes[dir_id].dir_index;
+	dir_root* root = root_of(fs, dir_id);
+	for (uint32_t j = 0; j < (1u << root->depth); j++) {
+		int b = *table_slot(fs, root, j);
+		// a bucket appears in the table once for every value of the bits above its local depth
+		if(j < (1u << bucket_at(fs, b)->depth)){
+			block_free(fs, b);
+		}
+	}
+	for (size_t i = 0; i < DIR_ROOT_LEAVES; i++) {
+		if(root->leaves[i] != -1) block_free(fs, root->leaves[i]);
+	}
+	block_free(fs, root_block);
+	fs_mark_inode_dirty(fs, dir_id);
+	fs->inodes[dir_id].dir_index = -1;
+}
+
+/*
+ * Doubles the bucket table, the new half points to the same buckets as the old one
+ */
+static int table_double(file_system* fs, int root_block){
+	dir_root* root = (dir_root*)fs->data_blocks[root_block].block;
+	if(root->depth >= DIR_MAX_DEPTH) return -1;
+
+	mark_index_block(fs, root_block);
+	uint32_t old_size = 1u << root->depth;
+	uint32_t leaves = (2 * old_size + DIR_LEAF_SLOTS - 1) / DIR_LEAF_SLOTS;
+	for (uint32_t leaf = old_size / DIR_LEAF_SLOTS; leaf < leaves; leaf++) {
+		if(root->leaves[leaf] == -1){
+			int block_id = block_alloc(fs);
+			if(block_id < 0) return -1;
+			root->leaves[leaf] = block_id;
+		}
+	}
+	for (uint32_t leaf = 0; leaf < leaves; leaf++) {
+		mark_index_block(fs, root->leaves[leaf]);
+	}
+	for (uint32_t j = 0; j < old_size; j++) {
+		*table_slot(fs, root, old_size + j) = *table_slot(fs, root, j);
+	}
+	root->depth++;
+	return 0;
+}
+
+/*
+ * Splits the full bucket found through table entry j into two buckets one level deeper
+ */
+static int bucket_split(file_system* fs, int root_block, uint32_t j){
+	dir_root* root = (dir_root*)fs->data_blocks[root_block].block;
+	int old_block = *table_slot(fs, root, j);
+	dir_bucket* old_bucket = bucket_at(fs, old_block);
+
+	if(old_bucket->depth == root->depth && table_double(fs, root_block) != 0) return -1;
+
+	int new_block = block_alloc(fs);
+	if(new_block < 0) return -1;
+	mark_index_block(fs, old_block);
+	mark_index_block(fs, new_block);
+	dir_bucket* new_bucket = bucket_at(fs, new_block);
+
+	// entries with the next hash bit set move to the new bucket
+	uint32_t bit = 1u << old_bucket->depth;
+	old_bucket->depth++;
+	new_bucket->depth = old_bucket->depth;
+	new_bucket->count = 0;
+	uint32_t kept = 0;
+	for (uint32_t k = 0; k < old_bucket->count; k++) {
+		if(old_bucket->entries[k].hash & bit){
+			new_bucket->entries[new_bucket->count++] = old_bucket->entries[k];
+		}
+		else{
+			old_bucket->entries[kept++] = old_bucket->entries[k];
+		}
+	}
+	old_bucket->count = kept;
+
+	for (uint32_t k = (j & (bit - 1)) | bit; k < (1u << root->depth); k += bit << 1) {
+		fs_mark_block_dirty(fs, root->leaves[k / DIR_LEAF_SLOTS]);
+		*table_slot(fs, root, k) = new_block;
+	}
+	return 0;
+}
+
+static int hashed_add(file_system* fs, int dir_id, int child_id, uint32_t hash){
+	if(fs->inodes[dir_id].dir_index == -1 && index_create(fs, dir_id) != 0) return -1;
+	int root_block = fs->inodes[dir_id].dir_index;
+	dir_root* root = root_of(fs, dir_id);
+
+	while(1){
+		uint32_t j = hash & ((1u << root->depth) - 1);
+		int b = *table_slot(fs, root, j);
+		dir_bucket* bucket = bucket_at(fs, b);
+		if(bucket->count < DIR_BUCKET_ENTRIES){
+			mark_index_block(fs, b);
+			mark_index_block(fs, root_block);
+			bucket->entries[bucket->count].hash = hash;
+			bucket->entries[bucket->count].inode = child_id;
+			bucket->count++;
+			root->count++;
+			return 0;
+		}
+		if(bucket_split(fs, root_block, j) != 0) return -1;
+	}
+}
+
+int dir_find(file_system* fs, int dir_id, const char* name){
+	inode* dir = &fs->inodes[dir_id];
+	for (int i = 0; i < DIRECT_BLOCKS_COUNT; i++) {
+		int child_id = dir->direct_blocks[i];
+		if(child_id != -1 && strcmp(fs->inodes[child_id].name, name) == 0){
+			return child_id;
+		}
+	}
+	if(dir->dir_index == -1) return -1;
+
+	uint32_t hash = dir_hash(name);
+	dir_root* root = root_of(fs, dir_id);
+	dir_bucket* bucket = bucket_at(fs, *table_slot(fs, root, hash & ((1u << root->depth) - 1)));
+	for (uint32_t k = 0; k < bucket->count; k++) {
+		int child_id = bucket->entries[k].inode;
+		if(bucket->entries[k].hash == hash && strcmp(fs->inodes[child_id].name, name) == 0){
+			return child_id;
+		}
+	}
+	return -1;
+}
+
+int dir_add(file_system* fs, int dir_id, int child_id){
+	inode* dir = &fs->inodes[dir_id];
+	for (int i = 0; i < DIRECT_BLOCKS_COUNT; i++) {
+		if(dir->direct_blocks[i] == -1){
+			fs_mark_inode_dirty(fs, dir_id);
+			dir->direct_blocks[i] = child_id;
+			return 0;
+		}
+	}
+	return hashed_add(fs, dir_id, child_id, dir_hash(fs->inodes[child_id].name));
+}
+
+int dir_remove(file_system* fs, int dir_id, int child_id){
+	inode* dir = &fs->inodes[dir_id];
+	for (int i = 0; i < DIRECT_BLOCKS_COUNT; i++) {
+		if(dir->direct_blocks[i] == child_id){
+			fs_mark_inode_dirty(fs, dir_id);
+			dir->direct_blocks[i] = -1;
+			return 0;
+		}
+	}
+	if(dir->dir_index == -1) return -1;
+
+	uint32_t hash = dir_hash(fs->inodes[child_id].name);
+	dir_root* root = root_of(fs, dir_id);
+	int b = *table_slot(fs, root, hash & ((1u << root->depth) - 1));
+	dir_bucket* bucket = bucket_at(fs, b);
+	for (uint32_t k = 0; k < bucket->count; k++) {
+		if(bucket->entries[k].inode == child_id){
+			mark_index_block(fs, b);
+			mark_index_block(fs, dir->dir_index);
+			bucket->entries[k] = bucket->entries[bucket->count - 1];
+			bucket->count--;
+			root->count--;
+			// buckets are not merged again, but an empty index is given back
+			if(root->count == 0){
+				index_free(fs, dir_id);
+			}
+			return 0;
+		}
+	}
+	return -1;
+}
+
+int dir_next(file_system* fs, int dir_id, uint64_t* cursor){
+	inode* dir = &fs->inodes[dir_id];
+	while(*cursor < DIRECT_BLOCKS_COUNT){
+		int child_id = dir->direct_blocks[(*cursor)++];
+		if(child_id != -1) return child_id;
+	}
+	if(dir->dir_index == -1) return -1;
+
+	// past the direct blocks the cursor is DIRECT_BLOCKS_COUNT + table entry * DIR_BUCKET_ENTRIES + entry
+	dir_root* root = root_of(fs, dir_id);
+	uint64_t pos = *cursor - DIRECT_BLOCKS_COUNT;
+	uint32_t j = pos / DIR_BUCKET_ENTRIES;
+	uint32_t k = pos % DIR_BUCKET_ENTRIES;
+	for (; j < (1u << root->depth); j++, k = 0) {
+		dir_bucket* bucket = bucket_at(fs, *table_slot(fs, root, j));
+		// visit each bucket only through its first table entry
+		if(j < (1u << bucket->depth) && k < bucket->count){
+			*cursor = DIRECT_BLOCKS_COUNT + (uint64_t)j * DIR_BUCKET_ENTRIES + k + 1;
+			return bucket->entries[k].inode;
+		}
+	}
+	*cursor = DIRECT_BLOCKS_COUNT + (uint64_t)j * DIR_BUCKET_ENTRIES;
+	return -1;
+}
+
+uint32_t dir_count(file_system* fs, int dir_id){
+	inode* dir = &fs->inodes[dir_id];
+	uint32_t count = 0;
+	for (int i = 0; i < DIRECT_BLOCKS_COUNT; i++) {
+		if(dir->direct_blocks[i] != -1) count++;
+	}
+	if(dir->dir_index != -1){
+		count += root_of(fs, dir_id)->count;
+	}
+	return count;
+}
+
+static int compare_ids(const void* a, const void* b){
+	return *(const int*)a - *(const int*)b;
+}
+
+int dir_children(file_system* fs, int dir_id, int** children){
+	uint32_t count = dir_count(fs, dir_id);
+	*children = malloc((count ? count : 1) * sizeof(int));
+	if(*children == NULL) return -2;
+
+	uint32_t n = 0;
+	uint64_t cursor = 0;
+	int child_id;
+	while(n < count && (child_id = dir_next(fs, dir_id, &cursor)) != -1){
+		int child_type = fs->inodes[child_id].n_type;
+		if(child_type == reg_file || child_type == directory){
+			(*children)[n++] = child_id;
+		}
+	}
+	qsort(*children, n, sizeof(int), compare_ids);
+	return n;
+}
@@ -2,11 +2,233 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../lib/bitmap.h"
+#include "../lib/bmap.h"
+#include "../lib/dcache.h"
+#include "../lib/dedup.h"
+#include "../lib/journal.h"
+#include "../lib/lock.h"
+#include "../lib/snapshot.h"
+#include "../lib/stats.h"
+#include "../lib/trace.h"
+#include "../lib/zfile.h"
 #include "../lib/filesystem.h"
 #include "../lib/utils.h"
 #include <errno.h>
 
+/*
+ * On-disk layout: superblock, free list (one byte per block), inode table,
+ * data blocks. The inode table starts at the next multiple of 8 after the
+ * free list, so every section can be accessed in place when mapped.
+ */
+#define ALIGN8(x) (((x) + 7) & ~(size_t)7)
+
+static size_t free_list_offset(void){
+	return sizeof(superblock);
+}
+
+static size_t inodes_offset(uint32_t num_blocks){
+	return ALIGN8(free_list_offset() + num_blocks);
+}
+
+static size_t data_blocks_offset(uint32_t num_blocks){
+	return inodes_offset(num_blocks) + sizeof(inode) * (size_t)num_blocks;
+}
+
+static size_t image_size(uint32_t num_blocks){
+	return data_blocks_offset(num_blocks) + sizeof(data_block) * (size_t)num_blocks;
+}
+
+/*
+ * Sets up the in-memory bookkeeping that is not part of the image
+ */
+static void init_state(file_system* fs){
+	uint32_t n = fs->s_block->num_blocks;
+	fs->map_base = NULL;
+	fs->map_len = 0;
+	fs->image_fd = -1;
+	fs->dirty_inodes = bitmap_alloc(n);
+	fs->dirty_blocks = bitmap_alloc(n);
+	if(fs->dirty_inodes == NULL || fs->dirty_blocks == NULL){
+		perror("Calloc error");
+		exit(errno);
+	}
+	fs->dirty_free_lo = n;
+	fs->dirty_free_hi = 0;
+	fs->free_map = NULL;
+	fs->free_hint = 0;
+	fs->inode_map = NULL;
+	fs->inode_summary = NULL;
+	fs->inode_hint = 0;
+	fs->free_inodes = 0;
+	fs->block_refs = NULL;
+	fs->dcache = NULL;
+	fs->dedup = NULL;
+	fs->zfile = NULL;
+	fs->journal = NULL;
+	fs->snapshots = NULL;
+	fs->read_only = 0;
+	fs_locks_init(fs);
+}
+
+/*
+ * Builds the packed free map from the free list on first use of the block allocator
+ */
+static void init_free_map(file_system* fs){
+	uint32_t n = fs->s_block->num_blocks;
+	fs->free_map = bitmap_alloc(n);
+	if(fs->free_map == NULL){
+		perror("Calloc error");
+		exit(errno);
+	}
+	for (uint32_t i = 0; i < n; i++) {
+		if(fs->free_list[i]){
+			bitmap_set(fs->free_map, i);
+		}
+	}
+	fs->free_hint = 0;
+}
+
+static void clear_dirty(file_system* fs){
+	uint32_t n = fs->s_block->num_blocks;
+	memset(fs->dirty_inodes, 0, BITMAP_WORDS(n) * sizeof(uint64_t));
+	memset(fs->dirty_blocks, 0, BITMAP_WORDS(n) * sizeof(uint64_t));
+	fs->dirty_free_lo = n;
+	fs->dirty_free_hi = 0;
+}
+
+/*
+ * Layouts of older images, which are converted when they are loaded.
+ * Version 1 was written before the format was versioned: an 8 byte
+ * superblock, the free list, inodes without dir_index and the data blocks,
+ * without padding in between.
+ * Version 2 has the current superblock and alignment, but inodes with a
+ * 16 bit size and no indirect blocks.
+ * Version 3 inodes have no flags.
+ */
+typedef struct _superblock_v1{
+	uint32_t num_blocks;
+	uint32_t free_blocks;
+} superblock_v1;
+
+typedef struct _inode_v1 {
+	enum node_type n_type;
+	uint16_t size;
+	char name[NAME_MAX_LENGTH];
+	int direct_blocks[DIRECT_BLOCKS_COUNT];
+	int parent;
+} inode_v1;
+
+typedef struct _inode_v2 {
+	enum node_type n_type;
+	uint16_t size;
+	char name[NAME_MAX_LENGTH];
+	int direct_blocks[DIRECT_BLOCKS_COUNT];
+	int parent;
+	int dir_index;
+} inode_v2;
+
+typedef struct _inode_v3 {
+	enum node_type n_type;
+	uint64_t size;
+	char name[NAME_MAX_LENGTH];
+	int direct_blocks[DIRECT_BLOCKS_COUNT];
+	int indirect_blocks[INDIRECT_LEVELS];
+	int parent;
+	int dir_index;
+} inode_v3;
+
+static void convert_v1(inode* dst, const void* src){
+	const inode_v1* old = src;
+	dst->n_type = old->n_type;
+	dst->size = old->size;
+	memcpy(dst->name, old->name, NAME_MAX_LENGTH);
+	memcpy(dst->direct_blocks, old->direct_blocks, sizeof(old->direct_blocks));
+	dst->parent = old->parent;
+}
+
+static void convert_v2(inode* dst, const void* src){
+	const inode_v2* old = src;
+	dst->n_type = old->n_type;
+	dst->size = old->size;
+	memcpy(dst->name, old->name, NAME_MAX_LENGTH);
+	memcpy(dst->direct_blocks, old->direct_blocks, sizeof(old->direct_blocks));
+	dst->parent = old->parent;
+	dst->dir_index = old->dir_index;
+}
+
+static void convert_v3(inode* dst, const void* src){
+	const inode_v3* old = src;
+	dst->n_type = old->n_type;
+	dst->size = old->size;
+	memcpy(dst->name, old->name, NAME_MAX_LENGTH);
+	memcpy(dst->direct_blocks, old->direct_blocks, sizeof(old->direct_blocks));
+	memcpy(dst->indirect_blocks, old->indirect_blocks, sizeof(old->indirect_blocks));
+	dst->parent = old->parent;
+	dst->dir_index = old->dir_index;
+}
+
+typedef struct _old_layout{
+	size_t superblock_size;
+	size_t inode_size;
+	int aligned; //the inode table starts at a multiple of 8
+	void (*convert)(inode* dst, const void* src);
+} old_layout;
+
+static const old_layout old_layouts[FS_VERSION] = {
+	[1] = {sizeof(superblock_v1), sizeof(inode_v1), 0, convert_v1},
+	[2] = {sizeof(superblock), sizeof(inode_v2), 1, convert_v2},
+	[3] = {sizeof(superblock), sizeof(inode_v3), 1, convert_v3},
+};
+
+static int read_at(FILE* fs_file, size_t offset, void* dst, size_t size, size_t count){
+	if(fseek(fs_file, offset, SEEK_SET) != 0) return -1;
+	return fread(dst, size, count, fs_file) == count ? 0 : -1;
+}
+
+/*
+ * Reads free list, inodes and data blocks of an image of an older version into fs
+ */
+static int load_old(file_system* fs, FILE* fs_file, const old_layout* layout){
+	uint32_t n = fs->s_block->num_blocks;
+	size_t offset = layout->superblock_size;
+	if(read_at(fs_file, offset, fs->free_list, sizeof(uint8_t), n) != 0) return -1;
+	offset += n;
+	if(layout->aligned) offset = ALIGN8(offset);
+
+	uint8_t* old_inodes = malloc(layout->inode_size * (size_t)n);
+	if(old_inodes == NULL) return -1;
+	if(read_at(fs_file, offset, old_inodes, layout->inode_size, n) != 0){
+		free(old_inodes);
+		return -1;
+	}
+	for (uint32_t i = 0; i < n; i++) {
+		inode_init(&fs->inodes[i]);
+		layout->convert(&fs->inodes[i], old_inodes + layout->inode_size * i);
+	}
+	free(old_inodes);
+	offset += layout->inode_size * (size_t)n;
+
+	return read_at(fs_file, offset, fs->data_blocks, sizeof(data_block), n);
+}
+
+static void find_root_node(file_system* fs){
+	fs->root_node = 0;
+	for (int i = 0; i<fs->s_block->num_blocks; i++) {
+		if(fs->inodes[i].n_type==directory && strncmp(fs->inodes[i].name,"/",NAME_MAX_LENGTH)==0){
+			fs->root_node = i;
+			break;
+		}
+	}
+}
+
 file_system* fs_load(const char* fs_file_path){
+	uint64_t start = stats_start();
+	TRACE_SCOPE("fs_load");
 	//open file
 	FILE* fs_file = fopen(fs_file_path,"r");
 	if(fs_file == NULL){
@@ -14,34 +236,138 @@ file_system* fs_load(const char* fs_file_path){
 	}
 	file_system* new_fs = malloc(sizeof(file_system));
 
-	new_fs->s_block = malloc(sizeof(superblock));
+	new_fs->s_block = calloc(1, sizeof(superblock));
 
 	//read size from superblock
 	fread(new_fs->s_block, sizeof(superblock), 1, fs_file);
+	uint32_t n = new_fs->s_block->num_blocks;
+
+	//allocate memory for the free list, the inodes and the data blocks
+	new_fs->free_list = malloc(n);
+	new_fs->inodes = malloc(sizeof(inode) * n);
+	new_fs->data_blocks = malloc(sizeof(data_block)* n);
+	if(new_fs->free_list == NULL || new_fs->inodes == NULL || new_fs->data_blocks == NULL){
+		perror("Malloc error");
+		exit(errno);
+	}
+
+	int res;
+	TRACE_BEGIN(load, "load_image");
+	if(new_fs->s_block->magic != FS_MAGIC){
+		// the free list bytes of a version 1 image can never look like the magic number
+		new_fs->s_block->version = 1;
+	}
+	if(new_fs->s_block->version < 1 || new_fs->s_block->version > FS_VERSION){
+		fprintf(stderr, "Unsupported image version %u\n", new_fs->s_block->version);
+		exit(1);
+	}
+	int converted = new_fs->s_block->version < FS_VERSION;
+	if(converted){
+		LOG("Converting image from an older format version\n");
+		res = load_old(new_fs, fs_file, &old_layouts[new_fs->s_block->version]);
+		new_fs->s_block->magic = FS_MAGIC;
+		new_fs->s_block->version = FS_VERSION;
+	}
+	else{
+		res = read_at(fs_file, free_list_offset(), new_fs->free_list, sizeof(uint8_t), n);
+		if(res == 0) res = read_at(fs_file, inodes_offset(n), new_fs->inodes, sizeof(inode), n);
+		if(res == 0) res = read_at(fs_file, data_blocks_offset(n), new_fs->data_blocks, sizeof(data_block), n);
+	}
+	if(res != 0){
+		fprintf(stderr, "Image is truncated\n");
+		exit(1);
+	}
+	TRACE_END(load);
 
-	//allocate memory for the free list and load the free list from file
-	new_fs->free_list = malloc(new_fs->s_block->num_blocks);
-	fread(new_fs->free_list,sizeof(uint8_t), new_fs->s_block->num_blocks, fs_file);
+	init_state(new_fs);
+	//keep the image open so later dumps can write only what changed.
+	//A converted image has to be written as a whole, its layout may match the current one in size only
+	if(!converted) new_fs->image_fd = open(fs_file_path, O_RDWR);
 
-	//allocate memory for the inodes and read them from file
-	new_fs->inodes = malloc(sizeof(inode) * new_fs->s_block->num_blocks);
-	fread(new_fs->inodes,sizeof(inode), new_fs->s_block->num_blocks, fs_file);
+	//the snapshots come first, replaying the journal saves what it changes for them
+	if(snapshot_load(new_fs, fs_file_path) < 0){
+		fprintf(stderr, "Snapshots could not be read, continuing without them\n");
+	}
 
-	//allocate memory for the data blocks and read them from file
-	new_fs->data_blocks = malloc(sizeof(data_block)* new_fs->s_block->num_blocks);
-	fread(new_fs->data_blocks,sizeof(data_block), new_fs->s_block->num_blocks, fs_file);
+	//apply what was committed to the journal after the image was last written
+	if(journal_replay(new_fs, fs_file_path) < 0){
+		fprintf(stderr, "Journal could not be written to the image\n");
+		exit(1);
+	}
 
 	//find root node
-	for (int i = 0; i<new_fs->s_block->num_blocks; i++) {
-		if(new_fs->inodes[i].n_type==directory && strncmp(new_fs->inodes[i].name,"/",NAME_MAX_LENGTH)==0){
-			new_fs->root_node = i;
-			break;
-		}
-	}
+	find_root_node(new_fs);
 	
 	LOG("Loaded filesystem from file\n");
 
 	fclose(fs_file);
+	stats_op(STATS_LOAD, start, 0, image_size(new_fs->s_block->num_blocks));
+	return new_fs;
+}
+
+file_system* fs_load_mmap(const char* fs_file_path){
+	uint64_t start = stats_start();
+	TRACE_SCOPE("fs_load_mmap");
+	int fd = open(fs_file_path, O_RDWR);
+	if(fd < 0){
+		exit(1);
+	}
+
+	superblock s_block;
+	if(pread(fd, &s_block, sizeof(superblock), 0) != sizeof(superblock)){
+		close(fd);
+		exit(1);
+	}
+
+	// older images have to be converted, they can't be used in place
+	if(s_block.magic != FS_MAGIC || s_block.version != FS_VERSION){
+		LOG("Image is in an older format, loading a converted copy instead of mapping\n");
+		close(fd);
+		return fs_load(fs_file_path);
+	}
+	// the mapping would carry changes to the image before the snapshots saved what they replace
+	if(snapshot_exists(fs_file_path)){
+		LOG("Image has snapshots, loading a copy instead of mapping\n");
+		close(fd);
+		return fs_load(fs_file_path);
+	}
+
+	struct stat st;
+	size_t len = image_size(s_block.num_blocks);
+	if(fstat(fd, &st) != 0 || (size_t)st.st_size < len){
+		close(fd);
+		exit(1);
+	}
+
+	uint8_t* base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(base == MAP_FAILED){
+		perror("mmap error");
+		close(fd);
+		exit(errno);
+	}
+
+	file_system* new_fs = malloc(sizeof(file_system));
+	if(new_fs == NULL){
+		perror("Malloc error");
+		exit(errno);
+	}
+	new_fs->s_block = (superblock*)base;
+	new_fs->free_list = base + free_list_offset();
+	new_fs->inodes = (inode*)(base + inodes_offset(s_block.num_blocks));
+	new_fs->data_blocks = (data_block*)(base + data_blocks_offset(s_block.num_blocks));
+	init_state(new_fs);
+	new_fs->map_base = base;
+	new_fs->map_len = len;
+	new_fs->image_fd = fd;
+
+	if(journal_replay(new_fs, fs_file_path) < 0){
+		fprintf(stderr, "Journal could not be written to the image\n");
+		exit(1);
+	}
+	find_root_node(new_fs);
+
+	LOG("Mapped filesystem from file\n");
+	stats_op(STATS_LOAD_MMAP, start, 0, 0);
 	return new_fs;
 }
 
@@ -60,6 +386,8 @@ file_system* fs_create(const char* fs_file_path, uint32_t size){
 	}
 	new_fs->s_block->num_blocks = size;
 	new_fs->s_block->free_blocks = size;
+	new_fs->s_block->magic = FS_MAGIC;
+	new_fs->s_block->version = FS_VERSION;
 	
 	// Create free list and set every entry to 1 (meaning that block is free);
 	new_fs->free_list = malloc(size);
@@ -90,6 +418,7 @@ file_system* fs_create(const char* fs_file_path, uint32_t size){
 	new_fs->inodes[0].n_type = directory;
 	strncpy(new_fs->inodes[0].name,"/",NAME_MAX_LENGTH);
 	new_fs->root_node = 0;
+	init_state(new_fs);
 
 	
 	new_fs->data_blocks = calloc(size,sizeof(data_block));
@@ -114,13 +443,96 @@ void inode_init(inode *i){
 	for (int j=0; j<DIRECT_BLOCKS_COUNT; j++) {
 		i->direct_blocks[j] = -1;
 	}
+	for (int j=0; j<INDIRECT_LEVELS; j++) {
+		i->indirect_blocks[j] = -1;
+	}
 	i->parent = -1; //meaning it has no parent
+	i->dir_index = -1;
+	i->flags = 0;
 }
 
 
-int fs_dump(file_system *fs, const char *file_path){
+/*
+ * Returns 1 if file_path names the file open as fd
+ */
+static int is_same_file(int fd, const char *file_path){
+	struct stat open_file, target;
+	if(fd < 0 || fstat(fd, &open_file) != 0 || stat(file_path, &target) != 0){
+		return 0;
+	}
+	return open_file.st_dev == target.st_dev && open_file.st_ino == target.st_ino;
+}
+
+static int pwrite_all(int fd, const void *buf, size_t len, off_t offset){
+	const uint8_t *p = buf;
+	while(len > 0){
+		ssize_t written = pwrite(fd, p, len, offset);
+		if(written < 0){
+			if(errno == EINTR) continue;
+			return -1;
+		}
+		p += written;
+		offset += written;
+		len -= written;
+	}
+	return 0;
+}
+
+/*
+ * Writes every run of consecutive set bits in dirty as one pwrite of the
+ * matching records starting at offset
+ */
+static int dump_dirty_runs(int fd, const uint64_t *dirty, uint32_t n, const void *records, size_t record_size, size_t offset){
+	size_t start = bitmap_next_set(dirty, n, 0);
+	while(start < n){
+		size_t end = bitmap_next_clear(dirty, n, start);
+		if(pwrite_all(fd, (const uint8_t*)records + start * record_size, (end - start) * record_size, offset + start * record_size) != 0){
+			return -1;
+		}
+		start = bitmap_next_set(dirty, n, end);
+	}
+	return 0;
+}
+
+/*
+ * Writes the superblock and the dirty regions in place into the image open as fs->image_fd
+ */
+static int dump_incremental(file_system *fs){
+	uint32_t n = fs->s_block->num_blocks;
+	int fd = fs->image_fd;
+
+	if(pwrite_all(fd, fs->s_block, sizeof(superblock), 0) != 0) return -1;
+	if(fs->dirty_free_lo < fs->dirty_free_hi){
+		if(pwrite_all(fd, fs->free_list + fs->dirty_free_lo, fs->dirty_free_hi - fs->dirty_free_lo,
+		              free_list_offset() + fs->dirty_free_lo) != 0) return -1;
+	}
+	if(dump_dirty_runs(fd, fs->dirty_inodes, n, fs->inodes, sizeof(inode), inodes_offset(n)) != 0) return -1;
+	if(dump_dirty_runs(fd, fs->dirty_blocks, n, fs->data_blocks, sizeof(data_block), data_blocks_offset(n)) != 0) return -1;
+
+	clear_dirty(fs);
+	return 0;
+}
+
+/*
+ * Writes the image itself, see fs_dump
+ */
+static int dump_image(file_system *fs, const char *file_path){
+	TRACE_SCOPE("dump_image");
 	uint32_t size = fs->s_block->num_blocks;
 
+	if(is_same_file(fs->image_fd, file_path)){
+		// the mapping is the image, only the dirty pages have to reach the disk
+		if(fs->map_base != NULL){
+			if(msync(fs->map_base, fs->map_len, MS_SYNC) != 0) return -1;
+			clear_dirty(fs);
+			return 0;
+		}
+		struct stat st;
+		if(fstat(fs->image_fd, &st) == 0 && (size_t)st.st_size == image_size(size)){
+			return dump_incremental(fs);
+		}
+	}
+
 	FILE* fs_file = fopen(file_path,"w+b");
 	if (fs_file == NULL){
 		exit(1);
@@ -128,31 +540,447 @@ int fs_dump(file_system *fs, const char *file_path){
 
 	fwrite(fs->s_block, sizeof(superblock), 1, fs_file);
 	fwrite(fs->free_list, sizeof(uint8_t),size,fs_file);
+	fseek(fs_file, inodes_offset(size), SEEK_SET); //the gap before the inodes reads back as zeros
 	fwrite(fs->inodes, sizeof(inode),size,fs_file);
 	fwrite(fs->data_blocks, sizeof(data_block),size,fs_file);
 	fclose(fs_file);
+	clear_dirty(fs);
 
+	// the next dump to this file only has to write what changed from here on
+	if(fs->map_base == NULL){
+		if(fs->image_fd >= 0) close(fs->image_fd);
+		fs->image_fd = open(file_path, O_RDWR);
+	}
 	return 0;
+}
+
+int fs_dump(file_system *fs, const char *file_path){
+	uint64_t start = stats_start();
+	TRACE_SCOPE("fs_dump");
+	// no operation may be halfway through while the image is written
+	fs_lock_exclusive(fs);
+	// a dump to the image of the journal is a checkpoint: commit first, empty the journal once the image is written
+	int checkpoint = fs->journal != NULL && is_same_file(fs->image_fd, file_path);
+	int res = -1;
+	if((!checkpoint || journal_commit(fs) == 0) && dump_image(fs, file_path) == 0
+	   // what the snapshots saved is relative to the image just written
+	   && snapshot_dump(fs, file_path) == 0){
+		res = checkpoint ? journal_reset(fs) : 0;
+	}
+	fs_unlock(fs);
+	stats_op(STATS_DUMP, start, res != 0, 0);
+	return res;
+}
+
+file_system* fs_clone(file_system* fs){
+	uint32_t n = fs->s_block->num_blocks;
+	file_system* copy = malloc(sizeof(file_system));
+	if(copy == NULL){
+		perror("Malloc error");
+		exit(errno);
+	}
+	copy->s_block = malloc(sizeof(superblock));
+	copy->free_list = malloc(n);
+	copy->inodes = malloc(sizeof(inode) * n);
+	copy->data_blocks = malloc(sizeof(data_block) * n);
+	if(copy->s_block == NULL || copy->free_list == NULL || copy->inodes == NULL || copy->data_blocks == NULL){
+		perror("Malloc error");
+		exit(errno);
+	}
+	*copy->s_block = *fs->s_block;
+	memcpy(copy->free_list, fs->free_list, n);
+	memcpy(copy->inodes, fs->inodes, sizeof(inode) * n);
+	memcpy(copy->data_blocks, fs->data_blocks, sizeof(data_block) * n);
+	copy->root_node = fs->root_node;
+	init_state(copy);
+	return copy;
+}
+
+void fs_drop_caches(file_system* fs){
+	// readers without locks may still be in the caches
+	epoch_synchronize(fs);
+	free(fs->free_map);
+	fs->free_map = NULL;
+	free(fs->inode_map);
+	fs->inode_map = NULL;
+	free(fs->inode_summary);
+	fs->inode_summary = NULL;
+	free(fs->block_refs);
+	fs->block_refs = NULL;
+	dcache_destroy(fs);
+	zfile_destroy(fs);
+	// the dedup index compares every hit byte by byte, stale entries only miss
+}
 
+void fs_mark_inode_dirty(file_system* fs, int inode_id){
+	if(inode_id >= 0 && inode_id < fs->s_block->num_blocks){
+		alloc_lock(fs);
+		if(fs->snapshots) snapshot_save_inode(fs, inode_id);
+		bitmap_set(fs->dirty_inodes, inode_id);
+		if(fs->journal) journal_mark_inode(fs, inode_id);
+		alloc_unlock(fs);
+	}
+}
+
+void fs_mark_block_dirty(file_system* fs, int block_id){
+	if(block_id >= 0 && block_id < fs->s_block->num_blocks){
+		alloc_lock(fs);
+		if(fs->snapshots) snapshot_save_block(fs, block_id);
+		bitmap_set(fs->dirty_blocks, block_id);
+		if(fs->journal) journal_mark_block(fs, block_id);
+		alloc_unlock(fs);
+	}
 }
 
+void fs_mark_free_dirty(file_system* fs, int block_id){
+	if(block_id < 0 || block_id >= fs->s_block->num_blocks) return;
+	alloc_lock(fs);
+	if(fs->snapshots) snapshot_save_free(fs, block_id);
+	if(block_id < fs->dirty_free_lo) fs->dirty_free_lo = block_id;
+	if(block_id + 1 > fs->dirty_free_hi) fs->dirty_free_hi = block_id + 1;
+	if(fs->journal) journal_mark_free(fs, block_id);
+	alloc_unlock(fs);
+}
+
+
+/*
+ * Builds the free inode bitmaps from the inode table on first use of the inode allocator
+ */
+static void init_inode_map(file_system* fs){
+	uint32_t n = fs->s_block->num_blocks;
+	fs->inode_map = bitmap_alloc(n);
+	fs->inode_summary = bitmap_alloc(BITMAP_WORDS(n));
+	if(fs->inode_map == NULL || fs->inode_summary == NULL){
+		perror("Calloc error");
+		exit(errno);
+	}
+	fs->free_inodes = 0;
+	for (uint32_t i = 0; i < n; i++) {
+		if(fs->inodes[i].n_type == free_block){
+			bitmap_set(fs->inode_map, i);
+			bitmap_set(fs->inode_summary, i / 64);
+			fs->free_inodes++;
+		}
+	}
+	fs->inode_hint = 0;
+}
+
+/*
+ * Returns the lowest inode marked free in the bitmaps without taking it, or -1
+ */
+static int inode_map_first(file_system* fs){
+	uint32_t n = fs->s_block->num_blocks;
+	size_t words = BITMAP_WORDS(n);
+	size_t w = bitmap_next_set(fs->inode_summary, words, fs->inode_hint);
+	fs->inode_hint = w;
+	if(w >= words) return -1;
+	return w * 64 + __builtin_ctzll(fs->inode_map[w]);
+}
+
+static void inode_map_take(file_system* fs, int inode_id){
+	bitmap_clear(fs->inode_map, inode_id);
+	if(fs->inode_map[inode_id / 64] == 0){
+		bitmap_clear(fs->inode_summary, inode_id / 64);
+	}
+	fs->free_inodes--;
+}
 
 int find_free_inode(file_system* fs){
-	for (int i=0; i<fs->s_block->num_blocks; i++) {
-		if(fs->inodes[i].n_type==free_block){
-			return i;
+	alloc_lock(fs);
+	if(fs->inode_map == NULL) init_inode_map(fs);
+	epoch_reclaim(fs);
+	int i;
+	uint64_t scanned = 0;
+	// inodes taken without going through the allocator are dropped from the bitmaps here
+	while((i = inode_map_first(fs)) >= 0 && fs->inodes[i].n_type != free_block){
+		inode_map_take(fs, i);
+		scanned++;
+	}
+	stats_count(STATS_INODES_SCANNED, scanned + (i >= 0));
+	alloc_unlock(fs);
+	return i;
+}
+
+int inode_alloc(file_system* fs){
+	alloc_lock(fs);
+	int i = find_free_inode(fs);
+	if(i >= 0){
+		inode_map_take(fs, i);
+	}
+	alloc_unlock(fs);
+	return i;
+}
+
+int inode_alloc_n(file_system* fs, int count, int* inodes){
+	alloc_lock(fs);
+	if(fs->inode_map == NULL) init_inode_map(fs);
+	epoch_reclaim(fs);
+	int allocated = 0;
+	int i;
+	uint64_t scanned = 0;
+	while(allocated < count && (i = inode_map_first(fs)) >= 0){
+		scanned++;
+		inode_map_take(fs, i);
+		// inodes taken without going through the allocator are only dropped from the bitmaps
+		if(fs->inodes[i].n_type == free_block) inodes[allocated++] = i;
+	}
+	stats_count(STATS_INODES_SCANNED, scanned);
+	alloc_unlock(fs);
+	return allocated;
+}
+
+/*
+ * Hands a freed inode to the allocator, once no reader can see it anymore
+ */
+static void inode_release(file_system* fs, int inode_id){
+	// it may have been taken again by a rollback meanwhile
+	if(fs->inode_map == NULL || fs->inodes[inode_id].n_type != free_block) return;
+	if(!bitmap_test(fs->inode_map, inode_id)){
+		bitmap_set(fs->inode_map, inode_id);
+		bitmap_set(fs->inode_summary, inode_id / 64);
+		if(inode_id / 64 < fs->inode_hint){
+			fs->inode_hint = inode_id / 64;
 		}
+		fs->free_inodes++;
 	}
-	return -1;
+}
+
+void inode_free(file_system* fs, int inode_id){
+	if(inode_id < 0 || inode_id >= fs->s_block->num_blocks) return;
+	alloc_lock(fs);
+	// built before the inode is free, or the map would offer it right away
+	if(fs->inode_map == NULL) init_inode_map(fs);
+	fs_mark_inode_dirty(fs, inode_id);
+	inode_init(&fs->inodes[inode_id]);
+	epoch_defer(fs, inode_release, inode_id);
+	alloc_unlock(fs);
+}
+
+uint32_t inode_count_free(file_system* fs){
+	alloc_lock(fs);
+	if(fs->inode_map == NULL) init_inode_map(fs);
+	epoch_reclaim(fs);
+	uint32_t count = fs->free_inodes;
+	alloc_unlock(fs);
+	return count;
+}
+
+int block_alloc(file_system* fs){
+	int block_id;
+	return block_alloc_n(fs, 1, &block_id) == 1 ? block_id : -1;
+}
+
+int block_alloc_n(file_system* fs, int count, int* blocks){
+	uint32_t n = fs->s_block->num_blocks;
+	alloc_lock(fs);
+	if(fs->free_map == NULL) init_free_map(fs);
+	epoch_reclaim(fs);
+	int allocated = 0;
+	uint64_t scanned = 0;
+	size_t i = bitmap_next_set(fs->free_map, n, fs->free_hint);
+	while(allocated < count && i < n){
+		scanned++;
+		bitmap_clear(fs->free_map, i);
+		// the byte map is authoritative, skip blocks that were taken behind our back
+		if(fs->free_list[i]){
+			fs_mark_free_dirty(fs, i);
+			fs->free_list[i] = 0;
+			fs->s_block->free_blocks--;
+			blocks[allocated++] = i;
+		}
+		i = bitmap_next_set(fs->free_map, n, i + 1);
+	}
+	fs->free_hint = i;
+	stats_count(STATS_BLOCKS_SCANNED, scanned);
+	alloc_unlock(fs);
+	return allocated;
+}
+
+/*
+ * Length of the run of free blocks starting at start, at most max.
+ * A block taken behind the allocator's back ends the run and is dropped from free_map.
+ */
+static size_t free_run_length(file_system* fs, size_t start, size_t max){
+	uint32_t n = fs->s_block->num_blocks;
+	size_t end = start;
+	while(end < n && end - start < max && bitmap_test(fs->free_map, end)){
+		if(!fs->free_list[end]){
+			bitmap_clear(fs->free_map, end);
+			break;
+		}
+		end++;
+	}
+	return end - start;
+}
+
+static void take_run(file_system* fs, size_t start, size_t len, int* blocks){
+	for (size_t i = 0; i < len; i++) {
+		bitmap_clear(fs->free_map, start + i);
+		fs_mark_free_dirty(fs, start + i);
+		fs->free_list[start + i] = 0;
+		blocks[i] = start + i;
+	}
+	fs->s_block->free_blocks -= len;
+}
+
+int block_alloc_run(file_system* fs, int count, int goal, int* blocks){
+	uint32_t n = fs->s_block->num_blocks;
+	alloc_lock(fs);
+	if(fs->free_map == NULL) init_free_map(fs);
+	epoch_reclaim(fs);
+	int allocated = 0;
+
+	// extend the run the caller already has in place
+	if(goal >= 0 && goal < n){
+		allocated = free_run_length(fs, goal, count);
+		take_run(fs, goal, allocated, blocks);
+	}
+
+	uint64_t scanned = allocated;
+	// the lowest run that holds all of the rest
+	size_t start = bitmap_next_set(fs->free_map, n, fs->free_hint);
+	while(allocated < count && start < n){
+		size_t len = free_run_length(fs, start, count - allocated);
+		scanned += len;
+		if(len == count - allocated){
+			take_run(fs, start, len, blocks + allocated);
+			allocated += len;
+			break;
+		}
+		// block start + len is taken, no run can contain it
+		start = bitmap_next_set(fs->free_map, n, start + len + 1);
+	}
+	stats_count(STATS_BLOCKS_SCANNED, scanned);
+
+	// free space is too fragmented, take the lowest free blocks
+	if(allocated < count){
+		allocated += block_alloc_n(fs, count - allocated, blocks + allocated);
+	}
+	alloc_unlock(fs);
+	return allocated;
+}
+
+/*
+ * Counts the references to every data block in the block maps of all files
+ */
+static void init_block_refs(file_system* fs){
+	uint32_t n = fs->s_block->num_blocks;
+	fs->block_refs = calloc(n ? n : 1, sizeof(uint32_t));
+	if(fs->block_refs == NULL){
+		perror("Calloc error");
+		exit(errno);
+	}
+	for (uint32_t i = 0; i < n; i++) {
+		if(fs->inodes[i].n_type != reg_file) continue;
+		uint64_t next = 0;
+		int block_id;
+		while((block_id = bmap_next(fs, i, &next)) != -1){
+			if(block_id >= 0 && block_id < n) fs->block_refs[block_id]++;
+		}
+	}
+	// only the references beyond the first are kept
+	for (uint32_t b = 0; b < n; b++) {
+		if(fs->block_refs[b] > 0) fs->block_refs[b]--;
+	}
+}
+
+void block_share(file_system* fs, int block_id){
+	if(block_id < 0 || block_id >= fs->s_block->num_blocks) return;
+	alloc_lock(fs);
+	if(fs->block_refs == NULL) init_block_refs(fs);
+	fs->block_refs[block_id]++;
+	alloc_unlock(fs);
+}
+
+int block_is_shared(file_system* fs, int block_id){
+	if(block_id < 0 || block_id >= fs->s_block->num_blocks) return 0;
+	alloc_lock(fs);
+	if(fs->block_refs == NULL) init_block_refs(fs);
+	int shared = fs->block_refs[block_id] > 0;
+	alloc_unlock(fs);
+	return shared;
+}
+
+/*
+ * Hands a freed block to the allocator, once no reader can see it anymore
+ */
+static void block_reuse(file_system* fs, int block_id){
+	// it may have been taken again by a rollback meanwhile
+	if(fs->free_map == NULL || !fs->free_list[block_id]) return;
+	bitmap_set(fs->free_map, block_id);
+	if(block_id < fs->free_hint){
+		fs->free_hint = block_id;
+	}
+}
+
+/*
+ * Returns the block to the free list, called with the allocator lock held
+ */
+static void block_release(file_system* fs, int block_id){
+	if(fs->block_refs == NULL) init_block_refs(fs);
+	if(fs->block_refs[block_id] > 0){
+		// another file still uses the block
+		fs->block_refs[block_id]--;
+		return;
+	}
+	dedup_forget(fs, block_id);
+	// a snapshot still sees what the block held
+	if(fs->snapshots) snapshot_save_block(fs, block_id);
+	// built before the block is free, or the map would offer it right away
+	if(fs->free_map == NULL) init_free_map(fs);
+	fs_mark_free_dirty(fs, block_id);
+	fs->free_list[block_id] = 1;
+	fs->s_block->free_blocks++;
+	epoch_defer(fs, block_reuse, block_id);
+}
+
+void block_free(file_system* fs, int block_id){
+	if(block_id < 0 || block_id >= fs->s_block->num_blocks) return;
+	alloc_lock(fs);
+	if(!fs->free_list[block_id]) block_release(fs, block_id);
+	alloc_unlock(fs);
+}
+
+uint32_t block_count_free(file_system* fs){
+	uint32_t n = fs->s_block->num_blocks;
+	uint32_t count = 0;
+	alloc_lock(fs);
+	if(fs->free_map == NULL) init_free_map(fs);
+	epoch_reclaim(fs);
+	for (size_t w = 0; w < BITMAP_WORDS(n); w++) {
+		count += __builtin_popcountll(fs->free_map[w]);
+	}
+	alloc_unlock(fs);
+	return count;
 }
 
 
 void cleanup(file_system *fs){
 	
-	free(fs->s_block);
-	free(fs->inodes);
-	free(fs->free_list);
-	free(fs->data_blocks);
+	journal_destroy(fs);
+	snapshot_destroy(fs);
+	if(fs->image_fd >= 0){
+		close(fs->image_fd);
+	}
+	free(fs->dirty_inodes);
+	free(fs->dirty_blocks);
+	free(fs->free_map);
+	free(fs->inode_map);
+	free(fs->inode_summary);
+	free(fs->block_refs);
+	dcache_destroy(fs);
+	dedup_destroy(fs);
+	zfile_destroy(fs);
+	if(fs->map_base != NULL){
+		munmap(fs->map_base, fs->map_len);
+	}
+	else{
+		free(fs->s_block);
+		free(fs->inodes);
+		free(fs->free_list);
+		free(fs->data_blocks);
+	}
+	fs_locks_destroy(fs);
 	free(fs);
 
 }
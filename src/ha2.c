@@ -1,17 +1,365 @@
+#include <fnmatch.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "../lib/dedup.h"
 #include "../lib/filesystem.h"
+#include "../lib/journal.h"
 #include "../lib/linenoise.h"
 #include "../lib/operations.h"
+#include "../lib/pool.h"
+#include "../lib/server.h"
+#include "../lib/snapshot.h"
+#include "../lib/stats.h"
+#include "../lib/trace.h"
 #include "../lib/utils.h"
 
+#define READF_IOV 64 //data blocks written to stdout with one writev
+#define BATCH_STDIO (1 << 20) //stdout buffer in batch mode
+#define FIND_PATH 4096 //longest path find prints
+#define CMD_USAGE -3 //result of an unknown command or one with wrong arguments
+
+#define COMMANDS "Valid commands:\nlist\nmkfile\nmkdir\ncp\nrm\nexport\nimport\nwritef\nreadf\ndump\ndedup\ncompress\njournal\nsync\nsnapshot\nrollback\nmount\numount\nstats\ntrace\ndu\nfind\nexit\n"
+
+// state the commands work on
+typedef struct _session{
+	file_system *live; //the loaded filesystem
+	file_system *fs; //live, or a mounted snapshot of it while one is mounted
+	const char *image; //file the filesystem was loaded from or created as
+	int batch; //commands come from -b or -e, they are dumped once at the end
+	int quit;
+} session;
+
+/*
+ * Write iov_count blocks to out, straight with writev if out is a file
+ */
+static int put_iov(FILE *out, struct iovec *iov, int iov_count)
+{
+	int fd = fileno(out);
+	if (fd >= 0) {
+		fflush(out);
+		return writev_all(fd, iov, iov_count);
+	}
+	for (int i = 0; i < iov_count; i++) {
+		if (fwrite(iov[i].iov_base, 1, iov[i].iov_len, out) != iov[i].iov_len) return -1;
+	}
+	return 0;
+}
+
+// the totals of du, added to by several threads
+struct usage{
+	uint64_t bytes;
+	uint64_t files;
+	uint64_t dirs;
+};
+
+static int add_usage(file_system *fs, int inode_id, int depth, void *arg)
+{
+	(void)depth;
+	struct usage *u = arg;
+	inode *node = &fs->inodes[inode_id];
+	if (node->n_type == reg_file) {
+		__atomic_add_fetch(&u->bytes, node->size, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&u->files, 1, __ATOMIC_RELAXED);
+	} else {
+		__atomic_add_fetch(&u->dirs, 1, __ATOMIC_RELAXED);
+	}
+	return 0;
+}
+
+struct search{
+	const char *pattern; //NULL matches everything
+	FILE *out;
+};
+
+static int print_match(file_system *fs, int inode_id, int depth, void *arg)
+{
+	(void)depth;
+	struct search *search = arg;
+	if (search->pattern && fnmatch(search->pattern, fs->inodes[inode_id].name, 0) != 0) return 0;
+	char path[FIND_PATH];
+	if (tree_path(fs, inode_id, path, sizeof(path)) == 0) fprintf(search->out, "%s\n", path);
+	return 0;
+}
+
+/*
+ * Report a command that is unknown or used wrongly, on stderr also in
+ * batch mode, where a typo must not pass for success
+ */
+static int usage(const char *text)
+{
+	fputs(text, stderr);
+	return CMD_USAGE;
+}
+
+/*
+ * Run one command line, what it prints goes to out.
+ * Returns the result of the command, negative if it failed
+ */
+static int run_command(session *s, char *line, FILE *out)
+{
+	file_system *fs = s->fs;
+	file_system *live = s->live;
+	char *command = strtok(line, " \n");
+	if(command == NULL) return usage("Unknown command\n" COMMANDS);
+
+	//determine which command to execute (only our build in commands are possible)
+	int res = 0;
+	if (!strcmp(command, "mkdir")) {
+		res = fs_mkdir(fs, strtok(NULL, " \n"));
+	} else if (!strcmp(command, "mkfile")) {
+		res = fs_mkfile(fs, strtok(NULL, " \n"));
+	} else if (strcmp(command, "cp") == 0) {
+		// the order arguments are evaluated in is unspecified
+		char *src_path = strtok(NULL, " \n");
+		char *dst_path = strtok(NULL, " \n");
+		res = fs_cp(fs, src_path, dst_path);
+	} else if (!strcmp(command, "list")) {
+		char *output = (char *)fs_list(fs, strtok(NULL, " \n"));
+		if(output){
+			fwrite(output, strlen(output), 1, out);
+			free(output);
+		}
+		else{
+			res = -2;
+		}
+	} else if (!strcmp(command, "writef")) {
+		char *path = strtok(NULL, " \n");
+		char *text = strtok(NULL, "\0");
+		res = fs_writef(fs, path, text);
+	} else if (!strcmp(command, "readf")) {
+		// write the file straight from its data blocks
+		char *path = strtok(NULL, " \n");
+		struct iovec iov[READF_IOV];
+		uint64_t offset = 0;
+		int iov_count;
+		while((iov_count = fs_readv(fs, path, offset, SIZE_MAX, iov, READF_IOV)) > 0){
+			for (int i = 0; i < iov_count; i++) offset += iov[i].iov_len;
+			if(put_iov(out, iov, iov_count) != 0) break;
+		}
+		if(offset > 0){
+			if(!s->batch) LOG("\n")
+		}
+		else{
+			res = -2;
+		}
+	} else if (!strcmp(command, "rm")) {
+		res = fs_rm(fs, strtok(NULL, " \n"));
+	} else if (!strcmp(command, "export")) {
+		char *int_path = strtok(NULL, " \n");
+		char *ext_path = strtok(NULL, "\0");
+		res = fs_export(fs, int_path, ext_path);
+	} else if (!strcmp(command, "import")) {
+		char *int_path = strtok(NULL, " \n");
+		char *ext_path = strtok(NULL, "\0");
+		res = fs_import(fs, int_path, ext_path);
+	} else if (!strcmp(command, "dedup")) {
+		// dedup on|off, without an argument print the counters
+		char *mode = strtok(NULL, " \n");
+		if(mode == NULL){
+			uint64_t checked, shared;
+			dedup_stats(live, &checked, &shared);
+			fprintf(out, "checked %lu shared %lu ratio %.2f\n", (unsigned long)checked, (unsigned long)shared,
+			        checked ? (double)shared / checked : 0.0);
+		}
+		else if(!strcmp(mode, "on") || !strcmp(mode, "off")){
+			res = dedup_enable(live, !strcmp(mode, "on")) == 0 ? 0 : -2;
+		}
+		else{
+			res = usage("usage: dedup [on|off]\n");
+		}
+	} else if (!strcmp(command, "compress")) {
+		char *path = strtok(NULL, " \n");
+		char *mode = strtok(NULL, " \n");
+		if(mode != NULL && (!strcmp(mode, "on") || !strcmp(mode, "off"))){
+			res = fs_compress(fs, path, !strcmp(mode, "on"));
+		}
+		else{
+			res = usage("usage: compress <file> on|off\n");
+		}
+	} else if (!strcmp(command, "journal")) {
+		// journal on [operations per commit] | off
+		char *mode = strtok(NULL, " \n");
+		char *group = strtok(NULL, " \n");
+		if(mode != NULL && !strcmp(mode, "on")){
+			res = journal_open(live, s->image, group ? atoi(group) : 1) == 0 ? 0 : -2;
+		}
+		else if(mode != NULL && !strcmp(mode, "off")){
+			res = journal_close(live) == 0 ? 0 : -2;
+		}
+		else{
+			res = usage("usage: journal on [group]|off\n");
+		}
+	} else if (!strcmp(command, "sync")) {
+		res = journal_commit(live) == 0 ? 0 : -2;
+	} else if (!strcmp(command, "snapshot")) {
+		// snapshot <name> | -d <name>, without an argument list the snapshots
+		char *name = strtok(NULL, " \n");
+		if(name == NULL){
+			char *output = snapshot_list(live);
+			if(output){
+				fwrite(output, strlen(output), 1, out);
+				free(output);
+			}
+			else{
+				res = -2;
+			}
+		}
+		else if(!strcmp(name, "-d")){
+			res = snapshot_delete(live, strtok(NULL, " \n"));
+		}
+		else{
+			res = snapshot_create(live, name);
+		}
+	} else if (!strcmp(command, "stats")) {
+		// stats [json|reset], the counters of the whole process
+		char *mode = strtok(NULL, " \n");
+		if(mode != NULL && !strcmp(mode, "reset")){
+			stats_reset();
+		}
+		else if(mode == NULL || !strcmp(mode, "json")){
+			char *output = stats_format(mode != NULL);
+			fwrite(output, strlen(output), 1, out);
+			free(output);
+		}
+		else{
+			res = usage("usage: stats [json|reset]\n");
+		}
+	} else if (!strcmp(command, "trace")) {
+		// trace on|off|export <file>, needs a build with make TRACE=1
+		char *mode = strtok(NULL, " \n");
+		if(mode != NULL && (!strcmp(mode, "on") || !strcmp(mode, "off"))){
+			res = trace_enable(!strcmp(mode, "on")) == 0 ? 0 : -2;
+		}
+		else if(mode != NULL && !strcmp(mode, "export")){
+			char *path = strtok(NULL, " \n");
+			res = path && trace_export(path) == 0 ? 0 : -2;
+		}
+		else{
+			res = usage("usage: trace on|off|export <file>\n");
+		}
+	} else if (!strcmp(command, "du")) {
+		// du <path>, the files and directories below path, walked on all processors
+		struct usage u = {0, 0, 0};
+		res = fs_walk(fs, strtok(NULL, " \n"), add_usage, NULL, &u, pool_threads());
+		if(res == 0){
+			fprintf(out, "bytes %lu files %lu dirs %lu\n", (unsigned long)u.bytes, (unsigned long)u.files,
+			        (unsigned long)u.dirs);
+		}
+	} else if (!strcmp(command, "find")) {
+		// find <path> [pattern], the paths below path whose name matches the shell pattern, in inode order
+		char *path = strtok(NULL, " \n");
+		struct search search = {strtok(NULL, " \n"), out};
+		res = fs_walk(fs, path, print_match, NULL, &search, 1);
+	} else if (!strcmp(command, "rollback")) {
+		res = snapshot_rollback(live, strtok(NULL, " \n"));
+	} else if (!strcmp(command, "mount")) {
+		// browse a snapshot read-only until umount
+		file_system *view = snapshot_mount(live, strtok(NULL, " \n"));
+		if(view){
+			if(fs != live) cleanup(fs);
+			s->fs = view;
+		}
+		else{
+			res = -1;
+		}
+	} else if (!strcmp(command, "umount")) {
+		if(fs != live) cleanup(fs);
+		s->fs = live;
+	} else if (!strcmp(command, "dump")) {
+		// a batch is dumped once, after its last command
+		if(!s->batch) res = fs_dump(live, s->image);
+	} else if (!strcmp(command, "exit") || !strcmp(command, "quit")) {
+		s->quit = 1;
+	} else {
+		res = usage("Unknown command\n" COMMANDS);
+	}
+	return res;
+}
+
+/*
+ * Run one command of a batch and report it on stdout as a line
+ * "<number> <command> <result> <length>" followed by the length bytes it printed.
+ * Returns the result of the command
+ */
+static int batch_command(session *s, long number, char *line)
+{
+	// skip blank lines and comments
+	line += strspn(line, " \t\r\n");
+	if (*line == '\0' || *line == '#') return 0;
+	char name[16];
+	size_t name_len = MIN(strcspn(line, " \t\r\n"), sizeof(name) - 1);
+	memcpy(name, line, name_len);
+	name[name_len] = '\0';
+
+	char *output = NULL;
+	size_t output_len = 0;
+	FILE *out = open_memstream(&output, &output_len);
+	if (out == NULL) {
+		perror("open_memstream");
+		exit(errno);
+	}
+	int res = run_command(s, line, out);
+	fclose(out);
+	printf("%ld %s %d %zu\n", number, name, res, output_len);
+	fwrite(output, 1, output_len, stdout);
+	free(output);
+	return res;
+}
+
+/*
+ * Run the commands in script (one per line, - for stdin), or in commands
+ * (separated by ';'), then dump once.
+ * Returns the exit status: 0 if every command and the dump succeeded, 1 else
+ */
+static int run_batch(session *s, const char *script, char *commands)
+{
+	s->batch = 1;
+	setvbuf(stdout, NULL, _IOFBF, BATCH_STDIO);
+	long number = 0;
+	int failed = 0;
+
+	if (script != NULL) {
+		FILE *in = strcmp(script, "-") == 0 ? stdin : fopen(script, "r");
+		if (in == NULL) {
+			perror(script);
+			return 1;
+		}
+		char *line = NULL;
+		size_t cap = 0;
+		ssize_t len;
+		while (!s->quit && (len = getline(&line, &cap, in)) != -1) {
+			if (len > 0 && line[len - 1] == '\n') line[len - 1] = '\0';
+			if (batch_command(s, ++number, line) < 0) failed = 1;
+		}
+		free(line);
+		if (in != stdin) fclose(in);
+	}
+	else {
+		char *next = commands;
+		while (!s->quit && next != NULL) {
+			char *line = next;
+			next = strchr(next, ';');
+			if (next != NULL) *next++ = '\0';
+			if (batch_command(s, ++number, line) < 0) failed = 1;
+		}
+	}
+
+	// the final dump is reported like a command of its own
+	int res = fs_dump(s->live, s->image);
+	printf("%ld dump %d 0\n", number + 1, res);
+	fflush(stdout);
+	return failed || res != 0;
+}
+
 int
 main(int argc, const char *argv[])
 {
 	file_system *fs = NULL;
+	int options = 3; //first argument after the filesystem
 	if (argc < 2) {
 		fprintf(stderr,
 		        "No arguments given. You must either load a filesystem or create a new one.\n\n");
@@ -24,11 +372,15 @@ main(int argc, const char *argv[])
 			exit(1);
 		} else {
 			fs = fs_create(argv[2], (uint32_t)atol(argv[3]));
+			options = 4;
 		}
 	} else if (strcmp(argv[1], "-l") == 0 || strcmp(argv[1], "--load") == 0) {
 		fs = fs_load(argv[2]);
+	} else if (strcmp(argv[1], "-m") == 0 || strcmp(argv[1], "--mmap") == 0) {
+		fs = fs_load_mmap(argv[2]);
 	} else if (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0) {
 		printhelp();
+		exit(0);
 	}
 	else{
 		fprintf(stderr, "Unknown argument.\n");
@@ -36,6 +388,44 @@ main(int argc, const char *argv[])
 		exit(1);
 	}
 
+	// -b <script> or -e "<command>; <command>" run the commands without a prompt
+	const char *script = NULL;
+	char *commands = NULL;
+	const char *socket_path = NULL;
+	for (int i = options; i < argc; i++) {
+		if (i + 1 < argc && (strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--batch") == 0)) {
+			script = argv[++i];
+		} else if (i + 1 < argc && (strcmp(argv[i], "-e") == 0 || strcmp(argv[i], "--exec") == 0)) {
+			commands = strdup(argv[++i]);
+		} else if (i + 1 < argc && (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--serve") == 0)) {
+			socket_path = argv[++i];
+		} else {
+			fprintf(stderr, "Unknown argument.\n");
+			printhelp();
+			exit(1);
+		}
+	}
+	if (fs == NULL && (script || commands || socket_path)) exit(1);
+
+	// --serve <socket> shares the filesystem with the clients of client.h
+	if (socket_path != NULL) {
+		int status = serve(fs, argv[2], socket_path) != 0;
+		if (status) perror("Socket error");
+		else status = fs_dump(fs, argv[2]) != 0;
+		cleanup(fs);
+		free(commands);
+		exit(status);
+	}
+
+	session s = { fs, fs, argv[2], 0, 0 };
+	if (script != NULL || commands != NULL) {
+		int status = run_batch(&s, script, commands);
+		if(s.fs != s.live) cleanup(s.fs);
+		cleanup(s.live);
+		free(commands);
+		exit(status);
+	}
+
 	linenoiseHistorySetMaxLen(20);
 
 	while (1) {
@@ -45,73 +435,23 @@ main(int argc, const char *argv[])
 		} else {
 			continue;
 		}
-		char *command = strtok(input_buf, " \n");
-		
-		if(command == NULL){
-			LOG("Unknown command\nValid commands:\nlist\nmkfile\nmakedir\ncp\nrm\nexport\nimport\nwritef\nreadf\ndump\n");
-			free(input_buf);
-			continue;
-		}
 
-		//determine which command to execute (only our build in commands are possible)
-		int res = 0;
-		if (!strcmp(command, "mkdir")) {
-			res = fs_mkdir(fs, strtok(NULL, " \n"));
-		} else if (!strcmp(command, "mkfile")) {
-			res = fs_mkfile(fs, strtok(NULL, " \n"));
-		} else if (strcmp(command, "cp") == 0) {
-        	res = fs_cp(fs, strtok(NULL, " \n"),  strtok(NULL, " \n"));
-    	} else if (!strcmp(command, "list")) {
-			char *output = (char *)fs_list(fs, strtok(NULL, " \n"));
-			if(output){
-				fwrite(output, strlen(output), 1, stdout);
-				fflush(stdout);
-				free(output);
-			}
-			else{
-				res = -2;
-			}
-		} else if (!strcmp(command, "writef")) {
-			char *path = strtok(NULL, " \n");
-			char *text = strtok(NULL, "\0");
-			res = fs_writef(fs, path, text);
-		} else if (!strcmp(command, "readf")) {
-			int file_size = 0;
-			char *output  = (char *)fs_readf(fs, strtok(NULL, " \n"), &file_size);
-			if(output){
-				fwrite(output, file_size, 1, stdout);
-				fflush(stdout);
-				free(output);
-				LOG("\n")
-			}
-			else{
-				res = -2;
-			}
-		} else if (!strcmp(command, "rm")) {
-			res = fs_rm(fs, strtok(NULL, " \n"));
-		} else if (!strcmp(command, "export")) {
-			char *int_path = strtok(NULL, " \n");
-			char *ext_path = strtok(NULL, "\0");
-			res = fs_export(fs, int_path, ext_path);
-		} else if (!strcmp(command, "import")) {
-			char *int_path = strtok(NULL, " \n");
-			char *ext_path = strtok(NULL, "\0");
-			res = fs_import(fs, int_path, ext_path);
-		} else if (!strcmp(command, "dump")) {
-			res = fs_dump(fs, argv[2]);
-		} else if (!strcmp(command, "exit") || !strcmp(command, "quit")) {
-			cleanup(fs);
+		int res = run_command(&s, input_buf, stdout);
+		fflush(stdout);
+		if (s.quit) {
+			if(s.fs != s.live) cleanup(s.fs);
+			cleanup(s.live);
 			free(input_buf);
 			exit(0);
-		} else {
-			LOG("Unknown command\nValid commands:\nlist\nmkfile\nmakedir\ncp\nrm\nexport\nimport\nwritef\nreadf\ndump\n");
 		}
 
 		if(res < 0){
 			char output[20];
 			switch(res){
 				case -1:	sprintf(output, "not found!"); break;
-				case -2:	sprintf(output, "failed"); break; 
+				case -2:	sprintf(output, "failed"); break;
+				case CMD_USAGE:	output[0] = '\0'; break; //the usage is printed already
+				default:	sprintf(output, "error %d", res); break;
 			}
 			fwrite(output, strlen(output), 1, stdout);
 			fflush(stdout);
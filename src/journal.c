@@ -0,0 +1,434 @@
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../lib/bitmap.h"
+#include "../lib/journal.h"
+#include "../lib/lock.h"
+#include "../lib/trace.h"
+#include "../lib/utils.h"
+
+#define JOURNAL_MAGIC 0x4c4e524a //"JRNL"
+#define JOURNAL_COMMIT 0x544d4d43 //"CMMT"
+#define JOURNAL_IOV 512 //iovecs per writev
+#define JOURNAL_MIN_LIMIT (4 << 20) //checkpoint a journal longer than this and a quarter of the image
+
+enum journal_record_type{
+	JOURNAL_SUPER = 1,
+	JOURNAL_FREE = 2,
+	JOURNAL_INODE = 3,
+	JOURNAL_BLOCK = 4
+};
+
+typedef struct _journal_header{
+	uint32_t magic; //JOURNAL_MAGIC
+	uint32_t records;
+	uint64_t seq;
+	uint64_t length; //bytes of the records that follow
+} journal_header;
+
+// followed by count superblocks, free list bytes, inodes or data blocks
+typedef struct _journal_record{
+	uint32_t type;
+	uint32_t start; //first free list entry, inode or data block
+	uint32_t count;
+} journal_record;
+
+typedef struct _journal_trailer{
+	uint32_t magic; //JOURNAL_COMMIT
+	uint32_t pad;
+	uint64_t seq;
+	uint64_t checksum; //of the header and the records
+} journal_trailer;
+
+struct journal{
+	int fd;
+	char* image_path;
+	int group; //operations per commit
+	int pending; //operations since the last commit
+	int changed; //something was marked since the last commit
+	uint64_t seq; //of the next transaction
+	uint64_t length; //of the journal file
+	uint64_t limit; //checkpoint once the journal is longer
+	uint64_t* inodes; //changed since the last commit
+	uint64_t* blocks;
+	uint32_t free_lo; //free list entries [free_lo, free_hi) changed since the last commit
+	uint32_t free_hi;
+};
+
+static char* journal_path(const char* image_path){
+	size_t len = strlen(image_path);
+	char* path = malloc(len + sizeof(".journal"));
+	if(path == NULL) return NULL;
+	memcpy(path, image_path, len);
+	memcpy(path + len, ".journal", sizeof(".journal"));
+	return path;
+}
+
+static uint64_t checksum_update(uint64_t h, const void* data, size_t len){
+	const uint8_t* p = data;
+	for (; len >= 8; p += 8, len -= 8) {
+		uint64_t w;
+		memcpy(&w, p, sizeof(w));
+		h = (h ^ w) * 0x100000001b3u;
+		h ^= h >> 29;
+	}
+	for (; len > 0; p++, len--) {
+		h = (h ^ *p) * 0x100000001b3u;
+	}
+	return h;
+}
+
+static size_t record_size(uint32_t type){
+	switch(type){
+		case JOURNAL_SUPER: return sizeof(superblock);
+		case JOURNAL_FREE: return sizeof(uint8_t);
+		case JOURNAL_INODE: return sizeof(inode);
+		case JOURNAL_BLOCK: return sizeof(data_block);
+	}
+	return 0;
+}
+
+static uint8_t* record_base(file_system* fs, uint32_t type){
+	switch(type){
+		case JOURNAL_SUPER: return (uint8_t*)fs->s_block;
+		case JOURNAL_FREE: return fs->free_list;
+		case JOURNAL_INODE: return (uint8_t*)fs->inodes;
+		case JOURNAL_BLOCK: return (uint8_t*)fs->data_blocks;
+	}
+	return NULL;
+}
+
+static size_t count_runs(const uint64_t* map, uint32_t n){
+	size_t runs = 0;
+	size_t start = bitmap_next_set(map, n, 0);
+	while(start < n){
+		runs++;
+		start = bitmap_next_set(map, n, bitmap_next_clear(map, n, start));
+	}
+	return runs;
+}
+
+// add a record and its payload to the transaction
+static void add_record(file_system* fs, journal_record* rec, struct iovec* iov, uint32_t type, uint32_t start, uint32_t count){
+	rec->type = type;
+	rec->start = start;
+	rec->count = count;
+	iov[0].iov_base = rec;
+	iov[0].iov_len = sizeof(journal_record);
+	iov[1].iov_base = record_base(fs, type) + start * record_size(type);
+	iov[1].iov_len = count * record_size(type);
+}
+
+static size_t add_runs(file_system* fs, const uint64_t* map, uint32_t type, journal_record* rec, struct iovec* iov){
+	uint32_t n = fs->s_block->num_blocks;
+	size_t added = 0;
+	size_t start = bitmap_next_set(map, n, 0);
+	while(start < n){
+		size_t end = bitmap_next_clear(map, n, start);
+		add_record(fs, &rec[added], &iov[2 * added], type, start, end - start);
+		added++;
+		start = bitmap_next_set(map, n, end);
+	}
+	return added;
+}
+
+static void clear_marks(file_system* fs, struct journal* j){
+	uint32_t n = fs->s_block->num_blocks;
+	memset(j->inodes, 0, BITMAP_WORDS(n) * sizeof(uint64_t));
+	memset(j->blocks, 0, BITMAP_WORDS(n) * sizeof(uint64_t));
+	j->free_lo = n;
+	j->free_hi = 0;
+	j->changed = 0;
+}
+
+static int open_journal(file_system* fs, const char* image_path, int group){
+	if(fs->journal != NULL){
+		fs->journal->group = group > 0 ? group : 1;
+		return 0;
+	}
+	// the image is the base the transactions apply to
+	if(fs_dump(fs, image_path) != 0 || fsync(fs->image_fd) != 0) return -1;
+
+	uint32_t n = fs->s_block->num_blocks;
+	struct journal* j = malloc(sizeof(struct journal));
+	if(j == NULL) return -1;
+	j->image_path = strdup(image_path);
+	char* path = journal_path(image_path);
+	j->inodes = bitmap_alloc(n);
+	j->blocks = bitmap_alloc(n);
+	j->fd = path ? open(path, O_RDWR | O_CREAT | O_TRUNC, 0666) : -1;
+	free(path);
+	if(j->image_path == NULL || j->inodes == NULL || j->blocks == NULL || j->fd < 0){
+		if(j->fd >= 0) close(j->fd);
+		free(j->image_path);
+		free(j->inodes);
+		free(j->blocks);
+		free(j);
+		return -1;
+	}
+	j->group = group > 0 ? group : 1;
+	j->pending = 0;
+	j->seq = 1;
+	j->length = 0;
+	j->limit = sizeof(data_block) * (uint64_t)n / 4;
+	if(j->limit < JOURNAL_MIN_LIMIT) j->limit = JOURNAL_MIN_LIMIT;
+	clear_marks(fs, j);
+	fs->journal = j;
+	return 0;
+}
+
+int journal_open(file_system* fs, const char* image_path, int group){
+	// a mapped image takes every change at once, there is nothing to write ahead of
+	if(fs->map_base != NULL) return -1;
+	fs_lock_exclusive(fs);
+	int res = open_journal(fs, image_path, group);
+	fs_unlock(fs);
+	return res;
+}
+
+void journal_mark_inode(file_system* fs, int inode_id){
+	bitmap_set(fs->journal->inodes, inode_id);
+	fs->journal->changed = 1;
+}
+
+void journal_mark_block(file_system* fs, int block_id){
+	bitmap_set(fs->journal->blocks, block_id);
+	fs->journal->changed = 1;
+}
+
+void journal_mark_free(file_system* fs, int block_id){
+	struct journal* j = fs->journal;
+	if(block_id < j->free_lo) j->free_lo = block_id;
+	if(block_id + 1 > j->free_hi) j->free_hi = block_id + 1;
+	j->changed = 1;
+}
+
+void journal_op_end(file_system* fs){
+	struct journal* j = fs->journal;
+	if(j == NULL) return;
+	if(++j->pending >= j->group){
+		journal_commit(fs);
+	}
+}
+
+static int commit(file_system* fs){
+	TRACE_SCOPE("journal_commit");
+	struct journal* j = fs->journal;
+	if(j == NULL) return 0;
+	j->pending = 0;
+	if(!j->changed) return 0;
+
+	// the superblock, the free list range and a record per run of changed inodes and blocks
+	uint32_t n = fs->s_block->num_blocks;
+	size_t max_records = 2 + count_runs(j->inodes, n) + count_runs(j->blocks, n);
+	journal_record* rec = malloc(max_records * sizeof(journal_record));
+	struct iovec* iov = malloc((2 * max_records + 2) * sizeof(struct iovec));
+	if(rec == NULL || iov == NULL){
+		free(rec);
+		free(iov);
+		return -1;
+	}
+	journal_header header;
+	journal_trailer trailer;
+	iov[0].iov_base = &header;
+	iov[0].iov_len = sizeof(header);
+	struct iovec* body = iov + 1;
+
+	size_t records = 0;
+	add_record(fs, &rec[records], &body[2 * records], JOURNAL_SUPER, 0, 1);
+	records++;
+	if(j->free_lo < j->free_hi){
+		add_record(fs, &rec[records], &body[2 * records], JOURNAL_FREE, j->free_lo, j->free_hi - j->free_lo);
+		records++;
+	}
+	records += add_runs(fs, j->inodes, JOURNAL_INODE, &rec[records], &body[2 * records]);
+	records += add_runs(fs, j->blocks, JOURNAL_BLOCK, &rec[records], &body[2 * records]);
+
+	header.magic = JOURNAL_MAGIC;
+	header.records = records;
+	header.seq = j->seq;
+	header.length = 0;
+	for (size_t i = 0; i < 2 * records; i++) {
+		header.length += body[i].iov_len;
+	}
+	uint64_t sum = checksum_update(0, &header, sizeof(header));
+	for (size_t i = 0; i < 2 * records; i++) {
+		sum = checksum_update(sum, body[i].iov_base, body[i].iov_len);
+	}
+	trailer.magic = JOURNAL_COMMIT;
+	trailer.pad = 0;
+	trailer.seq = j->seq;
+	trailer.checksum = sum;
+	size_t iov_count = 2 * records + 2;
+	iov[iov_count - 1].iov_base = &trailer;
+	iov[iov_count - 1].iov_len = sizeof(trailer);
+
+	// one sync for the whole transaction, the checksum catches a torn write
+	int res = lseek(j->fd, j->length, SEEK_SET) < 0 ? -1 : 0;
+	for (size_t i = 0; res == 0 && i < iov_count; i += JOURNAL_IOV) {
+		res = writev_all(j->fd, iov + i, iov_count - i < JOURNAL_IOV ? iov_count - i : JOURNAL_IOV);
+	}
+	if(res == 0) res = fdatasync(j->fd);
+	free(rec);
+	free(iov);
+	if(res != 0){
+		// drop what was written, the marks stay for the next commit
+		if(ftruncate(j->fd, j->length) != 0) LOG("Could not cut the journal back\n");
+		return -1;
+	}
+
+	j->length += sizeof(header) + header.length + sizeof(trailer);
+	j->seq++;
+	clear_marks(fs, j);
+	if(j->length > j->limit){
+		return fs_dump(fs, j->image_path);
+	}
+	return 0;
+}
+
+int journal_commit(file_system* fs){
+	// a transaction holds no operation halfway through
+	fs_lock_exclusive(fs);
+	int res = commit(fs);
+	fs_unlock(fs);
+	return res;
+}
+
+int journal_reset(file_system* fs){
+	struct journal* j = fs->journal;
+	if(j == NULL) return 0;
+	if(fsync(fs->image_fd) != 0) return -1;
+	if(ftruncate(j->fd, 0) != 0 || fsync(j->fd) != 0) return -1;
+	j->length = 0;
+	return 0;
+}
+
+// apply the records of one transaction, marking them dirty for the next dump
+static int apply_records(file_system* fs, const uint8_t* p, const uint8_t* end, uint32_t records){
+	uint32_t n = fs->s_block->num_blocks;
+	for (uint32_t r = 0; r < records; r++) {
+		journal_record rec;
+		if((size_t)(end - p) < sizeof(rec)) return -1;
+		memcpy(&rec, p, sizeof(rec));
+		p += sizeof(rec);
+		size_t size = record_size(rec.type);
+		if(size == 0 || rec.count == 0) return -1;
+		if(rec.type == JOURNAL_SUPER ? rec.start != 0 || rec.count != 1 : rec.start >= n || rec.count > n - rec.start) return -1;
+		if((size_t)(end - p) < rec.count * size) return -1;
+
+		if(rec.type == JOURNAL_SUPER){
+			superblock s;
+			memcpy(&s, p, sizeof(s));
+			if(s.num_blocks != n) return -1;
+			fs->s_block->free_blocks = s.free_blocks;
+		}
+		else{
+			for (uint32_t i = rec.start; i < rec.start + rec.count; i++) {
+				if(rec.type == JOURNAL_FREE) fs_mark_free_dirty(fs, i);
+				if(rec.type == JOURNAL_INODE) fs_mark_inode_dirty(fs, i);
+				if(rec.type == JOURNAL_BLOCK) fs_mark_block_dirty(fs, i);
+			}
+			memcpy(record_base(fs, rec.type) + rec.start * size, p, rec.count * size);
+		}
+		p += rec.count * size;
+	}
+	return p == end ? 0 : -1;
+}
+
+int journal_replay(file_system* fs, const char* image_path){
+	TRACE_SCOPE("journal_replay");
+	char* path = journal_path(image_path);
+	int fd = path ? open(path, O_RDWR) : -1;
+	free(path);
+	if(fd < 0) return 0;
+	struct stat st;
+	if(fstat(fd, &st) != 0 || st.st_size == 0){
+		close(fd);
+		return 0;
+	}
+
+	int replayed = 0;
+	uint64_t offset = 0;
+	uint64_t seq = 0;
+	while(1){
+		journal_header header;
+		journal_trailer trailer;
+		if(pread(fd, &header, sizeof(header), offset) != sizeof(header)) break;
+		if(header.magic != JOURNAL_MAGIC || (seq != 0 && header.seq != seq + 1)) break;
+		if(header.length > (uint64_t)st.st_size - offset - sizeof(header)) break;
+		uint8_t* records = malloc(header.length ? header.length : 1);
+		if(records == NULL) break;
+		if(pread(fd, records, header.length, offset + sizeof(header)) != (ssize_t)header.length
+		   || pread(fd, &trailer, sizeof(trailer), offset + sizeof(header) + header.length) != sizeof(trailer)
+		   || trailer.magic != JOURNAL_COMMIT || trailer.seq != header.seq){
+			free(records);
+			break;
+		}
+
+		// the checksum covers the pieces the way they were written
+		uint64_t sum = checksum_update(0, &header, sizeof(header));
+		const uint8_t* p = records;
+		const uint8_t* end = records + header.length;
+		for (uint32_t r = 0; r < header.records && (size_t)(end - p) >= sizeof(journal_record); r++) {
+			journal_record rec;
+			memcpy(&rec, p, sizeof(rec));
+			sum = checksum_update(sum, p, sizeof(rec));
+			p += sizeof(rec);
+			size_t len = rec.count * record_size(rec.type);
+			if(len > (size_t)(end - p)) break;
+			sum = checksum_update(sum, p, len);
+			p += len;
+		}
+		if(sum != trailer.checksum || apply_records(fs, records, end, header.records) != 0){
+			free(records);
+			break;
+		}
+		free(records);
+		replayed++;
+		seq = header.seq;
+		offset += sizeof(header) + header.length + sizeof(trailer);
+	}
+
+	if(replayed > 0){
+		LOG("Replayed the journal\n");
+		if(fs_dump(fs, image_path) != 0 || fsync(fs->image_fd) != 0){
+			close(fd);
+			return -1;
+		}
+	}
+	if(ftruncate(fd, 0) == 0) fsync(fd);
+	close(fd);
+	return replayed;
+}
+
+static void journal_free(file_system* fs){
+	struct journal* j = fs->journal;
+	fs->journal = NULL;
+	close(j->fd);
+	free(j->image_path);
+	free(j->inodes);
+	free(j->blocks);
+	free(j);
+}
+
+int journal_close(file_system* fs){
+	fs_lock_exclusive(fs);
+	struct journal* j = fs->journal;
+	int res = 0;
+	if(j != NULL && fs_dump(fs, j->image_path) != 0) res = -1;
+	else if(j != NULL){
+		char* path = journal_path(j->image_path);
+		if(path) unlink(path);
+		free(path);
+		journal_free(fs);
+	}
+	fs_unlock(fs);
+	return res;
+}
+
+void journal_destroy(file_system* fs){
+	if(fs->journal == NULL) return;
+	journal_commit(fs);
+	journal_free(fs);
+}
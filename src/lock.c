@@ -0,0 +1,324 @@
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include "../lib/lock.h"
+#include "../lib/trace.h"
+
+// a thread that reads without locks
+struct reader{
+	pthread_t thread;
+	struct reader* next; //readers are only ever added
+	uint64_t epoch; //epoch the thread entered its read in, 0 while it is not reading
+	int depth; //nested read_enter calls
+};
+
+// a release put off until the readers that may still see the id have left
+struct deferred{
+	uint64_t epoch;
+	void (*release)(file_system* fs, int id);
+	int id;
+};
+
+struct fs_locks{
+	pthread_rwlock_t fs;
+	pthread_t owner; //thread holding fs exclusive, 0 if none
+	int depth; //times the owner took fs
+	uint32_t fs_seq; //odd while a thread holds fs exclusive
+	pthread_mutex_t alloc;
+	pthread_rwlock_t inodes[INODE_LOCK_STRIPES];
+	uint32_t seqs[INODE_LOCK_STRIPES]; //odd while the inode lock is held exclusive
+	uint64_t epoch;
+	struct reader* readers;
+	struct deferred* deferred; //oldest first, from index head on
+	size_t head;
+	size_t count;
+	size_t cap;
+};
+
+void fs_locks_init(file_system* fs){
+	struct fs_locks* locks = malloc(sizeof(struct fs_locks));
+	if(locks == NULL){
+		perror("Malloc error");
+		exit(errno);
+	}
+	pthread_rwlock_init(&locks->fs, NULL);
+	locks->owner = 0;
+	locks->depth = 0;
+	locks->fs_seq = 0;
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&locks->alloc, &attr);
+	pthread_mutexattr_destroy(&attr);
+	for (int i = 0; i < INODE_LOCK_STRIPES; i++) {
+		pthread_rwlock_init(&locks->inodes[i], NULL);
+		locks->seqs[i] = 0;
+	}
+	locks->epoch = 1;
+	locks->readers = NULL;
+	locks->deferred = NULL;
+	locks->head = 0;
+	locks->count = 0;
+	locks->cap = 0;
+	fs->locks = locks;
+}
+
+void fs_locks_destroy(file_system* fs){
+	struct fs_locks* locks = fs->locks;
+	if(locks == NULL) return;
+	pthread_rwlock_destroy(&locks->fs);
+	pthread_mutex_destroy(&locks->alloc);
+	for (int i = 0; i < INODE_LOCK_STRIPES; i++) {
+		pthread_rwlock_destroy(&locks->inodes[i]);
+	}
+	// the allocator maps the deferred releases go to are gone already
+	free(locks->deferred);
+	while(locks->readers != NULL){
+		struct reader* next = locks->readers->next;
+		free(locks->readers);
+		locks->readers = next;
+	}
+	free(locks);
+	fs->locks = NULL;
+}
+
+// a writer makes the sequence odd before it changes anything and even again after
+static void seq_begin(uint32_t* seq){
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static void seq_end(uint32_t* seq){
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+int fs_lock_owned(file_system* fs){
+	// only the owner itself can find its own id here
+	return pthread_equal(__atomic_load_n(&fs->locks->owner, __ATOMIC_RELAXED), pthread_self());
+}
+
+void fs_lock_shared(file_system* fs){
+	if(fs_lock_owned(fs)){
+		fs->locks->depth++;
+		return;
+	}
+	pthread_rwlock_rdlock(&fs->locks->fs);
+}
+
+void fs_lock_exclusive(file_system* fs){
+	struct fs_locks* locks = fs->locks;
+	if(fs_lock_owned(fs)){
+		locks->depth++;
+		return;
+	}
+	// waiting for the operations that are running, the usual cause of a slow tree copy or dump
+	TRACE_BEGIN(waiting, "fs_lock_exclusive");
+	pthread_rwlock_wrlock(&locks->fs);
+	TRACE_END(waiting);
+	__atomic_store_n(&locks->owner, pthread_self(), __ATOMIC_RELAXED);
+	locks->depth = 1;
+	seq_begin(&locks->fs_seq);
+}
+
+void fs_unlock(file_system* fs){
+	struct fs_locks* locks = fs->locks;
+	if(fs_lock_owned(fs)){
+		if(--locks->depth > 0) return;
+		seq_end(&locks->fs_seq);
+		__atomic_store_n(&locks->owner, (pthread_t)0, __ATOMIC_RELAXED);
+	}
+	pthread_rwlock_unlock(&locks->fs);
+}
+
+void inode_lock_shared(file_system* fs, int inode_id){
+	if(fs_lock_owned(fs)) return;
+	pthread_rwlock_rdlock(&fs->locks->inodes[inode_id % INODE_LOCK_STRIPES]);
+}
+
+void inode_unlock_shared(file_system* fs, int inode_id){
+	if(fs_lock_owned(fs)) return;
+	pthread_rwlock_unlock(&fs->locks->inodes[inode_id % INODE_LOCK_STRIPES]);
+}
+
+void inode_locks_init(inode_locks* set){
+	set->count = 0;
+	set->skipped = 0;
+}
+
+void inode_locks_add(inode_locks* set, int inode_id, int exclusive){
+	uint32_t stripe = inode_id % INODE_LOCK_STRIPES;
+	// inodes sharing a lock are locked once, rwlocks can't be taken twice
+	for (int i = 0; i < set->count; i++) {
+		if(set->stripes[i] == stripe){
+			set->exclusive[i] |= exclusive;
+			return;
+		}
+	}
+	// keep the set sorted, that is the order the locks are taken in
+	int i = set->count++;
+	while(i > 0 && set->stripes[i - 1] > stripe){
+		set->stripes[i] = set->stripes[i - 1];
+		set->exclusive[i] = set->exclusive[i - 1];
+		i--;
+	}
+	set->stripes[i] = stripe;
+	set->exclusive[i] = exclusive;
+}
+
+void inode_locks_acquire(file_system* fs, inode_locks* set){
+	set->skipped = fs_lock_owned(fs);
+	if(set->skipped) return;
+	for (int i = 0; i < set->count; i++) {
+		pthread_rwlock_t* lock = &fs->locks->inodes[set->stripes[i]];
+		if(set->exclusive[i]){
+			pthread_rwlock_wrlock(lock);
+			seq_begin(&fs->locks->seqs[set->stripes[i]]);
+		}
+		else{
+			pthread_rwlock_rdlock(lock);
+		}
+	}
+}
+
+void inode_locks_release(file_system* fs, inode_locks* set){
+	if(set->skipped) return;
+	for (int i = set->count - 1; i >= 0; i--) {
+		if(set->exclusive[i]) seq_end(&fs->locks->seqs[set->stripes[i]]);
+		pthread_rwlock_unlock(&fs->locks->inodes[set->stripes[i]]);
+	}
+}
+
+void alloc_lock(file_system* fs){
+	pthread_mutex_lock(&fs->locks->alloc);
+}
+
+void alloc_unlock(file_system* fs){
+	pthread_mutex_unlock(&fs->locks->alloc);
+}
+
+/*
+ * The reader of the calling thread
+ */
+static struct reader* reader_get(file_system* fs){
+	struct fs_locks* locks = fs->locks;
+	pthread_t self = pthread_self();
+	struct reader* r = __atomic_load_n(&locks->readers, __ATOMIC_ACQUIRE);
+	while(r != NULL && !pthread_equal(r->thread, self)){
+		r = r->next;
+	}
+	if(r == NULL){
+		r = malloc(sizeof(struct reader));
+		if(r == NULL){
+			perror("Malloc error");
+			exit(errno);
+		}
+		r->thread = self;
+		r->epoch = 0;
+		r->depth = 0;
+		alloc_lock(fs);
+		r->next = locks->readers;
+		__atomic_store_n(&locks->readers, r, __ATOMIC_RELEASE);
+		alloc_unlock(fs);
+	}
+	return r;
+}
+
+int read_enter(file_system* fs, read_guard* guard){
+	struct fs_locks* locks = fs->locks;
+	struct reader* r = reader_get(fs);
+	guard->reader = r;
+	if(r->depth++ == 0){
+		__atomic_store_n(&r->epoch, __atomic_load_n(&locks->epoch, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+		// the epoch is visible before anything is read, see epoch_reclaim
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+	guard->fs_seq = __atomic_load_n(&locks->fs_seq, __ATOMIC_ACQUIRE);
+	return !(guard->fs_seq & 1);
+}
+
+int read_leave(file_system* fs, read_guard* guard){
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	int unchanged = __atomic_load_n(&fs->locks->fs_seq, __ATOMIC_RELAXED) == guard->fs_seq;
+	struct reader* r = guard->reader;
+	if(--r->depth == 0){
+		__atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+	}
+	return unchanged && !(guard->fs_seq & 1);
+}
+
+uint32_t inode_seq(file_system* fs, int inode_id){
+	return __atomic_load_n(&fs->locks->seqs[inode_id % INODE_LOCK_STRIPES], __ATOMIC_ACQUIRE);
+}
+
+int inode_seq_check(file_system* fs, int inode_id, uint32_t seq){
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return !(seq & 1) && __atomic_load_n(&fs->locks->seqs[inode_id % INODE_LOCK_STRIPES], __ATOMIC_RELAXED) == seq;
+}
+
+/*
+ * The oldest epoch a reader is in, UINT64_MAX if none reads
+ */
+static uint64_t oldest_reader(struct fs_locks* locks){
+	// pairs with the fence in read_enter: a reader this misses has not read anything yet
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	uint64_t oldest = UINT64_MAX;
+	for (struct reader* r = __atomic_load_n(&locks->readers, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+		uint64_t epoch = __atomic_load_n(&r->epoch, __ATOMIC_ACQUIRE);
+		if(epoch != 0 && epoch < oldest) oldest = epoch;
+	}
+	return oldest;
+}
+
+void epoch_defer(file_system* fs, void (*release)(file_system* fs, int id), int id){
+	struct fs_locks* locks = fs->locks;
+	alloc_lock(fs);
+	if(locks->count == locks->cap){
+		size_t cap = locks->cap ? 2 * locks->cap : 64;
+		struct deferred* deferred = realloc(locks->deferred, cap * sizeof(struct deferred));
+		if(deferred == NULL){
+			perror("Malloc error");
+			exit(errno);
+		}
+		locks->deferred = deferred;
+		locks->cap = cap;
+	}
+	// readers that enter from here on get a later epoch and can't find id anymore
+	struct deferred* d = &locks->deferred[locks->count++];
+	d->epoch = locks->epoch;
+	d->release = release;
+	d->id = id;
+	__atomic_store_n(&locks->epoch, locks->epoch + 1, __ATOMIC_RELEASE);
+	epoch_reclaim(fs);
+	alloc_unlock(fs);
+}
+
+void epoch_reclaim(file_system* fs){
+	struct fs_locks* locks = fs->locks;
+	alloc_lock(fs);
+	if(locks->head < locks->count){
+		uint64_t oldest = oldest_reader(locks);
+		while(locks->head < locks->count && locks->deferred[locks->head].epoch < oldest){
+			struct deferred* d = &locks->deferred[locks->head++];
+			d->release(fs, d->id);
+		}
+		if(locks->head == locks->count){
+			locks->head = 0;
+			locks->count = 0;
+		}
+	}
+	alloc_unlock(fs);
+}
+
+void epoch_synchronize(file_system* fs){
+	struct fs_locks* locks = fs->locks;
+	alloc_lock(fs);
+	uint64_t epoch = locks->epoch;
+	__atomic_store_n(&locks->epoch, epoch + 1, __ATOMIC_RELEASE);
+	alloc_unlock(fs);
+	// readers never wait for a lock, they are gone soon
+	while(oldest_reader(locks) <= epoch){
+		sched_yield();
+	}
+	epoch_reclaim(fs);
+}
@@ -0,0 +1,165 @@
+#include <string.h>
+#include "../lib/lz.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_LAST_LITERALS 5 //a match ends at least this many bytes before the end
+#define LZ_MATCH_LIMIT 12 //no match starts in the last bytes
+#define LZ_SKIP_SHIFT 6 //after 2^LZ_SKIP_SHIFT misses the search moves on faster
+
+static uint32_t read32(const uint8_t* p){
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint64_t read64(const uint8_t* p){
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t hash4(uint32_t v){
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// room for a sequence with lit literals and a match length of mlen - LZ_MIN_MATCH
+static size_t sequence_bound(size_t lit, size_t mlen){
+	return 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1;
+}
+
+static uint8_t* put_length(uint8_t* op, size_t len){
+	while(len >= 255){
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = (uint8_t)len;
+	return op;
+}
+
+static int get_length(const uint8_t** ip, const uint8_t* end, size_t* len){
+	uint8_t b;
+	do{
+		if(*ip >= end) return -1;
+		b = *(*ip)++;
+		*len += b;
+	}while(b == 255);
+	return 0;
+}
+
+int lz_compress(const uint8_t* src, int len, uint8_t* dst, int cap){
+	if(len < 0 || len > LZ_MAX_INPUT || cap < 0) return 0;
+
+	uint16_t table[1 << LZ_HASH_BITS]; //positions, an unused entry points at 0 and fails the compare
+	memset(table, 0, sizeof(table));
+	const uint8_t* ip = src;
+	const uint8_t* anchor = src;
+	const uint8_t* end = src + len;
+	uint8_t* op = dst;
+	uint8_t* op_end = dst + cap;
+
+	if(len > LZ_MATCH_LIMIT){
+		const uint8_t* match_limit = end - LZ_MATCH_LIMIT;
+		const uint8_t* match_end = end - LZ_LAST_LITERALS;
+		ip++;
+		while(ip < match_limit){
+			uint32_t seq = read32(ip);
+			uint32_t h = hash4(seq);
+			const uint8_t* ref = src + table[h];
+			table[h] = (uint16_t)(ip - src);
+			if(ref >= ip || read32(ref) != seq){
+				ip += 1 + ((ip - anchor) >> LZ_SKIP_SHIFT);
+				continue;
+			}
+
+			// extend the match backwards over the pending literals, then forwards
+			while(ip > anchor && ref > src && ip[-1] == ref[-1]){
+				ip--;
+				ref--;
+			}
+			const uint8_t* m = ip + LZ_MIN_MATCH;
+			const uint8_t* r = ref + LZ_MIN_MATCH;
+			while(m + 8 <= match_end && read64(m) == read64(r)){
+				m += 8;
+				r += 8;
+			}
+			while(m < match_end && *m == *r){
+				m++;
+				r++;
+			}
+
+			size_t lit = ip - anchor;
+			size_t mlen = m - ip - LZ_MIN_MATCH;
+			if(sequence_bound(lit, mlen) > (size_t)(op_end - op)) return 0;
+			uint8_t* token = op++;
+			*token = (uint8_t)((lit >= 15 ? 15 : lit) << 4);
+			if(lit >= 15) op = put_length(op, lit - 15);
+			memcpy(op, anchor, lit);
+			op += lit;
+			uint16_t offset = (uint16_t)(ip - ref);
+			*op++ = offset & 0xff;
+			*op++ = offset >> 8;
+			*token |= mlen >= 15 ? 15 : mlen;
+			if(mlen >= 15) op = put_length(op, mlen - 15);
+
+			// index a position near the end of the match, repeats often continue there
+			table[hash4(read32(m - 2))] = (uint16_t)(m - 2 - src);
+			ip = anchor = m;
+		}
+	}
+
+	size_t lit = end - anchor;
+	if(1 + lit / 255 + 1 + lit > (size_t)(op_end - op)) return 0;
+	*op++ = (uint8_t)((lit >= 15 ? 15 : lit) << 4);
+	if(lit >= 15) op = put_length(op, lit - 15);
+	memcpy(op, anchor, lit);
+	op += lit;
+	return op - dst;
+}
+
+int lz_decompress(const uint8_t* src, int len, uint8_t* dst, int cap){
+	if(len < 0 || cap < 0) return -1;
+	const uint8_t* ip = src;
+	const uint8_t* end = src + len;
+	uint8_t* op = dst;
+	uint8_t* op_end = dst + cap;
+
+	while(ip < end){
+		uint8_t token = *ip++;
+		size_t lit = token >> 4;
+		if(lit == 15 && get_length(&ip, end, &lit) != 0) return -1;
+		if(lit > (size_t)(end - ip) || lit > (size_t)(op_end - op)) return -1;
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+		if(ip == end) break; //the last sequence has no match
+
+		if(end - ip < 2) return -1;
+		size_t offset = ip[0] | (size_t)ip[1] << 8;
+		ip += 2;
+		if(offset == 0 || offset > (size_t)(op - dst)) return -1;
+		size_t mlen = token & 15;
+		if(mlen == 15 && get_length(&ip, end, &mlen) != 0) return -1;
+		mlen += LZ_MIN_MATCH;
+		if(mlen > (size_t)(op_end - op)) return -1;
+
+		const uint8_t* ref = op - offset;
+		if(offset >= 8 && mlen + 8 <= (size_t)(op_end - op)){
+			// whole words, each one was written before it is read
+			for (size_t i = 0; i < mlen; i += 8) {
+				memcpy(op + i, ref + i, 8);
+			}
+		}
+		else if(offset >= mlen){
+			memcpy(op, ref, mlen);
+		}
+		else{
+			// the match overlaps the bytes it produces
+			for (size_t i = 0; i < mlen; i++) {
+				op[i] = ref[i];
+			}
+		}
+		op += mlen;
+	}
+	return op - dst;
+}
@@ -1,63 +1,342 @@
 #include "../lib/operations.h"
+#include "../lib/bmap.h"
+#include "../lib/dcache.h"
+#include "../lib/dedup.h"
+#include "../lib/dir.h"
+#include "../lib/journal.h"
+#include "../lib/lock.h"
+#include "../lib/pool.h"
+#include "../lib/stats.h"
+#include "../lib/trace.h"
+#include "../lib/tree.h"
+#include "../lib/utils.h"
+#include "../lib/zfile.h"
+#include <fcntl.h>
+#include <limits.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define PATH_MAX_LENGTH 1024
+#define BLOCK_BATCH 64 //data blocks allocated at once when writing a file
+#define EXPORT_IOV 1024 //data blocks written with one writev, IOV_MAX on Linux
+#define CP_PARALLEL 256 //inodes of a tree copy before it is shared out to threads
+#define CP_FILE_TASK 64 //data blocks of a file whose copy is a task of its own
+#define READ_TRIES 4 //reads without locks before a reader takes the locks, see lock.h
+#define READ_RETRY 1 //a read without locks saw a writer and has to start over
+#define READ_LOCKED 2 //a read that is only done under the locks
 
 // If a function fails, it returns a negative error code, as follows:
 typedef enum {
     ERR_NOT_FOUND  = -1,
     ERR_IO         = ERR_NOT_FOUND,
 	ERR_EXIST	  = -2,
-    ERR_MEM_OVER   = ERR_EXIST
+    ERR_MEM_OVER   = ERR_EXIST,
+    ERR_READ_ONLY  = ERR_EXIST   // fs is a mounted snapshot
 } err_status_t;
 
-/*  Get child inode from path */
-int inode_from_path(file_system *fs, char *path, int *inode_id)
-{   
-	if(!path || !inode_id) return ERR_IO;
+/*  Find the child called name in directory dir_id, -1 if there is none */
+int dir_lookup(file_system *fs, int dir_id, const char *name)
+{
+	int child_id;
+	if(dcache_lookup(fs, dir_id, name, &child_id)) return child_id;
+
+	child_id = dir_find(fs, dir_id, name);
+	dcache_insert(fs, dir_id, name, child_id);
+	return child_id;
+}
+
+/*  dir_lookup for a reader without locks, which only caches children it found */
+static int dir_peek(file_system *fs, int dir_id, const char *name)
+{
+	int child_id;
+	if(dcache_lookup(fs, dir_id, name, &child_id)) return child_id;
+
+	child_id = dir_find(fs, dir_id, name);
+	if(child_id >= 0) dcache_insert(fs, dir_id, name, child_id);
+	return child_id;
+}
+
+/*  In dedup mode, replace the freshly written block block_id, which no file maps yet,
+ *  by an identical stored block if there is one. block_id is freed then.
+ *  Returns the block to map, the caller owns a reference to it */
+static int dedup_new_block(file_system *fs, int block_id)
+{
+	if (!fs->dedup) return block_id;
+	int stored = dedup_block(fs, block_id);
+	if (stored != block_id) block_free(fs, block_id);
+	return stored;
+}
+
+/*  Append len bytes to file inode_id: fill up its last block, then write
+ *  new blocks allocated BLOCK_BATCH at a time, continuing the file's last run of blocks.
+ *  Returns the number of bytes written, less than len if the filesystem runs full */
+static size_t file_append(file_system *fs, int inode_id, const uint8_t *data, size_t len)
+{
+	inode *node = &fs->inodes[inode_id];
+	uint64_t block_index = (node->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	size_t bytes_written = 0;
+
+	// clean data blocks behind the end of the file
+	bmap_truncate(fs, inode_id, block_index);
+
+	// Try appending into the last partially filled block, if it exists
+	int last_block_id = block_index > 0 ? bmap_get(fs, inode_id, block_index - 1) : -1;
+	if (last_block_id != -1 && len > 0 && fs->data_blocks[last_block_id].size < BLOCK_SIZE) {
+		// a block shared with a copy of the file is copied before it is changed
+		last_block_id = bmap_unshare(fs, inode_id, block_index - 1);
+		if (last_block_id == -1) return 0;
+	}
+	if (last_block_id != -1) {
+		data_block *blk = &fs->data_blocks[last_block_id];
+		size_t space_left = BLOCK_SIZE - blk->size;
+		if (space_left > 0) {
+			size_t to_write = MIN(len, space_left);
+			fs_mark_block_dirty(fs, last_block_id);
+			fs_mark_inode_dirty(fs, inode_id);
+			memcpy(blk->block + blk->size, data, to_write);
+			blk->size += to_write;
+			bytes_written += to_write;
+			node->size += to_write;
+		}
+	}
 
-	// Pointer protect
-	char path_copy[PATH_MAX_LENGTH];
-	strncpy(path_copy, path, sizeof(path_copy));
-	path_copy[sizeof(path_copy) - 1] = '\0';
+	int goal = last_block_id != -1 ? last_block_id + 1 : -1;
+	if (fs->dedup && last_block_id != -1 && bytes_written > 0 && fs->data_blocks[last_block_id].size == BLOCK_SIZE) {
+		// the last block just filled up, it may already be stored
+		int stored = dedup_block(fs, last_block_id);
+		if (stored != last_block_id) {
+			bmap_set(fs, inode_id, block_index - 1, stored);
+			block_free(fs, last_block_id);
+		}
+	}
+	while (bytes_written < len) {
+		size_t blocks_needed = (len - bytes_written + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		int batch = MIN(blocks_needed, BLOCK_BATCH);
+		int new_blocks[BLOCK_BATCH];
+		int allocated = block_alloc_run(fs, batch, goal, new_blocks);
+		if (allocated > 0) goal = new_blocks[allocated - 1] + 1;
+
+		for (int b = 0; b < allocated; b++) {
+			// split unit size BLOCK_SIZE(1024 bytes)
+			size_t chunk_size = MIN(len - bytes_written, BLOCK_SIZE);
+			memcpy(fs->data_blocks[new_blocks[b]].block, data + bytes_written, chunk_size);
+			fs->data_blocks[new_blocks[b]].size = chunk_size;
+			int block_id = dedup_new_block(fs, new_blocks[b]);
+
+			if (bmap_set(fs, inode_id, block_index, block_id) != 0) {
+				// no block left for an indirect block, or the file is as large as it gets
+				block_free(fs, block_id);
+				for (b++; b < allocated; b++) block_free(fs, new_blocks[b]);
+				return bytes_written;
+			}
+			block_index++;
 
+			if (block_id == new_blocks[b]) fs_mark_block_dirty(fs, block_id);
+			fs_mark_inode_dirty(fs, inode_id);
+			bytes_written += chunk_size;
+			node->size += chunk_size;
+		}
+
+		// Not enough blocks available
+		if (allocated < batch) break;
+	}
+	return bytes_written;
+}
+
+/*  Cut file inode_id down to its first size bytes */
+static int file_truncate(file_system *fs, int inode_id, uint64_t size)
+{
+	// the block that keeps part of its bytes may be shared
+	if (size % BLOCK_SIZE) {
+		int block_id = bmap_unshare(fs, inode_id, size / BLOCK_SIZE);
+		if (block_id == -1) return ERR_MEM_OVER;
+		fs_mark_block_dirty(fs, block_id);
+		fs->data_blocks[block_id].size = size % BLOCK_SIZE;
+	}
+	bmap_truncate(fs, inode_id, (size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+	fs_mark_inode_dirty(fs, inode_id);
+	fs->inodes[inode_id].size = size;
+	return 0;
+}
+
+/*  Append len bytes to the compressed file inode_id, see zfile.h. A last frame
+ *  that is not full is decoded and written again together with the new bytes.
+ *  Returns len, or 0 if the filesystem runs full, the file keeps its content then */
+static size_t compressed_append(file_system *fs, int inode_id, const uint8_t *data, size_t len)
+{
+	if (len == 0) return 0;
+	uint8_t *raw = malloc(3 * ZFILE_FRAME + ZFILE_HEADER);
+	if (!raw) return 0;
+	uint8_t *old = raw + ZFILE_FRAME;
+	uint8_t *frame = old + ZFILE_FRAME;
+
+	uint64_t pos;
+	int tail = zfile_tail(fs, inode_id, &pos, raw);
+	if (tail < 0) {
+		free(raw);
+		return 0;
+	}
+	memcpy(old, raw, tail);
+	zfile_forget(fs, inode_id, pos);
+	if (tail > 0 && file_truncate(fs, inode_id, pos) != 0) {
+		free(raw);
+		return 0;
+	}
+
+	size_t fill = tail;
+	size_t done = 0;
+	while (done < len) {
+		size_t n = MIN(ZFILE_FRAME - fill, len - done);
+		memcpy(raw + fill, data + done, n);
+		fill += n;
+		done += n;
+
+		size_t frame_len = zfile_encode(raw, fill, frame);
+		if (file_append(fs, inode_id, frame, frame_len) < frame_len) {
+			// drop the new frames and put the old last frame back
+			zfile_forget(fs, inode_id, pos);
+			file_truncate(fs, inode_id, pos);
+			if (tail > 0) {
+				frame_len = zfile_encode(old, tail, frame);
+				file_append(fs, inode_id, frame, frame_len);
+			}
+			free(raw);
+			return 0;
+		}
+		fill = 0;
+	}
+	free(raw);
+	return len;
+}
+
+/*  Append len bytes to file inode_id, compressed if the file is */
+static size_t content_append(file_system *fs, int inode_id, const uint8_t *data, size_t len)
+{
+	if (fs->inodes[inode_id].flags & INODE_COMPRESSED) return compressed_append(fs, inode_id, data, len);
+	return file_append(fs, inode_id, data, len);
+}
+
+/*  1 if inode_id is still the entry called name in directory parent_id,
+ *  parent_id -1 stands for the root. The caller holds inode_id locked */
+static int inode_is_entry(file_system *fs, int inode_id, int parent_id, const char *name)
+{
+	inode *node = &fs->inodes[inode_id];
+	if (parent_id < 0) return 1;
+	return node->n_type != free_block && node->parent == parent_id
+	       && strncmp(node->name, name, NAME_MAX_LENGTH) == 0;
+}
+
+/*  Resolve path to *inode_id and the directory holding it to *parent_id (-1 for the root),
+ *  the last component of the path goes to name.
+ *  If locked is set each directory is locked shared while it is searched, one at a time.
+ *  Else nothing is locked and READ_RETRY is returned if a writer changed a directory
+ *  meanwhile, the caller is inside read_enter then */
+static int walk(file_system *fs, const char *path, int locked, int *parent_id, int *inode_id, char *name)
+{
 	// Root is '/'
-	char* token = strtok(path_copy, "/");
 	int token_id = 0;
-	 
-	while(token != NULL){
-		if(fs->inodes[token_id].n_type != directory){
-			//If middle of path meets file, path is invalid
-			return ERR_NOT_FOUND;
+	int parent = -1;
+	const char *p = path;
+	char token[NAME_MAX_LENGTH];
+	name[0] = '\0';
+
+	while(1){
+		// split the next component off the path without modifying it
+		while(*p == '/') p++;
+		if(*p == '\0') break;
+		size_t len = strcspn(p, "/");
+		if(len >= NAME_MAX_LENGTH) return ERR_NOT_FOUND; //longer than any stored name
+		memcpy(token, p, len);
+		token[len] = '\0';
+		p += len;
+
+		uint32_t seq = 0;
+		if(locked) inode_lock_shared(fs, token_id);
+		else if((seq = inode_seq(fs, token_id)) & 1) return READ_RETRY;
+		int child_id = ERR_NOT_FOUND;
+		//An entry removed since it was found in its directory starts the walk over
+		int moved = !inode_is_entry(fs, token_id, parent, name);
+		//If middle of path meets file, path is invalid
+		if(!moved && fs->inodes[token_id].n_type == directory){
+			child_id = locked ? dir_lookup(fs, token_id, token) : dir_peek(fs, token_id, token);
 		}
-		
-		//If inode is directory, direct_blocks means sub inode list
-		int notFound = 1;
-		for(int i = 0 ; i < DIRECT_BLOCKS_COUNT ; i ++ ){
-			int sub_inode_id = fs->inodes[token_id].direct_blocks[i];
-			if(sub_inode_id != -1){
-				char* sub_dir = fs->inodes[sub_inode_id].name;
-				//check directory name is matched
-				if(strcmp(sub_dir, token) == 0){
-					token_id = sub_inode_id;
-					notFound = 0;
-					break;
-				}
-			}
+		if(locked) inode_unlock_shared(fs, token_id);
+		else if(!inode_seq_check(fs, token_id, seq)) return READ_RETRY;
+		if(moved){
+			token_id = 0;
+			parent = -1;
+			p = path;
+			name[0] = '\0';
+			continue;
 		}
-		if(notFound) return ERR_NOT_FOUND;  
+		if(child_id < 0) return ERR_NOT_FOUND;
 
-		token = strtok(NULL, "/");
+		parent = token_id;
+		token_id = child_id;
+		memcpy(name, token, len + 1);
+		stats_count(STATS_PATH_COMPONENTS, 1);
 	}
 
+	*parent_id = parent;
 	*inode_id = token_id;
 	return 0;
 }
 
+/*  walk without locks, with the locks if a writer keeps getting in the way.
+ *  The caller holds the filesystem lock, or no lock at all */
+static int path_walk(file_system *fs, const char *path, int *parent_id, int *inode_id, char *name)
+{
+	// alone with the filesystem, there is nothing to check
+	if (fs_lock_owned(fs)) return walk(fs, path, 1, parent_id, inode_id, name);
+
+	for (int tries = 0; tries < READ_TRIES; tries++) {
+		read_guard guard;
+		int res = read_enter(fs, &guard) ? walk(fs, path, 0, parent_id, inode_id, name) : READ_RETRY;
+		if (!read_leave(fs, &guard)) res = READ_RETRY;
+		if (res != READ_RETRY) return res;
+	}
+	fs_lock_shared(fs);
+	int res = walk(fs, path, 1, parent_id, inode_id, name);
+	fs_unlock(fs);
+	return res;
+}
+
+/*  Get child inode from path */
+int inode_from_path(file_system *fs, char *path, int *inode_id)
+{   
+	if(!path || !inode_id) return ERR_IO;
+
+	int parent_id;
+	char name[NAME_MAX_LENGTH];
+	return path_walk(fs, path, &parent_id, inode_id, name);
+}
+
+/*  Resolve path and lock the inode it names, exclusive if exclusive is set, else shared.
+ *  The directory holding it is locked exclusive as well if lock_parent is set,
+ *  and extra_id exclusive unless it is -1. An entry removed between the lookup and
+ *  the lock, whose inode may hold something else by then, is looked up again.
+ *  Returns 0 with the locks in held, or ERR_NOT_FOUND */
+static int lock_path(file_system *fs, const char *path, int exclusive, int lock_parent, int extra_id,
+                     int *parent_id, int *inode_id, inode_locks *held)
+{
+	char name[NAME_MAX_LENGTH];
+	while(1){
+		if(path_walk(fs, path, parent_id, inode_id, name) != 0) return ERR_NOT_FOUND;
+		inode_locks_init(held);
+		inode_locks_add(held, *inode_id, exclusive);
+		if(lock_parent && *parent_id >= 0) inode_locks_add(held, *parent_id, 1);
+		if(extra_id >= 0) inode_locks_add(held, extra_id, 1);
+		inode_locks_acquire(fs, held);
+		if(inode_is_entry(fs, *inode_id, *parent_id, name)) return 0;
+		inode_locks_release(fs, held);
+	}
+}
+
 //Convert path_and_name to inode_parent_dir,name
 int inode_from_splitpath(file_system *fs, const char* full_path, int *parent_dir_id, char* file_out) 
 {
@@ -84,6 +363,7 @@ int inode_from_splitpath(file_system *fs, const char* full_path, int *parent_dir
 			strcpy(parent_path, "/"); //this is used when last slash is root
 		else
 			strcpy(parent_path, path_copy);
+		if (strlen(last_slash + 1) >= NAME_MAX_LENGTH) return ERR_IO;
 		strcpy(file_out, last_slash + 1); // 		file name
     } else {
         // no slash found — only a file name
@@ -91,62 +371,107 @@ int inode_from_splitpath(file_system *fs, const char* full_path, int *parent_dir
         strcpy(file_out, path_copy);
     }
 
-	//Get parent inode
-	if(inode_from_path(fs, parent_path, parent_dir_id) != 0) return ERR_NOT_FOUND;
-	if(fs->inodes[*parent_dir_id].n_type != directory)	return ERR_NOT_FOUND; 
+	//Get parent inode, a directory stays one while the filesystem lock is held shared
+	int grandparent_id;
+	char parent_name[NAME_MAX_LENGTH];
+	if(path_walk(fs, parent_path, &grandparent_id, parent_dir_id, parent_name) != 0) return ERR_NOT_FOUND;
+	inode_lock_shared(fs, *parent_dir_id);
+	int is_dir = inode_is_entry(fs, *parent_dir_id, grandparent_id, parent_name)
+	             && fs->inodes[*parent_dir_id].n_type == directory;
+	inode_unlock_shared(fs, *parent_dir_id);
+	if(!is_dir)	return ERR_NOT_FOUND; 
 
 	return 0;
 }
 
-// Returns created inode id
-int inode_create(file_system *fs, int parent_inode_id, char *dst_name, int n_type)
+/*  Attach new_inode_id, just taken from the inode allocator, to directory parent_inode_id
+ *  as dst_name. The caller holds both locked exclusive. new_inode_id is freed again on failure.
+ *  Returns new_inode_id */
+static int inode_attach(file_system *fs, int parent_inode_id, char *dst_name, int n_type, int new_inode_id)
 {
 	// Check for name collision
-	inode *parent_inode = &fs->inodes[parent_inode_id];
-	for (int i = 0; i < DIRECT_BLOCKS_COUNT; i ++) {
-		int child_id = parent_inode->direct_blocks[i];
-		if(child_id == -1) continue;
-		if (strcmp(fs->inodes[child_id].name, dst_name) == 0) {
-			return ERR_EXIST;  
-		}
-	}
-
-	//Find free Inode
-	int new_inode_id = -1;
-	for(int i = 0 ; i < fs->s_block->num_blocks ; i ++){
-		if(fs->inodes[i].n_type == free_block){
-			new_inode_id = i;
-			break;
-		}
-	}
-	if(new_inode_id < 0) return ERR_MEM_OVER; 
-	
-	// Attach to parent
-	int added = 0;
-	for (int i = 0; i < DIRECT_BLOCKS_COUNT; i++) {
-		if (parent_inode->direct_blocks[i] == -1) {
-			parent_inode->direct_blocks[i] = new_inode_id;
-			added = 1;
-			break;
-		}
+	if (dir_lookup(fs, parent_inode_id, dst_name) != -1) {
+		inode_free(fs, new_inode_id);
+		return ERR_EXIST;  
 	}
-	if (!added) return ERR_MEM_OVER;  
 
 	//Initialize inode
 	inode *dst_inode = &fs->inodes[new_inode_id];
+	fs_mark_inode_dirty(fs, new_inode_id);
 	inode_init(dst_inode);
 	dst_inode->parent = parent_inode_id;
 	strncpy(dst_inode->name, dst_name, NAME_MAX_LENGTH);
 	dst_inode->name[NAME_MAX_LENGTH - 1] = '\0';
 	dst_inode->n_type = n_type;
+	
+	// Attach to parent
+	if (dir_add(fs, parent_inode_id, new_inode_id) != 0) {
+		inode_free(fs, new_inode_id);
+		return ERR_MEM_OVER;  
+	}
+	dcache_invalidate(fs, parent_inode_id, dst_inode->name);
 
 	return new_inode_id;
 }
 
+// Returns created inode id
+int inode_create(file_system *fs, int parent_inode_id, char *dst_name, int n_type)
+{
+	// Check for name collision, before an inode is taken for nothing
+	inode_lock_shared(fs, parent_inode_id);
+	int exists = dir_lookup(fs, parent_inode_id, dst_name) != -1;
+	inode_unlock_shared(fs, parent_inode_id);
+	if (exists) return ERR_EXIST;
+
+	//Find free Inode
+	int new_inode_id = inode_alloc(fs);
+	if(new_inode_id < 0) return ERR_MEM_OVER; 
+
+	// the new inode is locked as well, a lookup of the entry it held before may still check it
+	inode_locks held;
+	inode_locks_init(&held);
+	inode_locks_add(&held, parent_inode_id, 1);
+	inode_locks_add(&held, new_inode_id, 1);
+	inode_locks_acquire(fs, &held);
+	int res = inode_attach(fs, parent_inode_id, dst_name, n_type, new_inode_id);
+	inode_locks_release(fs, &held);
+	return res;
+}
+
+/*  Start of an operation that may change the filesystem: holds the filesystem lock shared.
+ *  The block reference counts are built from the block maps of all files first,
+ *  which needs the filesystem to itself, see lock.h */
+static void op_begin(file_system *fs)
+{
+	while (1) {
+		fs_lock_shared(fs);
+		if (fs->block_refs) return;
+		fs_unlock(fs);
+		fs_lock_exclusive(fs);
+		block_is_shared(fs, 0);
+		fs_unlock(fs);
+	}
+}
+
+// End of an operation that changes the filesystem, the journal commits after some of them
+static int op_done(file_system *fs, int res)
+{
+	int journaled = fs->journal != NULL;
+	fs_unlock(fs);
+	if (journaled) {
+		// a commit waits for the operations still running in other threads
+		fs_lock_exclusive(fs);
+		journal_op_end(fs);
+		fs_unlock(fs);
+	}
+	return res;
+}
+
 // One function for fs_mkdir and fs_mkfile
 int inode_make(file_system *fs, char *path, int n_type)
 {
 	if(!fs || !path) return ERR_IO;
+	if(fs->read_only) return ERR_READ_ONLY;
 	// check the path is valid
 	char inode_name[NAME_MAX_LENGTH];
 	int parent_inode_id  = 0;
@@ -157,464 +482,1194 @@ int inode_make(file_system *fs, char *path, int n_type)
 	return res < 0? res:0;
 }
 
-int
-fs_mkdir(file_system *fs, char *path)
+static int
+do_mkdir(file_system *fs, char *path)
 {
-	return inode_make(fs, path, directory);
+	if(!fs) return ERR_IO;
+	op_begin(fs);
+	return op_done(fs, inode_make(fs, path, directory));
 }
 
-int
-fs_mkfile(file_system *fs, char *path_and_name)
+static int
+do_mkfile(file_system *fs, char *path_and_name)
 {
-	return inode_make(fs, path_and_name, reg_file);
-}
-
-int 
-inode_copy(file_system *fs, int src_inode_id, int dst_parent_inode_id, char *dst_name)
-{
-	//src inode
-	inode *src_inode = &fs->inodes[src_inode_id];
-
-	//dst inode
-	int res = inode_create(fs, dst_parent_inode_id, dst_name, src_inode->n_type);
-	if(res < 0) return res; 
-	int new_inode_id = res;
- 
-	// Handle regular file copy
-	if (src_inode->n_type == reg_file) {
-		for (int i = 0; i < DIRECT_BLOCKS_COUNT; i++) {
-			int src_block_id = src_inode->direct_blocks[i];
-			if (src_block_id == -1) continue;
-
-			// Find free data block
-			int new_block_id = -1;
-			for (int j = 0; j < fs->s_block->num_blocks; j++) {
-				if (fs->free_list[j] == 1) {
-					new_block_id = j;
-					fs->free_list[j] = 0;
-					break;
-				}
-			}
-			if (new_block_id == -1) return ERR_MEM_OVER;
+	if(!fs) return ERR_IO;
+	op_begin(fs);
+	return op_done(fs, inode_make(fs, path_and_name, reg_file));
+}
 
-			fs->s_block->free_blocks--;
+/*  Let file new_inode_id share the data blocks of file src_inode_id, only the block map is copied */
+static int file_share_blocks(file_system *fs, int src_inode_id, int new_inode_id)
+{
+	uint64_t next = 0;
+	int block_id;
+	while ((block_id = bmap_next(fs, src_inode_id, &next)) != -1) {
+		// count the reference before it exists, the counts may be built from the block maps here
+		block_share(fs, block_id);
+		if (bmap_set(fs, new_inode_id, next - 1, block_id) != 0) {
+			block_free(fs, block_id);
+			return ERR_MEM_OVER;
+		}
+		fs->inodes[new_inode_id].size += fs->data_blocks[block_id].size;
+	}
+	fs->inodes[new_inode_id].flags = fs->inodes[src_inode_id].flags;
+	fs_mark_inode_dirty(fs, new_inode_id);
+	return 0;
+}
 
-			// copy data
-			fs->data_blocks[new_block_id].size = fs->data_blocks[src_block_id].size;
-			memcpy(fs->data_blocks[new_block_id].block,
-			       fs->data_blocks[src_block_id].block,
-			       fs->data_blocks[src_block_id].size);
+// one inode of a tree copy, the entries are in the order the copy visits the source
+struct cp_entry{
+	int src_id;
+	int new_id; //reserved up front, ascending in the order of the entries
+	int parent; //indices of entries, -1 if none
+	int first_child;
+	int next_sibling;
+	int used; //new_id was attached or freed, the others are freed at the end
+};
+
+struct cp_plan{
+	file_system *fs;
+	struct cp_entry *entries;
+	int count;
+	int capacity;
+	int *open; //the entry of the directory visited at each depth
+	int depths;
+	int blocks; //the indirect blocks the copies of the files need
+	int res; //the first failure, the copy stops at it
+};
+
+static void *grow(void *array, int *capacity, int count, size_t size)
+{
+	if (count < *capacity) return array;
+	int n = *capacity ? *capacity * 2 : 64;
+	void *p = realloc(array, n * size);
+	if (p != NULL) *capacity = n;
+	return p;
+}
 
-			fs->inodes[new_inode_id].direct_blocks[i] = new_block_id;
-			fs->inodes[new_inode_id].size += fs->data_blocks[src_block_id].size;
-		}
+/*  A tree_walk callback adding inode_id to the plan, below the directory visited last one level up */
+static int cp_plan_add(file_system *fs, int inode_id, int depth, void *arg)
+{
+	struct cp_plan *plan = arg;
+	struct cp_entry *entries = grow(plan->entries, &plan->capacity, plan->count, sizeof(struct cp_entry));
+	if (!entries) return ERR_MEM_OVER;
+	plan->entries = entries;
+	if (depth >= plan->depths) {
+		int *open = realloc(plan->open, (depth + 1) * 2 * sizeof(int));
+		if (!open) return ERR_MEM_OVER;
+		plan->open = open;
+		plan->depths = (depth + 1) * 2;
 	}
 
-	// Handle directory copy
-	else if (src_inode->n_type == directory) {
-		for (int i = 0; i < DIRECT_BLOCKS_COUNT; i++) {
-			int child_inode_id = src_inode->direct_blocks[i];
-			if (child_inode_id == -1) continue;
-			
-			//recursive copy
-			char *child_name = fs->inodes[child_inode_id].name;
-			int res = inode_copy(fs, child_inode_id, new_inode_id, child_name);
-			if (res < 0) return res;
-		}
+	int k = plan->count++;
+	entries[k] = (struct cp_entry){inode_id, -1, depth ? plan->open[depth - 1] : -1, -1, -1, 0};
+	plan->open[depth] = k;
+	if (fs->inodes[inode_id].n_type == reg_file) {
+		// a copy shares the data blocks, it only needs its own indirect blocks
+		plan->blocks += bmap_meta_blocks((fs->inodes[inode_id].size + BLOCK_SIZE - 1) / BLOCK_SIZE);
 	}
 	return 0;
 }
 
-// Calculate the number of used inodes and blocks recursively.
-void inode_property(file_system *fs, int inode_id, int *inodecnt, int *blockcnt)
+static int cp_failed(struct cp_plan *plan)
 {
-	if(fs->inodes[inode_id].n_type == reg_file){
-		(*inodecnt) ++;
-		for(int i = 0 ; i < DIRECT_BLOCKS_COUNT ; i ++){
-			if(fs->inodes[inode_id].direct_blocks[i] != -1){
-				(*blockcnt) ++;
-			}
+	return __atomic_load_n(&plan->res, __ATOMIC_RELAXED) < 0;
+}
+
+// keeps the first failure, returns res
+static int cp_fail(struct cp_plan *plan, int res)
+{
+	int none = 0;
+	if (res < 0) __atomic_compare_exchange_n(&plan->res, &none, res, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	return res;
+}
+
+/*  Attach the reserved inode of entry e to directory dst_parent_inode_id as dst_name.
+ *  Returns 0 or a negative failure */
+static int inode_copy(struct cp_plan *plan, struct cp_entry *e, int dst_parent_inode_id, char *dst_name)
+{
+	TRACE_SCOPE("inode_copy");
+	int res = inode_attach(plan->fs, dst_parent_inode_id, dst_name, plan->fs->inodes[e->src_id].n_type, e->new_id);
+	// on failure inode_attach freed it
+	e->used = 1;
+	return res < 0 ? res : 0;
+}
+
+/*  The copy of entry e, attached already, gets its content. A file shares the data blocks
+ *  of its source, a directory gets its entries in the order of the plan, the serial copy's.
+ *  The subdirectories and the big files are tasks of their own */
+static void cp_task(pool_worker *worker, void *task, void *arg)
+{
+	struct cp_plan *plan = arg;
+	struct cp_entry *e = task;
+	file_system *fs = plan->fs;
+	if (cp_failed(plan)) return;
+	if (fs->inodes[e->src_id].n_type == reg_file) {
+		cp_fail(plan, file_share_blocks(fs, e->src_id, e->new_id));
+		return;
+	}
+
+	for (int c = e->first_child; c != -1 && !cp_failed(plan); c = plan->entries[c].next_sibling) {
+		struct cp_entry *child = &plan->entries[c];
+		inode *src = &fs->inodes[child->src_id];
+		if (cp_fail(plan, inode_copy(plan, child, e->new_id, src->name)) < 0) break;
+		if (src->n_type == directory || src->size > (uint64_t)CP_FILE_TASK * BLOCK_SIZE) {
+			pool_push(worker, child);
+		} else {
+			cp_fail(plan, file_share_blocks(fs, child->src_id, child->new_id));
 		}
 	}
-	else if(fs->inodes[inode_id].n_type == directory){
-		(*inodecnt) ++;
-		for(int i = 0 ; i < DIRECT_BLOCKS_COUNT ; i ++){
-			int subId = fs->inodes[inode_id].direct_blocks[i];
-			if(subId != -1){
-				inode_property(fs, subId, inodecnt, blockcnt);
+}
+
+/*  fs_cp of a regular file, with the filesystem lock held shared.
+ *  Returns 1 if src_path names a directory, copying it needs the filesystem to itself */
+static int cp_file(file_system *fs, char *src_path, char *dst_path_and_name)
+{
+	while (1) {
+		//Find the inode of src_path
+		char src_name[NAME_MAX_LENGTH];
+		int src_parent_id, src_inode_id;
+		if (path_walk(fs, src_path, &src_parent_id, &src_inode_id, src_name) != 0) return ERR_NOT_FOUND;
+		inode_lock_shared(fs, src_inode_id);
+		int is_dir = fs->inodes[src_inode_id].n_type == directory;
+		inode_unlock_shared(fs, src_inode_id);
+		if (is_dir) return 1;
+
+		// Destination inode
+		char dst_name[NAME_MAX_LENGTH];
+		int dst_parent_inode_id = 0;
+		if (inode_from_splitpath(fs, dst_path_and_name, &dst_parent_inode_id, dst_name) != 0) return ERR_NOT_FOUND;
+
+		int new_inode_id = inode_alloc(fs);
+		if (new_inode_id < 0) return ERR_MEM_OVER;
+		inode_locks held;
+		inode_locks_init(&held);
+		inode_locks_add(&held, src_inode_id, 0);
+		inode_locks_add(&held, dst_parent_inode_id, 1);
+		inode_locks_add(&held, new_inode_id, 1);
+		inode_locks_acquire(fs, &held);
+
+		// 2: removed meanwhile, look again. 1: a directory took its place
+		int res = 2;
+		if (inode_is_entry(fs, src_inode_id, src_parent_id, src_name)) {
+			res = fs->inodes[src_inode_id].n_type == directory ? 1 : ERR_MEM_OVER;
+		}
+		if (res == ERR_MEM_OVER) {
+			// the copy only needs its own indirect blocks
+			int need_blocks = bmap_meta_blocks((fs->inodes[src_inode_id].size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+			if (block_count_free(fs) >= need_blocks) {
+				// the new inode belongs to the directory or is freed from here on
+				res = inode_attach(fs, dst_parent_inode_id, dst_name, reg_file, new_inode_id);
+				new_inode_id = -1;
+				if (res >= 0) res = file_share_blocks(fs, src_inode_id, res);
 			}
 		}
+		inode_locks_release(fs, &held);
+		if (new_inode_id >= 0) inode_free(fs, new_inode_id);
+		if (res != 2) return res;
 	}
 }
 
-int
-fs_cp(file_system *fs, char *src_path, char *dst_path_and_name)
+/*  fs_cp of anything, with the filesystem lock held exclusive.
+ *  The copy is planned first: the source tree in the order the copy visits it,
+ *  and the inodes for all of it taken in one allocator pass, ascending in that
+ *  order, as a copy one inode at a time would take them. A big tree is then
+ *  copied by several threads, each directory and each big file a task */
+static int cp_tree(file_system *fs, char *src_path, char *dst_path_and_name)
 {
-	if(!fs || !src_path || !dst_path_and_name) return ERR_IO;
-
 	//Find the inode of src_path	
 	int src_inode_id  = 0;
 	if(inode_from_path(fs, src_path, &src_inode_id) != 0) return ERR_NOT_FOUND; 
 
+	// Destination inode
+	char dst_name[NAME_MAX_LENGTH];
+    int dst_parent_inode_id = 0;
+	if (inode_from_splitpath(fs, dst_path_and_name, &dst_parent_inode_id, dst_name) != 0)  return ERR_NOT_FOUND;
+
+	// A directory can't be copied into itself
+	for (int id = dst_parent_inode_id; id >= 0; id = fs->inodes[id].parent) {
+		if (id == src_inode_id) return ERR_NOT_FOUND;
+	}
+	if (dir_lookup(fs, dst_parent_inode_id, dst_name) != -1) return ERR_EXIST;
+
 	//Get needed space
-	int need_inode_size = 0;
-	int need_datablock_size = 0;
-	inode_property(fs, src_inode_id, &need_inode_size, &need_datablock_size);
-
-	//Gget free space
-	int free_inode_size = 0;
-	int free_datablock_size = 0;
-	for(int i = 0 ; i < fs->s_block->num_blocks ; i ++){
-		if(fs->inodes[i].n_type == free_block){
-			free_inode_size ++;
+	struct cp_plan plan = {fs, NULL, 0, 0, NULL, 0, 0, 0};
+	int res = tree_walk(fs, src_inode_id, cp_plan_add, NULL, &plan, 1);
+	free(plan.open);
+	if (res == 0) {
+		// the children of each entry, in the order of the plan
+		for (int k = plan.count - 1; k > 0; k--) {
+			struct cp_entry *parent = &plan.entries[plan.entries[k].parent];
+			plan.entries[k].next_sibling = parent->first_child;
+			parent->first_child = k;
 		}
-		if(fs->free_list[i] == 1){
-			free_datablock_size ++;
+
+		//Check space, and take the inodes
+		int *ids = malloc(plan.count * sizeof(int));
+		if (!ids || inode_count_free(fs) < (uint32_t)plan.count || block_count_free(fs) < (uint32_t)plan.blocks) {
+			res = ERR_MEM_OVER;
+		} else {
+			int taken = inode_alloc_n(fs, plan.count, ids);
+			for (int k = 0; k < taken; k++) plan.entries[k].new_id = ids[k];
+			// freed below like the ones the copy did not use
+			if (taken < plan.count) res = ERR_MEM_OVER;
 		}
+		free(ids);
 	}
 
-	//Check space
-	if(free_inode_size < need_inode_size || free_datablock_size < need_datablock_size){
-		return ERR_MEM_OVER;
+	if (res == 0) {
+		res = inode_copy(&plan, &plan.entries[0], dst_parent_inode_id, dst_name);
+		if (res == 0) {
+			pool_run(plan.count < CP_PARALLEL ? 1 : pool_threads(), cp_task, &plan.entries[0], &plan);
+			res = plan.res;
+		}
 	}
 
-	// Destination inode
-	char dst_name[NAME_MAX_LENGTH];
-    int dst_parent_inode_id = 0;
-	if (inode_from_splitpath(fs, dst_path_and_name, &dst_parent_inode_id, dst_name) != 0)  return ERR_NOT_FOUND;
+	// a copy that failed half way keeps what it copied, like one inode at a time
+	for (int k = 0; k < plan.count; k++) {
+		if (!plan.entries[k].used && plan.entries[k].new_id >= 0) inode_free(fs, plan.entries[k].new_id);
+	}
+	free(plan.entries);
+	return res;
+}
 
-	// Get parent directory inode
-	return inode_copy(fs, src_inode_id, dst_parent_inode_id, dst_name);
+static int
+do_cp(file_system *fs, char *src_path, char *dst_path_and_name)
+{
+	if(!fs || !src_path || !dst_path_and_name) return ERR_IO;
+	if(fs->read_only) return ERR_READ_ONLY;
+
+	op_begin(fs);
+	int res = cp_file(fs, src_path, dst_path_and_name);
+	if (res == 1) {
+		// a whole tree is copied with the filesystem to itself
+		fs_unlock(fs);
+		fs_lock_exclusive(fs);
+		res = cp_tree(fs, src_path, dst_path_and_name);
+	}
+	return op_done(fs, res);
 }
 
-char *
-fs_list(file_system *fs, char *path)
+#define DIRENT_BATCH 64 //entries fs_readdir reads at once
+
+struct _fs_dir{
+	file_system *fs;
+	int dir_id;
+	int parent_id; //with name, to notice the directory was removed meanwhile
+	char name[NAME_MAX_LENGTH];
+	int *children; //the inode-indices of the entries at fs_opendir, ascending
+	int count;
+	int next; //the first of children not read into batch yet
+	fs_dirent batch[DIRENT_BATCH];
+	int batch_count;
+	int batch_pos;
+	uint64_t cursor;
+};
+
+/*  Take the inode-indices of the entries of directory dir->dir_id into dir.
+ *  Returns 0, ERR_NOT_FOUND if it is no directory or ERR_MEM_OVER */
+static int dir_snapshot(file_system *fs, fs_dir *dir)
 {
-	if(!fs || !path) return NULL;
-
-	int inode_id = 0;
-	if (inode_from_path(fs, path, &inode_id) != 0)return NULL;
-	if (fs->inodes[inode_id].n_type != directory)return NULL;
-
-	// Allocate a buffer for listing
-	char *buffer = malloc(1024);
-	if (!buffer) return NULL;
-	buffer[0] = '\0';
-
-	for (int i = 0; i < DIRECT_BLOCKS_COUNT; i++) {
-		int child_id = fs->inodes[inode_id].direct_blocks[i];
-		if (child_id != -1) {
-			int child_type = fs->inodes[child_id].n_type;
-			if(child_type == free_block) continue;
-			if(child_type == reg_file){
-				strcat(buffer, "FIL ");
-			}else if(child_type == directory){
-				strcat(buffer, "DIR ");
-			}
-			strcat(buffer, fs->inodes[child_id].name);
-			strcat(buffer, "\n");
+	if (fs->inodes[dir->dir_id].n_type != directory) return ERR_NOT_FOUND;
+	dir->count = dir_children(fs, dir->dir_id, &dir->children);
+	return dir->count < 0 ? dir->count : 0;
+}
+
+/*  fs_opendir without locks, inside read_enter. Returns READ_RETRY if a writer got in the way */
+static int opendir_unlocked(file_system *fs, char *path, fs_dir *dir)
+{
+	int res = walk(fs, path, 0, &dir->parent_id, &dir->dir_id, dir->name);
+	if (res != 0) return res;
+
+	uint32_t seq = inode_seq(fs, dir->dir_id);
+	if ((seq & 1) || !inode_is_entry(fs, dir->dir_id, dir->parent_id, dir->name)) return READ_RETRY;
+	res = dir_snapshot(fs, dir);
+	return inode_seq_check(fs, dir->dir_id, seq) ? res : READ_RETRY;
+}
+
+static fs_dir *do_opendir(file_system *fs, char *path)
+{
+	if (!fs || !path) return NULL;
+	fs_dir *dir = calloc(1, sizeof(fs_dir));
+	if (!dir) return NULL;
+	dir->fs = fs;
+
+	int res = READ_RETRY;
+	for (int tries = 0; tries < READ_TRIES && res == READ_RETRY; tries++) {
+		read_guard guard;
+		res = read_enter(fs, &guard) ? opendir_unlocked(fs, path, dir) : READ_RETRY;
+		if (!read_leave(fs, &guard)) res = READ_RETRY;
+		if (res == READ_RETRY) {
+			free(dir->children);
+			dir->children = NULL;
 		}
 	}
 
-	return buffer;
+	if (res == READ_RETRY) {
+		// writers kept getting in the way, wait for them
+		fs_lock_shared(fs);
+		inode_locks held;
+		res = lock_path(fs, path, 0, 0, -1, &dir->parent_id, &dir->dir_id, &held);
+		if (res == 0) {
+			memcpy(dir->name, fs->inodes[dir->dir_id].name, NAME_MAX_LENGTH);
+			dir->name[NAME_MAX_LENGTH - 1] = '\0';
+			res = dir_snapshot(fs, dir);
+			inode_locks_release(fs, &held);
+		}
+		fs_unlock(fs);
+	}
+
+	if (res != 0) {
+		fs_closedir(dir);
+		return NULL;
+	}
+	return dir;
 }
 
-int
-fs_writef(file_system *fs, char *filename, char *text)
+/*  Read the entries of dir from dir->next on into its batch, the position after them
+ *  goes to *next and their number to *count. Entries no longer in the directory are
+ *  skipped, their inodes may hold something else by now.
+ *  Unless locked this is inside read_enter, and READ_RETRY is returned if a writer got in the way */
+static int dir_fill(fs_dir *dir, int locked, int *next, int *count)
 {
-	if (!fs || !filename || !text) return ERR_IO;
+	file_system *fs = dir->fs;
+	uint32_t seq = 0;
+	if (!locked && ((seq = inode_seq(fs, dir->dir_id)) & 1)) return READ_RETRY;
+
+	*next = dir->next;
+	*count = 0;
+	// a directory removed meanwhile has no entries left
+	if (fs->inodes[dir->dir_id].n_type != directory || !inode_is_entry(fs, dir->dir_id, dir->parent_id, dir->name)) {
+		*next = dir->count;
+	}
+	for (; *next < dir->count && *count < DIRENT_BATCH; (*next)++) {
+		int child_id = dir->children[*next];
+		inode *child = &fs->inodes[child_id];
+		fs_dirent *entry = &dir->batch[*count];
+		size_t name_length = strnlen(child->name, NAME_MAX_LENGTH - 1);
+		memcpy(entry->name, child->name, name_length);
+		entry->name[name_length] = '\0';
+		entry->type = child->n_type;
+		if (dir_find(fs, dir->dir_id, entry->name) != child_id) continue;
+		entry->inode = child_id;
+		(*count)++;
+	}
+	return locked || inode_seq_check(fs, dir->dir_id, seq) ? 0 : READ_RETRY;
+}
 
-	int inode_id;
-	if (inode_from_path(fs, filename, &inode_id) != 0) return ERR_NOT_FOUND;  
-	inode *node = &fs->inodes[inode_id];
-	if (node->n_type != reg_file) return ERR_NOT_FOUND;
+/*  Read the next batch of entries of dir */
+static void dir_read(fs_dir *dir)
+{
+	TRACE_SCOPE("dir_read");
+	file_system *fs = dir->fs;
+	int next, count;
+	int res = READ_RETRY;
+	for (int tries = 0; tries < READ_TRIES && res == READ_RETRY; tries++) {
+		read_guard guard;
+		res = read_enter(fs, &guard) ? dir_fill(dir, 0, &next, &count) : READ_RETRY;
+		if (!read_leave(fs, &guard)) res = READ_RETRY;
+	}
 
-	// Skip exist data blocks
-	int block_index = 0;
-	while (block_index < DIRECT_BLOCKS_COUNT && node->direct_blocks[block_index] != -1){
-		block_index ++;
+	if (res == READ_RETRY) {
+		// writers kept getting in the way, wait for them
+		fs_lock_shared(fs);
+		inode_locks held;
+		inode_locks_init(&held);
+		inode_locks_add(&held, dir->dir_id, 0);
+		inode_locks_acquire(fs, &held);
+		dir_fill(dir, 1, &next, &count);
+		inode_locks_release(fs, &held);
+		fs_unlock(fs);
 	}
+	dir->next = next;
+	dir->batch_count = count;
+	dir->batch_pos = 0;
+}
 
-	// clean other data blocks
-	for (int i = block_index ; i < DIRECT_BLOCKS_COUNT ; i ++){
-		int block_id = node->direct_blocks[i];
-		if (block_id != -1) {
-			fs->free_list[block_id] = 1;
-			fs->s_block->free_blocks ++;
-			node->direct_blocks[i] = -1;
-		}
+static fs_dirent *do_readdir(fs_dir *dir)
+{
+	if (!dir) return NULL;
+	while (dir->batch_pos == dir->batch_count) {
+		if (dir->next == dir->count) return NULL;
+		dir_read(dir);
 	}
+	fs_dirent *entry = &dir->batch[dir->batch_pos++];
+	dir->cursor = (uint64_t)entry->inode + 1;
+	return entry;
+}
 
-	size_t text_len = strlen(text);
-	size_t bytes_written = 0;
+uint64_t fs_telldir(fs_dir *dir)
+{
+	return dir ? dir->cursor : 0;
+}
 
-	// Try appending into the last partially filled block, if it exists
-	if (block_index > 0) {
-        int last_block_id = node->direct_blocks[block_index - 1];
-        data_block *blk = &fs->data_blocks[last_block_id];
-        int space_left = BLOCK_SIZE - blk->size;
-
-        if (space_left > 0) {
-            int to_write = (text_len < space_left) ? text_len : space_left;
-            memcpy(blk->block + blk->size, text, to_write);
-            blk->size += to_write;
-            bytes_written += to_write;
-			node->size += to_write;
-        }
-    }
+void fs_seekdir(fs_dir *dir, uint64_t cursor)
+{
+	if (!dir) return;
+	// the first child at cursor or after it
+	int low = 0, high = dir->count;
+	while (low < high) {
+		int middle = low + (high - low) / 2;
+		if ((uint64_t)dir->children[middle] < cursor) low = middle + 1;
+		else high = middle;
+	}
+	dir->next = low;
+	dir->batch_count = dir->batch_pos = 0;
+	dir->cursor = cursor;
+}
 
-	while (bytes_written < text_len && block_index < DIRECT_BLOCKS_COUNT) {
-		// find a free block
-		int block_id = -1;
-		for (int i = 0; i < fs->s_block->num_blocks; i++) {
-			if (fs->free_list[i]) {
-				block_id = i;
-				fs->free_list[i] = 0;
-				fs->s_block->free_blocks--;
-				break;
-			}
+void fs_closedir(fs_dir *dir)
+{
+	if (!dir) return;
+	free(dir->children);
+	free(dir);
+}
+
+/*  The listing of fs_list, written from fs_readdir into a buffer that grows as needed */
+static char *
+do_list(file_system *fs, char *path)
+{
+	fs_dir *dir = fs_opendir(fs, path);
+	if (!dir) return NULL;
+
+	size_t length = 0;
+	size_t capacity = 256;
+	char *buffer = malloc(capacity);
+	fs_dirent *entry;
+	while (buffer && (entry = fs_readdir(dir)) != NULL) {
+		size_t name_length = strlen(entry->name);
+		// the line and the closing '\0'
+		if (length + 4 + name_length + 2 > capacity) {
+			capacity *= 2;
+			char *grown = realloc(buffer, capacity);
+			if (!grown) free(buffer);
+			buffer = grown;
+			if (!buffer) break;
 		}
-		if (block_id == -1) return ERR_MEM_OVER;  
+		memcpy(buffer + length, entry->type == reg_file ? "FIL " : "DIR ", 4);
+		length += 4;
+		memcpy(buffer + length, entry->name, name_length);
+		length += name_length;
+		buffer[length++] = '\n';
+	}
+	if (buffer) buffer[length] = '\0';
 
-		// split unit size BLOCK_SIZE(1024 bytes)
-		size_t chunk_size = text_len - bytes_written;
-		if (chunk_size > BLOCK_SIZE)
-			chunk_size = BLOCK_SIZE;
+	fs_closedir(dir);
+	return buffer;
+}
 
-		memcpy(fs->data_blocks[block_id].block, text + bytes_written, chunk_size);
-		fs->data_blocks[block_id].size = chunk_size;
+static int
+do_writef(file_system *fs, char *filename, char *text)
+{
+	if (!fs || !filename || !text) return ERR_IO;
+	if (fs->read_only) return ERR_READ_ONLY;
+
+	op_begin(fs);
+	int parent_id, inode_id;
+	inode_locks held;
+	if (lock_path(fs, filename, 1, 0, -1, &parent_id, &inode_id, &held) != 0) return op_done(fs, ERR_NOT_FOUND);
+	inode *node = &fs->inodes[inode_id];
+	if (node->n_type != reg_file) {
+		inode_locks_release(fs, &held);
+		return op_done(fs, ERR_NOT_FOUND);
+	}
 
-		node->direct_blocks[block_index++] = block_id;
-		bytes_written += chunk_size;
-		node->size += chunk_size;
-	} 
+	size_t text_len = strlen(text);
+	size_t bytes_written = content_append(fs, inode_id, (const uint8_t *)text, text_len);
+	inode_locks_release(fs, &held);
 
 	// Not enough blocks available
-    if (bytes_written < text_len) {
-        return ERR_MEM_OVER;
-    }
+	if (bytes_written < text_len) {
+		return op_done(fs, ERR_MEM_OVER);
+	}
 
-	return bytes_written;
+	return op_done(fs, bytes_written);
 }
 
-uint8_t *
-fs_readf(file_system *fs, char *filename, int *file_size)
+/*  fs_readf of file inode_id, which the caller holds locked or reads without locks */
+static uint8_t *file_read(file_system *fs, int inode_id, int *file_size)
 {
-	if (!fs || !filename || !file_size) return NULL;
-
-	int inode_id;
-    if (inode_from_path(fs, filename, &inode_id) != 0)  return NULL;
     inode *node = &fs->inodes[inode_id];
     if (node->n_type != reg_file) return NULL;
 
-    // Calculate total file size
-    int total_size = 0;
-    for (int i = 0; i < DIRECT_BLOCKS_COUNT; i++) {
-        int block_id = node->direct_blocks[i];
-        if (block_id != -1) {
-            total_size += fs->data_blocks[block_id].size;
+    if (node->flags & INODE_COMPRESSED) {
+        // decode every frame straight into the buffer
+        uint64_t size;
+        if (zfile_size(fs, inode_id, &size) != 0) return NULL;
+        if (size == 0) {
+            *file_size = 0;
+            return NULL; // Empty file
         }
+        if (size > INT_MAX) return NULL;
+        uint8_t *buffer = malloc(size);
+        if (!buffer) return NULL;
+        if (zfile_read_all(fs, inode_id, buffer, size) != 0) {
+            free(buffer);
+            return NULL;
+        }
+        *file_size = size;
+        return buffer;
+    }
+
+    // Calculate total file size
+    size_t total_size = 0;
+    uint64_t next = 0;
+    int block_id;
+    while ((block_id = bmap_next(fs, inode_id, &next)) != -1) {
+        total_size += MIN(fs->data_blocks[block_id].size, BLOCK_SIZE);
     }
 
     if (total_size == 0) {
         *file_size = 0;
         return NULL; // Empty file
     }
+    if (total_size > INT_MAX) return NULL; // does not fit into file_size
 
     uint8_t *buffer = malloc(total_size);
     if (!buffer) return NULL;
 
-    int offset = 0;
-    for (int i = 0; i < DIRECT_BLOCKS_COUNT; i++) {
-        int block_id = node->direct_blocks[i];
-        if (block_id != -1) {
-            int size = fs->data_blocks[block_id].size;
-            memcpy(buffer + offset, fs->data_blocks[block_id].block, size);
-            offset += size;
-        }
+    size_t offset = 0;
+    next = 0;
+    while ((block_id = bmap_next(fs, inode_id, &next)) != -1) {
+        // without locks the file may have grown since it was counted
+        size_t size = MIN(MIN(fs->data_blocks[block_id].size, BLOCK_SIZE), total_size - offset);
+        memcpy(buffer + offset, fs->data_blocks[block_id].block, size);
+        offset += size;
     }
 	
     *file_size = total_size;
     return buffer;
 }
 
-int
-fs_rm(file_system *fs, char *path)
+/*  fs_readf without locks, inside read_enter. Returns READ_RETRY if a writer got in the way.
+ *  Compressed files are decoded in the cursor of the thread, see zfile.h, so they are read
+ *  under the locks */
+static int readf_unlocked(file_system *fs, char *filename, uint8_t **buffer, int *file_size)
 {
-	if (!fs || !path) return ERR_IO;
+	int parent_id, inode_id;
+	char name[NAME_MAX_LENGTH];
+	int res = walk(fs, filename, 0, &parent_id, &inode_id, name);
+	if (res != 0) return res;
+
+	uint32_t seq = inode_seq(fs, inode_id);
+	if ((seq & 1) || !inode_is_entry(fs, inode_id, parent_id, name)) return READ_RETRY;
+	if (fs->inodes[inode_id].flags & INODE_COMPRESSED) return READ_LOCKED;
+	*buffer = file_read(fs, inode_id, file_size);
+	return inode_seq_check(fs, inode_id, seq) ? 0 : READ_RETRY;
+}
 
-    int inode_id;
-    if (inode_from_path(fs, path, &inode_id) != 0) return ERR_NOT_FOUND; 
+static uint8_t *
+do_readf(file_system *fs, char *filename, int *file_size)
+{
+	if (!fs || !filename || !file_size) return NULL;
 
-    inode *target = &fs->inodes[inode_id];
+	for (int tries = 0; tries < READ_TRIES; tries++) {
+		read_guard guard;
+		uint8_t *buffer = NULL;
+		int size = *file_size;
+		int res = read_enter(fs, &guard) ? readf_unlocked(fs, filename, &buffer, &size) : READ_RETRY;
+		if (!read_leave(fs, &guard)) res = READ_RETRY;
+		if (res == READ_LOCKED) break;
+		if (res != READ_RETRY) {
+			*file_size = size;
+			return buffer;
+		}
+		free(buffer);
+	}
 
-    // Cannot remove root directory
-    if (inode_id == 0) return ERR_NOT_FOUND;
+	// writers kept getting in the way, wait for them
+	fs_lock_shared(fs);
+	int parent_id, inode_id;
+	inode_locks held;
+	uint8_t *buffer = NULL;
+	if (lock_path(fs, filename, 0, 0, -1, &parent_id, &inode_id, &held) == 0) {
+		buffer = file_read(fs, inode_id, file_size);
+		inode_locks_release(fs, &held);
+	}
+	fs_unlock(fs);
+	return buffer;
+}
+
+/*  fs_readv of file inode_id, which the caller holds locked */
+static int file_readv(file_system *fs, int inode_id, uint64_t offset, size_t length, struct iovec *iov, int iov_count)
+{
+	if (fs->inodes[inode_id].n_type != reg_file) return ERR_NOT_FOUND;
+
+	if (fs->inodes[inode_id].flags & INODE_COMPRESSED) {
+		// the rest of the frame holding offset, decoded into the cursor
+		const uint8_t *data;
+		size_t len;
+		if (iov_count < 1 || length == 0) return 0;
+		if (zfile_read(fs, inode_id, offset, &data, &len) != 0) return ERR_IO;
+		if (len == 0) return 0;
+		iov[0].iov_base = (void *)data;
+		iov[0].iov_len = MIN(len, length);
+		return 1;
+	}
+
+	// every block but the last is full, so offset lies in block offset / BLOCK_SIZE
+	uint64_t block_index = offset / BLOCK_SIZE;
+	size_t block_offset = offset % BLOCK_SIZE;
+	int filled = 0;
+	while (filled < iov_count && length > 0) {
+		int block_id = bmap_get(fs, inode_id, block_index++);
+		if (block_id == -1) break;
+		data_block *blk = &fs->data_blocks[block_id];
+		if (block_offset >= blk->size) break;
+
+		size_t chunk_size = MIN(blk->size - block_offset, length);
+		iov[filled].iov_base = blk->block + block_offset;
+		iov[filled].iov_len = chunk_size;
+		filled++;
+		length -= chunk_size;
+		block_offset = 0;
+		if (blk->size < BLOCK_SIZE) break; // the last block
+	}
+	return filled;
+}
+
+static int
+do_readv(file_system *fs, char *filename, uint64_t offset, size_t length, struct iovec *iov, int iov_count)
+{
+	if (!fs || !filename || (!iov && iov_count > 0)) return ERR_IO;
+
+	fs_lock_shared(fs);
+	int parent_id, inode_id;
+	inode_locks held;
+	int res = ERR_NOT_FOUND;
+	if (lock_path(fs, filename, 0, 0, -1, &parent_id, &inode_id, &held) == 0) {
+		res = file_readv(fs, inode_id, offset, length, iov, iov_count);
+		inode_locks_release(fs, &held);
+	}
+	fs_unlock(fs);
+	return res;
+}
+
+// Removes an inode and, if it is a directory, everything below it
+int inode_remove(file_system *fs, int inode_id)
+{
+    TRACE_SCOPE("inode_remove");
+    inode *target = &fs->inodes[inode_id];
 
     // Recursively remove contents if it's a directory
-	int children[DIRECT_BLOCKS_COUNT];
-	memcpy(children, target->direct_blocks, sizeof(children));
     if (target->n_type == directory) {
-        for (int i = 0; i < DIRECT_BLOCKS_COUNT; i++) {
-            if (children[i] != -1) {
-                char child_path[PATH_MAX_LENGTH];
-                snprintf(child_path, sizeof(child_path), "%s/%s", path, fs->inodes[children[i]].name);
-                fs_rm(fs, child_path);
+        // collect first, removing a child changes the directory
+        int *children;
+        int n = dir_children(fs, inode_id, &children);
+        if (n < 0) return n;
+        for (int i = 0; i < n; i++) {
+            int res = inode_remove(fs, children[i]);
+            if (res < 0) {
+                free(children);
+                return res;
             }
         }
+        free(children);
     }
 
     // Free data blocks if it's a file
     if (target->n_type == reg_file) {
-        for (int i = 0; i < DIRECT_BLOCKS_COUNT; i++) {
-            int block_id = target->direct_blocks[i];
-            if (block_id != -1) {
-                fs->free_list[block_id] = 1;
-                fs->s_block->free_blocks++;
-                target->direct_blocks[i] = -1;
-            }
-        }
+        zfile_forget(fs, inode_id, 0);
+        bmap_truncate(fs, inode_id, 0);
     }
      
     // Remove inode from parent directory
     int parent_id = target->parent;
     if (parent_id >= 0 && parent_id < fs->s_block->num_blocks) {
-        inode *parent = &fs->inodes[parent_id];
-        for (int i = 0; i < DIRECT_BLOCKS_COUNT; i++) {
-            if (parent->direct_blocks[i] == inode_id) {
-                parent->direct_blocks[i] = -1;
-                break;
-            }
-        }
+        dir_remove(fs, parent_id, inode_id);
+        dcache_invalidate(fs, parent_id, target->name);
     }
 
     // Free inode
-    inode_init(target);
-    target->n_type = free_block;
-
+    inode_free(fs, inode_id);
     return 0;
 }
 
-int
-fs_import(file_system *fs, char *int_path, char *ext_path)
+static int
+do_rm(file_system *fs, char *path)
+{
+	if (!fs || !path) return ERR_IO;
+	if (fs->read_only) return ERR_READ_ONLY;
+
+    op_begin(fs);
+    int parent_id, inode_id;
+    inode_locks held;
+    int res = lock_path(fs, path, 1, 1, -1, &parent_id, &inode_id, &held);
+
+    // Cannot remove root directory
+    if (res == 0 && inode_id == 0) {
+        inode_locks_release(fs, &held);
+        res = ERR_NOT_FOUND;
+    }
+    else if (res == 0 && fs->inodes[inode_id].n_type == directory && !fs_lock_owned(fs)) {
+        // a whole tree is removed with the filesystem to itself
+        inode_locks_release(fs, &held);
+        fs_unlock(fs);
+        fs_lock_exclusive(fs);
+        res = lock_path(fs, path, 1, 1, -1, &parent_id, &inode_id, &held);
+    }
+    if (res == 0) {
+        res = inode_remove(fs, inode_id);
+        inode_locks_release(fs, &held);
+    }
+
+    return op_done(fs, res);
+}
+
+/*  Append everything left in fd to file inode_id, which has to end at a block boundary.
+ *  Reads straight into new blocks allocated BLOCK_BATCH at a time, so memory use
+ *  does not depend on the input size and the input need not be seekable.
+ *  head is NULL or one full block the caller already read from fd, it goes first.
+ *  Returns 0 at the end of the input, ERR_IO if reading fails
+ *  or ERR_MEM_OVER if the filesystem runs full first */
+static int file_append_fd(file_system *fs, int inode_id, const uint8_t *head, int fd)
+{
+	inode *node = &fs->inodes[inode_id];
+	uint64_t block_index = node->size / BLOCK_SIZE;
+	int last_block_id = block_index > 0 ? bmap_get(fs, inode_id, block_index - 1) : -1;
+	int goal = last_block_id != -1 ? last_block_id + 1 : -1;
+
+	// size the batches from the input where it is known, so small files don't claim a long run
+	struct stat st;
+	int known_size = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+	off_t position = known_size ? lseek(fd, 0, SEEK_CUR) : -1;
+
+	while (1) {
+		int head_len = head ? BLOCK_SIZE : 0;
+		int batch = BLOCK_BATCH;
+		if (known_size && position >= 0) {
+			off_t blocks_left = (head_len + st.st_size - position + BLOCK_SIZE - 1) / BLOCK_SIZE;
+			batch = MIN(MAX(blocks_left, 1), BLOCK_BATCH);
+		}
+		int new_blocks[BLOCK_BATCH];
+		int allocated = block_alloc_run(fs, batch, goal, new_blocks);
+		if (allocated == 0) {
+			if (head) return ERR_MEM_OVER;
+			// the filesystem is full, which only matters if there is more input
+			uint8_t probe;
+			struct iovec iov = { &probe, 1 };
+			ssize_t got = readv_all(fd, &iov, 1);
+			return got == 0 ? 0 : got < 0 ? ERR_IO : ERR_MEM_OVER;
+		}
+
+		// read into the payloads of the new blocks until they are full or the input ends
+		if (head) memcpy(fs->data_blocks[new_blocks[0]].block, head, BLOCK_SIZE);
+		struct iovec iov[BLOCK_BATCH];
+		int first = head ? 1 : 0;
+		for (int b = first; b < allocated; b++) {
+			iov[b].iov_base = fs->data_blocks[new_blocks[b]].block;
+			iov[b].iov_len = BLOCK_SIZE;
+		}
+		ssize_t got = readv_all(fd, iov + first, allocated - first);
+		if (got < 0) {
+			for (int b = 0; b < allocated; b++) block_free(fs, new_blocks[b]);
+			return ERR_IO;
+		}
+		if (position >= 0) position += got;
+		got += head_len;
+		head = NULL;
+
+		int used = (got + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		for (int b = 0; b < used; b++) {
+			size_t chunk_size = MIN(got - (ssize_t)b * BLOCK_SIZE, BLOCK_SIZE);
+			fs->data_blocks[new_blocks[b]].size = chunk_size;
+			int block_id = dedup_new_block(fs, new_blocks[b]);
+
+			if (bmap_set(fs, inode_id, block_index, block_id) != 0) {
+				block_free(fs, block_id);
+				for (b++; b < allocated; b++) block_free(fs, new_blocks[b]);
+				return ERR_MEM_OVER;
+			}
+			block_index++;
+			if (block_id == new_blocks[b]) fs_mark_block_dirty(fs, block_id);
+			fs_mark_inode_dirty(fs, inode_id);
+			node->size += chunk_size;
+		}
+		for (int b = used; b < allocated; b++) block_free(fs, new_blocks[b]);
+
+		// the input ended before the blocks were full
+		if (got < (ssize_t)allocated * BLOCK_SIZE) return 0;
+		goal = new_blocks[allocated - 1] + 1;
+	}
+}
+
+/*  Append everything left in fd to the compressed file inode_id a frame at a time.
+ *  head holds the head_len bytes the caller already read from fd, they go first.
+ *  Returns 0 at the end of the input, ERR_IO if reading fails
+ *  or ERR_MEM_OVER if the filesystem runs full first */
+static int compressed_append_fd(file_system *fs, int inode_id, const uint8_t *head, size_t head_len, int fd)
+{
+	uint8_t *raw = malloc(ZFILE_FRAME);
+	if (!raw) return ERR_MEM_OVER;
+	memcpy(raw, head, head_len);
+	size_t fill = head_len;
+
+	int res = 0;
+	while (1) {
+		struct iovec iov = { raw + fill, ZFILE_FRAME - fill };
+		ssize_t got = readv_all(fd, &iov, 1);
+		if (got < 0) {
+			res = ERR_IO;
+			break;
+		}
+		fill += got;
+		if (fill > 0 && compressed_append(fs, inode_id, raw, fill) < fill) {
+			res = ERR_MEM_OVER;
+			break;
+		}
+		// the input ended before the frame was full
+		if (fill < ZFILE_FRAME) break;
+		fill = 0;
+	}
+	free(raw);
+	return res;
+}
+
+static int
+do_import(file_system *fs, char *int_path, char *ext_path, uint64_t *bytes)
 {
+	*bytes = 0;
 	if (!fs || !int_path || !ext_path) return ERR_IO;
+	if (fs->read_only) return ERR_READ_ONLY;
 
     // Open external file for reading
-    FILE *src = fopen(ext_path, "rb");
-    if (!src) return ERR_NOT_FOUND;  
-
-    // Read external file content
-    fseek(src, 0, SEEK_END);
-    long data_len = ftell(src);
-    fseek(src, 0, SEEK_SET);
-    if (data_len <= 0) {
-        fclose(src);
+    int src = open(ext_path, O_RDONLY);
+    if (src < 0) return ERR_NOT_FOUND;
+    posix_fadvise(src, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // Read the first block before touching the filesystem, an empty input is an error
+    uint8_t first[BLOCK_SIZE];
+    struct iovec first_iov = { first, BLOCK_SIZE };
+    ssize_t first_len = readv_all(src, &first_iov, 1);
+    if (first_len <= 0) {
+        close(src);
         return ERR_IO;
     }
 
-    uint8_t *data = malloc(data_len);
-    if (!data) {
-		fclose(src);
-        return ERR_MEM_OVER;
-    }
-
-    fread(data, 1, data_len, src);
-    fclose(src);
-
     // Create internal file (if it does not exist)
-    int create_result = fs_mkfile(fs, int_path);
+    op_begin(fs);
+    int create_result = inode_make(fs, int_path, reg_file);
     if (create_result != 0 && create_result != ERR_EXIST) {
-        free(data);
-        return create_result;
+        close(src);
+        return op_done(fs, create_result);
     }
 	
-	int inode_id;
-	if (inode_from_path(fs, int_path, &inode_id) != 0){
-        free(data);
-		return ERR_NOT_FOUND; 
+	int parent_id, inode_id;
+	inode_locks held;
+	if (lock_path(fs, int_path, 1, 0, -1, &parent_id, &inode_id, &held) != 0) {
+        close(src);
+		return op_done(fs, ERR_NOT_FOUND);
+	}
+	if (fs->inodes[inode_id].n_type != reg_file){
+        inode_locks_release(fs, &held);
+        close(src);
+		return op_done(fs, ERR_NOT_FOUND); 
 	}
 
 	inode *node = &fs->inodes[inode_id]; 
 
 	// Clear origin data blocks
-	for (int i = 0 ; i < DIRECT_BLOCKS_COUNT ; i ++){
-		int block_id = node->direct_blocks[i];
-		if (block_id != -1) {
-			fs->free_list[block_id] = 1;
-			fs->s_block->free_blocks ++;
-			node->direct_blocks[i] = -1;
-		}
-	}
+	zfile_forget(fs, inode_id, 0);
+	bmap_truncate(fs, inode_id, 0);
+	fs_mark_inode_dirty(fs, inode_id);
 	node->size = 0;
 
-	// Write remaining data to new blocks
-	int block_index = 0;
-	size_t bytes_written = 0;
-	while (bytes_written < data_len && block_index < DIRECT_BLOCKS_COUNT) {
-		// find empty block
-		int block_id = -1;
-		for (int i = 0; i < fs->s_block->num_blocks; i++) {
-			if (fs->free_list[i]) {
-				block_id = i;
-				fs->free_list[i] = 0;
-				fs->s_block->free_blocks--;
-				break;
+	// Write the data to new blocks
+	int res = 0;
+	if (node->flags & INODE_COMPRESSED) {
+		res = compressed_append_fd(fs, inode_id, first, first_len, src);
+	}
+	else if (first_len < BLOCK_SIZE) {
+		if (file_append(fs, inode_id, first, first_len) < (size_t)first_len) res = ERR_MEM_OVER;
+	}
+	else {
+		res = file_append_fd(fs, inode_id, first, src);
+	}
+	*bytes = node->size;
+	inode_locks_release(fs, &held);
+
+	close(src);
+	return op_done(fs, res);
+}
+
+static int
+do_export(file_system *fs, char *int_path, char *ext_path, uint64_t *bytes)
+{
+	*bytes = 0;
+	if (!fs || !int_path || !ext_path) return ERR_IO;
+
+    // Locate the internal file inode, it stays locked until it is written out
+    fs_lock_shared(fs);
+    int parent_id, inode_id;
+    inode_locks held;
+    if (lock_path(fs, int_path, 0, 0, -1, &parent_id, &inode_id, &held) != 0) {
+        fs_unlock(fs);
+        return ERR_NOT_FOUND;
+    }
+    inode *file_inode = &fs->inodes[inode_id];
+
+    // Open the external file for writing
+    int dst = file_inode->n_type == reg_file ? open(ext_path, O_WRONLY | O_CREAT | O_TRUNC, 0666) : -1;
+    int res = dst < 0 ? ERR_NOT_FOUND : 0;
+
+    // Write the file straight from its data blocks, up to EXPORT_IOV blocks with one writev
+    struct iovec iov[EXPORT_IOV];
+    uint64_t offset = 0;
+    int iov_count;
+    while (res == 0 && (iov_count = file_readv(fs, inode_id, offset, SIZE_MAX, iov, EXPORT_IOV)) > 0) {
+        for (int i = 0; i < iov_count; i++) offset += iov[i].iov_len;
+        if (writev_all(dst, iov, iov_count) != 0) res = ERR_MEM_OVER;
+    }
+
+    if (dst >= 0) close(dst);
+    *bytes = offset;
+    inode_locks_release(fs, &held);
+    fs_unlock(fs);
+    return res;
+}
+
+static int
+do_compress(file_system *fs, char *filename, int on)
+{
+	if (!fs || !filename) return ERR_IO;
+	if (fs->read_only) return ERR_READ_ONLY;
+
+	// Write the content in its new form to an unlinked scratch file first,
+	// so the file keeps its content if the filesystem runs full.
+	// It is taken first, so it can be locked together with the file
+	op_begin(fs);
+	int scratch_id = inode_alloc(fs);
+	if (scratch_id < 0) return op_done(fs, ERR_MEM_OVER);
+
+	int parent_id, inode_id;
+	inode_locks held;
+	if (lock_path(fs, filename, 1, 0, scratch_id, &parent_id, &inode_id, &held) != 0) {
+		inode_free(fs, scratch_id);
+		return op_done(fs, ERR_NOT_FOUND);
+	}
+	inode *node = &fs->inodes[inode_id];
+	uint32_t flags = on ? node->flags | INODE_COMPRESSED : node->flags & ~INODE_COMPRESSED;
+	if (node->n_type != reg_file || flags == node->flags) {
+		int res = node->n_type != reg_file ? ERR_NOT_FOUND : 0;
+		inode_locks_release(fs, &held);
+		inode_free(fs, scratch_id);
+		return op_done(fs, res);
+	}
+	inode *scratch = &fs->inodes[scratch_id];
+	fs_mark_inode_dirty(fs, scratch_id);
+	inode_init(scratch);
+	scratch->n_type = reg_file;
+	scratch->flags = flags;
+
+	// a frame of content at a time, so compressing does not write the last frame again for every block
+	uint8_t *buffer = malloc(ZFILE_FRAME);
+	if (!buffer) {
+		inode_locks_release(fs, &held);
+		inode_free(fs, scratch_id);
+		return op_done(fs, ERR_MEM_OVER);
+	}
+	size_t fill = 0;
+	int res = 0;
+	uint64_t offset = 0;
+	struct iovec iov[EXPORT_IOV];
+	int iov_count;
+	while (res == 0 && (iov_count = file_readv(fs, inode_id, offset, SIZE_MAX, iov, EXPORT_IOV)) > 0) {
+		for (int i = 0; i < iov_count && res == 0; i++) {
+			const uint8_t *data = iov[i].iov_base;
+			size_t len = iov[i].iov_len;
+			offset += len;
+			while (len > 0) {
+				size_t n = MIN(ZFILE_FRAME - fill, len);
+				memcpy(buffer + fill, data, n);
+				fill += n;
+				data += n;
+				len -= n;
+				if (fill == ZFILE_FRAME) {
+					if (content_append(fs, scratch_id, buffer, fill) < fill) res = ERR_MEM_OVER;
+					fill = 0;
+					if (res != 0) break;
+				}
 			}
 		}
-		if (block_id == -1){
-			free(data);
-			return ERR_MEM_OVER; 
-		}  
+	}
+	if (iov_count < 0) res = iov_count;
+	if (res == 0 && fill > 0 && content_append(fs, scratch_id, buffer, fill) < fill) res = ERR_MEM_OVER;
+	free(buffer);
+
+	// On success the file takes over the new block map and the scratch file the old one
+	if (res == 0) {
+		fs_mark_inode_dirty(fs, inode_id);
+		fs_mark_inode_dirty(fs, scratch_id);
+		inode old = *node;
+		memcpy(node->direct_blocks, scratch->direct_blocks, sizeof(node->direct_blocks));
+		memcpy(node->indirect_blocks, scratch->indirect_blocks, sizeof(node->indirect_blocks));
+		node->size = scratch->size;
+		node->flags = flags;
+		memcpy(scratch->direct_blocks, old.direct_blocks, sizeof(old.direct_blocks));
+		memcpy(scratch->indirect_blocks, old.indirect_blocks, sizeof(old.indirect_blocks));
+		scratch->size = old.size;
+	}
+	zfile_forget(fs, inode_id, 0);
+	zfile_forget(fs, scratch_id, 0);
+	bmap_truncate(fs, scratch_id, 0);
+	inode_free(fs, scratch_id);
+	inode_locks_release(fs, &held);
+	return op_done(fs, res);
+}
 
-		//split unit is BLOCK_SIZE(1024 bytes)
-		size_t chunk_size = data_len - bytes_written;
-		if (chunk_size > BLOCK_SIZE)
-			chunk_size = BLOCK_SIZE;
+/*  The entry points of operations.h, each call is counted and timed, see stats.h and trace.h.
+ *  fs_telldir, fs_seekdir and fs_closedir only touch the handle and are not counted. */
 
-		memcpy(fs->data_blocks[block_id].block, data + bytes_written, chunk_size);
-		fs->data_blocks[block_id].size = chunk_size;
+int
+fs_mkdir(file_system *fs, char *path)
+{
+	TRACE_SCOPE("fs_mkdir");
+	uint64_t start = stats_start();
+	int res = do_mkdir(fs, path);
+	stats_op(STATS_MKDIR, start, res < 0, 0);
+	return res;
+}
 
-		node->direct_blocks[block_index++] = block_id;
-		bytes_written += chunk_size;
-		node->size += chunk_size;
-	}
+int
+fs_mkfile(file_system *fs, char *path_and_name)
+{
+	TRACE_SCOPE("fs_mkfile");
+	uint64_t start = stats_start();
+	int res = do_mkfile(fs, path_and_name);
+	stats_op(STATS_MKFILE, start, res < 0, 0);
+	return res;
+}
 
-	free(data);
-	if (bytes_written < data_len){
-		return ERR_MEM_OVER;
-	}
+int
+fs_cp(file_system *fs, char *src_path, char *dst_path_and_name)
+{
+	TRACE_SCOPE("fs_cp");
+	uint64_t start = stats_start();
+	int res = do_cp(fs, src_path, dst_path_and_name);
+	stats_op(STATS_CP, start, res < 0, 0);
+	return res;
+}
 
-	return 0;
+char *
+fs_list(file_system *fs, char *path)
+{
+	TRACE_SCOPE("fs_list");
+	uint64_t start = stats_start();
+	char *listing = do_list(fs, path);
+	stats_op(STATS_LIST, start, listing == NULL, 0);
+	return listing;
+}
+
+fs_dir *
+fs_opendir(file_system *fs, char *path)
+{
+	TRACE_SCOPE("fs_opendir");
+	uint64_t start = stats_start();
+	fs_dir *dir = do_opendir(fs, path);
+	stats_op(STATS_OPENDIR, start, dir == NULL, 0);
+	return dir;
+}
+
+fs_dirent *
+fs_readdir(fs_dir *dir)
+{
+	uint64_t start = stats_start();
+	fs_dirent *entry = do_readdir(dir);
+	stats_op(STATS_READDIR, start, 0, 0);
+	return entry;
 }
 
 int
-fs_export(file_system *fs, char *int_path, char *ext_path)
+fs_walk(file_system *fs, char *path, walk_fn pre, walk_fn post, void *arg, int threads)
 {
-	if (!fs || !int_path || !ext_path) return ERR_IO;
+	if (!fs || !path) return ERR_IO;
+	TRACE_SCOPE("fs_walk");
+	uint64_t start = stats_start();
+	fs_lock_shared(fs);
+	int inode_id;
+	int res = inode_from_path(fs, path, &inode_id);
+	if (res == 0) res = tree_walk(fs, inode_id, pre, post, arg, threads);
+	fs_unlock(fs);
+	stats_op(STATS_WALK, start, res < 0, 0);
+	return res;
+}
 
-    // Locate the internal file inode
-    int inode_id;
-    if (inode_from_path(fs, int_path, &inode_id) != 0)  return ERR_NOT_FOUND;
-    inode *file_inode = &fs->inodes[inode_id];
-    if (file_inode->n_type != reg_file)  return ERR_NOT_FOUND;  
+int
+fs_writef(file_system *fs, char *filename, char *text)
+{
+	TRACE_SCOPE("fs_writef");
+	uint64_t start = stats_start();
+	int res = do_writef(fs, filename, text);
+	stats_op(STATS_WRITEF, start, res < 0, res > 0 ? res : 0);
+	return res;
+}
 
-    // Open the external file for writing
-    FILE *dst = fopen(ext_path, "wb");
-    if (!dst)  return ERR_NOT_FOUND;
-
-    // Write all data blocks in order
-    for (int i = 0; i < DIRECT_BLOCKS_COUNT; ++i) {
-        int block_id = file_inode->direct_blocks[i];
-        if (block_id == -1) continue;
-
-        data_block *blk = &fs->data_blocks[block_id];
-        if (fwrite(blk->block, 1, blk->size, dst) != blk->size) {
-            fclose(dst);
-            return ERR_MEM_OVER;
-        }
-    }
+uint8_t *
+fs_readf(file_system *fs, char *filename, int *file_size)
+{
+	TRACE_SCOPE("fs_readf");
+	if (!file_size) return NULL;
+	uint64_t start = stats_start();
+	// an empty file reads as NULL too, a failed read leaves file_size alone
+	int given = *file_size;
+	*file_size = -1;
+	uint8_t *buffer = do_readf(fs, filename, file_size);
+	int failed = *file_size == -1;
+	if (failed) *file_size = given;
+	stats_op(STATS_READF, start, failed, failed ? 0 : *file_size);
+	return buffer;
+}
 
-    fclose(dst);
-    return 0;
+int
+fs_readv(file_system *fs, char *filename, uint64_t offset, size_t length, struct iovec *iov, int iov_count)
+{
+	TRACE_SCOPE("fs_readv");
+	uint64_t start = stats_start();
+	int res = do_readv(fs, filename, offset, length, iov, iov_count);
+	uint64_t bytes = 0;
+	for (int i = 0; i < res; i++) bytes += iov[i].iov_len;
+	stats_op(STATS_READV, start, res < 0, bytes);
+	return res;
+}
+
+int
+fs_rm(file_system *fs, char *path)
+{
+	TRACE_SCOPE("fs_rm");
+	uint64_t start = stats_start();
+	int res = do_rm(fs, path);
+	stats_op(STATS_RM, start, res < 0, 0);
+	return res;
+}
+
+int
+fs_import(file_system *fs, char *int_path, char *ext_path)
+{
+	TRACE_SCOPE("fs_import");
+	uint64_t start = stats_start();
+	uint64_t bytes;
+	int res = do_import(fs, int_path, ext_path, &bytes);
+	stats_op(STATS_IMPORT, start, res < 0, bytes);
+	return res;
+}
+
+int
+fs_export(file_system *fs, char *int_path, char *ext_path)
+{
+	TRACE_SCOPE("fs_export");
+	uint64_t start = stats_start();
+	uint64_t bytes;
+	int res = do_export(fs, int_path, ext_path, &bytes);
+	stats_op(STATS_EXPORT, start, res < 0, bytes);
+	return res;
+}
+
+int
+fs_compress(file_system *fs, char *filename, int on)
+{
+	TRACE_SCOPE("fs_compress");
+	uint64_t start = stats_start();
+	int res = do_compress(fs, filename, on);
+	stats_op(STATS_COMPRESS, start, res < 0, 0);
+	return res;
 }
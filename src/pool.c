@@ -0,0 +1,136 @@
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../lib/pool.h"
+
+// the tasks of one thread: it pushes and takes at the tail, others steal at the head
+struct deque{
+	pthread_mutex_t lock;
+	void** tasks;
+	uint32_t head;
+	uint32_t tail;
+	uint32_t capacity;
+};
+
+struct pool{
+	pool_fn fn;
+	void* arg;
+	int threads;
+	uint64_t pending; //tasks pushed and not done yet
+	struct _pool_worker* workers;
+};
+
+struct _pool_worker{
+	struct pool* pool;
+	struct deque deque;
+	int index;
+};
+
+static void deque_push(struct deque* d, void* task){
+	pthread_mutex_lock(&d->lock);
+	if(d->tail == d->capacity){
+		// move the tasks left to the front before growing
+		uint32_t count = d->tail - d->head;
+		memmove(d->tasks, d->tasks + d->head, count * sizeof(void*));
+		d->head = 0;
+		d->tail = count;
+		if(count * 2 >= d->capacity){
+			uint32_t capacity = d->capacity ? d->capacity * 2 : 64;
+			void** tasks = realloc(d->tasks, capacity * sizeof(void*));
+			if(tasks == NULL){
+				perror("Realloc error");
+				exit(errno);
+			}
+			d->tasks = tasks;
+			d->capacity = capacity;
+		}
+	}
+	d->tasks[d->tail++] = task;
+	pthread_mutex_unlock(&d->lock);
+}
+
+// the newest task, for the owner, or the oldest one, for a thief
+static void* deque_take(struct deque* d, int oldest){
+	void* task = NULL;
+	pthread_mutex_lock(&d->lock);
+	if(d->head < d->tail){
+		task = oldest ? d->tasks[d->head++] : d->tasks[--d->tail];
+		if(d->head == d->tail) d->head = d->tail = 0;
+	}
+	pthread_mutex_unlock(&d->lock);
+	return task;
+}
+
+static void* work(void* arg){
+	pool_worker* worker = arg;
+	struct pool* p = worker->pool;
+	while(1){
+		void* task = deque_take(&worker->deque, 0);
+		for (int i = 1; task == NULL && i < p->threads; i++) {
+			task = deque_take(&p->workers[(worker->index + i) % p->threads].deque, 1);
+		}
+		if(task != NULL){
+			p->fn(worker, task, p->arg);
+			__atomic_sub_fetch(&p->pending, 1, __ATOMIC_ACQ_REL);
+		}
+		else if(__atomic_load_n(&p->pending, __ATOMIC_ACQUIRE) == 0){
+			return NULL;
+		}
+		else{
+			// the tasks still running may push more
+			sched_yield();
+		}
+	}
+}
+
+void pool_run(int threads, pool_fn fn, void* task, void* arg){
+	if(threads < 1) threads = 1;
+	struct pool p = {fn, arg, threads, 1, calloc(threads, sizeof(pool_worker))};
+	pthread_t* ids = calloc(threads, sizeof(pthread_t));
+	if(p.workers == NULL || ids == NULL){
+		perror("Calloc error");
+		exit(errno);
+	}
+	for (int i = 0; i < threads; i++) {
+		p.workers[i].pool = &p;
+		p.workers[i].index = i;
+		pthread_mutex_init(&p.workers[i].deque.lock, NULL);
+	}
+	deque_push(&p.workers[0].deque, task);
+
+	// a thread that can't be started leaves its share to the others, its deque stays empty
+	int started = 1;
+	for (int i = 1; i < threads; i++) {
+		if(pthread_create(&ids[i], NULL, work, &p.workers[i]) != 0) break;
+		started++;
+	}
+	work(&p.workers[0]);
+	for (int i = 1; i < started; i++) {
+		pthread_join(ids[i], NULL);
+	}
+
+	for (int i = 0; i < threads; i++) {
+		pthread_mutex_destroy(&p.workers[i].deque.lock);
+		free(p.workers[i].deque.tasks);
+	}
+	free(p.workers);
+	free(ids);
+}
+
+void pool_push(pool_worker* worker, void* task){
+	__atomic_add_fetch(&worker->pool->pending, 1, __ATOMIC_ACQ_REL);
+	deque_push(&worker->deque, task);
+}
+
+int pool_threads(void){
+	const char* threads = getenv("POOL_THREADS");
+	if(threads != NULL && atoi(threads) > 0) return atoi(threads);
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+}
@@ -0,0 +1,352 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "../lib/operations.h"
+#include "../lib/protocol.h"
+#include "../lib/server.h"
+
+#define SERVER_EVENTS 64 //events taken from epoll at once
+#define SERVER_READ (64 * 1024) //bytes read from a connection at once
+#define SERVER_IOV 64
+#define SERVER_LINGER 1 //seconds a reply may take to be written at shutdown
+
+// a client connection
+struct conn{
+	struct conn* prev;
+	struct conn* next;
+	int fd;
+	int closing; //drop the connection once out is written
+	uint8_t* in; //bytes read and not yet handled
+	size_t in_len;
+	size_t in_cap;
+	uint8_t* out; //replies not yet written, from out_off on
+	size_t out_off;
+	size_t out_len;
+	size_t out_cap;
+	uint32_t events; //what epoll waits for
+};
+
+struct server{
+	file_system* fs;
+	const char* image_path;
+	int epoll_fd;
+	int stop;
+	struct conn* conns; //open connections
+};
+
+static void* grow(void* buf, size_t* cap, size_t need){
+	if(need <= *cap) return buf;
+	size_t cap_new = *cap ? *cap : 4096;
+	while(cap_new < need) cap_new *= 2;
+	void* grown = realloc(buf, cap_new);
+	if(grown == NULL){
+		perror("Malloc error");
+		exit(errno);
+	}
+	*cap = cap_new;
+	return grown;
+}
+
+static void out_append(struct conn* c, const void* data, size_t len){
+	c->out = grow(c->out, &c->out_cap, c->out_len + len);
+	memcpy(c->out + c->out_len, data, len);
+	c->out_len += len;
+}
+
+/*
+ * The next NUL terminated string of the arguments, NULL if there is none
+ */
+static char* next_string(uint8_t** args, uint8_t* end){
+	uint8_t* nul = memchr(*args, '\0', end - *args);
+	if(nul == NULL) return NULL;
+	char* s = (char*)*args;
+	*args = nul + 1;
+	return s;
+}
+
+/*
+ * Run request req with its arguments args and append the reply to c->out
+ */
+static void handle(struct server* srv, struct conn* c, const proto_request* req, uint8_t* args){
+	file_system* fs = srv->fs;
+	uint8_t* end = args + req->length;
+	size_t start = c->out_len;
+	proto_reply reply = { 0, req->tag, PROTO_BAD_REQUEST };
+	out_append(c, &reply, sizeof(reply));
+
+	uint64_t range[2] = { 0, 0 };
+	if(req->op == PROTO_READV){
+		if(end - args < (ptrdiff_t)sizeof(range)) goto done;
+		memcpy(range, args, sizeof(range));
+		args += sizeof(range);
+	}
+	char* path = next_string(&args, end);
+	char* arg = NULL;
+	if(req->op == PROTO_CP || req->op == PROTO_WRITEF || req->op == PROTO_IMPORT || req->op == PROTO_EXPORT){
+		arg = next_string(&args, end);
+		if(arg == NULL) goto done;
+	}
+	if(path == NULL && req->op != PROTO_DUMP && req->op != PROTO_SHUTDOWN) goto done;
+
+	switch(req->op){
+		case PROTO_MKDIR:	reply.status = fs_mkdir(fs, path); break;
+		case PROTO_MKFILE:	reply.status = fs_mkfile(fs, path); break;
+		case PROTO_CP:	reply.status = fs_cp(fs, path, arg); break;
+		case PROTO_WRITEF:	reply.status = fs_writef(fs, path, arg); break;
+		case PROTO_RM:	reply.status = fs_rm(fs, path); break;
+		case PROTO_IMPORT:	reply.status = fs_import(fs, path, arg); break;
+		case PROTO_EXPORT:	reply.status = fs_export(fs, path, arg); break;
+		case PROTO_COMPRESS:	reply.status = fs_compress(fs, path, req->flag); break;
+		case PROTO_DUMP:	reply.status = fs_dump(fs, srv->image_path); break;
+		case PROTO_SHUTDOWN:
+			reply.status = 0;
+			srv->stop = 1;
+			break;
+		case PROTO_LIST: {
+			char* listing = fs_list(fs, path);
+			reply.status = listing ? 0 : -1;
+			if(listing){
+				out_append(c, listing, strlen(listing));
+				free(listing);
+			}
+			break;
+		}
+		case PROTO_READF: {
+			int size = 0;
+			uint8_t* content = fs_readf(fs, path, &size);
+			// an empty file reads as NULL as well
+			reply.status = content || size == 0 ? 0 : -1;
+			if(content){
+				out_append(c, content, size);
+				free(content);
+			}
+			break;
+		}
+		case PROTO_READV: {
+			// copied out of the blocks, later requests may change them before the reply is written
+			uint64_t offset = range[0];
+			uint64_t left = MIN(range[1], PROTO_MAX_READV);
+			struct iovec iov[SERVER_IOV];
+			int n = 0;
+			while(left > 0 && (n = fs_readv(fs, path, offset, left, iov, SERVER_IOV)) > 0){
+				for (int i = 0; i < n; i++) {
+					out_append(c, iov[i].iov_base, iov[i].iov_len);
+					offset += iov[i].iov_len;
+					left -= iov[i].iov_len;
+				}
+			}
+			reply.status = n < 0 ? n : (int32_t)(offset - range[0]);
+			break;
+		}
+	}
+
+done:
+	reply.length = c->out_len - start - sizeof(reply);
+	memcpy(c->out + start, &reply, sizeof(reply));
+}
+
+/*
+ * Run the complete requests in c->in, while the replies waiting are few enough
+ */
+static void handle_input(struct server* srv, struct conn* c){
+	size_t pos = 0;
+	while(!c->closing && c->out_len - c->out_off < SERVER_OUT_HIGH && c->in_len - pos >= sizeof(proto_request)){
+		proto_request req;
+		memcpy(&req, c->in + pos, sizeof(req));
+		if(req.length > PROTO_MAX_REQUEST){
+			c->closing = 1;
+			break;
+		}
+		if(c->in_len - pos - sizeof(req) < req.length) break;
+		handle(srv, c, &req, c->in + pos + sizeof(req));
+		pos += sizeof(req) + req.length;
+	}
+	memmove(c->in, c->in + pos, c->in_len - pos);
+	c->in_len -= pos;
+}
+
+static void conn_close(struct server* srv, struct conn* c){
+	if(c->prev) c->prev->next = c->next;
+	else srv->conns = c->next;
+	if(c->next) c->next->prev = c->prev;
+	epoll_ctl(srv->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	free(c->in);
+	free(c->out);
+	free(c);
+}
+
+/*
+ * Write what can be written of c->out. Returns -1 if the connection broke
+ */
+static int flush_out(struct conn* c){
+	while(c->out_off < c->out_len){
+		ssize_t written = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL);
+		if(written < 0){
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			return -1;
+		}
+		c->out_off += written;
+	}
+	c->out_off = 0;
+	c->out_len = 0;
+	return 0;
+}
+
+/*
+ * Read what c sent and answer it. Returns -1 if the connection is done
+ */
+static int conn_read(struct server* srv, struct conn* c){
+	while(1){
+		// requests beyond the buffered ones wait while the client is not reading
+		if(c->out_len - c->out_off >= SERVER_OUT_HIGH) return 0;
+		c->in = grow(c->in, &c->in_cap, c->in_len + SERVER_READ);
+		ssize_t got = recv(c->fd, c->in + c->in_len, SERVER_READ, 0);
+		if(got < 0){
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			return -1;
+		}
+		if(got == 0){
+			// the client is done sending, answer what it sent
+			c->closing = 1;
+			return 0;
+		}
+		c->in_len += got;
+		handle_input(srv, c);
+		if(c->closing || srv->stop) return 0;
+	}
+}
+
+/*
+ * Wait for input while few replies are waiting, for output while any are
+ */
+static void conn_watch(struct server* srv, struct conn* c){
+	uint32_t events = 0;
+	if(!c->closing && c->out_len - c->out_off < SERVER_OUT_HIGH) events |= EPOLLIN;
+	if(c->out_off < c->out_len) events |= EPOLLOUT;
+	if(events == c->events) return;
+	struct epoll_event ev = { .events = events, .data.ptr = c };
+	epoll_ctl(srv->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+	c->events = events;
+}
+
+/*
+ * Serve an event of connection c, it is closed and freed when it is done
+ */
+static void conn_event(struct server* srv, struct conn* c, uint32_t events){
+	int broken = 0;
+	if(events & (EPOLLIN | EPOLLHUP | EPOLLERR)) broken = conn_read(srv, c) != 0;
+	if(!broken && flush_out(c) != 0) broken = 1;
+	// replies written make room for the requests still buffered
+	if(!broken && c->in_len > 0 && c->out_len - c->out_off < SERVER_OUT_HIGH){
+		handle_input(srv, c);
+		if(flush_out(c) != 0) broken = 1;
+	}
+	if(broken || (c->closing && c->out_off == c->out_len)){
+		conn_close(srv, c);
+		return;
+	}
+	conn_watch(srv, c);
+}
+
+static void accept_all(struct server* srv, int listen_fd){
+	while(1){
+		int fd = accept(listen_fd, NULL, NULL);
+		if(fd < 0) return;
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		struct conn* c = calloc(1, sizeof(struct conn));
+		if(c == NULL){
+			perror("Calloc error");
+			exit(errno);
+		}
+		c->fd = fd;
+		c->events = EPOLLIN;
+		struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+		if(epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0){
+			close(fd);
+			free(c);
+			continue;
+		}
+		c->next = srv->conns;
+		if(c->next) c->next->prev = c;
+		srv->conns = c;
+	}
+}
+
+int serve(file_system* fs, const char* image_path, const char* socket_path){
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if(strlen(socket_path) >= sizeof(addr.sun_path)) return -1;
+	strcpy(addr.sun_path, socket_path);
+
+	int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(listen_fd < 0) return -1;
+	unlink(socket_path);
+	if(bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listen_fd, SOMAXCONN) != 0){
+		close(listen_fd);
+		return -1;
+	}
+
+	// SIGINT and SIGTERM end the loop like a shutdown request
+	sigset_t signals, old_signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, &old_signals);
+	int signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+	struct server srv = { fs, image_path, epoll_create1(EPOLL_CLOEXEC), 0, NULL };
+	// listen_fd and signal_fd are told apart from connections by their data
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &listen_fd };
+	epoll_ctl(srv.epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+	if(signal_fd >= 0){
+		ev.data.ptr = &signal_fd;
+		epoll_ctl(srv.epoll_fd, EPOLL_CTL_ADD, signal_fd, &ev);
+	}
+
+	struct epoll_event events[SERVER_EVENTS];
+	while(!srv.stop){
+		int n = epoll_wait(srv.epoll_fd, events, SERVER_EVENTS, -1);
+		if(n < 0 && errno != EINTR) break;
+		for (int i = 0; i < n; i++) {
+			if(events[i].data.ptr == &listen_fd){
+				accept_all(&srv, listen_fd);
+			}
+			else if(events[i].data.ptr == &signal_fd){
+				// taken off, or it would be delivered once the mask is restored
+				struct signalfd_siginfo info;
+				if(read(signal_fd, &info, sizeof(info)) == sizeof(info)) srv.stop = 1;
+			}
+			else{
+				conn_event(&srv, events[i].data.ptr, events[i].events);
+			}
+		}
+	}
+
+	// the replies already made are written, waiting a little for slow readers
+	while(srv.conns != NULL){
+		struct conn* c = srv.conns;
+		struct timeval linger = { SERVER_LINGER, 0 };
+		setsockopt(c->fd, SOL_SOCKET, SO_SNDTIMEO, &linger, sizeof(linger));
+		fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) & ~O_NONBLOCK);
+		flush_out(c);
+		conn_close(&srv, c);
+	}
+	close(srv.epoll_fd);
+	close(listen_fd);
+	unlink(socket_path);
+	if(signal_fd >= 0) close(signal_fd);
+	pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+	return 0;
+}
@@ -0,0 +1,551 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "../lib/bitmap.h"
+#include "../lib/journal.h"
+#include "../lib/snapshot.h"
+#include "../lib/lock.h"
+#include "../lib/trace.h"
+
+#define SNAPSHOT_MAGIC 0x50414e53 //"SNAP"
+
+typedef struct _saved_inode{
+	uint32_t id;
+	inode value;
+} saved_inode;
+
+typedef struct _saved_block{
+	uint32_t id;
+	data_block value;
+} saved_block;
+
+typedef struct _saved_free{
+	uint32_t id;
+	uint8_t value;
+} saved_free;
+
+// a snapshot and the old content of what changed after it was taken, until the next one was
+typedef struct _snapshot{
+	char name[NAME_MAX_LENGTH];
+	superblock s_block; //as it was when the snapshot was taken
+	uint32_t n_inodes;
+	uint32_t n_blocks;
+	uint32_t n_free;
+	uint32_t cap_inodes;
+	uint32_t cap_blocks;
+	uint32_t cap_free;
+	saved_inode* inodes;
+	saved_block* blocks;
+	saved_free* free;
+} snapshot;
+
+struct snapshots{
+	int count;
+	int capacity;
+	snapshot* list; //oldest first
+	uint64_t* saved_inodes; //saved for the newest snapshot
+	uint64_t* saved_blocks;
+	uint64_t* saved_free;
+	uint64_t* was_free; //free list entries saved for the newest snapshot as free
+};
+
+// <image>.snap is a header, then for every snapshot an entry followed by its saved records
+typedef struct _snapshot_file_header{
+	uint32_t magic; //SNAPSHOT_MAGIC
+	uint32_t count;
+	uint32_t num_blocks; //of the image
+	uint32_t pad;
+} snapshot_file_header;
+
+typedef struct _snapshot_entry{
+	char name[NAME_MAX_LENGTH];
+	superblock s_block;
+	uint32_t n_inodes;
+	uint32_t n_blocks;
+	uint32_t n_free;
+	uint32_t pad;
+} snapshot_entry;
+
+static char* snapshot_path(const char* image_path, const char* suffix){
+	size_t len = strlen(image_path);
+	char* path = malloc(len + strlen(suffix) + 1);
+	if(path == NULL) return NULL;
+	memcpy(path, image_path, len);
+	strcpy(path + len, suffix);
+	return path;
+}
+
+/*
+ * Returns array with room for one more than count elements of size bytes, NULL if there is no memory
+ */
+static void* grow(void* array, uint32_t* capacity, uint32_t count, size_t size){
+	if(count < *capacity) return array;
+	uint32_t n = *capacity ? *capacity * 2 : 16;
+	void* p = realloc(array, n * size);
+	if(p != NULL) *capacity = n;
+	return p;
+}
+
+static snapshot* newest(struct snapshots* snaps){
+	return &snaps->list[snaps->count - 1];
+}
+
+static int find(file_system* fs, const char* name){
+	struct snapshots* snaps = fs->snapshots;
+	if(snaps == NULL || name == NULL) return -1;
+	for (int i = 0; i < snaps->count; i++) {
+		if(strncmp(snaps->list[i].name, name, NAME_MAX_LENGTH) == 0) return i;
+	}
+	return -1;
+}
+
+/*
+ * Sets or clears the bits of the records of s, which is the newest snapshot
+ */
+static void mark_saved(struct snapshots* snaps, const snapshot* s, int set){
+	void (*update)(uint64_t*, size_t) = set ? bitmap_set : bitmap_clear;
+	for (uint32_t r = 0; r < s->n_inodes; r++) {
+		update(snaps->saved_inodes, s->inodes[r].id);
+	}
+	for (uint32_t r = 0; r < s->n_blocks; r++) {
+		update(snaps->saved_blocks, s->blocks[r].id);
+	}
+	for (uint32_t r = 0; r < s->n_free; r++) {
+		update(snaps->saved_free, s->free[r].id);
+		if(s->free[r].value) update(snaps->was_free, s->free[r].id);
+	}
+}
+
+static void snapshot_free_records(snapshot* s){
+	free(s->inodes);
+	free(s->blocks);
+	free(s->free);
+}
+
+static void out_of_memory(void){
+	perror("Malloc error");
+	exit(errno);
+}
+
+void snapshot_save_inode(file_system* fs, int inode_id){
+	struct snapshots* snaps = fs->snapshots;
+	if(snaps == NULL || bitmap_test(snaps->saved_inodes, inode_id)) return;
+	snapshot* s = newest(snaps);
+	saved_inode* inodes = grow(s->inodes, &s->cap_inodes, s->n_inodes, sizeof(saved_inode));
+	if(inodes == NULL) out_of_memory();
+	s->inodes = inodes;
+	inodes[s->n_inodes].id = inode_id;
+	inodes[s->n_inodes].value = fs->inodes[inode_id];
+	s->n_inodes++;
+	bitmap_set(snaps->saved_inodes, inode_id);
+}
+
+void snapshot_save_block(file_system* fs, int block_id){
+	struct snapshots* snaps = fs->snapshots;
+	if(snaps == NULL || bitmap_test(snaps->saved_blocks, block_id)) return;
+	// what a block held that was free when the snapshot was taken is of no use to it
+	int was_free = bitmap_test(snaps->saved_free, block_id) ? bitmap_test(snaps->was_free, block_id) : fs->free_list[block_id];
+	if(was_free) return;
+	snapshot* s = newest(snaps);
+	saved_block* blocks = grow(s->blocks, &s->cap_blocks, s->n_blocks, sizeof(saved_block));
+	if(blocks == NULL) out_of_memory();
+	s->blocks = blocks;
+	blocks[s->n_blocks].id = block_id;
+	blocks[s->n_blocks].value = fs->data_blocks[block_id];
+	s->n_blocks++;
+	bitmap_set(snaps->saved_blocks, block_id);
+}
+
+void snapshot_save_free(file_system* fs, int block_id){
+	struct snapshots* snaps = fs->snapshots;
+	if(snaps == NULL || bitmap_test(snaps->saved_free, block_id)) return;
+	snapshot* s = newest(snaps);
+	saved_free* entries = grow(s->free, &s->cap_free, s->n_free, sizeof(saved_free));
+	if(entries == NULL) out_of_memory();
+	s->free = entries;
+	entries[s->n_free].id = block_id;
+	entries[s->n_free].value = fs->free_list[block_id];
+	s->n_free++;
+	bitmap_set(snaps->saved_free, block_id);
+	if(fs->free_list[block_id]) bitmap_set(snaps->was_free, block_id);
+}
+
+static struct snapshots* snapshots_new(uint32_t n){
+	struct snapshots* snaps = calloc(1, sizeof(struct snapshots));
+	if(snaps == NULL) return NULL;
+	snaps->saved_inodes = bitmap_alloc(n);
+	snaps->saved_blocks = bitmap_alloc(n);
+	snaps->saved_free = bitmap_alloc(n);
+	snaps->was_free = bitmap_alloc(n);
+	if(snaps->saved_inodes == NULL || snaps->saved_blocks == NULL || snaps->saved_free == NULL || snaps->was_free == NULL){
+		free(snaps->saved_inodes);
+		free(snaps->saved_blocks);
+		free(snaps->saved_free);
+		free(snaps->was_free);
+		free(snaps);
+		return NULL;
+	}
+	return snaps;
+}
+
+/*
+ * Appends an empty snapshot to the list, NULL if there is no memory
+ */
+static snapshot* snapshot_append(file_system* fs, const char* name, const superblock* s_block){
+	struct snapshots* snaps = fs->snapshots;
+	if(snaps == NULL){
+		snaps = snapshots_new(fs->s_block->num_blocks);
+		if(snaps == NULL) return NULL;
+		fs->snapshots = snaps;
+	}
+	if(snaps->count == snaps->capacity){
+		int capacity = snaps->capacity ? snaps->capacity * 2 : 4;
+		snapshot* list = realloc(snaps->list, capacity * sizeof(snapshot));
+		if(list == NULL){
+			if(snaps->count == 0) snapshot_destroy(fs);
+			return NULL;
+		}
+		snaps->list = list;
+		snaps->capacity = capacity;
+	}
+	snapshot* s = &snaps->list[snaps->count];
+	memset(s, 0, sizeof(snapshot));
+	strncpy(s->name, name, NAME_MAX_LENGTH - 1);
+	s->s_block = *s_block;
+	snaps->count++;
+	return s;
+}
+
+static int take(file_system* fs, const char* name){
+	if(name == NULL || name[0] == '\0' || strlen(name) >= NAME_MAX_LENGTH) return -1;
+	if(fs->read_only || fs->map_base != NULL || find(fs, name) >= 0) return -2;
+
+	// nothing is saved for the new snapshot yet, the bits of the one before go
+	if(fs->snapshots) mark_saved(fs->snapshots, newest(fs->snapshots), 0);
+	if(snapshot_append(fs, name, fs->s_block) == NULL){
+		if(fs->snapshots) mark_saved(fs->snapshots, newest(fs->snapshots), 1);
+		return -2;
+	}
+	return 0;
+}
+
+static char* list_names(file_system* fs){
+	struct snapshots* snaps = fs->snapshots;
+	int count = snaps ? snaps->count : 0;
+	// a name and its newline fit into NAME_MAX_LENGTH
+	char* out = malloc((size_t)count * NAME_MAX_LENGTH + 1);
+	if(out == NULL) return NULL;
+	char* end = out;
+	for (int i = 0; i < count; i++) {
+		size_t len = strnlen(snaps->list[i].name, NAME_MAX_LENGTH - 1);
+		memcpy(end, snaps->list[i].name, len);
+		end += len;
+		*end++ = '\n';
+	}
+	*end = '\0';
+	return out;
+}
+
+/*
+ * Puts the content saved for s back into fs, marking it dirty
+ */
+static void apply(file_system* fs, const snapshot* s){
+	for (uint32_t r = 0; r < s->n_inodes; r++) {
+		fs_mark_inode_dirty(fs, s->inodes[r].id);
+		fs->inodes[s->inodes[r].id] = s->inodes[r].value;
+	}
+	for (uint32_t r = 0; r < s->n_blocks; r++) {
+		fs_mark_block_dirty(fs, s->blocks[r].id);
+		fs->data_blocks[s->blocks[r].id] = s->blocks[r].value;
+	}
+	for (uint32_t r = 0; r < s->n_free; r++) {
+		fs_mark_free_dirty(fs, s->free[r].id);
+		fs->free_list[s->free[r].id] = s->free[r].value;
+	}
+}
+
+static file_system* mount(file_system* fs, const char* name){
+	int index = find(fs, name);
+	if(index < 0) return NULL;
+	struct snapshots* snaps = fs->snapshots;
+
+	// the oldest saved content wins, it is applied last
+	file_system* view = fs_clone(fs);
+	for (int k = snaps->count - 1; k >= index; k--) {
+		apply(view, &snaps->list[k]);
+	}
+	*view->s_block = snaps->list[index].s_block;
+	view->read_only = 1;
+	return view;
+}
+
+static int rollback(file_system* fs, const char* name){
+	int index = find(fs, name);
+	if(index < 0) return -1;
+	struct snapshots* snaps = fs->snapshots;
+
+	// detached, so putting the old content back saves nothing
+	fs->snapshots = NULL;
+	for (int k = snaps->count - 1; k >= index; k--) {
+		apply(fs, &snaps->list[k]);
+	}
+	fs->s_block->free_blocks = snaps->list[index].s_block.free_blocks;
+	fs->snapshots = snaps;
+
+	// fs is the snapshot again, nothing changed since it was taken
+	mark_saved(snaps, newest(snaps), 0);
+	for (int k = index + 1; k < snaps->count; k++) {
+		snapshot_free_records(&snaps->list[k]);
+	}
+	snaps->count = index + 1;
+	snapshot* s = &snaps->list[index];
+	s->n_inodes = 0;
+	s->n_blocks = 0;
+	s->n_free = 0;
+
+	fs_drop_caches(fs);
+	journal_op_end(fs);
+	return 0;
+}
+
+/*
+ * Adds the records of src that dst has none for to dst, which was taken before src
+ */
+static int merge(file_system* fs, snapshot* dst, const snapshot* src){
+	uint64_t* has = bitmap_alloc(fs->s_block->num_blocks);
+	if(has == NULL) return -1;
+	int res = 0;
+
+	for (uint32_t r = 0; r < dst->n_inodes; r++) bitmap_set(has, dst->inodes[r].id);
+	for (uint32_t r = 0; r < src->n_inodes && res == 0; r++) {
+		if(bitmap_test(has, src->inodes[r].id)) continue;
+		saved_inode* inodes = grow(dst->inodes, &dst->cap_inodes, dst->n_inodes, sizeof(saved_inode));
+		if(inodes == NULL){
+			res = -1;
+			break;
+		}
+		dst->inodes = inodes;
+		inodes[dst->n_inodes++] = src->inodes[r];
+	}
+
+	memset(has, 0, BITMAP_WORDS(fs->s_block->num_blocks) * sizeof(uint64_t));
+	for (uint32_t r = 0; r < dst->n_blocks; r++) bitmap_set(has, dst->blocks[r].id);
+	for (uint32_t r = 0; r < src->n_blocks && res == 0; r++) {
+		if(bitmap_test(has, src->blocks[r].id)) continue;
+		saved_block* blocks = grow(dst->blocks, &dst->cap_blocks, dst->n_blocks, sizeof(saved_block));
+		if(blocks == NULL){
+			res = -1;
+			break;
+		}
+		dst->blocks = blocks;
+		blocks[dst->n_blocks++] = src->blocks[r];
+	}
+
+	memset(has, 0, BITMAP_WORDS(fs->s_block->num_blocks) * sizeof(uint64_t));
+	for (uint32_t r = 0; r < dst->n_free; r++) bitmap_set(has, dst->free[r].id);
+	for (uint32_t r = 0; r < src->n_free && res == 0; r++) {
+		if(bitmap_test(has, src->free[r].id)) continue;
+		saved_free* entries = grow(dst->free, &dst->cap_free, dst->n_free, sizeof(saved_free));
+		if(entries == NULL){
+			res = -1;
+			break;
+		}
+		dst->free = entries;
+		entries[dst->n_free++] = src->free[r];
+	}
+
+	free(has);
+	return res;
+}
+
+static int drop(file_system* fs, const char* name){
+	int index = find(fs, name);
+	if(index < 0) return -1;
+	struct snapshots* snaps = fs->snapshots;
+	snapshot* s = &snaps->list[index];
+	int was_newest = index == snaps->count - 1;
+
+	// the snapshot before sees what this one saved, a merge cut short leaves it seeing the same
+	if(index > 0 && merge(fs, &snaps->list[index - 1], s) != 0) return -2;
+	if(was_newest) mark_saved(snaps, s, 0);
+	snapshot_free_records(s);
+	memmove(s, s + 1, (snaps->count - index - 1) * sizeof(snapshot));
+	snaps->count--;
+
+	if(snaps->count == 0){
+		snapshot_destroy(fs);
+	}
+	else if(was_newest){
+		mark_saved(snaps, newest(snaps), 1);
+	}
+	return 0;
+}
+
+/*
+ * The entry points below hold the filesystem lock exclusive, see lock.h
+ */
+int snapshot_create(file_system* fs, const char* name){
+	fs_lock_exclusive(fs);
+	int res = take(fs, name);
+	fs_unlock(fs);
+	return res;
+}
+
+char* snapshot_list(file_system* fs){
+	fs_lock_exclusive(fs);
+	char* out = list_names(fs);
+	fs_unlock(fs);
+	return out;
+}
+
+file_system* snapshot_mount(file_system* fs, const char* name){
+	fs_lock_exclusive(fs);
+	file_system* view = mount(fs, name);
+	fs_unlock(fs);
+	return view;
+}
+
+int snapshot_rollback(file_system* fs, const char* name){
+	fs_lock_exclusive(fs);
+	int res = rollback(fs, name);
+	fs_unlock(fs);
+	return res;
+}
+
+int snapshot_delete(file_system* fs, const char* name){
+	fs_lock_exclusive(fs);
+	int res = drop(fs, name);
+	fs_unlock(fs);
+	return res;
+}
+
+int snapshot_dump(file_system* fs, const char* file_path){
+	TRACE_SCOPE("snapshot_dump");
+	char* path = snapshot_path(file_path, ".snap");
+	char* tmp_path = snapshot_path(file_path, ".snap.tmp");
+	int res = -1;
+	struct snapshots* snaps = fs->snapshots;
+	if(path == NULL || tmp_path == NULL) goto out;
+
+	if(snaps == NULL){
+		// the image must not pick up the snapshots of an image written there before
+		res = unlink(path) == 0 || errno == ENOENT ? 0 : -1;
+		goto out;
+	}
+
+	// written next to the old file and renamed over it, so a crash leaves one of them whole
+	FILE* f = fopen(tmp_path, "wb");
+	if(f == NULL) goto out;
+	snapshot_file_header header = {SNAPSHOT_MAGIC, snaps->count, fs->s_block->num_blocks, 0};
+	int ok = fwrite(&header, sizeof(header), 1, f) == 1;
+	for (int i = 0; i < snaps->count && ok; i++) {
+		snapshot* s = &snaps->list[i];
+		snapshot_entry entry;
+		memset(&entry, 0, sizeof(entry));
+		memcpy(entry.name, s->name, NAME_MAX_LENGTH);
+		entry.s_block = s->s_block;
+		entry.n_inodes = s->n_inodes;
+		entry.n_blocks = s->n_blocks;
+		entry.n_free = s->n_free;
+		ok = fwrite(&entry, sizeof(entry), 1, f) == 1
+		     && fwrite(s->inodes, sizeof(saved_inode), s->n_inodes, f) == s->n_inodes
+		     && fwrite(s->blocks, sizeof(saved_block), s->n_blocks, f) == s->n_blocks
+		     && fwrite(s->free, sizeof(saved_free), s->n_free, f) == s->n_free;
+	}
+	if(fclose(f) != 0) ok = 0;
+	if(ok && rename(tmp_path, path) == 0){
+		res = 0;
+	}
+	else{
+		unlink(tmp_path);
+	}
+
+out:
+	free(path);
+	free(tmp_path);
+	return res;
+}
+
+/*
+ * Reads count records of size bytes into a new array, *array stays NULL for none
+ */
+static int read_records(FILE* f, void** array, uint32_t* capacity, uint32_t count, size_t size){
+	if(count == 0) return 0;
+	*array = malloc((size_t)count * size);
+	if(*array == NULL) return -1;
+	*capacity = count;
+	return fread(*array, size, count, f) == count ? 0 : -1;
+}
+
+int snapshot_exists(const char* file_path){
+	char* path = snapshot_path(file_path, ".snap");
+	int res = path != NULL && access(path, F_OK) == 0;
+	free(path);
+	return res;
+}
+
+int snapshot_load(file_system* fs, const char* file_path){
+	TRACE_SCOPE("snapshot_load");
+	char* path = snapshot_path(file_path, ".snap");
+	FILE* f = path ? fopen(path, "rb") : NULL;
+	free(path);
+	if(f == NULL) return 0;
+
+	uint32_t n = fs->s_block->num_blocks;
+	snapshot_file_header header;
+	int ok = fread(&header, sizeof(header), 1, f) == 1 && header.magic == SNAPSHOT_MAGIC && header.num_blocks == n;
+	for (uint32_t i = 0; ok && i < header.count; i++) {
+		snapshot_entry entry;
+		if(fread(&entry, sizeof(entry), 1, f) != 1){
+			ok = 0;
+			break;
+		}
+		entry.name[NAME_MAX_LENGTH - 1] = '\0';
+		snapshot* s = snapshot_append(fs, entry.name, &entry.s_block);
+		if(s == NULL){
+			ok = 0;
+			break;
+		}
+		void* inodes = NULL;
+		void* blocks = NULL;
+		void* entries = NULL;
+		ok = read_records(f, &inodes, &s->cap_inodes, entry.n_inodes, sizeof(saved_inode)) == 0
+		     && read_records(f, &blocks, &s->cap_blocks, entry.n_blocks, sizeof(saved_block)) == 0
+		     && read_records(f, &entries, &s->cap_free, entry.n_free, sizeof(saved_free)) == 0;
+		s->inodes = inodes;
+		s->blocks = blocks;
+		s->free = entries;
+		if(!ok) break;
+		s->n_inodes = entry.n_inodes;
+		s->n_blocks = entry.n_blocks;
+		s->n_free = entry.n_free;
+		for (uint32_t r = 0; r < s->n_inodes; r++) ok &= s->inodes[r].id < n;
+		for (uint32_t r = 0; r < s->n_blocks; r++) ok &= s->blocks[r].id < n;
+		for (uint32_t r = 0; r < s->n_free; r++) ok &= s->free[r].id < n;
+	}
+	fclose(f);
+
+	if(!ok){
+		snapshot_destroy(fs);
+		return -1;
+	}
+	if(fs->snapshots == NULL) return 0;
+	mark_saved(fs->snapshots, newest(fs->snapshots), 1);
+	return fs->snapshots->count;
+}
+
+void snapshot_destroy(file_system* fs){
+	struct snapshots* snaps = fs->snapshots;
+	if(snaps == NULL) return;
+	for (int i = 0; i < snaps->count; i++) {
+		snapshot_free_records(&snaps->list[i]);
+	}
+	free(snaps->list);
+	free(snaps->saved_inodes);
+	free(snaps->saved_blocks);
+	free(snaps->saved_free);
+	free(snaps->was_free);
+	free(snaps);
+	fs->snapshots = NULL;
+}
@@ -0,0 +1,188 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../lib/stats.h"
+
+static const char* OP_NAMES[STATS_OPS] = {
+	"mkdir", "mkfile", "cp", "list", "writef", "readf", "readv", "rm",
+	"import", "export", "compress", "load", "load_mmap", "dump",
+	"opendir", "readdir", "walk"
+};
+static const char* COUNTER_NAMES[STATS_COUNTERS] = {
+	"blocks_scanned", "inodes_scanned", "path_components"
+};
+
+// the counts of one thread, or of threads that ended before it took the shard over
+struct shard{
+	fs_stats totals;
+	int taken; //by a running thread
+	struct shard* next; //shards are only ever added
+};
+
+static struct shard* shards;
+static fs_stats zero; //the sums at the last reset
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t shard_key; //hands the shard back when its thread ends
+static __thread struct shard* own;
+
+static void shard_put(void* s){
+	pthread_mutex_lock(&shards_lock);
+	((struct shard*)s)->taken = 0;
+	pthread_mutex_unlock(&shards_lock);
+}
+
+static void key_create(void){
+	pthread_key_create(&shard_key, shard_put);
+}
+
+/*
+ * The shard of the calling thread, a free one or a new one the first time
+ */
+static struct shard* shard_get(void){
+	if(own != NULL) return own;
+	pthread_once(&key_once, key_create);
+	pthread_mutex_lock(&shards_lock);
+	struct shard* s = shards;
+	while(s != NULL && s->taken) s = s->next;
+	if(s == NULL){
+		s = calloc(1, sizeof(struct shard));
+		if(s == NULL){
+			perror("Calloc error");
+			exit(errno);
+		}
+		s->next = shards;
+		__atomic_store_n(&shards, s, __ATOMIC_RELEASE);
+	}
+	s->taken = 1;
+	pthread_mutex_unlock(&shards_lock);
+	pthread_setspecific(shard_key, s);
+	own = s;
+	return s;
+}
+
+// only the owner writes, readers load the words while it does
+static inline void add(uint64_t* total, uint64_t n){
+	__atomic_store_n(total, *total + n, __ATOMIC_RELAXED);
+}
+
+uint64_t stats_start(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+void stats_op(enum stats_op op, uint64_t start, int failed, uint64_t bytes){
+	uint64_t ns = stats_start() - start;
+	int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+	if(bucket >= STATS_BUCKETS) bucket = STATS_BUCKETS - 1;
+	stats_op_totals* t = &shard_get()->totals.ops[op];
+	add(&t->calls, 1);
+	if(failed) add(&t->errors, 1);
+	add(&t->bytes, bytes);
+	add(&t->ns, ns);
+	add(&t->buckets[bucket], 1);
+}
+
+void stats_count(enum stats_counter counter, uint64_t n){
+	add(&shard_get()->totals.counters[counter], n);
+}
+
+/*
+ * The sums over all shards, the words of fs_stats added up one by one
+ */
+static void sum(fs_stats* out){
+	uint64_t* total = (uint64_t*)out;
+	memset(out, 0, sizeof(fs_stats));
+	for (struct shard* s = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); s != NULL; s = s->next) {
+		uint64_t* counts = (uint64_t*)&s->totals;
+		for (size_t i = 0; i < sizeof(fs_stats) / sizeof(uint64_t); i++) {
+			total[i] += __atomic_load_n(&counts[i], __ATOMIC_RELAXED);
+		}
+	}
+}
+
+void stats_read(fs_stats* out){
+	pthread_mutex_lock(&shards_lock);
+	sum(out);
+	uint64_t* total = (uint64_t*)out;
+	uint64_t* base = (uint64_t*)&zero;
+	for (size_t i = 0; i < sizeof(fs_stats) / sizeof(uint64_t); i++) {
+		total[i] -= base[i];
+	}
+	pthread_mutex_unlock(&shards_lock);
+}
+
+void stats_reset(void){
+	pthread_mutex_lock(&shards_lock);
+	sum(&zero);
+	pthread_mutex_unlock(&shards_lock);
+}
+
+/*
+ * Upper bound of the bucket holding percentile p of t, in ns
+ */
+static uint64_t percentile(const stats_op_totals* t, int p){
+	uint64_t rank = (t->calls * p + 99) / 100;
+	uint64_t seen = 0;
+	for (int b = 0; b < STATS_BUCKETS; b++) {
+		seen += t->buckets[b];
+		if(seen >= rank && seen > 0) return 1ull << b;
+	}
+	return 1ull << (STATS_BUCKETS - 1);
+}
+
+char* stats_format(int json){
+	fs_stats st;
+	stats_read(&st);
+	char* text = NULL;
+	size_t len = 0;
+	FILE* out = open_memstream(&text, &len);
+	if(out == NULL){
+		perror("Malloc error");
+		exit(errno);
+	}
+
+	if(json) fprintf(out, "{\"ops\": {");
+	else fprintf(out, "%-10s %10s %8s %12s %12s %10s %10s %10s %10s\n",
+		"op", "calls", "errors", "bytes", "total_us", "mean_ns", "p50_ns", "p90_ns", "p99_ns");
+	int first = 1;
+	for (int op = 0; op < STATS_OPS; op++) {
+		const stats_op_totals* t = &st.ops[op];
+		if(t->calls == 0) continue;
+		if(!json){
+			fprintf(out, "%-10s %10llu %8llu %12llu %12llu %10llu %10llu %10llu %10llu\n", OP_NAMES[op],
+				(unsigned long long)t->calls, (unsigned long long)t->errors, (unsigned long long)t->bytes,
+				(unsigned long long)(t->ns / 1000), (unsigned long long)(t->ns / t->calls),
+				(unsigned long long)percentile(t, 50), (unsigned long long)percentile(t, 90),
+				(unsigned long long)percentile(t, 99));
+			continue;
+		}
+		fprintf(out, "%s\"%s\": {\"calls\": %llu, \"errors\": %llu, \"bytes\": %llu, \"ns\": %llu, "
+			"\"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, \"histogram\": {",
+			first ? "" : ", ", OP_NAMES[op], (unsigned long long)t->calls, (unsigned long long)t->errors,
+			(unsigned long long)t->bytes, (unsigned long long)t->ns, (unsigned long long)percentile(t, 50),
+			(unsigned long long)percentile(t, 90), (unsigned long long)percentile(t, 99));
+		// keyed by the upper bound of the bucket in ns, empty buckets left out
+		int first_bucket = 1;
+		for (int b = 0; b < STATS_BUCKETS; b++) {
+			if(t->buckets[b] == 0) continue;
+			fprintf(out, "%s\"%llu\": %llu", first_bucket ? "" : ", ", 1ull << b, (unsigned long long)t->buckets[b]);
+			first_bucket = 0;
+		}
+		fprintf(out, "}}");
+		first = 0;
+	}
+
+	if(json) fprintf(out, "}, \"counters\": {");
+	for (int c = 0; c < STATS_COUNTERS; c++) {
+		if(json) fprintf(out, "%s\"%s\": %llu", c ? ", " : "", COUNTER_NAMES[c], (unsigned long long)st.counters[c]);
+		else fprintf(out, "%s %llu\n", COUNTER_NAMES[c], (unsigned long long)st.counters[c]);
+	}
+	if(json) fprintf(out, "}}\n");
+	fclose(out);
+	return text;
+}
@@ -0,0 +1,159 @@
+#include "../lib/trace.h"
+
+#ifdef TRACE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+struct trace_event{
+	uint64_t tick;
+	const char* name;
+	uint32_t tid;
+	char phase; //'B' or 'E'
+};
+
+// the events of one thread, taken over by another one once the thread ends
+struct ring{
+	struct trace_event events[TRACE_RING];
+	uint64_t head; //events written so far, only the owner writes
+	uint32_t tid; //of the owner, events keep the tid they were written with
+	int taken;
+	struct ring* next; //rings are only ever added
+};
+
+int trace_on;
+static struct ring* rings;
+static uint32_t next_tid = 1;
+static uint64_t start_tick; //events before it were dropped by trace_enable
+static uint64_t start_ns;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key; //hands the ring back when its thread ends
+static __thread struct ring* own;
+
+static inline uint64_t tick_now(void){
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+#endif
+}
+
+static uint64_t ns_now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void ring_put(void* r){
+	pthread_mutex_lock(&rings_lock);
+	((struct ring*)r)->taken = 0;
+	pthread_mutex_unlock(&rings_lock);
+}
+
+static void key_create(void){
+	pthread_key_create(&ring_key, ring_put);
+}
+
+/*
+ * The ring of the calling thread, a free one or a new one the first time
+ */
+static struct ring* ring_get(void){
+	if(own != NULL) return own;
+	pthread_once(&key_once, key_create);
+	pthread_mutex_lock(&rings_lock);
+	struct ring* r = rings;
+	while(r != NULL && r->taken) r = r->next;
+	if(r == NULL){
+		r = calloc(1, sizeof(struct ring));
+		if(r == NULL){
+			perror("Calloc error");
+			exit(errno);
+		}
+		r->next = rings;
+		__atomic_store_n(&rings, r, __ATOMIC_RELEASE);
+	}
+	r->taken = 1;
+	r->tid = next_tid++;
+	pthread_mutex_unlock(&rings_lock);
+	pthread_setspecific(ring_key, r);
+	own = r;
+	return r;
+}
+
+void trace_event(const char* name, char phase){
+	struct ring* r = ring_get();
+	struct trace_event* e = &r->events[r->head % TRACE_RING];
+	e->tick = tick_now();
+	e->name = name;
+	e->tid = r->tid;
+	e->phase = phase;
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+int trace_enable(int on){
+	pthread_mutex_lock(&rings_lock);
+	if(on && !trace_on){
+		start_ns = ns_now();
+		start_tick = tick_now();
+	}
+	__atomic_store_n(&trace_on, on != 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&rings_lock);
+	return 0;
+}
+
+int trace_export(const char* path){
+	FILE* out = fopen(path, "w");
+	if(out == NULL) return -1;
+
+	// ticks per ns, measured over the time since tracing started
+	uint64_t ns = ns_now();
+	if(ns - start_ns < 1000000){
+		usleep(1000);
+		ns = ns_now();
+	}
+	double ns_per_tick = (double)(ns - start_ns) / (double)(tick_now() - start_tick);
+
+	fprintf(out, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+	int first = 1;
+	pid_t pid = getpid();
+	for (struct ring* r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+		uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		uint64_t i = head > TRACE_RING ? head - TRACE_RING : 0;
+		for (; i < head; i++) {
+			const struct trace_event* e = &r->events[i % TRACE_RING];
+			if(e->tick < start_tick) continue;
+			// timestamps in microseconds
+			fprintf(out, "%s\n{\"name\": \"%s\", \"ph\": \"%c\", \"ts\": %.3f, \"pid\": %d, \"tid\": %u}",
+				first ? "" : ",", e->name, e->phase, (double)(e->tick - start_tick) * ns_per_tick / 1000.0,
+				(int)pid, e->tid);
+			first = 0;
+		}
+	}
+	fprintf(out, "\n]}\n");
+	return fclose(out) == 0 ? 0 : -1;
+}
+
+#else
+
+int trace_enable(int on){
+	(void)on;
+	return -1;
+}
+
+int trace_export(const char* path){
+	(void)path;
+	return -1;
+}
+
+#endif //TRACE
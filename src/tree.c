@@ -0,0 +1,158 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../lib/dir.h"
+#include "../lib/lock.h"
+#include "../lib/pool.h"
+#include "../lib/trace.h"
+#include "../lib/tree.h"
+
+struct walk{
+	file_system* fs;
+	walk_fn pre;
+	walk_fn post;
+	void* arg;
+	int res; //the first failure, the walk stops at it
+};
+
+// a directory of a parallel walk, done once its entries and the directories below it are
+struct node{
+	int inode_id;
+	int depth;
+	uint32_t pending; //itself and the directories below it that are not done
+	struct node* parent;
+};
+
+static int failed(struct walk* w){
+	return __atomic_load_n(&w->res, __ATOMIC_RELAXED) < 0;
+}
+
+// only the first failure is kept
+static int fail(struct walk* w, int res){
+	int none = 0;
+	__atomic_compare_exchange_n(&w->res, &none, res, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	return res;
+}
+
+/*
+ * Call pre on inode_id, a file gets post right after it.
+ * Returns 0 if it is a directory to go into, WALK_SKIP if not or a negative failure
+ */
+static int enter(struct walk* w, int inode_id, int parent_id, int depth){
+	file_system* fs = w->fs;
+	inode_lock_shared(fs, inode_id);
+	inode* node = &fs->inodes[inode_id];
+	int res = WALK_SKIP;
+	// an entry removed since its directory was read is passed over
+	if((node->n_type == reg_file || node->n_type == directory) && (parent_id < 0 || node->parent == parent_id)){
+		res = w->pre ? w->pre(fs, inode_id, depth, w->arg) : 0;
+		if(res == 0 && node->n_type == reg_file){
+			res = w->post ? w->post(fs, inode_id, depth, w->arg) : 0;
+			if(res == 0) res = WALK_SKIP;
+		}
+	}
+	inode_unlock_shared(fs, inode_id);
+	return res < 0 ? fail(w, res) : res;
+}
+
+// post of a directory, after everything below it
+static void leave(struct walk* w, int inode_id, int depth){
+	if(w->post == NULL || failed(w)) return;
+	inode_lock_shared(w->fs, inode_id);
+	int res = w->post(w->fs, inode_id, depth, w->arg);
+	inode_unlock_shared(w->fs, inode_id);
+	if(res < 0) fail(w, res);
+}
+
+static int children(struct walk* w, int dir_id, int** ids){
+	inode_lock_shared(w->fs, dir_id);
+	int count = dir_children(w->fs, dir_id, ids);
+	inode_unlock_shared(w->fs, dir_id);
+	if(count < 0){
+		fail(w, count);
+		*ids = NULL;
+		return 0;
+	}
+	return count;
+}
+
+static void descend(struct walk* w, int dir_id, int depth){
+	int* ids;
+	int count = children(w, dir_id, &ids);
+	for (int i = 0; i < count && !failed(w); i++) {
+		if(enter(w, ids[i], dir_id, depth + 1) == 0) descend(w, ids[i], depth + 1);
+	}
+	free(ids);
+	leave(w, dir_id, depth);
+}
+
+static struct node* node_new(int inode_id, int depth, struct node* parent){
+	struct node* n = malloc(sizeof(struct node));
+	if(n == NULL){
+		perror("Malloc error");
+		exit(errno);
+	}
+	n->inode_id = inode_id;
+	n->depth = depth;
+	n->pending = 1;
+	n->parent = parent;
+	return n;
+}
+
+// n or one of the directories below it is done, the last one finishes n and goes up
+static void node_done(struct walk* w, struct node* n){
+	while(n != NULL && __atomic_sub_fetch(&n->pending, 1, __ATOMIC_ACQ_REL) == 0){
+		leave(w, n->inode_id, n->depth);
+		struct node* parent = n->parent;
+		free(n);
+		n = parent;
+	}
+}
+
+// descend as a task: the directories found are tasks of their own
+static void descend_task(pool_worker* worker, void* task, void* arg){
+	struct walk* w = arg;
+	struct node* n = task;
+	int* ids = NULL;
+	int count = failed(w) ? 0 : children(w, n->inode_id, &ids);
+	for (int i = 0; i < count && !failed(w); i++) {
+		if(enter(w, ids[i], n->inode_id, n->depth + 1) == 0){
+			__atomic_add_fetch(&n->pending, 1, __ATOMIC_ACQ_REL);
+			pool_push(worker, node_new(ids[i], n->depth + 1, n));
+		}
+	}
+	free(ids);
+	node_done(w, n);
+}
+
+int tree_walk(file_system* fs, int inode_id, walk_fn pre, walk_fn post, void* arg, int threads){
+	TRACE_SCOPE("tree_walk");
+	struct walk w = {fs, pre, post, arg, 0};
+	if(enter(&w, inode_id, -1, 0) != 0) return w.res;
+	if(threads <= 1){
+		descend(&w, inode_id, 0);
+	}
+	else{
+		pool_run(threads, descend_task, node_new(inode_id, 0, NULL), &w);
+	}
+	return w.res;
+}
+
+int tree_path(file_system* fs, int inode_id, char* path, size_t length){
+	if(length < 2) return -1;
+	// the names from the end of path backwards, then moved to its start
+	size_t start = length - 1;
+	path[start] = '\0';
+	for (int id = inode_id; id > 0; id = fs->inodes[id].parent) {
+		size_t name_length = strnlen(fs->inodes[id].name, NAME_MAX_LENGTH - 1);
+		if(start < name_length + 1) return -1;
+		start -= name_length;
+		memcpy(path + start, fs->inodes[id].name, name_length);
+		path[--start] = '/';
+	}
+	if(start == length - 1) path[--start] = '/';
+	memmove(path, path + start, length - start);
+	return 0;
+}
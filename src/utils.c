@@ -3,6 +3,12 @@
 void printhelp(){
 	printf("Usage:\n"
 	"-l, --load <filename>\n\tLoads an existing filesystem\n"
+	"-m, --mmap <filename>\n\tMaps an existing filesystem into memory instead of loading a copy\n"
 	"-c, --create <filename> <size>\n\tCreates a new filesystem with given filename and size (amount of INodes/Blocks)\n"
-	"-h, --help\n\tPrint this help\n");
+	"-h, --help\n\tPrint this help\n"
+	"After the filesystem:\n"
+	"-b, --batch <script>\n\tRuns the commands in script (one per line, - for stdin) without a prompt and dumps once at the end\n"
+	"-e, --exec \"<command>; <command>\"\n\tThe same for the commands given\n"
+	"\tEach command is reported as a line \"<number> <command> <result> <length>\" followed by the length bytes it printed\n"
+	"-s, --serve <socket>\n\tServes the filesystem to the clients of lib/client.h on a Unix socket until one shuts it down, then dumps it\n");
 }
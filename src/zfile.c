@@ -0,0 +1,243 @@
+#include <pthread.h>
+#include <string.h>
+#include "../lib/bmap.h"
+#include "../lib/lock.h"
+#include "../lib/lz.h"
+#include "../lib/zfile.h"
+
+struct zfile{
+	pthread_t owner; //thread the cursor belongs to
+	struct zfile* next; //cursor of another thread
+	pthread_mutex_t lock; //zfile_forget moves the cursors of other threads
+	int inode_id; //file the cursor is in, -1 if none
+	uint64_t pos; //stream offset of the cursor frame, always a frame boundary
+	uint64_t raw_start; //decoded offset of the cursor frame
+	int header; //stored and raw hold the header of the cursor frame
+	int decoded; //buf holds the content of the cursor frame
+	uint16_t stored;
+	uint16_t raw;
+	uint8_t buf[ZFILE_FRAME];
+	uint8_t scratch[ZFILE_FRAME]; //stored bytes of a frame that crosses a block boundary
+};
+
+/*
+ * The cursor of the calling thread, locked
+ */
+static struct zfile* zfile_get(file_system* fs){
+	pthread_t self = pthread_self();
+	// cursors are only ever added, so the list is walked without a lock
+	struct zfile* cursor = __atomic_load_n(&fs->zfile, __ATOMIC_ACQUIRE);
+	while(cursor != NULL && !pthread_equal(cursor->owner, self)){
+		cursor = cursor->next;
+	}
+	if(cursor == NULL){
+		cursor = malloc(sizeof(struct zfile));
+		if(cursor == NULL) return NULL;
+		cursor->owner = self;
+		cursor->inode_id = -1;
+		pthread_mutex_init(&cursor->lock, NULL);
+		alloc_lock(fs);
+		cursor->next = fs->zfile;
+		__atomic_store_n(&fs->zfile, cursor, __ATOMIC_RELEASE);
+		alloc_unlock(fs);
+	}
+	pthread_mutex_lock(&cursor->lock);
+	return cursor;
+}
+
+// copy len bytes of the stream of inode_id from pos on into dst
+static int stream_read(file_system* fs, int inode_id, uint64_t pos, uint8_t* dst, size_t len){
+	while(len > 0){
+		int block_id = bmap_get(fs, inode_id, pos / BLOCK_SIZE);
+		if(block_id == -1) return -1;
+		data_block* blk = &fs->data_blocks[block_id];
+		size_t block_offset = pos % BLOCK_SIZE;
+		if(block_offset >= blk->size) return -1;
+		size_t n = blk->size - block_offset < len ? blk->size - block_offset : len;
+		memcpy(dst, blk->block + block_offset, n);
+		dst += n;
+		pos += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// len bytes of the stream from pos on, in place if they lie in one block, else gathered into scratch
+static const uint8_t* stream_span(file_system* fs, int inode_id, uint64_t pos, size_t len, uint8_t* scratch){
+	if(pos % BLOCK_SIZE + len <= BLOCK_SIZE){
+		int block_id = bmap_get(fs, inode_id, pos / BLOCK_SIZE);
+		if(block_id == -1 || pos % BLOCK_SIZE + len > fs->data_blocks[block_id].size) return NULL;
+		return fs->data_blocks[block_id].block + pos % BLOCK_SIZE;
+	}
+	return stream_read(fs, inode_id, pos, scratch, len) == 0 ? scratch : NULL;
+}
+
+static int read_header(file_system* fs, int inode_id, uint64_t pos, uint16_t* stored, uint16_t* raw){
+	uint8_t header[ZFILE_HEADER];
+	if(pos + ZFILE_HEADER > fs->inodes[inode_id].size) return -1;
+	if(stream_read(fs, inode_id, pos, header, ZFILE_HEADER) != 0) return -1;
+	*stored = header[0] | header[1] << 8;
+	*raw = header[2] | header[3] << 8;
+	if(*raw == 0 || *raw > ZFILE_FRAME || *stored > *raw) return -1;
+	if(pos + ZFILE_HEADER + *stored > fs->inodes[inode_id].size) return -1;
+	return 0;
+}
+
+// decode the stored bytes of the frame at pos into dst, which holds raw bytes
+static int decode_frame(file_system* fs, int inode_id, uint64_t pos, uint16_t stored, uint16_t raw, uint8_t* dst, uint8_t* scratch){
+	if(stored == raw) return stream_read(fs, inode_id, pos + ZFILE_HEADER, dst, raw);
+	const uint8_t* src = stream_span(fs, inode_id, pos + ZFILE_HEADER, stored, scratch);
+	if(src == NULL) return -1;
+	return lz_decompress(src, stored, dst, raw) == raw ? 0 : -1;
+}
+
+/*
+ * Move the cursor to the frame of inode_id that holds offset, or to the last frame if offset is past the end.
+ * Returns 0 if the cursor is on a frame, 1 if the file is empty, -1 if the stream is corrupt
+ */
+static int zfile_seek(file_system* fs, struct zfile* cursor, int inode_id, uint64_t offset){
+	uint64_t size = fs->inodes[inode_id].size;
+	if(cursor->inode_id != inode_id || cursor->raw_start > offset || cursor->pos >= size){
+		cursor->inode_id = inode_id;
+		cursor->pos = 0;
+		cursor->raw_start = 0;
+		cursor->header = 0;
+		cursor->decoded = 0;
+	}
+	if(size == 0) return 1;
+
+	while(1){
+		if(!cursor->header){
+			if(read_header(fs, inode_id, cursor->pos, &cursor->stored, &cursor->raw) != 0){
+				cursor->inode_id = -1;
+				return -1;
+			}
+			cursor->header = 1;
+		}
+		uint64_t next = cursor->pos + ZFILE_HEADER + cursor->stored;
+		if(offset < cursor->raw_start + cursor->raw || next >= size) return 0;
+		cursor->pos = next;
+		cursor->raw_start += cursor->raw;
+		cursor->header = 0;
+		cursor->decoded = 0;
+	}
+}
+
+size_t zfile_encode(const uint8_t* raw, size_t len, uint8_t* frame){
+	// keep the content as it is unless compressing saves something
+	int stored = lz_compress(raw, len, frame + ZFILE_HEADER, len - 1);
+	if(stored == 0){
+		memcpy(frame + ZFILE_HEADER, raw, len);
+		stored = len;
+	}
+	frame[0] = stored & 0xff;
+	frame[1] = stored >> 8;
+	frame[2] = len & 0xff;
+	frame[3] = len >> 8;
+	return ZFILE_HEADER + stored;
+}
+
+int zfile_size(file_system* fs, int inode_id, uint64_t* size){
+	struct zfile* cursor = zfile_get(fs);
+	if(cursor == NULL) return -1;
+	int res = zfile_seek(fs, cursor, inode_id, UINT64_MAX);
+	if(res >= 0) *size = res == 1 ? 0 : cursor->raw_start + cursor->raw;
+	pthread_mutex_unlock(&cursor->lock);
+	return res < 0 ? -1 : 0;
+}
+
+// zfile_read with the cursor locked
+static int cursor_read(file_system* fs, struct zfile* cursor, int inode_id, uint64_t offset, const uint8_t** data, size_t* len){
+	int res = zfile_seek(fs, cursor, inode_id, offset);
+	if(res < 0) return -1;
+	if(res == 1 || offset >= cursor->raw_start + cursor->raw){
+		*len = 0;
+		return 0;
+	}
+	if(!cursor->decoded){
+		if(decode_frame(fs, inode_id, cursor->pos, cursor->stored, cursor->raw, cursor->buf, cursor->scratch) != 0){
+			cursor->inode_id = -1;
+			return -1;
+		}
+		cursor->decoded = 1;
+	}
+	*data = cursor->buf + (offset - cursor->raw_start);
+	*len = cursor->raw_start + cursor->raw - offset;
+	return 0;
+}
+
+int zfile_read(file_system* fs, int inode_id, uint64_t offset, const uint8_t** data, size_t* len){
+	struct zfile* cursor = zfile_get(fs);
+	if(cursor == NULL) return -1;
+	int res = cursor_read(fs, cursor, inode_id, offset, data, len);
+	pthread_mutex_unlock(&cursor->lock);
+	return res;
+}
+
+int zfile_read_all(file_system* fs, int inode_id, uint8_t* dst, uint64_t size){
+	uint8_t* scratch = malloc(ZFILE_FRAME);
+	if(scratch == NULL) return -1;
+	uint64_t pos = 0;
+	uint64_t done = 0;
+	int res = 0;
+	while(done < size){
+		uint16_t stored, raw;
+		if(read_header(fs, inode_id, pos, &stored, &raw) != 0 || raw > size - done
+		   || decode_frame(fs, inode_id, pos, stored, raw, dst + done, scratch) != 0){
+			res = -1;
+			break;
+		}
+		pos += ZFILE_HEADER + stored;
+		done += raw;
+	}
+	free(scratch);
+	return res;
+}
+
+// zfile_tail with the cursor locked
+static int cursor_tail(file_system* fs, struct zfile* cursor, int inode_id, uint64_t* pos, uint8_t* raw){
+	int res = zfile_seek(fs, cursor, inode_id, UINT64_MAX);
+	if(res < 0) return -1;
+	if(res == 1 || cursor->raw == ZFILE_FRAME){
+		*pos = fs->inodes[inode_id].size;
+		return 0;
+	}
+	if(decode_frame(fs, inode_id, cursor->pos, cursor->stored, cursor->raw, raw, cursor->scratch) != 0) return -1;
+	*pos = cursor->pos;
+	return cursor->raw;
+}
+
+int zfile_tail(file_system* fs, int inode_id, uint64_t* pos, uint8_t* raw){
+	struct zfile* cursor = zfile_get(fs);
+	if(cursor == NULL) return -1;
+	int res = cursor_tail(fs, cursor, inode_id, pos, raw);
+	pthread_mutex_unlock(&cursor->lock);
+	return res;
+}
+
+void zfile_forget(file_system* fs, int inode_id, uint64_t pos){
+	struct zfile* cursor = __atomic_load_n(&fs->zfile, __ATOMIC_ACQUIRE);
+	for (; cursor != NULL; cursor = cursor->next) {
+		pthread_mutex_lock(&cursor->lock);
+		if(cursor->inode_id == inode_id && cursor->pos > pos){
+			cursor->inode_id = -1;
+		}
+		else if(cursor->inode_id == inode_id && cursor->pos == pos){
+			// a frame boundary stays one, but the frame starting there is rewritten
+			cursor->header = 0;
+			cursor->decoded = 0;
+		}
+		pthread_mutex_unlock(&cursor->lock);
+	}
+}
+
+void zfile_destroy(file_system* fs){
+	struct zfile* cursor = fs->zfile;
+	while(cursor != NULL){
+		struct zfile* next = cursor->next;
+		pthread_mutex_destroy(&cursor->lock);
+		free(cursor);
+		cursor = next;
+	}
+	fs->zfile = NULL;
+}
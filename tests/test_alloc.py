@@ -0,0 +1,94 @@
+import ctypes
+from wrappers import *
+
+class Test_Alloc:
+    # Allocating several blocks at once hands out the lowest free blocks in order
+    def test_alloc_n_first_fit(self):
+        fs = setup(100)
+        fs.free_list[1] = 0 # taken without going through the allocator
+        blocks = (ctypes.c_int * 4)()
+        retval = libc.block_alloc_n(ctypes.byref(fs), 4, blocks)
+        assert retval == 4
+        assert list(blocks) == [0, 2, 3, 4]
+        for b in blocks:
+            assert fs.free_list[b] == 0
+
+    # A freed block below the previous allocations is found again
+    def test_free_lowers_hint(self):
+        fs = setup(100)
+        for i in range(70):
+            assert libc.block_alloc(ctypes.byref(fs)) == i
+        libc.block_free(ctypes.byref(fs), 3)
+        assert fs.free_list[3] == 1
+        assert libc.block_alloc(ctypes.byref(fs)) == 3
+        assert libc.block_alloc(ctypes.byref(fs)) == 70
+
+    # Asking for more blocks than there are returns what was available
+    def test_alloc_n_full(self):
+        fs = setup(5)
+        blocks = (ctypes.c_int * 8)()
+        assert libc.block_alloc_n(ctypes.byref(fs), 8, blocks) == 5
+        assert libc.block_alloc(ctypes.byref(fs)) == -1
+        assert libc.block_count_free(ctypes.byref(fs)) == 0
+
+    # Inodes come out lowest first and a removed file's inode is handed out again
+    def test_inode_reuse(self):
+        fs = setup(200)
+        for i in range(1, 12):
+            assert libc.fs_mkdir(ctypes.byref(fs), ctypes.c_char_p(bytes("/d%d" % i,"UTF-8"))) == 0
+            assert fs.inodes[i].name.decode("utf-8") == "d%d" % i
+        assert libc.inode_count_free(ctypes.byref(fs)) == 200 - 12
+        assert libc.fs_rm(ctypes.byref(fs), ctypes.c_char_p(bytes("/d3","UTF-8"))) == 0
+        assert libc.inode_count_free(ctypes.byref(fs)) == 200 - 11
+        assert libc.fs_mkfile(ctypes.byref(fs), ctypes.c_char_p(bytes("/f","UTF-8"))) == 0
+        assert fs.inodes[3].n_type == 1
+        assert fs.inodes[3].name.decode("utf-8") == "f"
+
+    # An inode taken without going through the allocator is skipped
+    def test_inode_taken_behind_allocator(self):
+        fs = setup(5)
+        fs = set_dir(name="newDir",inode=1,parent=0,parent_block=0,fs=fs)
+        assert libc.find_free_inode(ctypes.byref(fs)) == 2
+        assert libc.inode_alloc(ctypes.byref(fs)) == 2
+        assert libc.inode_alloc(ctypes.byref(fs)) == 3
+
+    # A run of blocks skips holes too small for it, and a goal extends the previous run in place
+    def test_alloc_run_skips_holes(self):
+        fs = setup(100)
+        blocks = (ctypes.c_int * 10)()
+        assert libc.block_alloc_n(ctypes.byref(fs), 10, blocks) == 10
+        for b in (1, 3, 4, 7):
+            libc.block_free(ctypes.byref(fs), b)
+        run = (ctypes.c_int * 4)()
+        assert libc.block_alloc_run(ctypes.byref(fs), 4, -1, run) == 4
+        assert list(run) == [10, 11, 12, 13]
+        assert libc.block_alloc_run(ctypes.byref(fs), 2, -1, run) == 2
+        assert list(run)[:2] == [3, 4]
+        assert libc.block_alloc_run(ctypes.byref(fs), 3, 14, run) == 3
+        assert list(run)[:3] == [14, 15, 16]
+
+    # Without a run long enough the lowest free blocks are taken
+    def test_alloc_run_fragmented(self):
+        fs = setup(10)
+        blocks = (ctypes.c_int * 10)()
+        assert libc.block_alloc_n(ctypes.byref(fs), 10, blocks) == 10
+        for b in (1, 3, 5):
+            libc.block_free(ctypes.byref(fs), b)
+        fs.free_list[3] = 0 # taken without going through the allocator
+        run = (ctypes.c_int * 3)()
+        assert libc.block_alloc_run(ctypes.byref(fs), 3, 1, run) == 2
+        assert list(run)[:2] == [1, 5]
+
+    # A file written into fragmented free space gets consecutive blocks
+    def test_import_contiguous(self):
+        fs = setup(100)
+        for i in range(8):
+            assert libc.fs_mkfile(ctypes.byref(fs), ctypes.c_char_p(bytes("/f%d" % i,"UTF-8"))) == 0
+            assert libc.fs_writef(ctypes.byref(fs), ctypes.c_char_p(bytes("/f%d" % i,"UTF-8")), ctypes.c_char_p(bytes("x","UTF-8"))) == 1
+        for i in range(0, 8, 2):
+            assert libc.fs_rm(ctypes.byref(fs), ctypes.c_char_p(bytes("/f%d" % i,"UTF-8"))) == 0
+        filename = create_temp_file(data=LONG_DATA * 4)
+        assert libc.fs_import(ctypes.byref(fs), ctypes.c_char_p(bytes("/big","UTF-8")), ctypes.c_char_p(bytes(filename,"UTF-8"))) == 0
+        delete_temp_file()
+        blocks = [fs.inodes[fs.inodes[0].direct_blocks[0]].direct_blocks[i] for i in range(5)]
+        assert blocks == list(range(8, 13))
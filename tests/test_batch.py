@@ -0,0 +1,102 @@
+import ctypes
+import json
+import os
+import subprocess
+from wrappers import *
+
+libc.fs_load.restype = ctypes.POINTER(FileSystem)
+libc.fs_list.restype = ctypes.c_char_p
+
+IMAGE = "./mybatch.fs"
+BINARY = "./mybatch.bin"
+
+# runs ./build/ha2 on a new image of 100 blocks with the given arguments after it
+def ha2(*args, stdin=None):
+    return subprocess.run(["./build/ha2", "-c", IMAGE, "100"] + list(args),
+                          input=stdin, capture_output=True, timeout=30)
+
+# the records of a batch: (number, command, result, output) for each line "<number> <command> <result> <length>"
+def records(stdout):
+    result = []
+    while stdout:
+        line, stdout = stdout.split(b"\n", 1)
+        number, command, res, length = line.split(b" ")
+        result.append((int(number), command.decode("utf-8"), int(res), stdout[:int(length)]))
+        stdout = stdout[int(length):]
+    return result
+
+class Test_Batch:
+    def setup_method(self):
+        with open(BINARY, "wb") as f:
+            f.write(bytes(range(256)) * 5)
+
+    def teardown_method(self):
+        for name in (IMAGE, BINARY):
+            if os.path.exists(name):
+                os.remove(name)
+
+    # A few commands given with -e
+    # Expected outcome:
+    #  * each is reported with its number, name, result and the exact bytes it printed, also binary ones
+    #  * blank commands are skipped but numbered, the dump at the end is the last record
+    def test_framing(self):
+        run = ha2("-e", "mkdir /d; import /d/bin %s;; readf /d/bin; list /d" % BINARY)
+        assert run.returncode == 0
+        assert records(run.stdout) == [
+            (1, "mkdir", 0, b""),
+            (2, "import", 0, b""),
+            (4, "readf", 0, bytes(range(256)) * 5),
+            (5, "list", 0, b"FIL bin\n"),
+            (6, "dump", 0, b""),
+        ]
+
+    # dump inside a batch
+    # Expected outcome:
+    #  * it succeeds without writing, the image is written once after the last command with all changes
+    def test_single_dump(self):
+        # creating the image dumps it, the counters start after that
+        run = ha2("-e", "stats reset; mkdir /d; dump; mkfile /d/f; stats json")
+        assert run.returncode == 0
+        batch = records(run.stdout)
+        assert [r[:3] for r in batch] == [(1, "stats", 0), (2, "mkdir", 0), (3, "dump", 0), (4, "mkfile", 0),
+                                          (5, "stats", 0), (6, "dump", 0)]
+        assert "dump" not in json.loads(batch[4][3])["ops"]
+
+        loaded = libc.fs_load(path(IMAGE))
+        assert libc.fs_list(loaded, path("/d")).decode("utf-8") == "FIL f\n"
+        libc.cleanup(loaded)
+
+    # An unknown command, a command with wrong arguments and a failing command
+    # Expected outcome:
+    #  * the batch goes on after them and exits with 1
+    #  * unknown commands and wrong arguments give -3 and the usage on stderr
+    def test_failures(self):
+        run = ha2("-e", "mkfle /x; mkdir /d")
+        assert run.returncode == 1
+        assert [r[:3] for r in records(run.stdout)] == [(1, "mkfle", -3), (2, "mkdir", 0), (3, "dump", 0)]
+        assert b"Valid commands:\n" in run.stderr and b"\nmkdir\n" in run.stderr
+
+        run = ha2("-e", "dedup maybe")
+        assert run.returncode == 1
+        assert records(run.stdout)[0][:3] == (1, "dedup", -3)
+        assert b"usage: dedup [on|off]" in run.stderr
+
+        run = ha2("-e", "rm /none")
+        assert run.returncode == 1
+        assert records(run.stdout)[0][:3] == (1, "rm", -1)
+
+    # A script on stdin with -b -
+    # Expected outcome:
+    #  * its lines are run in order, comments are skipped, exit stops it before the dump
+    def test_script_stdin(self):
+        script = b"# a comment\nmkdir /d\nmkfile /d/f\nwritef /d/f hello\nreadf /d/f\nexit\nmkdir /never\n"
+        run = ha2("-b", "-", stdin=script)
+        assert run.returncode == 0
+        assert records(run.stdout) == [
+            (2, "mkdir", 0, b""),
+            (3, "mkfile", 0, b""),
+            (4, "writef", 5, b""),
+            (5, "readf", 0, b"hello"),
+            (6, "exit", 0, b""),
+            (7, "dump", 0, b""),
+        ]
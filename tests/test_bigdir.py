@@ -0,0 +1,56 @@
+import ctypes
+from wrappers import *
+
+libc.fs_list.restype = ctypes.c_char_p
+libc.fs_load.restype = ctypes.POINTER(FileSystem)
+
+class Test_Bigdir:
+    # Fills a directory far beyond its direct blocks
+    # Expected outcome:
+    #  * every entry can be found again and the listing is sorted by inode-index
+    #  * the first entries still live in the direct blocks
+    def test_bigdir_create_and_list(self):
+        fs = setup(3000)
+        for i in range(2000):
+            assert libc.fs_mkfile(ctypes.byref(fs), path("/f%d" % i)) == 0
+        assert fs.inodes[0].direct_blocks[0] == 1
+        assert fs.inodes[0].dir_index != -1
+        assert libc.fs_mkfile(ctypes.byref(fs), path("/f1500")) == -2
+        for i in range(0, 2000, 7):
+            assert libc.fs_writef(ctypes.byref(fs), path("/f%d" % i), path("x")) == 1
+        listing = libc.fs_list(ctypes.byref(fs), path("/")).decode("utf-8")
+        assert listing == "".join("FIL f%d\n" % i for i in range(2000))
+
+    # Removes entries from a big directory, then the whole directory
+    # Expected outcome:
+    #  * removed entries are gone, the others remain
+    #  * all blocks used by the directory index are free again
+    def test_bigdir_remove(self):
+        fs = setup(1000)
+        free_before = libc.block_count_free(ctypes.byref(fs))
+        assert libc.fs_mkdir(ctypes.byref(fs), path("/d")) == 0
+        for i in range(500):
+            assert libc.fs_mkdir(ctypes.byref(fs), path("/d/e%d" % i)) == 0
+        for i in range(0, 500, 2):
+            assert libc.fs_rm(ctypes.byref(fs), path("/d/e%d" % i)) == 0
+        listing = libc.fs_list(ctypes.byref(fs), path("/d")).decode("utf-8")
+        assert listing == "".join("DIR e%d\n" % i for i in range(1, 500, 2))
+        assert libc.fs_rm(ctypes.byref(fs), path("/d")) == 0
+        assert libc.block_count_free(ctypes.byref(fs)) == free_before
+        assert libc.fs_list(ctypes.byref(fs), path("/")).decode("utf-8") == ""
+
+    # Copies a big directory and reloads the image
+    def test_bigdir_copy_and_reload(self):
+        fs = setup(1000)
+        assert libc.fs_mkdir(ctypes.byref(fs), path("/d")) == 0
+        for i in range(300):
+            assert libc.fs_mkfile(ctypes.byref(fs), path("/d/f%d" % i)) == 0
+        assert libc.fs_cp(ctypes.byref(fs), path("/d"), path("/c")) == 0
+        assert libc.fs_cp(ctypes.byref(fs), path("/d"), path("/d/inner")) == -1
+        expected = libc.fs_list(ctypes.byref(fs), path("/d")).decode("utf-8")
+        assert libc.fs_dump(ctypes.byref(fs), path("./mypyfiles.fs")) == 0
+
+        loaded = libc.fs_load(path("./mypyfiles.fs"))
+        assert libc.fs_list(loaded, path("/c")).decode("utf-8") == expected
+        assert libc.fs_mkfile(loaded, path("/c/f299")) == -2
+        libc.cleanup(loaded)
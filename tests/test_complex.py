@@ -23,4 +23,21 @@ class Test_Complex:
         assert fs.inodes[0].direct_blocks[0] == -1, "The parent node should not point to the file anymore"
         assert fs.free_list[0] == 1, "The free list needs to be updated when a file that holds data is removed"
 
+    # Looks up a missing name, creates it, removes it and creates a directory under the same name.
+    # Every lookup has to see the current state of the directory
+    def test_complex_lookup_after_changes(self):
+        fs = setup(10)
+        libc.fs_list.restype = ctypes.c_char_p
+        assert libc.fs_mkdir(ctypes.byref(fs), ctypes.c_char_p(bytes("/a","UTF-8"))) == 0
+        assert libc.fs_writef(ctypes.byref(fs), ctypes.c_char_p(bytes("/a/b","UTF-8")), ctypes.c_char_p(bytes("x","UTF-8"))) == -1
+        assert libc.fs_mkfile(ctypes.byref(fs), ctypes.c_char_p(bytes("/a/b","UTF-8"))) == 0
+        assert libc.fs_writef(ctypes.byref(fs), ctypes.c_char_p(bytes("/a/b","UTF-8")), ctypes.c_char_p(bytes("x","UTF-8"))) == 1
+        assert libc.fs_rm(ctypes.byref(fs), ctypes.c_char_p(bytes("/a/b","UTF-8"))) == 0
+        assert libc.fs_writef(ctypes.byref(fs), ctypes.c_char_p(bytes("/a/b","UTF-8")), ctypes.c_char_p(bytes("x","UTF-8"))) == -1
+        assert libc.fs_mkdir(ctypes.byref(fs), ctypes.c_char_p(bytes("/a/b","UTF-8"))) == 0
+        assert libc.fs_mkfile(ctypes.byref(fs), ctypes.c_char_p(bytes("/a/b/c","UTF-8"))) == 0
+        assert libc.fs_list(ctypes.byref(fs), ctypes.c_char_p(bytes("/a/b","UTF-8"))).decode("utf-8") == "FIL c\n"
+        assert libc.fs_rm(ctypes.byref(fs), ctypes.c_char_p(bytes("/a","UTF-8"))) == 0
+        assert libc.fs_list(ctypes.byref(fs), ctypes.c_char_p(bytes("/a/b","UTF-8"))) is None
+
 # TODO: Maybe think of more tests
@@ -0,0 +1,130 @@
+import ctypes
+import os
+from wrappers import *
+
+libc.fs_readf.restype = ctypes.c_char_p
+libc.fs_load.restype = ctypes.POINTER(FileSystem)
+
+IMAGE = bytes("./mypyfiles.fs","UTF-8")
+FRAME = 8 * BLOCK_SIZE
+
+def readv_all(fs, name):
+    iov = (Iovec * 16)()
+    data = b""
+    while True:
+        n = libc.fs_readv(fs, path(name), ctypes.c_uint64(len(data)), ctypes.c_size_t(2**64 - 1), iov, 16)
+        assert n >= 0
+        if n == 0:
+            return data
+        for i in range(n):
+            data += ctypes.string_at(iov[i].iov_base, iov[i].iov_len)
+
+def import_data(fs, name, data):
+    with open(DEFAULT_TEST_FILE_NAME, "wb") as f:
+        f.write(data)
+    retval = libc.fs_import(ctypes.byref(fs), path(name), path(DEFAULT_TEST_FILE_NAME))
+    delete_temp_file()
+    return retval
+
+# log lines compress well, 100 KiB of them cross many frames
+LOG_DATA = ("".join("%06d INFO request served in %d ms\n" % (i, i % 97) for i in range(3000))).encode("utf-8")
+
+class Test_Compress:
+    # Appends log lines to a compressed file piece by piece
+    # Expected outcome:
+    #  * reading the file returns every piece in order
+    #  * the file needs a fraction of the blocks of its content
+    def test_writef_compressed(self):
+        fs = setup(200)
+        assert libc.fs_mkfile(ctypes.byref(fs), path("/log")) == 0
+        assert libc.fs_compress(ctypes.byref(fs), path("/log"), 1) == 0
+        assert fs.inodes[1].flags & INODE_COMPRESSED
+        expected = b""
+        for i in range(0, len(LOG_DATA), 3000):
+            piece = LOG_DATA[i:i + 3000]
+            assert libc.fs_writef(ctypes.byref(fs), path("/log"), ctypes.c_char_p(piece)) == len(piece)
+            expected += piece
+        assert read_all(ctypes.byref(fs), "/log") == expected
+        assert readv_all(ctypes.byref(fs), "/log") == expected
+        used = 200 - libc.block_count_free(ctypes.byref(fs))
+        assert used * 3 < len(expected) // BLOCK_SIZE
+
+    # Imports into a compressed file and exports it again
+    # Expected outcome:
+    #  * the exported file is identical
+    #  * the content survives a dump and load, the file stays compressed
+    def test_import_export_reload(self):
+        fs = setup(200)
+        assert libc.fs_mkfile(ctypes.byref(fs), path("/log")) == 0
+        assert libc.fs_compress(ctypes.byref(fs), path("/log"), 1) == 0
+        assert import_data(fs, "/log", LOG_DATA) == 0
+        assert libc.fs_export(ctypes.byref(fs), path("/log"), path(DEFAULT_TEST_FILE_NAME)) == 0
+        with open(DEFAULT_TEST_FILE_NAME, "rb") as f:
+            assert f.read() == LOG_DATA
+        delete_temp_file()
+        assert libc.fs_dump(ctypes.byref(fs), ctypes.c_char_p(IMAGE)) == 0
+
+        loaded = libc.fs_load(ctypes.c_char_p(IMAGE))
+        assert loaded.contents.inodes[1].flags & INODE_COMPRESSED
+        assert read_all(loaded, "/log") == LOG_DATA
+        libc.cleanup(loaded)
+
+    # Turns compression on and off for a file with content, and copies it
+    # Expected outcome:
+    #  * the content is the same in either form and frees the blocks of the other one
+    #  * a copy is compressed too and can be appended to without changing the original
+    def test_convert_and_copy(self):
+        fs = setup(200)
+        assert import_data(fs, "/log", LOG_DATA) == 0
+        raw_free = libc.block_count_free(ctypes.byref(fs))
+        assert libc.fs_compress(ctypes.byref(fs), path("/log"), 1) == 0
+        assert read_all(ctypes.byref(fs), "/log") == LOG_DATA
+        assert libc.block_count_free(ctypes.byref(fs)) > raw_free
+
+        assert libc.fs_cp(ctypes.byref(fs), path("/log"), path("/copy")) == 0
+        assert fs.inodes[2].flags & INODE_COMPRESSED
+        assert libc.fs_writef(ctypes.byref(fs), path("/copy"), ctypes.c_char_p(b"more")) == 4
+        assert read_all(ctypes.byref(fs), "/copy") == LOG_DATA + b"more"
+        assert read_all(ctypes.byref(fs), "/log") == LOG_DATA
+
+        assert libc.fs_compress(ctypes.byref(fs), path("/log"), 0) == 0
+        assert not fs.inodes[1].flags & INODE_COMPRESSED
+        assert read_all(ctypes.byref(fs), "/log") == LOG_DATA
+        assert libc.fs_rm(ctypes.byref(fs), path("/log")) == 0
+        assert libc.fs_rm(ctypes.byref(fs), path("/copy")) == 0
+        assert libc.block_count_free(ctypes.byref(fs)) == 200
+
+    # Random bytes don't compress, they are stored as they are
+    def test_incompressible(self):
+        fs = setup(100)
+        data = os.urandom(3 * FRAME + 100)
+        assert libc.fs_mkfile(ctypes.byref(fs), path("/rnd")) == 0
+        assert libc.fs_compress(ctypes.byref(fs), path("/rnd"), 1) == 0
+        assert import_data(fs, "/rnd", data) == 0
+        assert readv_all(ctypes.byref(fs), "/rnd") == data
+        assert fs.inodes[1].size == len(data) + 4 * 4
+
+    # Appending to a compressed file in a full filesystem fails without changing the file
+    def test_full_keeps_content(self):
+        fs = setup(10)
+        data = os.urandom(4 * BLOCK_SIZE)
+        assert libc.fs_mkfile(ctypes.byref(fs), path("/rnd")) == 0
+        assert libc.fs_compress(ctypes.byref(fs), path("/rnd"), 1) == 0
+        assert import_data(fs, "/rnd", data) == 0
+        more = os.urandom(8 * BLOCK_SIZE).hex().encode("utf-8")
+        assert libc.fs_writef(ctypes.byref(fs), path("/rnd"), ctypes.c_char_p(more)) == -2
+        assert readv_all(ctypes.byref(fs), "/rnd") == data
+
+    # The codec restores what it compressed and rejects corrupt input
+    def test_codec_roundtrip(self):
+        out = ctypes.create_string_buffer(FRAME + 64)
+        back = ctypes.create_string_buffer(FRAME)
+        for data in (b"", b"a", b"abcabcabcabcabcabcabc", b"x" * FRAME, LOG_DATA[:FRAME], os.urandom(FRAME)):
+            n = libc.lz_compress(data, len(data), out, FRAME + 64)
+            assert n > 0
+            assert libc.lz_decompress(out, n, back, FRAME) == len(data)
+            assert back.raw[:len(data)] == data
+        n = libc.lz_compress(LOG_DATA[:FRAME], FRAME, out, FRAME + 64)
+        assert n < FRAME // 3
+        assert libc.lz_decompress(out, n, back, FRAME // 2) == -1
+        assert libc.lz_compress(os.urandom(FRAME), FRAME, out, FRAME - 1) == 0
@@ -1,6 +1,9 @@
 import ctypes
 from wrappers import *
 
+libc.fs_readf.restype = ctypes.c_char_p
+libc.fs_load.restype = ctypes.POINTER(FileSystem)
+
 class Test_Cp:
     # successful mkdir operation on a fresh filesystem
     # * valid path
@@ -71,3 +74,98 @@ class Test_Cp:
         assert fs.inodes[4].n_type == 2 # meaning it is marked as directory
         assert fs.inodes[3].direct_blocks[0] == 4 #fs.inodes[0] is the root node. its first direct block should point to the 1st inode (where the new dir is located)
         assert fs.inodes[4].parent == 3
+
+    # Copying a file shares its data blocks instead of copying them
+    # Expected outcome:
+    #  * the copy maps the same blocks, no data block is allocated
+    #  * appending to the copy gives it a private last block, the original is unchanged
+    def test_cp_shares_blocks(self):
+        fs = setup(10)
+        assert libc.fs_mkfile(ctypes.byref(fs), ctypes.c_char_p(bytes("/a","UTF-8"))) == 0
+        assert libc.fs_writef(ctypes.byref(fs), ctypes.c_char_p(bytes("/a","UTF-8")), ctypes.c_char_p(bytes(LONG_DATA,"UTF-8"))) == len(LONG_DATA)
+        free_before = libc.block_count_free(ctypes.byref(fs))
+        assert libc.fs_cp(ctypes.byref(fs), ctypes.c_char_p(bytes("/a","UTF-8")), ctypes.c_char_p(bytes("/b","UTF-8"))) == 0
+        assert libc.block_count_free(ctypes.byref(fs)) == free_before
+        assert list(fs.inodes[2].direct_blocks)[:2] == list(fs.inodes[1].direct_blocks)[:2]
+        assert fs.inodes[2].size == len(LONG_DATA)
+
+        assert libc.fs_writef(ctypes.byref(fs), ctypes.c_char_p(bytes("/b","UTF-8")), ctypes.c_char_p(bytes(SHORT_DATA,"UTF-8"))) == len(SHORT_DATA)
+        assert fs.inodes[2].direct_blocks[0] == fs.inodes[1].direct_blocks[0]
+        assert fs.inodes[2].direct_blocks[1] != fs.inodes[1].direct_blocks[1]
+        assert read_all(ctypes.byref(fs), "/a").decode("utf-8") == LONG_DATA
+        assert read_all(ctypes.byref(fs), "/b").decode("utf-8") == LONG_DATA + SHORT_DATA
+
+    # Removing one of two files sharing blocks leaves the other intact
+    # Expected outcome:
+    #  * the blocks are freed with the last file using them, also after a reload
+    def test_cp_rm_shared(self):
+        fs = setup(10)
+        assert libc.fs_mkfile(ctypes.byref(fs), ctypes.c_char_p(bytes("/a","UTF-8"))) == 0
+        assert libc.fs_writef(ctypes.byref(fs), ctypes.c_char_p(bytes("/a","UTF-8")), ctypes.c_char_p(bytes(LONG_DATA,"UTF-8"))) == len(LONG_DATA)
+        assert libc.fs_cp(ctypes.byref(fs), ctypes.c_char_p(bytes("/a","UTF-8")), ctypes.c_char_p(bytes("/b","UTF-8"))) == 0
+        assert libc.fs_cp(ctypes.byref(fs), ctypes.c_char_p(bytes("/a","UTF-8")), ctypes.c_char_p(bytes("/c","UTF-8"))) == 0
+        assert libc.fs_rm(ctypes.byref(fs), ctypes.c_char_p(bytes("/a","UTF-8"))) == 0
+        assert libc.block_count_free(ctypes.byref(fs)) == 8
+        assert libc.fs_dump(ctypes.byref(fs), ctypes.c_char_p(bytes("./mypyfiles.fs","UTF-8"))) == 0
+
+        loaded = libc.fs_load(ctypes.c_char_p(bytes("./mypyfiles.fs","UTF-8")))
+        assert libc.fs_rm(loaded, ctypes.c_char_p(bytes("/b","UTF-8"))) == 0
+        assert read_all(loaded, "/c").decode("utf-8") == LONG_DATA
+        assert libc.block_count_free(loaded) == 8
+        assert libc.fs_rm(loaded, ctypes.c_char_p(bytes("/c","UTF-8"))) == 0
+        assert libc.block_count_free(loaded) == 10
+        libc.cleanup(loaded)
+
+    # Copies a tree big enough to be copied by several threads, with a few big files
+    # Expected outcome:
+    #  * the copy takes the lowest free inodes in the order the source is visited,
+    #    directories before their entries, each in inode-index order, as one at a time
+    #  * every copy has the name, type, size and data blocks of its source
+    #  * only the indirect blocks of the big files and the index of /dst are allocated
+    def test_cp_tree_parallel(self, monkeypatch):
+        # as many threads as on a machine with more processors than this one may have
+        monkeypatch.setenv("POOL_THREADS", "4")
+        fs = setup(3000)
+        big = "b" * (70 * BLOCK_SIZE)
+        assert libc.fs_mkdir(ctypes.byref(fs), ctypes.c_char_p(bytes("/src","UTF-8"))) == 0
+        for i in range(30):
+            assert libc.fs_mkdir(ctypes.byref(fs), ctypes.c_char_p(bytes("/src/d%d" % i,"UTF-8"))) == 0
+            for k in range(12):
+                name = ctypes.c_char_p(bytes("/src/d%d/f%d" % (i, k),"UTF-8"))
+                assert libc.fs_mkfile(ctypes.byref(fs), name) == 0
+                text = big if k == 0 and i % 10 == 0 else "x" * (i + k)
+                assert libc.fs_writef(ctypes.byref(fs), name, ctypes.c_char_p(bytes(text,"UTF-8"))) == len(text)
+        inodes = lambda: [n for n in range(3000) if fs.inodes[n].n_type != 3]
+        def preorder(id):
+            children = sorted(n for n in inodes() if fs.inodes[n].parent == id and n != 0)
+            return [id] + [m for c in children for m in preorder(c)]
+        source = preorder(1)
+        free_before = libc.block_count_free(ctypes.byref(fs))
+
+        assert libc.fs_cp(ctypes.byref(fs), ctypes.c_char_p(bytes("/src","UTF-8")), ctypes.c_char_p(bytes("/dst","UTF-8"))) == 0
+        copy = preorder(len(source) + 1)
+        assert copy == list(range(len(source) + 1, 2 * len(source) + 1))
+        for s, c in zip(source, copy):
+            assert fs.inodes[c].name == fs.inodes[s].name or s == 1
+            assert fs.inodes[c].n_type == fs.inodes[s].n_type
+            assert fs.inodes[c].size == fs.inodes[s].size
+            if fs.inodes[s].n_type == 1:
+                assert list(fs.inodes[c].direct_blocks) == list(fs.inodes[s].direct_blocks)
+            if s != 1:
+                assert copy[source.index(fs.inodes[s].parent)] == fs.inodes[c].parent
+        # 70 blocks need one single indirect block each, 30 entries a hashed index of 3 blocks
+        assert libc.block_count_free(ctypes.byref(fs)) == free_before - 3 - 3
+        assert read_all(ctypes.byref(fs), "/dst/d20/f0").decode("utf-8") == big
+
+    # A tree copy that doesn't fit
+    # Expected outcome:
+    #  * nothing is copied and no inode is taken
+    def test_cp_tree_full(self):
+        fs = setup(12)
+        assert libc.fs_mkdir(ctypes.byref(fs), ctypes.c_char_p(bytes("/src","UTF-8"))) == 0
+        for i in range(6):
+            assert libc.fs_mkfile(ctypes.byref(fs), ctypes.c_char_p(bytes("/src/f%d" % i,"UTF-8"))) == 0
+        free_before = libc.inode_count_free(ctypes.byref(fs))
+        assert libc.fs_cp(ctypes.byref(fs), ctypes.c_char_p(bytes("/src","UTF-8")), ctypes.c_char_p(bytes("/dst","UTF-8"))) == -2
+        assert libc.inode_count_free(ctypes.byref(fs)) == free_before
+        assert libc.fs_list(ctypes.byref(fs), ctypes.c_char_p(bytes("/","UTF-8"))) == b"DIR src\n"
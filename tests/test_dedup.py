@@ -0,0 +1,78 @@
+import ctypes
+from wrappers import *
+
+libc.fs_readf.restype = ctypes.c_char_p
+libc.fs_load.restype = ctypes.POINTER(FileSystem)
+
+IMAGE = bytes("./mypyfiles.fs","UTF-8")
+
+def stats(fs):
+    checked = ctypes.c_uint64(0)
+    shared = ctypes.c_uint64(0)
+    libc.dedup_stats(ctypes.byref(fs), ctypes.byref(checked), ctypes.byref(shared))
+    return checked.value, shared.value
+
+def import_data(fs, name, data):
+    with open(DEFAULT_TEST_FILE_NAME, "wb") as f:
+        f.write(data)
+    retval = libc.fs_import(ctypes.byref(fs), path(name), path(DEFAULT_TEST_FILE_NAME))
+    delete_temp_file()
+    return retval
+
+# 20 distinct full blocks and a partial one
+DATA = ("".join("%07d\n" % i for i in range(20 * BLOCK_SIZE // 8)) + "tail").encode("utf-8")
+
+class Test_Dedup:
+    # Imports the same content twice in dedup mode
+    # Expected outcome:
+    #  * the second file only stores its partial last block and its indirect block
+    #  * the counters report the full blocks it shares
+    def test_import_twice(self):
+        fs = setup(100)
+        assert libc.dedup_enable(ctypes.byref(fs), 1) == 0
+        assert import_data(fs, "/a", DATA) == 0
+        free = libc.block_count_free(ctypes.byref(fs))
+        assert import_data(fs, "/b", DATA) == 0
+        assert libc.block_count_free(ctypes.byref(fs)) == free - 2
+        assert stats(fs) == (40, 20)
+        assert read_all(ctypes.byref(fs), "/b") == DATA
+        assert fs.inodes[2].direct_blocks[0] == fs.inodes[1].direct_blocks[0]
+
+    # Identical blocks within one file are stored once, also when written in pieces
+    def test_writef_repeated_blocks(self):
+        fs = setup(100)
+        assert libc.dedup_enable(ctypes.byref(fs), 1) == 0
+        assert libc.fs_mkfile(ctypes.byref(fs), path("/f")) == 0
+        piece = b"z" * 700
+        for i in range(6):
+            assert libc.fs_writef(ctypes.byref(fs), path("/f"), ctypes.c_char_p(piece)) == len(piece)
+        assert read_all(ctypes.byref(fs), "/f") == piece * 6
+        blocks = set(fs.inodes[1].direct_blocks[i] for i in range(4))
+        assert len(blocks) == 1
+        assert libc.block_count_free(ctypes.byref(fs)) == 100 - 2
+
+    # Blocks stored before dedup mode was turned on are found too,
+    # and shared blocks survive a dump and are freed with their last file
+    def test_existing_blocks_reload_rm(self):
+        fs = setup(100)
+        assert import_data(fs, "/a", DATA) == 0
+        assert libc.dedup_enable(ctypes.byref(fs), 1) == 0
+        assert import_data(fs, "/b", DATA) == 0
+        assert stats(fs)[1] == 20
+        assert libc.fs_dump(ctypes.byref(fs), ctypes.c_char_p(IMAGE)) == 0
+
+        loaded = libc.fs_load(ctypes.c_char_p(IMAGE))
+        assert libc.fs_rm(loaded, path("/a")) == 0
+        assert read_all(loaded, "/b") == DATA
+        assert libc.fs_rm(loaded, path("/b")) == 0
+        assert loaded.contents.s_block.contents.free_blocks == 100
+        libc.cleanup(loaded)
+
+    # Without dedup mode identical content is stored twice
+    def test_off_by_default(self):
+        fs = setup(100)
+        assert import_data(fs, "/a", DATA) == 0
+        free = libc.block_count_free(ctypes.byref(fs))
+        assert import_data(fs, "/b", DATA) == 0
+        assert libc.block_count_free(ctypes.byref(fs)) == free - 22
+        assert stats(fs) == (0, 0)
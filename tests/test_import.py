@@ -1,6 +1,11 @@
 import ctypes
+import os
+import tempfile
+import threading
 from wrappers import *
 
+libc.fs_readf.restype = ctypes.c_char_p
+
 
 class Test_Imp:
     # Creates a file, fills it with some short text, then imports it to an existing (empty) file in the fs
@@ -45,4 +50,42 @@ class Test_Imp:
         delete_temp_file()
 
 
-    # TODO: add test for failing operations
+    # Imports from a pipe, fed in pieces smaller than a block
+    # Expected outcome:
+    #  * the input is read to its end although it can't be seeked
+    #  * every block but the last is full
+    def test_import_from_pipe(self):
+        fs = setup(20)
+        data = (LONG_DATA * 8).encode("utf-8")
+        fifo = os.path.join(tempfile.mkdtemp(), "fifo")
+        os.mkfifo(fifo)
+        def feed():
+            with open(fifo, "wb", buffering=0) as f:
+                for i in range(0, len(data), 700):
+                    f.write(data[i:i + 700])
+        writer = threading.Thread(target=feed)
+        writer.start()
+        retval = libc.fs_import(ctypes.byref(fs), ctypes.c_char_p(bytes("/fil1","UTF-8")), ctypes.c_char_p(bytes(fifo,"utf-8")))
+        writer.join()
+        os.remove(fifo)
+
+        assert retval == 0
+        assert fs.inodes[1].size == len(data)
+        blocks = [fs.inodes[1].direct_blocks[i] for i in range(10)]
+        assert [fs.data_blocks[b].size for b in blocks[:9]] == [BLOCK_SIZE] * 9
+        file_length = ctypes.c_int(0)
+        retval = libc.fs_readf(ctypes.byref(fs), ctypes.c_char_p(bytes("/fil1","utf-8")), ctypes.byref(file_length))
+        assert retval[:file_length.value] == data
+
+    # Imports a file larger than the filesystem, and onto a directory
+    # Expected outcome:
+    #  * -2 when the blocks run out, -1 for the directory
+    def test_import_failing(self):
+        fs = setup(5)
+        filename = create_temp_file(data=LONG_DATA * 5)
+        retval = libc.fs_import(ctypes.byref(fs), ctypes.c_char_p(bytes("/fil1","UTF-8")), ctypes.c_char_p(bytes(filename,"utf-8")))
+        assert retval == -2
+        assert libc.fs_mkdir(ctypes.byref(fs), ctypes.c_char_p(bytes("/dir","UTF-8"))) == 0
+        retval = libc.fs_import(ctypes.byref(fs), ctypes.c_char_p(bytes("/dir","UTF-8")), ctypes.c_char_p(bytes(filename,"utf-8")))
+        assert retval == -1
+        delete_temp_file()
@@ -0,0 +1,117 @@
+import ctypes
+import os
+import shutil
+from wrappers import *
+
+libc.fs_readf.restype = ctypes.c_char_p
+libc.fs_list.restype = ctypes.c_char_p
+libc.fs_load.restype = ctypes.POINTER(FileSystem)
+libc.fs_load_mmap.restype = ctypes.POINTER(FileSystem)
+libc.fs_create.restype = ctypes.POINTER(FileSystem)
+
+IMAGE = "./myjournal.fs"
+JOURNAL = IMAGE + ".journal"
+CRASHED = "./mycrashed.fs"
+
+def remove_images():
+    for name in (IMAGE, JOURNAL, CRASHED, CRASHED + ".journal"):
+        if os.path.exists(name):
+            os.remove(name)
+
+# copies the image and its journal as they are on disk, like a crash would leave them
+def crash_copy():
+    shutil.copyfile(IMAGE, CRASHED)
+    shutil.copyfile(JOURNAL, CRASHED + ".journal")
+
+class Test_Journal:
+    def setup_method(self):
+        remove_images()
+
+    def teardown_method(self):
+        remove_images()
+
+    # Operations are journaled without a dump and replayed on load
+    # Expected outcome:
+    #  * the loaded image has every committed change, the journal is empty after the load
+    def test_replay_without_dump(self):
+        fs = libc.fs_create(path(IMAGE), 100)
+        assert libc.journal_open(fs, path(IMAGE), 1) == 0
+        assert libc.fs_mkdir(fs, path("/dir")) == 0
+        assert libc.fs_mkfile(fs, path("/dir/fil")) == 0
+        assert libc.fs_writef(fs, path("/dir/fil"), ctypes.c_char_p(bytes(LONG_DATA,"UTF-8"))) == len(LONG_DATA)
+        assert os.path.getsize(JOURNAL) > 0
+        crash_copy()
+
+        loaded = libc.fs_load(path(CRASHED))
+        assert libc.fs_list(loaded, path("/dir")).decode("utf-8") == "FIL fil\n"
+        assert read_all(loaded, "/dir/fil").decode("utf-8") == LONG_DATA
+        assert os.path.getsize(CRASHED + ".journal") == 0
+        libc.cleanup(loaded)
+        libc.cleanup(fs)
+
+    # Operations are committed in groups
+    # Expected outcome:
+    #  * nothing reaches the journal before the group is full
+    #  * after a crash only the operations of committed groups are there
+    def test_group_commit(self):
+        fs = libc.fs_create(path(IMAGE), 100)
+        assert libc.journal_open(fs, path(IMAGE), 3) == 0
+        for i in range(5):
+            assert libc.fs_mkfile(fs, path("/f%d" % i)) == 0
+            if i == 1:
+                assert os.path.getsize(JOURNAL) == 0
+        crash_copy()
+
+        loaded = libc.fs_load_mmap(path(CRASHED))
+        assert libc.fs_list(loaded, path("/")).decode("utf-8") == "FIL f0\nFIL f1\nFIL f2\n"
+        libc.cleanup(loaded)
+        libc.cleanup(fs)
+
+    # The last transaction is cut short by a crash
+    # Expected outcome:
+    #  * the transactions before it are replayed, it is dropped
+    def test_torn_transaction(self):
+        fs = libc.fs_create(path(IMAGE), 100)
+        assert libc.journal_open(fs, path(IMAGE), 1) == 0
+        assert libc.fs_mkfile(fs, path("/a")) == 0
+        committed = os.path.getsize(JOURNAL)
+        assert libc.fs_mkfile(fs, path("/b")) == 0
+        crash_copy()
+        with open(CRASHED + ".journal", "r+b") as f:
+            f.truncate(os.path.getsize(JOURNAL) - 8)
+
+        loaded = libc.fs_load(path(CRASHED))
+        assert libc.fs_list(loaded, path("/")).decode("utf-8") == "FIL a\n"
+        assert loaded.contents.s_block.contents.free_blocks == 100
+        libc.cleanup(loaded)
+        libc.cleanup(fs)
+        assert committed > 0
+
+    # A dump to the image is a checkpoint, closing the journal removes it
+    def test_dump_checkpoints(self):
+        fs = libc.fs_create(path(IMAGE), 100)
+        assert libc.journal_open(fs, path(IMAGE), 1) == 0
+        assert libc.fs_mkfile(fs, path("/a")) == 0
+        assert os.path.getsize(JOURNAL) > 0
+        assert libc.fs_dump(fs, path(IMAGE)) == 0
+        assert os.path.getsize(JOURNAL) == 0
+        assert libc.fs_writef(fs, path("/a"), ctypes.c_char_p(bytes(SHORT_DATA,"UTF-8"))) == len(SHORT_DATA)
+        assert libc.journal_close(fs) == 0
+        assert not os.path.exists(JOURNAL)
+
+        loaded = libc.fs_load(path(IMAGE))
+        assert read_all(loaded, "/a").decode("utf-8") == SHORT_DATA
+        libc.cleanup(loaded)
+        libc.cleanup(fs)
+
+    # Journaling is asked for on a mapped image
+    # Expected outcome:
+    #  * it is refused, the mapping writes changes to the image before any commit
+    def test_refused_on_mmap(self):
+        fs = libc.fs_create(path(IMAGE), 100)
+        assert libc.fs_dump(fs, path(IMAGE)) == 0
+        libc.cleanup(fs)
+        mapped = libc.fs_load_mmap(path(IMAGE))
+        assert libc.journal_open(mapped, path(IMAGE), 1) == -1
+        assert not os.path.exists(JOURNAL)
+        libc.cleanup(mapped)
@@ -0,0 +1,82 @@
+import ctypes
+from wrappers import *
+
+libc.fs_readf.restype = ctypes.c_char_p
+libc.fs_load.restype = ctypes.POINTER(FileSystem)
+
+IMAGE = bytes("./mypyfiles.fs","UTF-8")
+
+# 300 KiB reach past the direct and the single indirect blocks into the double indirect ones
+LARGE_DATA = ("".join("%07d\n" % i for i in range(300 * BLOCK_SIZE // 8))).encode("utf-8")
+
+class Test_Largefile:
+    # Imports a file larger than the direct blocks and exports it again
+    # Expected outcome:
+    #  * the exported file is identical, the size is not truncated to 16 bit
+    #  * the single and double indirect blocks are in use, the triple one is not
+    def test_import_export_large(self):
+        fs = setup(400)
+        with open(DEFAULT_TEST_FILE_NAME, "wb") as f:
+            f.write(LARGE_DATA)
+        assert libc.fs_import(ctypes.byref(fs), path("/big"), path(DEFAULT_TEST_FILE_NAME)) == 0
+        assert fs.inodes[1].size == len(LARGE_DATA)
+        assert fs.inodes[1].indirect_blocks[0] != -1
+        assert fs.inodes[1].indirect_blocks[1] != -1
+        assert fs.inodes[1].indirect_blocks[2] == -1
+
+        delete_temp_file()
+        assert libc.fs_export(ctypes.byref(fs), path("/big"), path(DEFAULT_TEST_FILE_NAME)) == 0
+        with open(DEFAULT_TEST_FILE_NAME, "rb") as f:
+            assert f.read() == LARGE_DATA
+        delete_temp_file()
+
+    # Appends to a file in pieces that cross the end of the direct blocks
+    # Expected outcome:
+    #  * reading the file returns all pieces in order
+    def test_writef_across_indirect(self):
+        fs = setup(100)
+        assert libc.fs_mkfile(ctypes.byref(fs), path("/fil")) == 0
+        expected = b""
+        for i in range(30):
+            piece = LARGE_DATA[i * 1000:(i + 1) * 1000]
+            assert libc.fs_writef(ctypes.byref(fs), path("/fil"), ctypes.c_char_p(piece)) == len(piece)
+            expected += piece
+        assert fs.inodes[1].size == len(expected)
+        assert fs.inodes[1].indirect_blocks[0] != -1
+        assert read_all(ctypes.byref(fs), "/fil") == expected
+
+    # Copies a large file, removes the original and reloads the image
+    # Expected outcome:
+    #  * the copy survives the dump with the same content
+    #  * removing both files frees every data and indirect block
+    def test_cp_rm_reload_large(self):
+        fs = setup(700)
+        with open(DEFAULT_TEST_FILE_NAME, "wb") as f:
+            f.write(LARGE_DATA)
+        assert libc.fs_import(ctypes.byref(fs), path("/big"), path(DEFAULT_TEST_FILE_NAME)) == 0
+        delete_temp_file()
+        assert libc.fs_cp(ctypes.byref(fs), path("/big"), path("/copy")) == 0
+        assert libc.fs_rm(ctypes.byref(fs), path("/big")) == 0
+        assert libc.fs_dump(ctypes.byref(fs), ctypes.c_char_p(IMAGE)) == 0
+
+        loaded = libc.fs_load(ctypes.c_char_p(IMAGE))
+        assert read_all(loaded, "/copy") == LARGE_DATA
+        assert libc.fs_rm(loaded, path("/copy")) == 0
+        assert loaded.contents.s_block.contents.free_blocks == 700
+        libc.cleanup(loaded)
+
+    # Copies a large file into a filesystem with little room left
+    # Expected outcome:
+    #  * the copy shares the data blocks and only needs its own indirect blocks
+    #  * without room for those the copy is refused
+    def test_cp_large_little_space(self):
+        fs = setup(306)
+        with open(DEFAULT_TEST_FILE_NAME, "wb") as f:
+            f.write(LARGE_DATA)
+        assert libc.fs_import(ctypes.byref(fs), path("/big"), path(DEFAULT_TEST_FILE_NAME)) == 0
+        delete_temp_file()
+        assert libc.block_count_free(ctypes.byref(fs)) == 3
+        assert libc.fs_cp(ctypes.byref(fs), path("/big"), path("/copy")) == 0
+        assert libc.block_count_free(ctypes.byref(fs)) == 0
+        assert libc.fs_cp(ctypes.byref(fs), path("/big"), path("/copy2")) == -2
+        assert read_all(ctypes.byref(fs), "/copy") == LARGE_DATA
@@ -0,0 +1,136 @@
+import ctypes
+import struct
+from wrappers import *
+
+libc.fs_load.restype = ctypes.POINTER(FileSystem)
+libc.fs_load_mmap.restype = ctypes.POINTER(FileSystem)
+libc.fs_readf.restype = ctypes.c_char_p
+libc.fs_list.restype = ctypes.c_char_p
+
+IMAGE = bytes("./mypyfiles.fs","UTF-8")
+
+class Test_Load:
+    # Builds a small tree, dumps it and maps the image again
+    # Expected outcome:
+    #  * the mapped filesystem shows the same directories and file content
+    def test_mmap_roundtrip(self):
+        fs = setup(8)
+        assert libc.fs_mkdir(ctypes.byref(fs), ctypes.c_char_p(bytes("/dir","UTF-8"))) == 0
+        assert libc.fs_mkfile(ctypes.byref(fs), ctypes.c_char_p(bytes("/dir/fil","UTF-8"))) == 0
+        assert libc.fs_writef(ctypes.byref(fs), ctypes.c_char_p(bytes("/dir/fil","UTF-8")), ctypes.c_char_p(bytes(LONG_DATA,"UTF-8"))) == len(LONG_DATA)
+        assert libc.fs_dump(ctypes.byref(fs), ctypes.c_char_p(IMAGE)) == 0
+
+        mapped = libc.fs_load_mmap(ctypes.c_char_p(IMAGE))
+        assert libc.fs_list(mapped, ctypes.c_char_p(bytes("/dir","UTF-8"))).decode("utf-8") == "FIL fil\n"
+        file_length = ctypes.c_int(0)
+        retval = libc.fs_readf(mapped, ctypes.c_char_p(bytes("/dir/fil","UTF-8")), ctypes.byref(file_length))
+        assert file_length.value == len(LONG_DATA)
+        assert retval[:len(LONG_DATA)].decode("utf-8") == LONG_DATA
+        libc.cleanup(mapped)
+
+    # Changes made through a mapping reach the image with a dump to the same file
+    def test_mmap_dump_in_place(self):
+        fs = setup(8)
+        assert libc.fs_dump(ctypes.byref(fs), ctypes.c_char_p(IMAGE)) == 0
+
+        mapped = libc.fs_load_mmap(ctypes.c_char_p(IMAGE))
+        assert libc.fs_mkfile(mapped, ctypes.c_char_p(bytes("/fil","UTF-8"))) == 0
+        assert libc.fs_dump(mapped, ctypes.c_char_p(IMAGE)) == 0
+        libc.cleanup(mapped)
+
+        loaded = libc.fs_load(ctypes.c_char_p(IMAGE))
+        assert libc.fs_list(loaded, ctypes.c_char_p(bytes("/","UTF-8"))).decode("utf-8") == "FIL fil\n"
+        libc.cleanup(loaded)
+
+    # An image from before the format was versioned is converted into a copy instead of mapped
+    def test_mmap_legacy_image_converted(self):
+        loaded = libc.fs_load_mmap(ctypes.c_char_p(bytes("./SysProgFiles.fs","UTF-8")))
+        assert loaded.contents.map_base is None
+        assert loaded.contents.s_block.contents.version == FS_VERSION
+        assert libc.fs_list(loaded, ctypes.c_char_p(bytes("/","UTF-8"))).decode("utf-8") == "DIR documents\nDIR pictures\n"
+        assert libc.fs_list(loaded, ctypes.c_char_p(bytes("/pictures","UTF-8"))).decode("utf-8") == "FIL success.jpg\n"
+        libc.cleanup(loaded)
+
+    # A dump to the image the filesystem came from writes only the changed regions
+    # Expected outcome:
+    #  * the change is visible after loading the image again
+    #  * bytes of an untouched data block on disk are left alone
+    def test_incremental_dump(self):
+        fs = setup(8)
+        assert libc.fs_mkfile(ctypes.byref(fs), ctypes.c_char_p(bytes("/fil","UTF-8"))) == 0
+        assert libc.fs_dump(ctypes.byref(fs), ctypes.c_char_p(IMAGE)) == 0
+
+        size = os.path.getsize(IMAGE)
+        marker = b"untouched"
+        with open(IMAGE, "r+b") as image:
+            image.seek(size - BLOCK_SIZE)
+            image.write(marker)
+
+        assert libc.fs_writef(ctypes.byref(fs), ctypes.c_char_p(bytes("/fil","UTF-8")), ctypes.c_char_p(bytes(SHORT_DATA,"UTF-8"))) == len(SHORT_DATA)
+        assert libc.fs_dump(ctypes.byref(fs), ctypes.c_char_p(IMAGE)) == 0
+        assert os.path.getsize(IMAGE) == size
+        with open(IMAGE, "rb") as image:
+            image.seek(size - BLOCK_SIZE)
+            assert image.read(len(marker)) == marker
+
+        loaded = libc.fs_load(ctypes.c_char_p(IMAGE))
+        file_length = ctypes.c_int(0)
+        retval = libc.fs_readf(loaded, ctypes.c_char_p(bytes("/fil","UTF-8")), ctypes.byref(file_length))
+        assert file_length.value == len(SHORT_DATA)
+        assert retval[:len(SHORT_DATA)].decode("utf-8") == SHORT_DATA
+        libc.cleanup(loaded)
+
+    # A version 2 image, whose inodes have a 16 bit size and no indirect blocks, is converted on load
+    # Expected outcome:
+    #  * directories and file content survive, the indirect blocks are unused
+    def test_version2_image_converted(self):
+        n = 4
+        image = struct.pack("<IIII", n, n - 1, FS_MAGIC, 2) + bytes([0, 1, 1, 1])
+        image += bytes(-len(image) % 8)
+        def inode_v2(n_type, size, name, direct_blocks, parent):
+            direct_blocks = direct_blocks + [-1] * (DIRECT_BLOCKS_COUNT - len(direct_blocks))
+            return struct.pack("<iH32sxx12iii", n_type, size, name, *direct_blocks, parent, -1)
+        image += inode_v2(NodeType.directory, 0, b"/", [1], -1)
+        image += inode_v2(NodeType.reg_file, len(SHORT_DATA), b"fil", [0], 0)
+        image += inode_v2(NodeType.free_block, 0, b"", [], -1) * (n - 2)
+        image += struct.pack("<Q1024s", len(SHORT_DATA), bytes(SHORT_DATA, "UTF-8"))
+        image += struct.pack("<Q1024s", 0, b"") * (n - 1)
+        with open(IMAGE, "wb") as f:
+            f.write(image)
+
+        loaded = libc.fs_load_mmap(ctypes.c_char_p(IMAGE))
+        assert loaded.contents.map_base is None
+        assert loaded.contents.s_block.contents.version == FS_VERSION
+        assert list(loaded.contents.inodes[1].indirect_blocks) == [-1] * INDIRECT_LEVELS
+        assert libc.fs_list(loaded, ctypes.c_char_p(bytes("/","UTF-8"))).decode("utf-8") == "FIL fil\n"
+        file_length = ctypes.c_int(0)
+        retval = libc.fs_readf(loaded, ctypes.c_char_p(bytes("/fil","UTF-8")), ctypes.byref(file_length))
+        assert file_length.value == len(SHORT_DATA)
+        assert retval[:len(SHORT_DATA)].decode("utf-8") == SHORT_DATA
+        libc.cleanup(loaded)
+
+    # A version 3 image has the size of a current one, but its inodes have no flags
+    # Expected outcome:
+    #  * whatever lies where the flags are now is dropped on load
+    #  * dumping back to the same file rewrites every inode, not only the changed ones
+    def test_version3_image_rewritten(self):
+        fs = setup(8)
+        assert libc.fs_mkfile(ctypes.byref(fs), ctypes.c_char_p(bytes("/fil","UTF-8"))) == 0
+        assert libc.fs_writef(ctypes.byref(fs), ctypes.c_char_p(bytes("/fil","UTF-8")), ctypes.c_char_p(bytes(SHORT_DATA,"UTF-8"))) == len(SHORT_DATA)
+        fs.inodes[1].flags = 0xdead
+        fs.s_block.contents.version = 3
+        assert libc.fs_dump(ctypes.byref(fs), ctypes.c_char_p(IMAGE)) == 0
+
+        loaded = libc.fs_load(ctypes.c_char_p(IMAGE))
+        assert loaded.contents.inodes[1].flags == 0
+        assert libc.fs_mkdir(loaded, ctypes.c_char_p(bytes("/dir","UTF-8"))) == 0
+        assert libc.fs_dump(loaded, ctypes.c_char_p(IMAGE)) == 0
+        libc.cleanup(loaded)
+
+        loaded = libc.fs_load(ctypes.c_char_p(IMAGE))
+        assert loaded.contents.s_block.contents.version == FS_VERSION
+        assert loaded.contents.inodes[1].flags == 0
+        file_length = ctypes.c_int(0)
+        retval = libc.fs_readf(loaded, ctypes.c_char_p(bytes("/fil","UTF-8")), ctypes.byref(file_length))
+        assert retval[:file_length.value].decode("utf-8") == SHORT_DATA
+        libc.cleanup(loaded)
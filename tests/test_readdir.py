@@ -0,0 +1,105 @@
+import ctypes
+from wrappers import *
+
+libc.fs_list.restype = ctypes.c_char_p
+libc.fs_opendir.restype = ctypes.c_void_p
+libc.fs_telldir.restype = ctypes.c_uint64
+
+class Dirent(ctypes.Structure):
+    _fields_ = [
+        ("inode", ctypes.c_int),
+        ("type", ctypes.c_int),
+        ("name", ctypes.c_char * 32)
+    ]
+
+libc.fs_readdir.restype = ctypes.POINTER(Dirent)
+
+# the entries the handle has left, at most limit of them
+def read_entries(dir, limit=None):
+    entries = []
+    while limit is None or len(entries) < limit:
+        entry = libc.fs_readdir(ctypes.c_void_p(dir))
+        if not entry:
+            break
+        entries.append((entry.contents.inode, entry.contents.type, entry.contents.name.decode("utf-8")))
+    return entries
+
+class Test_Readdir:
+    # Reads a directory with files and directories
+    # Expected outcome:
+    #  * every entry once, sorted by inode-index, with its type
+    #  * files and missing paths can't be opened
+    def test_readdir_entries(self):
+        fs = setup(50)
+        assert libc.fs_mkdir(ctypes.byref(fs), path("/d")) == 0
+        assert libc.fs_mkfile(ctypes.byref(fs), path("/d/f")) == 0
+        assert libc.fs_mkdir(ctypes.byref(fs), path("/d/e")) == 0
+        dir = libc.fs_opendir(ctypes.byref(fs), path("/d"))
+        assert dir
+        assert read_entries(dir) == [(2, 1, "f"), (3, 2, "e")]
+        assert not libc.fs_readdir(ctypes.c_void_p(dir))
+        libc.fs_closedir(ctypes.c_void_p(dir))
+
+        assert not libc.fs_opendir(ctypes.byref(fs), path("/d/f"))
+        assert not libc.fs_opendir(ctypes.byref(fs), path("/none"))
+
+    # Pages through a big directory, each page with a handle of its own
+    # Expected outcome:
+    #  * the pages together hold every entry once, also with entries removed and added between them,
+    #    of which the ones added may or may not be there
+    def test_readdir_paging(self):
+        fs = setup(3000)
+        for i in range(1000):
+            assert libc.fs_mkfile(ctypes.byref(fs), path("/f%d" % i)) == 0
+        names = []
+        cursor = 0
+        while True:
+            dir = libc.fs_opendir(ctypes.byref(fs), path("/"))
+            libc.fs_seekdir(ctypes.c_void_p(dir), ctypes.c_uint64(cursor))
+            page = read_entries(dir, 150)
+            cursor = libc.fs_telldir(ctypes.c_void_p(dir))
+            libc.fs_closedir(ctypes.c_void_p(dir))
+            if not page:
+                break
+            names += [name for _, _, name in page]
+            # the removed ones were read already
+            if len(names) == 300:
+                for i in range(0, 300, 3):
+                    assert libc.fs_rm(ctypes.byref(fs), path("/f%d" % i)) == 0
+                for i in range(50):
+                    assert libc.fs_mkfile(ctypes.byref(fs), path("/new%d" % i)) == 0
+        assert len(set(names)) == len(names)
+        assert [name for name in names if name[0] == "f"] == ["f%d" % i for i in range(1000)]
+
+    # Removes entries while a handle reads the directory
+    # Expected outcome:
+    #  * removed entries that were not read yet are skipped
+    #  * a removed directory has no entries left
+    def test_readdir_removed(self):
+        fs = setup(500)
+        assert libc.fs_mkdir(ctypes.byref(fs), path("/d")) == 0
+        for i in range(200):
+            assert libc.fs_mkfile(ctypes.byref(fs), path("/d/f%d" % i)) == 0
+        dir = libc.fs_opendir(ctypes.byref(fs), path("/d"))
+        first = read_entries(dir, 10)
+        assert [name for _, _, name in first] == ["f%d" % i for i in range(10)]
+        for i in range(100, 200):
+            assert libc.fs_rm(ctypes.byref(fs), path("/d/f%d" % i)) == 0
+        assert [name for _, _, name in read_entries(dir)] == ["f%d" % i for i in range(10, 100)]
+        assert libc.fs_telldir(ctypes.c_void_p(dir)) == first[0][0] + 99 + 1
+
+        libc.fs_seekdir(ctypes.c_void_p(dir), ctypes.c_uint64(0))
+        assert libc.fs_rm(ctypes.byref(fs), path("/d")) == 0
+        assert read_entries(dir) == []
+        libc.fs_closedir(ctypes.c_void_p(dir))
+
+    # fs_list is written from the entries
+    # Expected outcome:
+    #  * a listing longer than any fixed buffer is complete
+    def test_list_long(self):
+        fs = setup(3000)
+        long_name = "n" * 25
+        for i in range(1500):
+            assert libc.fs_mkfile(ctypes.byref(fs), path("/%s%04d" % (long_name, i))) == 0
+        listing = libc.fs_list(ctypes.byref(fs), path("/")).decode("utf-8")
+        assert listing == "".join("FIL %s%04d\n" % (long_name, i) for i in range(1500))
@@ -61,3 +61,30 @@ class Test_Readf:
         assert file_length.value == 0
         assert retval == None
 
+
+    # Reads a range spanning two blocks without copying it
+    # Expected outcome:
+    #  * one iovec per block, pointing into the data blocks
+    #  * the range ends at the end of the file, reading past it returns 0
+    def test_readv_range(self):
+        fs = setup(5)
+        fs = set_fil(name="fil1",inode=1,parent=0,parent_block=0,fs=fs)
+        fs = set_data_block_with_string(block_num=0,string_data=LONG_DATA[:1024],parent_inode=1,parent_block_num=0,fs=fs)
+        fs = set_data_block_with_string(block_num=1,string_data=LONG_DATA[1024:],parent_inode=1,parent_block_num=1,fs=fs)
+
+        iov = (Iovec * 4)()
+        retval = libc.fs_readv(ctypes.byref(fs), ctypes.c_char_p(bytes("/fil1","utf-8")), ctypes.c_uint64(1000), ctypes.c_size_t(100), iov, 4)
+        assert retval == 2
+        assert iov[0].iov_base == ctypes.addressof(fs.data_blocks[0].block) + 1000
+        assert iov[1].iov_base == ctypes.addressof(fs.data_blocks[1].block)
+        assert [iov[0].iov_len, iov[1].iov_len] == [24, 76]
+        data = b"".join(ctypes.string_at(v.iov_base, v.iov_len) for v in iov[:2])
+        assert data.decode("utf-8") == LONG_DATA[1000:1100]
+
+        retval = libc.fs_readv(ctypes.byref(fs), ctypes.c_char_p(bytes("/fil1","utf-8")), ctypes.c_uint64(1100), ctypes.c_size_t(10**6), iov, 4)
+        assert retval == 1
+        assert iov[0].iov_len == len(LONG_DATA) - 1100
+        retval = libc.fs_readv(ctypes.byref(fs), ctypes.c_char_p(bytes("/fil1","utf-8")), ctypes.c_uint64(len(LONG_DATA)), ctypes.c_size_t(10), iov, 4)
+        assert retval == 0
+        retval = libc.fs_readv(ctypes.byref(fs), ctypes.c_char_p(bytes("/nofile","utf-8")), ctypes.c_uint64(0), ctypes.c_size_t(10), iov, 4)
+        assert retval == -1
@@ -0,0 +1,264 @@
+import ctypes
+import os
+import threading
+import time
+from wrappers import *
+
+# a handle of its own, the buffers are freed here so the other tests' restypes can't be used
+libc = ctypes.CDLL("./build/operations.so")
+libc.fs_create.restype = ctypes.POINTER(FileSystem)
+libc.fs_load.restype = ctypes.POINTER(FileSystem)
+libc.client_connect.restype = ctypes.c_void_p
+libc.client_connect.argtypes = [ctypes.c_char_p]
+libc.client_list.restype = ctypes.c_void_p
+libc.client_readf.restype = ctypes.c_void_p
+libc.client_readv.restype = ctypes.c_int64
+
+IMAGE = "./mypyfiles.fs"
+SOCKET = b"./test_server.sock"
+
+PROTO_MKFILE = 2
+PROTO_LIST = 4
+PROTO_WRITEF = 5
+PROTO_READF = 6
+PROTO_READV = 7
+PROTO_MAX_READV = 4 << 20
+
+class ClientReply(ctypes.Structure):
+    _fields_ = [
+        ("tag", ctypes.c_uint32),
+        ("status", ctypes.c_int32),
+        ("data", ctypes.c_void_p),
+        ("length", ctypes.c_uint32)
+    ]
+
+# serves fs in a thread until a client shuts it down, the thread doesn't keep pytest from ending
+class Server:
+    def __init__(self, fs):
+        self.status = None
+        def run():
+            self.status = libc.serve(fs, path(IMAGE), ctypes.c_char_p(SOCKET))
+        self.thread = threading.Thread(target=run, daemon=True)
+        self.thread.start()
+
+    def connect(self):
+        for _ in range(500):
+            client = libc.client_connect(SOCKET)
+            if client:
+                return ctypes.c_void_p(client)
+            time.sleep(0.01)
+        raise AssertionError("server not listening")
+
+    def join(self):
+        self.thread.join(30)
+        assert not self.thread.is_alive(), "server did not stop"
+        return self.status
+
+    # shut the server down if a test failed before it did
+    def stop(self):
+        if self.thread.is_alive():
+            client = libc.client_connect(SOCKET)
+            if client:
+                libc.client_shutdown(ctypes.c_void_p(client))
+                libc.client_close(ctypes.c_void_p(client))
+            self.thread.join(30)
+
+def client_read_all(client, name):
+    size = ctypes.c_int(0)
+    buffer = libc.client_readf(client, path(name), ctypes.byref(size))
+    if not buffer:
+        return b""
+    data = ctypes.string_at(buffer, size.value)
+    libc.free(ctypes.c_void_p(buffer))
+    return data
+
+def list_dir(client, name):
+    buffer = libc.client_list(client, path(name))
+    if not buffer:
+        return None
+    listing = ctypes.string_at(buffer).decode("utf-8")
+    libc.free(ctypes.c_void_p(buffer))
+    return listing
+
+def send(client, op, name, arg=None):
+    return libc.client_send(client, ctypes.c_uint8(op), ctypes.c_uint8(0), path(name) if name else None,
+                            path(arg) if arg else None, ctypes.c_uint64(0), ctypes.c_uint64(0))
+
+class Test_Server:
+    def setup_method(self):
+        self.servers = []
+
+    def teardown_method(self):
+        for server in self.servers:
+            server.stop()
+
+    def serve(self, fs):
+        server = Server(fs)
+        self.servers.append(server)
+        return server
+
+    # Every operation is run through the client
+    # Expected outcome:
+    #  * the clients get what the fs_* calls return
+    #  * the fs holds the changes once the server is shut down, and the image was dumped
+    def test_operations(self):
+        fs = libc.fs_create(path(IMAGE), 500)
+        server = self.serve(fs)
+        client = server.connect()
+        assert libc.client_mkdir(client, path("/d")) == 0
+        assert libc.client_mkfile(client, path("/d/a")) == 0
+        assert libc.client_mkfile(client, path("/d/a")) == -2
+        assert libc.client_mkfile(client, path("/nodir/a")) == -1
+        assert libc.client_writef(client, path("/d/a"), path(LONG_DATA)) == len(LONG_DATA)
+        assert client_read_all(client, "/d/a") == LONG_DATA.encode("utf-8")
+        assert client_read_all(client, "/d/none") == b""
+        assert libc.client_cp(client, path("/d"), path("/e")) == 0
+        assert list_dir(client, "/") == "DIR d\nDIR e\n"
+        assert list_dir(client, "/none") is None
+
+        dst = ctypes.create_string_buffer(100)
+        assert libc.client_readv(client, path("/e/a"), ctypes.c_uint64(6), ctypes.c_size_t(5), dst) == 5
+        assert dst.raw[:5] == b"ipsum"
+
+        assert libc.client_compress(client, path("/e/a"), 1) == 0
+        assert client_read_all(client, "/e/a") == LONG_DATA.encode("utf-8")
+        assert libc.client_export(client, path("/e/a"), path(DEFAULT_TEST_FILE_NAME)) == 0
+        assert libc.client_import(client, path("/d/b"), path(DEFAULT_TEST_FILE_NAME)) == 0
+        os.remove(DEFAULT_TEST_FILE_NAME)
+        assert client_read_all(client, "/d/b") == LONG_DATA.encode("utf-8")
+        assert libc.client_rm(client, path("/d/a")) == 0
+        assert libc.client_rm(client, path("/d/a")) == -1
+        assert libc.client_dump(client) == 0
+        assert libc.client_shutdown(client) == 0
+        libc.client_close(client)
+        assert server.join() == 0
+        assert not os.path.exists(SOCKET)
+        libc.cleanup(fs)
+
+        loaded = libc.fs_load(path(IMAGE))
+        assert libc.fs_mkfile(loaded, path("/d/b")) == -2
+        assert libc.fs_mkfile(loaded, path("/d/a")) == 0
+        libc.cleanup(loaded)
+
+    # A client sends many requests before it reads a reply, a second client works meanwhile
+    # Expected outcome:
+    #  * the replies come back in the order the requests were sent, with their tags
+    #  * the second client sees the first one's files
+    def test_pipelined(self):
+        fs = libc.fs_create(path(IMAGE), 2000)
+        server = self.serve(fs)
+        client = server.connect()
+        other = server.connect()
+        count = 300
+        tags = []
+        for i in range(count):
+            tags.append(send(client, PROTO_MKFILE, "/f%d" % i))
+            tags.append(send(client, PROTO_WRITEF, "/f%d" % i, "%d" % i * 50))
+            tags.append(send(client, PROTO_READF, "/f%d" % i))
+        tags.append(send(client, PROTO_LIST, "/"))
+        assert libc.client_flush(client) == 0
+        assert libc.client_mkdir(other, path("/other")) == 0
+
+        reply = ClientReply()
+        for k, tag in enumerate(tags[:-1]):
+            assert libc.client_recv(client, ctypes.byref(reply)) == 0
+            assert reply.tag == tag
+            i = k // 3
+            if k % 3 == 0:
+                assert reply.status == 0
+            elif k % 3 == 1:
+                assert reply.status == len("%d" % i) * 50
+            else:
+                assert reply.status == 0
+                assert ctypes.string_at(reply.data, reply.length) == ("%d" % i * 50).encode("utf-8")
+        assert libc.client_recv(client, ctypes.byref(reply)) == 0
+        assert reply.tag == tags[-1]
+        assert len(ctypes.string_at(reply.data, reply.length).splitlines()) in (count, count + 1)
+
+        assert client_read_all(other, "/f123") == ("123" * 50).encode("utf-8")
+        assert list_dir(client, "/other") == ""
+        libc.client_close(other)
+        assert libc.client_shutdown(client) == 0
+        libc.client_close(client)
+        assert server.join() == 0
+        libc.cleanup(fs)
+
+    # More requests are pipelined than the server keeps replies for, see SERVER_OUT_HIGH
+    # Expected outcome:
+    #  * sending them doesn't wait forever for the server, which waits for the client to read
+    #  * every reply arrives
+    def test_pipelined_backpressure(self):
+        fs = libc.fs_create(path(IMAGE), 100)
+        server = self.serve(fs)
+        client = server.connect()
+        content = "x" * 1000
+        assert libc.client_mkfile(client, path("/f")) == 0
+        assert libc.client_writef(client, path("/f"), path(content)) == len(content)
+        # 20 MB of replies, several times SERVER_OUT_HIGH
+        count = 20000
+        tags = [send(client, PROTO_READF, "/f") for _ in range(count)]
+        flushed = []
+        flusher = threading.Thread(target=lambda: flushed.append(libc.client_flush(client)), daemon=True)
+        flusher.start()
+        flusher.join(30)
+        assert flushed == [0]
+
+        reply = ClientReply()
+        for tag in tags:
+            assert libc.client_recv(client, ctypes.byref(reply)) == 0
+            assert reply.tag == tag and reply.length == len(content)
+        assert ctypes.string_at(reply.data, reply.length) == content.encode("utf-8")
+        assert libc.client_shutdown(client) == 0
+        libc.client_close(client)
+        assert server.join() == 0
+        libc.cleanup(fs)
+
+    # A request with an unknown operation or without its arguments
+    # Expected outcome:
+    #  * it is answered as a bad request and the connection keeps working
+    def test_bad_request(self):
+        fs = libc.fs_create(path(IMAGE), 100)
+        server = self.serve(fs)
+        client = server.connect()
+        reply = ClientReply()
+        tag = libc.client_send(client, ctypes.c_uint8(200), ctypes.c_uint8(0), path("/x"), None,
+                               ctypes.c_uint64(0), ctypes.c_uint64(0))
+        assert libc.client_recv(client, ctypes.byref(reply)) == 0
+        assert reply.tag == tag and reply.status == -3
+        send(client, PROTO_MKFILE, None)
+        assert libc.client_recv(client, ctypes.byref(reply)) == 0
+        assert reply.status == -3
+        assert libc.client_mkfile(client, path("/x")) == 0
+        assert libc.client_shutdown(client) == 0
+        libc.client_close(client)
+        assert server.join() == 0
+        libc.cleanup(fs)
+
+    # A range longer than a PROTO_READV returns
+    # Expected outcome:
+    #  * the server answers a request with PROTO_MAX_READV bytes
+    #  * client_readv asks for the rest in more requests and reads up to the end of the file
+    def test_readv_pieces(self):
+        fs = libc.fs_create(path(IMAGE), 6000)
+        content = bytes(range(256)) * (PROTO_MAX_READV // 256 + 1000)
+        with open(DEFAULT_TEST_FILE_NAME, "wb") as f:
+            f.write(content)
+        server = self.serve(fs)
+        client = server.connect()
+        assert libc.client_import(client, path("/big"), path(DEFAULT_TEST_FILE_NAME)) == 0
+        os.remove(DEFAULT_TEST_FILE_NAME)
+
+        reply = ClientReply()
+        tag = libc.client_send(client, ctypes.c_uint8(PROTO_READV), ctypes.c_uint8(0), path("/big"), None,
+                               ctypes.c_uint64(0), ctypes.c_uint64(len(content)))
+        assert libc.client_recv(client, ctypes.byref(reply)) == 0
+        assert reply.tag == tag and reply.status == reply.length == PROTO_MAX_READV
+
+        dst = ctypes.create_string_buffer(len(content) + 100)
+        assert libc.client_readv(client, path("/big"), ctypes.c_uint64(0), ctypes.c_size_t(len(dst)), dst) == len(content)
+        assert dst.raw[:len(content)] == content
+        assert libc.client_readv(client, path("/none"), ctypes.c_uint64(0), ctypes.c_size_t(10), dst) == -1
+        assert libc.client_shutdown(client) == 0
+        libc.client_close(client)
+        assert server.join() == 0
+        libc.cleanup(fs)
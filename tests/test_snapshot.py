@@ -0,0 +1,173 @@
+import ctypes
+import os
+from wrappers import *
+
+libc.fs_readf.restype = ctypes.c_char_p
+libc.fs_list.restype = ctypes.c_char_p
+libc.snapshot_list.restype = ctypes.c_char_p
+libc.snapshot_mount.restype = ctypes.POINTER(FileSystem)
+libc.fs_load.restype = ctypes.POINTER(FileSystem)
+libc.fs_load_mmap.restype = ctypes.POINTER(FileSystem)
+libc.fs_create.restype = ctypes.POINTER(FileSystem)
+
+IMAGE = "./mysnapshot.fs"
+
+def remove_images():
+    for name in (IMAGE, IMAGE + ".snap"):
+        if os.path.exists(name):
+            os.remove(name)
+
+# free list, inodes and the data blocks in use, as bytes
+def state(fs):
+    n = fs.contents.s_block.contents.num_blocks
+    free_list = ctypes.string_at(fs.contents.free_list, n)
+    inodes = ctypes.string_at(fs.contents.inodes, n * ctypes.sizeof(Inode))
+    blocks = [ctypes.string_at(ctypes.addressof(fs.contents.data_blocks[b]), ctypes.sizeof(DataBlock))
+              for b in range(n) if not free_list[b]]
+    return free_list, inodes, blocks, fs.contents.s_block.contents.free_blocks
+
+# writes, removes and copies that touch direct and indirect blocks and a hashed directory
+def churn(fs, tag):
+    long_text = ctypes.c_char_p(bytes(LONG_DATA * 12,"UTF-8"))
+    assert libc.fs_mkdir(fs, path("/" + tag)) == 0
+    for i in range(20):
+        assert libc.fs_mkfile(fs, path("/%s/f%d" % (tag, i))) == 0
+    assert libc.fs_writef(fs, path("/%s/f0" % tag), long_text) > 0
+    assert libc.fs_writef(fs, path("/big"), long_text) > 0
+    assert libc.fs_cp(fs, path("/big"), path("/%s/big" % tag)) == 0
+    assert libc.fs_writef(fs, path("/%s/big" % tag), ctypes.c_char_p(bytes(tag,"UTF-8"))) > 0
+    assert libc.fs_rm(fs, path("/%s/f3" % tag)) == 0
+
+class Test_Snapshot:
+    def setup_method(self):
+        remove_images()
+
+    def teardown_method(self):
+        remove_images()
+
+    # A snapshot is mounted after the filesystem changed
+    # Expected outcome:
+    #  * the mount has exactly the free list, inodes and blocks in use of the time it was taken
+    #  * it can't be changed
+    def test_mount(self):
+        fs = libc.fs_create(path(IMAGE), 400)
+        assert libc.fs_mkfile(fs, path("/big")) == 0
+        churn(fs, "a")
+        before = state(fs)
+        assert libc.snapshot_create(fs, path("s1")) == 0
+        churn(fs, "b")
+        assert libc.fs_rm(fs, path("/a")) == 0
+
+        view = libc.snapshot_mount(fs, path("s1"))
+        assert state(view) == before
+        assert read_all(view, "/a/f0").decode("utf-8") == LONG_DATA * 12
+        assert libc.fs_mkfile(view, path("/new")) == -2
+        assert libc.fs_writef(view, path("/big"), path("x")) == -2
+        assert libc.fs_rm(view, path("/a")) == -2
+        assert libc.fs_list(fs, path("/")).decode("utf-8") == "FIL big\nDIR b\n"
+        assert not libc.snapshot_mount(fs, path("nope"))
+        libc.cleanup(view)
+        libc.cleanup(fs)
+
+    # Rolling back over two snapshots
+    # Expected outcome:
+    #  * the filesystem is as it was, the later snapshot is gone
+    #  * it keeps working, and the allocators see the old free list
+    def test_rollback(self):
+        fs = libc.fs_create(path(IMAGE), 400)
+        assert libc.fs_mkfile(fs, path("/big")) == 0
+        churn(fs, "a")
+        before = state(fs)
+        assert libc.snapshot_create(fs, path("s1")) == 0
+        churn(fs, "b")
+        assert libc.snapshot_create(fs, path("s2")) == 0
+        assert libc.fs_rm(fs, path("/a")) == 0
+        churn(fs, "c")
+
+        assert libc.snapshot_rollback(fs, path("s1")) == 0
+        assert state(fs) == before
+        assert libc.snapshot_list(fs).decode("utf-8") == "s1\n"
+        assert libc.block_count_free(fs) == before[3]
+        churn(fs, "d")
+        assert read_all(fs, "/d/f0").decode("utf-8") == LONG_DATA * 12
+        assert libc.snapshot_rollback(fs, path("s1")) == 0
+        assert state(fs) == before
+        assert libc.snapshot_rollback(fs, path("s2")) == -1
+        libc.cleanup(fs)
+
+    # Snapshots are dumped and loaded with the image
+    # Expected outcome:
+    #  * after loading the image they can be listed and mounted
+    #  * changes after the load are saved for them as well
+    #  * an image with snapshots is loaded as a copy when it is to be mapped, it stays unchanged
+    def test_persist(self):
+        fs = libc.fs_create(path(IMAGE), 400)
+        assert libc.fs_mkfile(fs, path("/big")) == 0
+        churn(fs, "a")
+        first = state(fs)
+        assert libc.snapshot_create(fs, path("s1")) == 0
+        churn(fs, "b")
+        second = state(fs)
+        assert libc.snapshot_create(fs, path("s2")) == 0
+        assert libc.fs_rm(fs, path("/a")) == 0
+        assert libc.fs_dump(fs, path(IMAGE)) == 0
+        libc.cleanup(fs)
+
+        for load in (libc.fs_load, libc.fs_load_mmap):
+            loaded = load(path(IMAGE))
+            assert libc.snapshot_list(loaded).decode("utf-8") == "s1\ns2\n"
+            churn(loaded, "c")
+            for name, expected in (("s1", first), ("s2", second)):
+                view = libc.snapshot_mount(loaded, path(name))
+                assert state(view) == expected
+                libc.cleanup(view)
+            libc.cleanup(loaded)
+
+        on_disk = libc.fs_load(path(IMAGE))
+        assert libc.fs_list(on_disk, path("/")).decode("utf-8") == "FIL big\nDIR b\n"
+        libc.cleanup(on_disk)
+
+    # Snapshots of a mapped image
+    # Expected outcome:
+    #  * none can be taken, the mapping changes the image before they could save anything
+    def test_refused_on_mmap(self):
+        fs = libc.fs_create(path(IMAGE), 100)
+        assert libc.fs_dump(fs, path(IMAGE)) == 0
+        libc.cleanup(fs)
+        mapped = libc.fs_load_mmap(path(IMAGE))
+        assert libc.snapshot_create(mapped, path("s1")) == -2
+        assert libc.snapshot_list(mapped).decode("utf-8") == ""
+        libc.cleanup(mapped)
+
+    # Deleting snapshots in the middle and at the end
+    # Expected outcome:
+    #  * the older snapshot still sees its own state
+    #  * without snapshots the snapshot file is removed by the next dump
+    def test_delete(self):
+        fs = libc.fs_create(path(IMAGE), 400)
+        assert libc.fs_mkfile(fs, path("/big")) == 0
+        churn(fs, "a")
+        first = state(fs)
+        assert libc.snapshot_create(fs, path("s1")) == 0
+        assert libc.snapshot_create(fs, path("s1")) == -2
+        churn(fs, "b")
+        assert libc.snapshot_create(fs, path("s2")) == 0
+        assert libc.fs_rm(fs, path("/a")) == 0
+        assert libc.snapshot_create(fs, path("s3")) == 0
+        churn(fs, "c")
+
+        assert libc.snapshot_delete(fs, path("s2")) == 0
+        assert libc.snapshot_delete(fs, path("s3")) == 0
+        assert libc.snapshot_list(fs).decode("utf-8") == "s1\n"
+        churn(fs, "d")
+        view = libc.snapshot_mount(fs, path("s1"))
+        assert state(view) == first
+        libc.cleanup(view)
+
+        assert libc.fs_dump(fs, path(IMAGE)) == 0
+        assert os.path.exists(IMAGE + ".snap")
+        assert libc.snapshot_delete(fs, path("s1")) == 0
+        assert libc.snapshot_list(fs).decode("utf-8") == ""
+        assert libc.fs_dump(fs, path(IMAGE)) == 0
+        assert not os.path.exists(IMAGE + ".snap")
+        libc.cleanup(fs)
@@ -0,0 +1,144 @@
+import ctypes
+import json
+import threading
+from wrappers import *
+
+# a handle of its own, the buffers are freed here so the other tests' restypes can't be used
+libc = ctypes.CDLL("./build/operations.so")
+libc.fs_create.restype = ctypes.POINTER(FileSystem)
+libc.fs_load.restype = ctypes.POINTER(FileSystem)
+libc.fs_readf.restype = ctypes.c_void_p
+libc.fs_list.restype = ctypes.c_void_p
+libc.stats_format.restype = ctypes.c_void_p
+
+IMAGE = "./mypyfiles.fs"
+STATS_BUCKETS = 40
+OPS = ["mkdir", "mkfile", "cp", "list", "writef", "readf", "readv", "rm",
+       "import", "export", "compress", "load", "load_mmap", "dump",
+       "opendir", "readdir", "walk"]
+COUNTERS = ["blocks_scanned", "inodes_scanned", "path_components"]
+
+class OpTotals(ctypes.Structure):
+    _fields_ = [
+        ("calls", ctypes.c_uint64),
+        ("errors", ctypes.c_uint64),
+        ("bytes", ctypes.c_uint64),
+        ("ns", ctypes.c_uint64),
+        ("buckets", ctypes.c_uint64 * STATS_BUCKETS)
+    ]
+
+class Stats(ctypes.Structure):
+    _fields_ = [
+        ("ops", OpTotals * len(OPS)),
+        ("counters", ctypes.c_uint64 * len(COUNTERS))
+    ]
+
+def read_stats():
+    st = Stats()
+    libc.stats_read(ctypes.byref(st))
+    return st
+
+def op(st, name):
+    return st.ops[OPS.index(name)]
+
+class Test_Stats:
+    # A few operations after a reset, some of them failing
+    # Expected outcome:
+    #  * calls, errors and bytes are counted per operation, each call in one histogram bucket
+    #  * path components and allocator work are counted
+    #  * a reset starts over from zero
+    def test_counts(self):
+        fs = libc.fs_create(path(IMAGE), 200)
+        libc.stats_reset()
+        assert libc.fs_mkdir(fs, path("/a")) == 0
+        assert libc.fs_mkdir(fs, path("/a/b")) == 0
+        assert libc.fs_mkfile(fs, path("/a/b/c")) == 0
+        assert libc.fs_mkfile(fs, path("/a/b/c")) == -2
+        assert libc.fs_writef(fs, path("/a/b/c"), path(LONG_DATA)) == len(LONG_DATA)
+        assert len(read_all(fs, "/a/b/c")) == len(LONG_DATA)
+        assert read_all(fs, "/a/none") == b""
+        assert libc.fs_rm(fs, path("/none")) == -1
+        # handles of their own, test_readdir types libc.fs_opendir and fs_readdir
+        opendir, readdir = libc["fs_opendir"], libc["fs_readdir"]
+        opendir.restype = readdir.restype = ctypes.c_void_p
+        dir = opendir(fs, path("/a"))
+        assert readdir(ctypes.c_void_p(dir)) and not readdir(ctypes.c_void_p(dir))
+        libc.fs_closedir(ctypes.c_void_p(dir))
+        assert libc.fs_walk(fs, path("/a"), None, None, None, 1) == 0
+        assert libc.fs_walk(fs, path("/none"), None, None, None, 1) == -1
+        assert libc.fs_dump(fs, path(IMAGE)) == 0
+
+        st = read_stats()
+        assert (op(st, "mkdir").calls, op(st, "mkdir").errors) == (2, 0)
+        assert (op(st, "mkfile").calls, op(st, "mkfile").errors) == (2, 1)
+        assert op(st, "writef").bytes == len(LONG_DATA)
+        assert (op(st, "readf").calls, op(st, "readf").errors, op(st, "readf").bytes) == (2, 1, len(LONG_DATA))
+        assert (op(st, "rm").calls, op(st, "rm").errors) == (1, 1)
+        assert op(st, "dump").calls == 1
+        assert op(st, "cp").calls == 0
+        assert (op(st, "opendir").calls, op(st, "readdir").calls) == (1, 2)
+        assert (op(st, "walk").calls, op(st, "walk").errors) == (2, 1)
+        for name in OPS:
+            assert sum(op(st, name).buckets) == op(st, name).calls
+            assert op(st, name).ns > 0 or op(st, name).calls == 0
+        # the blocks of LONG_DATA and the inodes of /a, /a/b and /a/b/c
+        assert st.counters[COUNTERS.index("blocks_scanned")] >= 2
+        assert st.counters[COUNTERS.index("inodes_scanned")] >= 3
+        assert st.counters[COUNTERS.index("path_components")] >= 6
+
+        libc.stats_reset()
+        st = read_stats()
+        assert all(op(st, name).calls == 0 for name in OPS)
+        assert all(c == 0 for c in st.counters)
+        libc.cleanup(fs)
+
+        loaded = libc.fs_load(path(IMAGE))
+        st = read_stats()
+        assert op(st, "load").calls == 1 and op(st, "load").bytes > 200 * BLOCK_SIZE
+        libc.cleanup(loaded)
+
+    # Threads count into shards of their own, some of them ending before others start
+    # Expected outcome:
+    #  * no call is lost when the shards are summed
+    def test_threads(self):
+        fs = libc.fs_create(path(IMAGE), 2000)
+        libc.stats_reset()
+        rounds = 50
+
+        def worker(t):
+            for k in range(rounds):
+                assert libc.fs_mkfile(fs, path("/t%d_%d" % (t, k))) == 0
+
+        for wave in range(3):
+            threads = [threading.Thread(target=worker, args=(wave * 4 + t,)) for t in range(4)]
+            for t in threads:
+                t.start()
+            for t in threads:
+                t.join()
+        st = read_stats()
+        assert op(st, "mkfile").calls == 12 * rounds
+        assert op(st, "mkfile").errors == 0
+        libc.cleanup(fs)
+
+    # The report as JSON
+    # Expected outcome:
+    #  * it parses and agrees with stats_read
+    def test_json(self):
+        fs = libc.fs_create(path(IMAGE), 100)
+        libc.stats_reset()
+        assert libc.fs_mkfile(fs, path("/x")) == 0
+        assert libc.fs_list(fs, path("/none")) is None
+        buffer = libc.stats_format(1)
+        report = json.loads(ctypes.string_at(buffer).decode("utf-8"))
+        libc.free(ctypes.c_void_p(buffer))
+        assert report["ops"]["mkfile"]["calls"] == 1
+        assert report["ops"]["list"]["errors"] == 1
+        assert sum(report["ops"]["mkfile"]["histogram"].values()) == 1
+        assert "cp" not in report["ops"]
+        assert set(report["counters"]) == set(COUNTERS)
+
+        buffer = libc.stats_format(0)
+        text = ctypes.string_at(buffer).decode("utf-8")
+        libc.free(ctypes.c_void_p(buffer))
+        assert text.splitlines()[1].split()[:3] == ["mkfile", "1", "0"]
+        libc.cleanup(fs)
@@ -0,0 +1,216 @@
+import ctypes
+import re
+import threading
+from wrappers import *
+
+# a handle of its own, the buffers are freed here so the other tests' restypes can't be used
+libc = ctypes.CDLL("./build/operations.so")
+libc.fs_readf.restype = ctypes.c_void_p
+libc.fs_list.restype = ctypes.c_void_p
+libc.fs_load.restype = ctypes.POINTER(FileSystem)
+libc.fs_create.restype = ctypes.POINTER(FileSystem)
+
+IMAGE = "./mypyfiles.fs"
+
+# fs_list leaves freeing its buffer to the caller
+def list_dir(fs, name):
+    buffer = libc.fs_list(fs, path(name))
+    assert buffer
+    listing = ctypes.string_at(buffer).decode("utf-8")
+    libc.free(ctypes.c_void_p(buffer))
+    return listing
+
+# runs every target in a thread of its own and re-raises the first failure
+def run_threads(targets):
+    errors = []
+    def guard(target):
+        try:
+            target()
+        except BaseException as e:
+            errors.append(e)
+    threads = [threading.Thread(target=guard, args=(t,)) for t in targets]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    if errors:
+        raise errors[0]
+
+def chunk(writer, i):
+    return ("<%d:%d>" % (writer, i) + SHORT_DATA * (i % 20)).encode("utf-8")
+
+class Test_Threads:
+    # Writers append to files of their own while readers read them
+    # Expected outcome:
+    #  * a reader only ever sees whole appends
+    #  * every file ends up with all of its chunks in order
+    def test_writers_readers(self):
+        fs = libc.fs_create(path(IMAGE), 4000)
+        writers = 6
+        rounds = 60
+        for w in range(writers):
+            assert libc.fs_mkfile(fs, path("/f%d" % w)) == 0
+        expected = [b"".join(chunk(w, i) for i in range(rounds)) for w in range(writers)]
+        done = threading.Event()
+
+        def writer(w):
+            def run():
+                for i in range(rounds):
+                    data = chunk(w, i)
+                    assert libc.fs_writef(fs, path("/f%d" % w), ctypes.c_char_p(data)) == len(data)
+            return run
+
+        def reader(r):
+            def run():
+                while not done.is_set():
+                    for w in range(writers):
+                        data = read_all(fs, "/f%d" % w)
+                        assert expected[w].startswith(data)
+                        assert data == b"" or data.endswith(chunk(w, data.count(b"<") - 1))
+            return run
+
+        def write_then_stop():
+            try:
+                run_threads([writer(w) for w in range(writers)])
+            finally:
+                done.set()
+
+        run_threads([write_then_stop] + [reader(r) for r in range(3)])
+        for w in range(writers):
+            assert read_all(fs, "/f%d" % w) == expected[w]
+        libc.cleanup(fs)
+
+    # Threads create, copy and remove files in one directory while others list it
+    # Expected outcome:
+    #  * listings only hold whole entries
+    #  * afterwards the directory is empty and no inode or block is lost
+    def test_create_copy_remove(self):
+        fs = libc.fs_create(path(IMAGE), 3000)
+        assert libc.fs_mkdir(fs, path("/d")) == 0
+        free_blocks = libc.block_count_free(fs)
+        free_inodes = libc.inode_count_free(fs)
+        done = threading.Event()
+        long_text = ctypes.c_char_p(bytes(LONG_DATA * 3,"UTF-8"))
+
+        def worker(t):
+            def run():
+                for k in range(40):
+                    name = "/d/t%d_%d" % (t, k)
+                    assert libc.fs_mkfile(fs, path(name)) == 0
+                    assert libc.fs_mkfile(fs, path(name)) == -2
+                    assert libc.fs_writef(fs, path(name), long_text) > 0
+                    assert libc.fs_cp(fs, path(name), path(name + "c")) == 0
+                    assert read_all(fs, name + "c") == long_text.value
+                    assert libc.fs_rm(fs, path(name)) == 0
+                    assert libc.fs_rm(fs, path(name + "c")) == 0
+            return run
+
+        def lister():
+            while not done.is_set():
+                for line in list_dir(fs, "/d").splitlines():
+                    assert re.fullmatch(r"FIL t\d+_\d+c?", line)
+
+        def work_then_stop():
+            try:
+                run_threads([worker(t) for t in range(5)])
+            finally:
+                done.set()
+
+        run_threads([work_then_stop, lister])
+        assert list_dir(fs, "/d") == ""
+        assert libc.block_count_free(fs) == free_blocks
+        assert libc.inode_count_free(fs) == free_inodes
+        libc.cleanup(fs)
+
+    # Files are removed and written again while readers look at them without locks
+    # Expected outcome:
+    #  * a read sees a file as one of its whole versions or not at all
+    #  * inodes and blocks freed under the readers are all given back afterwards
+    def test_reads_during_reuse(self):
+        fs = libc.fs_create(path(IMAGE), 3000)
+        assert libc.fs_mkdir(fs, path("/d")) == 0
+        free_blocks = libc.block_count_free(fs)
+        free_inodes = libc.inode_count_free(fs)
+        files = 4
+        rounds = 40
+        done = threading.Event()
+
+        def version(f, k):
+            # long enough for indirect blocks
+            return ("%d:%d;" % (f, k) + LONG_DATA * 14).encode("utf-8")
+
+        def writer(f):
+            def run():
+                name = "/d/f%d" % f
+                for k in range(rounds):
+                    assert libc.fs_mkfile(fs, path(name)) == 0
+                    data = version(f, k)
+                    assert libc.fs_writef(fs, path(name), ctypes.c_char_p(data)) == len(data)
+                    assert libc.fs_rm(fs, path(name)) == 0
+            return run
+
+        def reader():
+            while not done.is_set():
+                for f in range(files):
+                    data = read_all(fs, "/d/f%d" % f)
+                    if data:
+                        k = int(data.split(b";")[0].split(b":")[1])
+                        assert data == version(f, k)
+                for line in list_dir(fs, "/d").splitlines():
+                    assert re.fullmatch(r"FIL f\d", line)
+
+        def write_then_stop():
+            try:
+                run_threads([writer(f) for f in range(files)])
+            finally:
+                done.set()
+
+        run_threads([write_then_stop, reader, reader])
+        assert list_dir(fs, "/d") == ""
+        assert libc.block_count_free(fs) == free_blocks
+        assert libc.inode_count_free(fs) == free_inodes
+        libc.cleanup(fs)
+
+    # Directory trees are copied and removed while files are written and the image is dumped
+    # Expected outcome:
+    #  * the loaded image holds what the threads left behind
+    def test_trees_and_dumps(self):
+        fs = libc.fs_create(path(IMAGE), 6000)
+        assert libc.fs_mkdir(fs, path("/src")) == 0
+        for i in range(15):
+            assert libc.fs_mkfile(fs, path("/src/f%d" % i)) == 0
+            assert libc.fs_writef(fs, path("/src/f%d" % i), path(LONG_DATA)) > 0
+        assert libc.fs_mkfile(fs, path("/log")) == 0
+        rounds = 30
+
+        def copier(t):
+            def run():
+                for k in range(rounds):
+                    name = "/copy%d_%d" % (t, k)
+                    assert libc.fs_cp(fs, path("/src"), path(name)) == 0
+                    assert read_all(fs, name + "/f7") == LONG_DATA.encode("utf-8")
+                    if k % 3:
+                        assert libc.fs_rm(fs, path(name)) == 0
+            return run
+
+        def logger():
+            for k in range(rounds * 4):
+                assert libc.fs_writef(fs, path("/log"), path("%d," % k)) > 0
+
+        def dumper():
+            for k in range(rounds // 3):
+                assert libc.fs_dump(fs, path(IMAGE)) == 0
+
+        run_threads([copier(0), copier(1), logger, dumper])
+        assert libc.fs_dump(fs, path(IMAGE)) == 0
+        log = "".join("%d," % k for k in range(rounds * 4)).encode("utf-8")
+        root = list_dir(fs, "/")
+        libc.cleanup(fs)
+
+        loaded = libc.fs_load(path(IMAGE))
+        assert list_dir(loaded, "/") == root
+        assert sorted(root.splitlines()) == sorted(["DIR src", "FIL log"] +
+            ["DIR copy%d_%d" % (t, k) for t in range(2) for k in range(0, rounds, 3)])
+        assert read_all(loaded, "/log") == log
+        assert read_all(loaded, "/copy1_27/f14") == LONG_DATA.encode("utf-8")
+        libc.cleanup(loaded)
@@ -0,0 +1,102 @@
+import ctypes
+import json
+import os
+import threading
+from wrappers import *
+
+# built with -D TRACE, see the Makefile
+traced = ctypes.CDLL("./build/operations_trace.so")
+traced.fs_create.restype = ctypes.POINTER(FileSystem)
+plain = ctypes.CDLL("./build/operations.so")
+
+IMAGE = "./mypyfiles.fs"
+TRACE_FILE = "./test_trace.json"
+
+def export():
+    assert traced.trace_export(path(TRACE_FILE)) == 0
+    with open(TRACE_FILE) as f:
+        events = json.load(f)["traceEvents"]
+    os.remove(TRACE_FILE)
+    return events
+
+# the names of the spans of each thread, checking every end closes the last begin
+def spans(events):
+    stacks = {}
+    names = {}
+    for e in events:
+        stack = stacks.setdefault(e["tid"], [])
+        if e["ph"] == "B":
+            stack.append(e)
+            names.setdefault(e["tid"], []).append(e["name"])
+        else:
+            begin = stack.pop()
+            assert begin["name"] == e["name"]
+            assert begin["ts"] <= e["ts"]
+    assert all(stack == [] for stack in stacks.values())
+    return names
+
+class Test_Trace:
+    # A tree is copied and removed while tracing
+    # Expected outcome:
+    #  * the operations and their recursive steps are nested begin/end pairs
+    #  * the exported file is Chrome trace JSON
+    def test_nesting(self):
+        fs = traced.fs_create(path(IMAGE), 500)
+        assert traced.fs_mkdir(fs, path("/a")) == 0
+        assert traced.fs_mkdir(fs, path("/a/b")) == 0
+        assert traced.fs_mkfile(fs, path("/a/b/c")) == 0
+        assert traced.trace_enable(1) == 0
+        assert traced.fs_cp(fs, path("/a"), path("/z")) == 0
+        assert traced.fs_rm(fs, path("/z")) == 0
+        assert traced.fs_dump(fs, path(IMAGE)) == 0
+        assert traced.trace_enable(0) == 0
+        assert traced.fs_mkfile(fs, path("/untraced")) == 0
+
+        events = export()
+        names = spans(events)
+        assert len(names) == 1
+        recorded = list(names.values())[0]
+        assert recorded.count("inode_copy") == 3
+        assert recorded.count("inode_remove") == 3
+        assert recorded.index("fs_cp") < recorded.index("inode_copy") < recorded.index("fs_rm")
+        assert "fs_dump" in recorded and "dump_image" in recorded
+        assert "fs_mkdir" not in recorded and "fs_mkfile" not in recorded
+        assert all(set(e) == {"name", "ph", "ts", "pid", "tid"} for e in events)
+        traced.cleanup(fs)
+
+    # Several threads while tracing, then tracing started again
+    # Expected outcome:
+    #  * every thread has balanced events under a tid of its own
+    #  * starting again drops the events recorded before
+    def test_threads(self):
+        fs = traced.fs_create(path(IMAGE), 2000)
+        assert traced.trace_enable(1) == 0
+
+        def worker(t):
+            for k in range(20):
+                assert traced.fs_mkfile(fs, path("/t%d_%d" % (t, k))) == 0
+                assert traced.fs_writef(fs, path("/t%d_%d" % (t, k)), path(SHORT_DATA)) > 0
+
+        threads = [threading.Thread(target=worker, args=(t,)) for t in range(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        assert traced.trace_enable(0) == 0
+        names = spans(export())
+        assert len(names) == 4
+        assert all(n.count("fs_mkfile") == 20 and n.count("fs_writef") == 20 for n in names.values())
+
+        assert traced.trace_enable(1) == 0
+        assert traced.fs_rm(fs, path("/t0_0")) == 0
+        assert traced.trace_enable(0) == 0
+        names = spans(export())
+        assert [n for n in names.values() if n] == [["fs_rm", "inode_remove"]]
+        traced.cleanup(fs)
+
+    # The library built without TRACE
+    # Expected outcome:
+    #  * tracing can't be started or exported
+    def test_compiled_out(self):
+        assert plain.trace_enable(1) == -1
+        assert plain.trace_export(path(TRACE_FILE)) == -1
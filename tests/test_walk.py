@@ -0,0 +1,76 @@
+import ctypes
+from wrappers import *
+
+WALK_SKIP = 1
+WALK_FN = ctypes.CFUNCTYPE(ctypes.c_int, ctypes.c_void_p, ctypes.c_int, ctypes.c_int, ctypes.c_void_p)
+
+def walk(fs, at, pre=None, post=None, threads=1):
+    # keep the callbacks referenced while C calls them
+    callbacks = [WALK_FN(pre) if pre else None, WALK_FN(post) if post else None]
+    return libc.fs_walk(ctypes.byref(fs), path(at), callbacks[0], callbacks[1], None, threads)
+
+# /d with directories e0..e(dirs-1), each with files f0..f(files-1)
+def make_tree(fs, dirs, files):
+    assert libc.fs_mkdir(ctypes.byref(fs), path("/d")) == 0
+    for i in range(dirs):
+        assert libc.fs_mkdir(ctypes.byref(fs), path("/d/e%d" % i)) == 0
+        for k in range(files):
+            assert libc.fs_mkfile(ctypes.byref(fs), path("/d/e%d/f%d" % (i, k))) == 0
+            assert libc.fs_writef(ctypes.byref(fs), path("/d/e%d/f%d" % (i, k)), path("x" * k)) == k
+
+class Test_Walk:
+    # Walks a small tree in the calling thread
+    # Expected outcome:
+    #  * pre-order and post-order by inode-index, with the depth below the start
+    def test_walk_order(self):
+        fs = setup(100)
+        make_tree(fs, 2, 2)
+        pre, post = [], []
+        assert walk(fs, "/d",
+                    lambda f, i, depth, a: pre.append((i, depth)) or 0,
+                    lambda f, i, depth, a: post.append((i, depth)) or 0) == 0
+        # /d 1, /d/e0 2, its files 3 4, /d/e1 5, its files 6 7
+        assert pre == [(1, 0), (2, 1), (3, 2), (4, 2), (5, 1), (6, 2), (7, 2)]
+        assert post == [(3, 2), (4, 2), (2, 1), (6, 2), (7, 2), (5, 1), (1, 0)]
+        assert walk(fs, "/none") == -1
+
+    # Callbacks that skip a directory or fail
+    # Expected outcome:
+    #  * nothing below a skipped directory is visited, nor post of it
+    #  * a failure stops the walk and is returned
+    def test_walk_skip_and_fail(self):
+        fs = setup(100)
+        make_tree(fs, 2, 2)
+        post = []
+        assert walk(fs, "/d",
+                    lambda f, i, depth, a: WALK_SKIP if i == 2 else 0,
+                    lambda f, i, depth, a: post.append(i) or 0) == 0
+        assert post == [6, 7, 5, 1]
+
+        seen = []
+        assert walk(fs, "/d", lambda f, i, depth, a: seen.append(i) or (-5 if i == 3 else 0)) == -5
+        assert seen == [1, 2, 3]
+
+    # Walks a bigger tree on several threads
+    # Expected outcome:
+    #  * every inode is visited once, as serially
+    #  * post of each directory comes after everything below it
+    def test_walk_parallel(self):
+        fs = setup(2000)
+        make_tree(fs, 40, 10)
+        serial = []
+        assert walk(fs, "/", lambda f, i, depth, a: serial.append(i) or 0, threads=1) == 0
+
+        pre, post = [], []
+        assert walk(fs, "/",
+                    lambda f, i, depth, a: pre.append(i) or 0,
+                    lambda f, i, depth, a: post.append(i) or 0, threads=4) == 0
+        assert sorted(pre) == sorted(post) == sorted(serial) == list(range(len(serial)))
+        done = {i: k for k, i in enumerate(post)}
+        for i in post:
+            parent = fs.inodes[i].parent
+            if i != 0:
+                assert done[i] < done[parent]
+
+        # a failure in one thread stops the others
+        assert walk(fs, "/", lambda f, i, depth, a: -3 if i == 100 else 0, threads=4) == -3
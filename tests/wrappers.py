@@ -6,6 +6,10 @@ libc = ctypes.CDLL("./build/operations.so")
 BLOCK_SIZE = 1024
 NAME_MAX_LENGTH = 32
 DIRECT_BLOCKS_COUNT = 12
+INDIRECT_LEVELS = 3
+FS_MAGIC = 0x32414853
+INODE_COMPRESSED = 0x1
+FS_VERSION = 4
 DEFAULT_TEST_FILE_NAME = "temp_test_file"
 
 
@@ -30,17 +34,29 @@ class DataBlock(ctypes.Structure):
 class Inode(ctypes.Structure):
     _fields_ = [
         ("n_type", ctypes.c_int),
-        ("size", ctypes.c_uint16),
+        ("size", ctypes.c_uint64),
         ("name", ctypes.c_char * NAME_MAX_LENGTH),
         ("direct_blocks", ctypes.c_int * DIRECT_BLOCKS_COUNT),
-        ("parent", ctypes.c_int)
+        ("indirect_blocks", ctypes.c_int * INDIRECT_LEVELS),
+        ("parent", ctypes.c_int),
+        ("dir_index", ctypes.c_int),
+        ("flags", ctypes.c_uint32)
     ]
 
 # Define the superblock structure
 class Superblock(ctypes.Structure):
     _fields_ = [
         ("num_blocks", ctypes.c_uint32),
-        ("free_blocks", ctypes.c_uint32)
+        ("free_blocks", ctypes.c_uint32),
+        ("magic", ctypes.c_uint32),
+        ("version", ctypes.c_uint32)
+    ]
+
+# struct iovec, filled by fs_readv
+class Iovec(ctypes.Structure):
+    _fields_ = [
+        ("iov_base", ctypes.c_void_p),
+        ("iov_len", ctypes.c_size_t)
     ]
 
 # Define the file_system structure
@@ -50,7 +66,10 @@ class FileSystem(ctypes.Structure):
         ("free_list", ctypes.POINTER(ctypes.c_uint8)),
         ("inodes", ctypes.POINTER(Inode)),
         ("data_blocks", ctypes.POINTER(DataBlock)),
-        ("root_node", ctypes.c_int)
+        ("root_node", ctypes.c_int),
+        ("map_base", ctypes.c_void_p),
+        ("map_len", ctypes.c_size_t)
+        # the remaining fields are in-memory bookkeeping not used by the tests
     ]
 
 
@@ -67,6 +86,24 @@ def setup(fs_size):
     ptr = creator(ctypes.c_char_p(bytes("./mypyfiles.fs","UTF-8")),fsize)
     return ptr.contents
 
+# a path as the C functions take it
+def path(name):
+    return ctypes.c_char_p(bytes(name,"UTF-8"))
+
+# fs_readf of its own, the tests give libc.fs_readf the restype they need
+readf = libc["fs_readf"]
+readf.restype = ctypes.c_void_p
+
+# the whole content of a file as bytes, b"" if it is not there; fs_readf leaves freeing the buffer to the caller
+def read_all(fs, name):
+    file_length = ctypes.c_int(0)
+    buffer = readf(fs, path(name), ctypes.byref(file_length))
+    if not buffer:
+        return b""
+    data = ctypes.string_at(buffer, file_length.value)
+    libc.free(ctypes.c_void_p(buffer))
+    return data
+
 def set_dir(name: str, inode: int, parent: int, parent_block: int, fs):
     fs.inodes[inode].n_type = 2
     fs.inodes[inode].name = bytes(name,"utf-8")